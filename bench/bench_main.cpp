@@ -0,0 +1,325 @@
+// Micro-benchmarks of the firmware's hot functions, the same sources on the
+// host ([env:bench_native]) and on the ESP32 ([env:bench_esp32]).
+//
+//   .pio/build/bench_native/program --out new.json
+//   python3 bench/compare.py baseline.json new.json --threshold 10
+//
+// Times come from hal::CycleCount(): ns on the host, CPU cycles on the ESP32,
+// where the JSON is printed on Serial between BENCH-JSON-BEGIN and
+// BENCH-JSON-END. Each benchmark is calibrated to run about BENCH_TARGET_US,
+// repeated BENCH_REPEATS times, and the best repeat counts, so a preempted run
+// does not show up as a regression. Compare results of one target only.
+//
+// The firmware's main.cpp is compiled into this file with setup() and loop()
+// renamed, so the benchmarks call its internals (PumpControl(), the payload
+// builder, the control scheduler) exactly as the firmware builds them.
+
+#include <ArduinoJson.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "../src/clock_discipline.h"
+#include "../src/config.h"
+#include "../src/config_upload.h"
+#include "../src/hal.h"
+#include "../src/journal.h"
+#include "../src/logger.h"
+#include "../src/mqtt_client.h"
+#include "../src/pins.h"
+#include "../src/pressure_filter.h"
+#include "../src/pump_schedule.h"
+#include "../src/sample_batch.h"
+#include "../src/scheduler.h"
+#include "../src/seqlock.h"
+#include "../src/setup_ui.h"
+#include "../src/sntp_client.h"
+#include "../src/spsc_queue.h"
+#include "../src/string_arena.h"
+#include "../src/task_metrics.h"
+
+#define setup FirmwareSetup
+#define loop FirmwareLoop
+#include "../src/main.cpp"
+#undef setup
+#undef loop
+
+#ifndef ARDUINO
+#include <sys/stat.h>
+
+#include "../src/hal_sim.h"
+#endif
+
+#define BENCH_TARGET_US 50000  // Per repeat, calibrated.
+#define BENCH_REPEATS 5
+// Pump intervals of the generated configs.
+#define BENCH_CONFIG_SIZES {1, 8, 64}
+
+namespace {
+
+#ifdef ARDUINO
+const char *const kTarget = "esp32";
+const char *const kUnit = "cycles";
+#else
+const char *const kTarget = "host";
+const char *const kUnit = "ns";
+#endif
+
+// Results go through here so the compiler cannot drop the work.
+volatile int64_t sink;
+
+std::string results;
+
+void AddResult(const char *name, uint32_t iterations, double per_op) {
+  char line[128];
+  snprintf(line, sizeof(line), "%s    \"%s\": {\"iterations\": %lu, "
+           "\"per_op\": %.1f}",
+           results.empty() ? "" : ",\n", name,
+           static_cast<unsigned long>(iterations), per_op);
+  results += line;
+  Serial.printf("BENCH: %-24s %12.1f %s/op\n", name, per_op, kUnit);
+}
+
+// Runs fn() iterations times, returns the ticks that took.
+template <typename Fn>
+uint32_t TimeRun(Fn &fn, uint32_t iterations) {
+  const uint32_t start = hal::CycleCount();
+  for (uint32_t i = 0; i < iterations; ++i) {
+    fn();
+  }
+  return hal::CycleCount() - start;
+}
+
+template <typename Fn>
+void Bench(const char *name, Fn fn) {
+  fn();  // Warm up caches and lazy statics.
+  uint32_t iterations = 1;
+  uint32_t ticks = TimeRun(fn, iterations);
+  // Doubling, so the calibration runs add up to no more than one repeat.
+  while (hal::CyclesToMicros(ticks) < BENCH_TARGET_US / 2 &&
+         iterations < (1u << 30)) {
+    iterations *= 2;
+    ticks = TimeRun(fn, iterations);
+  }
+  iterations *= 2;
+  uint32_t best = UINT32_MAX;
+  for (int i = 0; i < BENCH_REPEATS; ++i) {
+    best = std::min(best, TimeRun(fn, iterations));
+  }
+  AddResult(name, iterations, static_cast<double>(best) / iterations);
+}
+
+// ArduinoJson writer that only counts.
+struct CountingWriter {
+  size_t bytes = 0;
+  size_t write(uint8_t) { return ++bytes, 1; }
+  size_t write(const uint8_t *, size_t size) {
+    bytes += size;
+    return size;
+  }
+};
+
+// A config like the ones in the field, with intervals pump runs spread over
+// the day, every other one limited to a few weekdays.
+bool WriteConfig(const char *path, int intervals) {
+  std::string json =
+      "{\"wifi\":{\"ssid\":\"greenhouse\",\"password\":\"secret\"},"
+      "\"ntp\":{\"server\":\"pool.ntp.org,time.google.com\"},"
+      "\"mqtt\":{\"broker\":\"10.0.0.2\",\"port\":1883,\"user\":\"u\","
+      "\"password\":\"p\",\"deviceId\":\"gh1\",\"topic\":\"greenhouse/1\","
+      "\"rawSamples\":true},"
+      "\"pumpSchedule\":{\"utcOffset\":3,\"pump\":[";
+  for (int i = 0; i < intervals; ++i) {
+    const int start_s = i * (86400 / intervals);
+    char interval[160];
+    snprintf(interval, sizeof(interval),
+             "%s{\"start\":{\"hour\":%d,\"minute\":%d,\"second\":%d},"
+             "\"end\":{\"hour\":%d,\"minute\":%d,\"second\":%d}%s}",
+             i ? "," : "", start_s / 3600, start_s / 60 % 60, start_s % 60,
+             start_s / 3600, start_s / 60 % 60 + 1, start_s % 60,
+             i % 2 ? ",\"days\":[1,3,5]" : "");
+    json += interval;
+  }
+  json += "]}}";
+  hal::File file = hal::File::Open(path, "w");
+  return file && file.Write(json.data(), json.size()) == json.size();
+}
+
+void RunBenchmarks() {
+  logger.SetLevels("*=error");
+  results.clear();
+
+  Bench("config_hms", [] {
+    static int h = 0;
+    h = (h + 7) % 48 - 12;
+    sink = Config::SafeHMSToSecondOfUtcDay(h, 62, -5);
+  });
+
+  static char strings[64][24];
+  for (int i = 0; i < 64; ++i) {
+    snprintf(strings[i], sizeof(strings[i]), "greenhouse/%d/pump", i);
+  }
+  Bench("intern_hit", [] {
+    static StringArena arena;
+    static int i = 0;
+    sink = reinterpret_cast<intptr_t>(arena.Intern(strings[i++ % 64]));
+  });
+  Bench("intern_fill_64", [] {
+    StringArena arena;
+    for (int i = 0; i < 64; ++i) {
+      arena.Intern(strings[i]);
+    }
+    sink = arena.Bytes();
+  });
+
+  static char path[32];
+  static std::unique_ptr<Config> config;
+  for (int intervals : BENCH_CONFIG_SIZES) {
+    snprintf(path, sizeof(path), "/bench_%d.json", intervals);
+    if (!WriteConfig(path, intervals)) {
+      Serial.printf("BENCH: cannot write %s\n", path);
+      continue;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "config_load_%d", intervals);
+    Bench(name, [] {
+      config = Config::CreateFromJsonFile(path);
+      sink = config ? config->schedule.SwitchCount() : -1;
+    });
+    hal::FsRemove(path);
+  }
+  if (!config) {
+    Serial.println("BENCH: no config, skipping the rest");
+    return;
+  }
+
+  static SysTime sys_time;
+  static ControlStatus status;
+  Bench("pump_control", [] {
+    // A different minute of the week each time.
+    sys_time.best_time += 60 * 1000000LL + 7;
+    bool pumping = false;
+    sink = PumpControl(config->schedule, pumping, sys_time, status);
+  });
+
+  static MqttPacket packet;
+  for (int i = 0; i < MQTT_BATCH_SAMPLES; ++i) {
+    packet.pressure_batch.Add(1748736000000LL + i * 234, 1800 + i % 37);
+  }
+  packet.version = 123;
+  static Config::Mqtt mqtt;
+  mqtt = config->mqtt;
+  mqtt.raw_samples = false;
+  Bench("mqtt_payload_json", [] {
+    JsonDocument doc;
+    BuildPayload(mqtt, packet, doc);
+    CountingWriter writer;
+    sink = SerializePayload(doc, false, writer);
+  });
+  mqtt.raw_samples = true;
+  Bench("mqtt_payload_json_raw", [] {
+    JsonDocument doc;
+    BuildPayload(mqtt, packet, doc);
+    CountingWriter writer;
+    sink = SerializePayload(doc, false, writer);
+  });
+  Bench("mqtt_payload_msgpack_raw", [] {
+    JsonDocument doc;
+    BuildPayload(mqtt, packet, doc);
+    CountingWriter writer;
+    sink = SerializePayload(doc, true, writer);
+  });
+
+  // One mains period of ADC samples, as ReadTankPressure() filters them.
+  constexpr uint32_t kSamplesPerPeriod = PRESSURE_ADC_HZ / PRESSURE_MAINS_HZ;
+  static uint16_t samples[kSamplesPerPeriod];
+  for (uint32_t i = 0; i < kSamplesPerPeriod; ++i) {
+    samples[i] = 1800 + static_cast<int>(
+                            200 * std::sin(i * 2 * M_PI / kSamplesPerPeriod));
+  }
+  Bench("pressure_period", [] {
+    static MainsIntegrator integrator(kSamplesPerPeriod);
+    static StepIir filter(PRESSURE_IIR_ALPHA_Q15, PRESSURE_STEP_COUNTS * 16);
+    int32_t mean_q4;
+    if (integrator.Process(samples, kSamplesPerPeriod, &mean_q4, 1)) {
+      sink = filter.Update(mean_q4);
+    }
+  });
+
+  // A pass of loop()'s control tasks with nothing due, and with the pump due
+  // as it is at every switch and after every clock adjustment.
+  static ControlContext context{config.get()};
+  Bench("dispatch_idle", [] {
+    sink = control_scheduler.Dispatch(context, EpochMs);
+  });
+  Bench("dispatch_pump", [] {
+    control_scheduler.MakeDue(kPumpControlTask, EpochMs());
+    sink = control_scheduler.Dispatch(context, EpochMs);
+  });
+}
+
+std::string ResultsJson() {
+  return std::string("{\n  \"target\": \"") + kTarget + "\",\n  \"unit\": \"" +
+         kUnit + "\",\n  \"results\": {\n" + results + "\n  }\n}\n";
+}
+
+}  // namespace
+
+#ifdef ARDUINO
+
+void setup() {
+  Serial.begin(115200);
+  if (!hal::FsMount()) {
+    Serial.println("BENCH: no file system");
+  }
+  RunBenchmarks();
+  Serial.println("BENCH-JSON-BEGIN");
+  Serial.print(ResultsJson().c_str());
+  Serial.println("BENCH-JSON-END");
+}
+
+void loop() { hal::DelayMs(1000); }
+
+#else
+
+// Host driver: --fs DIR for the generated configs (default bench_fs), --out
+// FILE for the JSON (default stdout, then without the progress lines).
+int main(int argc, char *argv[]) {
+  hal::sim::Options options;
+  options.fs_root = "bench_fs";
+  const char *out_path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--fs") && i + 1 < argc) {
+      options.fs_root = argv[++i];
+    } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+      out_path = argv[++i];
+    } else {
+      fprintf(stderr, "usage: %s [--fs DIR] [--out FILE]\n", argv[0]);
+      return 1;
+    }
+  }
+  // Progress goes to Serial, which would mix into the JSON on stdout.
+  options.quiet = !out_path;
+  mkdir(options.fs_root, 0755);
+  hal::sim::Init(options);
+  RunBenchmarks();
+
+  const std::string json = ResultsJson();
+  FILE *out = out_path ? fopen(out_path, "w") : stdout;
+  if (!out) {
+    perror(out_path);
+    return 1;
+  }
+  fputs(json.c_str(), out);
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,69 @@
+"""Compare two benchmark runs of bench/bench_main.cpp.
+
+    python3 bench/compare.py baseline.json new.json --threshold 10
+
+Prints each benchmark's time per op in both runs and the change, and exits
+with 1 if any got slower by more than --threshold percent (default 10), so it
+can gate a release. Runs must be of the same target. From the ESP32, save what
+is printed between BENCH-JSON-BEGIN and BENCH-JSON-END; a whole Serial capture
+works too, the rest is skipped.
+"""
+
+import argparse
+import json
+import sys
+
+BEGIN = "BENCH-JSON-BEGIN"
+END = "BENCH-JSON-END"
+
+
+def load(path):
+    with open(path) as f:
+        text = f.read()
+    if BEGIN in text:
+        text = text.split(BEGIN, 1)[1].split(END, 1)[0]
+    return json.loads(text)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline")
+    parser.add_argument("new")
+    parser.add_argument("--threshold", type=float, default=10,
+                        help="percent slower that counts as a regression")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    new = load(args.new)
+    if (baseline["target"], baseline["unit"]) != (new["target"], new["unit"]):
+        sys.exit("cannot compare %s (%s) with %s (%s)" % (
+            baseline["target"], baseline["unit"], new["target"], new["unit"]))
+
+    unit = new["unit"]
+    regressions = []
+    print("%-26s %14s %14s %8s" % ("benchmark", "baseline", "new", "change"))
+    for name, result in new["results"].items():
+        after = result["per_op"]
+        before = baseline["results"].get(name, {}).get("per_op")
+        if not before:
+            print("%-26s %14s %11.1f %s %8s" % (name, "-", after, unit, "new"))
+            continue
+        change = (after / before - 1) * 100
+        flag = ""
+        if change > args.threshold:
+            regressions.append(name)
+            flag = "  REGRESSION"
+        print("%-26s %11.1f %s %11.1f %s %+7.1f%%%s" % (
+            name, before, unit, after, unit, change, flag))
+    for name in baseline["results"]:
+        if name not in new["results"]:
+            print("%-26s gone" % name)
+
+    if regressions:
+        print("%d slower by more than %g%%: %s" % (
+            len(regressions), args.threshold, ", ".join(regressions)))
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,30 +1,159 @@
 import os
 import gzip
-import shutil
+import hashlib
+import re
+import sys
+
+try:
+    import brotli
+except ImportError:
+    sys.exit("compress_files.py: no brotli module, pip install brotli")
 
 SRC_DIR = "data_src"
-DEST_DIR = "data"
+# Compiled into the firmware, setup_ui.cpp serves it from flash.
+DEST_HEADER = os.path.join("src", "setup_ui_assets.h")
+
+CONTENT_TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "text/javascript",
+}
+# Served at "/" too.
+INDEX = "setup.html"
+
+# data_src/setup.html is the setup-ui build, `npm run build` stamps it with a
+# hash of the sources it was built from (setup-ui/stamp-build.js).
+UI_DIR = "setup-ui"
+UI_STAMP = os.path.join(SRC_DIR, "setup-ui.sha256")
+# Set to 1 to fail the build on a bundle older than its sources (CI).
+STRICT = "SETUP_UI_STRICT"
+
+def source_hash():
+    """SHA-256 of the setup-ui sources, as stamp-build.js computes it."""
+    names = ["index.html", "package.json", "vite.config.ts"]
+    names += [f for f in os.listdir(UI_DIR) if re.fullmatch(r"tsconfig.*\.json", f)]
+    for root, _, files in os.walk(os.path.join(UI_DIR, "src")):
+        names += [os.path.relpath(os.path.join(root, f), UI_DIR).replace(os.sep, "/")
+                  for f in files]
+    sha = hashlib.sha256()
+    for name in sorted(names):
+        with open(os.path.join(UI_DIR, name), "rb") as f:
+            sha.update(name.encode() + b"\0" + f.read().replace(b"\r", b"") + b"\0")
+    return sha.hexdigest()
+
+def check_ui_build():
+    """Warns if data_src/ was not built from the current setup-ui/."""
+    if not os.path.isdir(UI_DIR):
+        return
+    stamp = None
+    if os.path.exists(UI_STAMP):
+        with open(UI_STAMP) as f:
+            stamp = f.read().strip()
+    if stamp == source_hash():
+        return
+    message = (f"{SRC_DIR}/{INDEX} is older than {UI_DIR}/src, "
+               f"run `npm run build` in {UI_DIR}/")
+    if os.environ.get(STRICT) == "1":
+        sys.exit(f"compress_files.py: {message}")
+    print(f"WARNING: {message}, building with it anyway")
 
-def compress_file(src_path, dest_path):
-    """Compress a file using gzip and save it in the destination directory."""
-    os.makedirs(os.path.dirname(dest_path), exist_ok=True)
-    with open(src_path, "rb") as f_in, gzip.open(dest_path, "wb") as f_out:
-        shutil.copyfileobj(f_in, f_out)
-    print(f"Compressed: {src_path} → {dest_path}")
+# Scripts and styles come minified from the setup-ui build, only what is
+# between them is left.
+RAW_BLOCK = re.compile(rb"<(script|style)\b.*?</\1>", re.S | re.I)
 
-def compress_spiffs_files():
-    """Compress files from 'data_src/' into 'data/'."""
+def minify(data, ext):
+    """Whitespace between the tags of an .html file."""
+    if ext != ".html":
+        return data
+    out = []
+    at = 0
+    for block in RAW_BLOCK.finditer(data):
+        out.append(re.sub(rb">\s+<", b"><", data[at:block.start()]).strip())
+        out.append(block.group(0))
+        at = block.end()
+    out.append(re.sub(rb">\s+<", b"><", data[at:]).strip())
+    return b"".join(out)
+
+def c_array(name, data):
+    lines = [f"inline constexpr uint8_t {name}[] = {{"]
+    for i in range(0, len(data), 16):
+        lines.append("    " + ", ".join(f"0x{b:02x}" for b in data[i:i + 16]) + ",")
+    lines.append("};")
+    return "\n".join(lines)
+
+def compress_file(src_path, path):
+    """C arrays of the gzip and br of a file, and its route table entries."""
+    ext = os.path.splitext(src_path)[1]
+    with open(src_path, "rb") as f_in:
+        data = minify(f_in.read(), ext)
+
+    name = "k" + "".join(part.capitalize() for part in re.split(r"[^0-9A-Za-z]+", path) if part)
+    arrays = []
+    # mtime=0 so the same source gives the same bytes every build.
+    gz = gzip.compress(data, compresslevel=9, mtime=0)
+    arrays.append(c_array(name + "Gz", gz))
+    br = brotli.compress(data, quality=11)
+    arrays.append(c_array(name + "Br", br))
+    print(f"Compressed: {src_path} → {DEST_HEADER} "
+          f"({len(gz)} bytes gzip, {len(br)} bytes br)")
+
+    # The server sends this as a strong ETag (plus the encoding), so browsers
+    # revalidate with If-None-Match and get a 304 while the UI is unchanged.
+    etag = hashlib.sha256(data).hexdigest()[:16]
+    paths = ["/" + path] + (["/"] if path == INDEX else [])
+    routes = [f'    {{"{p}", "{CONTENT_TYPES[ext]}", "{etag}", {name}Gz, sizeof({name}Gz), {name}Br, sizeof({name}Br)}},'
+              for p in paths]
+    return arrays, routes
+
+def compress_ui_files():
+    """Compress files from 'data_src/' into DEST_HEADER."""
     if not os.path.exists(SRC_DIR):
         print(f"No '{SRC_DIR}/' folder found, skipping compression.")
         return
+    check_ui_build()
 
-    for root, _, files in os.walk(SRC_DIR):
-        for file in files:
-            if file.endswith((".html", ".css", ".js")) and not file.endswith(".gz"):
+    arrays = []
+    routes = []
+    for root, _, files in sorted(os.walk(SRC_DIR)):
+        for file in sorted(files):
+            if file.endswith(tuple(CONTENT_TYPES)):
                 src_path = os.path.join(root, file)
-                relative_path = os.path.relpath(src_path, SRC_DIR)
-                dest_path = os.path.join(DEST_DIR, relative_path + ".gz")
-                compress_file(src_path, dest_path)
+                relative_path = os.path.relpath(src_path, SRC_DIR).replace(os.sep, "/")
+                file_arrays, file_routes = compress_file(src_path, relative_path)
+                arrays += file_arrays
+                routes += file_routes
+
+    header = "\n".join([
+        f"// Generated by compress_files.py from {SRC_DIR}/, do not edit.",
+        "#pragma once",
+        "",
+        "#include <cstddef>",
+        "#include <cstdint>",
+        "",
+        "struct EmbeddedAsset {",
+        "  const char *path;",
+        "  const char *content_type;",
+        "  const char *etag;",
+        "  const uint8_t *gzip;",
+        "  size_t gzip_length;",
+        "  const uint8_t *br;",
+        "  size_t br_length;",
+        "};",
+        "",
+        *arrays,
+        "",
+        "inline constexpr EmbeddedAsset kEmbeddedAssets[] = {",
+        *routes,
+        "};",
+        "",
+    ])
+    # Only when it changed, or every build would recompile setup_ui.cpp.
+    if os.path.exists(DEST_HEADER):
+        with open(DEST_HEADER) as f:
+            if f.read() == header:
+                return
+    with open(DEST_HEADER, "w") as f:
+        f.write(header)
 
-# Run compression before uploading SPIFFS
-compress_spiffs_files()
+# Run compression before building, the UI goes into the firmware image
+compress_ui_files()
@@ -0,0 +1,122 @@
+"""Turn a binary log (see src/logger.h) back into text.
+
+    curl -s http://<device>/api/log?old=1 > log.old.bin
+    curl -s http://<device>/api/log > log.bin
+    python3 decode_log.py log.old.bin log.bin
+
+Each line is Millis() at the time it was logged, level, module and message.
+"""
+
+import re
+import struct
+import sys
+
+LEVELS = {1: "E", 2: "W", 3: "I", 4: "D"}
+
+# printf conversion, the length modifiers are dropped: Python's % has no use
+# for them, the arguments are stored at full width anyway.
+SPEC = re.compile(r"%([-+ #0]*[0-9]*(?:\.[0-9]*)?)(?:hh|h|ll|l|L|q|j|z|t)?([diuxXocfFeEgGsp%])")
+
+
+def read_varint(data, at):
+    value = 0
+    shift = 0
+    while True:
+        byte = data[at]
+        at += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, at
+
+
+def read_args(data):
+    args = []
+    at = 0
+    while at < len(data):
+        kind = chr(data[at])
+        at += 1
+        if kind == "i":
+            value, at = read_varint(data, at)
+            args.append((value >> 1) ^ -(value & 1))
+        elif kind == "u":
+            value, at = read_varint(data, at)
+            args.append(value)
+        elif kind == "d":
+            args.append(struct.unpack_from("<d", data, at)[0])
+            at += 8
+        elif kind == "s":
+            length = data[at]
+            args.append(data[at + 1 : at + 1 + length].decode("utf-8", "replace"))
+            at += 1 + length
+        else:
+            break
+    return args
+
+
+def format_message(fmt, args):
+    args = iter(args)
+
+    def convert(match):
+        flags, conversion = match.groups()
+        if conversion == "%":
+            return "%"
+        value = next(args, None)
+        if value is None:
+            return "?"
+        if conversion in "diuc":
+            conversion = {"i": "d", "u": "d"}.get(conversion, conversion)
+            value = int(value)
+        elif conversion in "xXo":
+            value = int(value)
+        elif conversion == "p":
+            return "0x%x" % int(value)
+        elif conversion == "s":
+            value = str(value)
+        else:
+            value = float(value)
+        return ("%" + flags + conversion) % value
+
+    return SPEC.sub(convert, fmt)
+
+
+def decode(data, out):
+    formats = {}
+    at = 0
+    while at < len(data):
+        tag = chr(data[at])
+        if tag == "F":
+            (fid,) = struct.unpack_from("<I", data, at + 1)
+            name_length = data[at + 5]
+            module = data[at + 6 : at + 6 + name_length].decode()
+            at += 6 + name_length
+            (format_length,) = struct.unpack_from("<H", data, at)
+            fmt = data[at + 2 : at + 2 + format_length].decode("utf-8", "replace")
+            at += 2 + format_length
+            formats[fid] = (module, fmt)
+        elif tag == "R":
+            fid, time_ms, level, length = struct.unpack_from("<IIBB", data, at + 1)
+            args = read_args(data[at + 11 : at + 11 + length])
+            at += 11 + length
+            module, fmt = formats.get(fid, ("?", "unknown format %08x\n" % fid))
+            message = format_message(fmt, args).rstrip("\n")
+            out.write("%10.3f %s %-8s %s\n" % (time_ms / 1000, LEVELS.get(level, "?"), module, message))
+        elif tag == "L":
+            (count,) = struct.unpack_from("<I", data, at + 1)
+            at += 5
+            out.write("%10s - %-8s %d records dropped\n" % ("", "log", count))
+        else:
+            out.write("garbage at byte %d, stopping\n" % at)
+            return
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    for path in sys.argv[1:]:
+        with open(path, "rb") as f:
+            decode(f.read(), sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
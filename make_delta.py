@@ -0,0 +1,193 @@
+"""Make a firmware patch from one build to the next (see src/ota_update.h).
+
+    python3 make_delta.py old/firmware.bin new/firmware.bin update.ghd
+
+old has to be exactly the image the device runs, the patch is refused
+otherwise. Then, in setup mode:
+
+    curl --data-binary @update.ghd http://192.168.42.1/api/ota
+
+or, while the controller runs, over MQTT (needs paho-mqtt):
+
+    python3 send_ota.py --broker 10.0.0.2 --topic greenhouse/1 update.ghd
+
+Like bsdiff: regions of the new image are matched to regions of the old one
+and stored as the bytewise difference, which is mostly zeros where code only
+moved and its addresses changed, and the whole is compressed.
+"""
+
+import hashlib
+import re
+import struct
+import sys
+
+MAGIC = b"GHD1"
+# Must match DeltaPatch.
+WINDOW_BITS = 11
+COUNT_BITS = 7
+
+KEY = 8  # Bytes that have to match exactly to try a region.
+MIN_MATCH = 16
+# A region ends once this many bytes in a row do not make it better.
+GIVE_UP = 32
+# Zero differences at least this long become a copy.
+ZERO_RUN = re.compile(b"\\x00{12,}")
+
+
+def find_regions(old, new):
+    """Yields (new_start, new_end, old_start) of regions that roughly match."""
+    index = {}
+    # Every 4th offset is enough, the new image is tried at every offset.
+    for j in range(0, len(old) - KEY + 1, 4):
+        index.setdefault(old[j : j + KEY], j)
+    i = 0
+    done = 0  # New bytes covered by a region already.
+    while i + KEY <= len(new):
+        j = index.get(new[i : i + KEY])
+        if j is None:
+            i += 1
+            continue
+        # Back to where the last region ended, as long as it matches exactly.
+        start = i
+        while start > done and j > 0 and new[start - 1] == old[j - 1]:
+            start -= 1
+            j -= 1
+        # Forward as long as it pays, counting a matching byte +1 and any
+        # other -1, like bsdiff.
+        score = best = length = 0
+        k = 0
+        limit = min(len(new) - start, len(old) - j)
+        while k < limit and k - length < GIVE_UP:
+            score += 1 if new[start + k] == old[j + k] else -1
+            k += 1
+            if score > best:
+                best = score
+                length = k
+        if length < MIN_MATCH:
+            i += 1
+            continue
+        yield start, start + length, j
+        i = done = start + length
+
+
+def operations(old, new):
+    """The patch operations as bytes, before compression."""
+    out = bytearray()
+
+    def insert(start, end):
+        if end > start:
+            out.extend(b"I" + struct.pack("<I", end - start))
+            out.extend(new[start:end])
+
+    at = 0
+    for start, end, old_start in find_regions(old, new):
+        insert(at, start)
+        diff = bytes((new[k] - old[old_start + k - start]) & 0xFF
+                     for k in range(start, end))
+        # Long zero runs are copies, the rest goes in as differences.
+        k = 0
+        for run in ZERO_RUN.finditer(diff):
+            if run.start() > k:
+                out.extend(b"A" + struct.pack("<II", old_start + k,
+                                              run.start() - k))
+                out.extend(diff[k : run.start()])
+            out.extend(b"C" + struct.pack("<II", old_start + run.start(),
+                                          run.end() - run.start()))
+            k = run.end()
+        if k < len(diff):
+            out.extend(b"A" + struct.pack("<II", old_start + k, len(diff) - k))
+            out.extend(diff[k:])
+        at = end
+    insert(at, len(new))
+    out.extend(b"E")
+    return bytes(out)
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.bits = 0
+        self.count = 0
+
+    def put(self, value, bits):
+        self.bits = self.bits << bits | value
+        self.count += bits
+        while self.count >= 8:
+            self.count -= 8
+            self.out.append(self.bits >> self.count & 0xFF)
+        self.bits &= (1 << self.count) - 1
+
+    def finish(self):
+        if self.count:
+            self.out.append(self.bits << (8 - self.count) & 0xFF)
+        return bytes(self.out)
+
+
+def compress(data):
+    """LZSS in DeltaPatch's format, greedy with hash chains."""
+    window = 1 << WINDOW_BITS
+    max_count = 1 << COUNT_BITS
+    min_count = 3  # Shorter back references cost more than the literals.
+    reference_bits = 1 + WINDOW_BITS + COUNT_BITS
+    heads = {}
+    chain = [0] * len(data)
+    writer = BitWriter()
+
+    def insert(position):
+        key = data[position : position + min_count]
+        chain[position] = heads.get(key, -1)
+        heads[key] = position
+
+    i = 0
+    while i < len(data):
+        best_length = 0
+        best_distance = 0
+        candidate = heads.get(data[i : i + min_count], -1)
+        tries = 32
+        while candidate >= 0 and i - candidate <= window and tries:
+            limit = min(max_count, len(data) - i)
+            length = 0
+            while (length < limit and
+                   data[candidate + length] == data[i + length]):
+                length += 1
+            if length > best_length:
+                best_length = length
+                best_distance = i - candidate
+                if length == limit:
+                    break
+            candidate = chain[candidate]
+            tries -= 1
+        if best_length >= min_count:
+            writer.put((best_distance - 1) << COUNT_BITS | (best_length - 1),
+                       reference_bits)
+            for k in range(best_length):
+                insert(i + k)
+            i += best_length
+        else:
+            writer.put(1 << 8 | data[i], 9)
+            insert(i)
+            i += 1
+    return writer.finish()
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit(__doc__)
+    with open(sys.argv[1], "rb") as f:
+        old = f.read()
+    with open(sys.argv[2], "rb") as f:
+        new = f.read()
+    ops = operations(old, new)
+    patch = (MAGIC +
+             struct.pack("<I", len(old)) + hashlib.sha256(old).digest() +
+             struct.pack("<I", len(new)) + hashlib.sha256(new).digest() +
+             compress(ops))
+    with open(sys.argv[3], "wb") as f:
+        f.write(patch)
+    print("%s: %d bytes for a %d byte image (%.1f%%), %d before compression" %
+          (sys.argv[3], len(patch), len(new), 100.0 * len(patch) / len(new),
+           len(ops)))
+
+
+if __name__ == "__main__":
+    main()
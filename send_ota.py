@@ -0,0 +1,86 @@
+"""Send a firmware patch from make_delta.py to a running controller over MQTT.
+
+    python3 send_ota.py --broker 10.0.0.2 --topic greenhouse/1 update.ghd
+
+Needs paho-mqtt. The patch goes to <topic>/ota a piece at a time, each piece
+its offset in the patch (u32, little endian) and the bytes from there, and
+the next one only once <topic>/ota/status says the last one is in (see
+MQTT_OTA_SUFFIX in src/main.cpp). A piece the controller missed is sent
+again after --timeout seconds, also across reconnects of either side. Exits
+with 1 if the controller refused the patch, it is left running the old image
+then.
+"""
+
+import argparse
+import json
+import queue
+import struct
+import sys
+import time
+
+import paho.mqtt.client as mqtt
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("patch")
+    parser.add_argument("--broker", required=True)
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--user")
+    parser.add_argument("--password")
+    parser.add_argument("--topic", required=True,
+                        help="the controller's mqtt.topic")
+    parser.add_argument("--piece", type=int, default=4096,
+                        help="patch bytes per message")
+    parser.add_argument("--timeout", type=float, default=30,
+                        help="seconds to wait for a status")
+    args = parser.parse_args()
+
+    with open(args.patch, "rb") as f:
+        patch = f.read()
+
+    statuses = queue.Queue()
+    try:
+        client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION1)
+    except AttributeError:  # paho-mqtt 1.x
+        client = mqtt.Client()
+    if args.user:
+        client.username_pw_set(args.user, args.password)
+    client.on_connect = lambda c, userdata, flags, rc: c.subscribe(
+        args.topic + "/ota/status", qos=1)
+    client.on_message = lambda c, userdata, message: statuses.put(
+        json.loads(message.payload))
+    client.connect(args.broker, args.port)
+    client.loop_start()
+
+    offset = 0
+    start = time.time()
+    try:
+        while True:
+            piece = patch[offset:offset + args.piece]
+            piece = struct.pack("<I", offset) + piece
+            client.publish(args.topic + "/ota", piece, qos=1)
+            try:
+                status = statuses.get(timeout=args.timeout)
+            except queue.Empty:
+                print("no status, sending %d again" % offset)
+                continue
+            # Also drops statuses of pieces sent before a timeout.
+            while not statuses.empty():
+                status = statuses.get()
+            if status["state"] == "failed":
+                sys.exit("refused at %d: %s" % (status["offset"],
+                                                status["error"]))
+            if status["state"] == "done":
+                print("%d bytes in %.0f s, the controller restarts into the "
+                      "new image" % (len(patch), time.time() - start))
+                return
+            offset = status["offset"]
+            print("%d of %d bytes" % (offset, len(patch)))
+    finally:
+        client.loop_stop()
+        client.disconnect()
+
+
+if __name__ == "__main__":
+    main()
@@ -1,6 +1,6 @@
 import { Card, Form } from 'react-bootstrap';
 import { VerifiedPasswordControl } from './verified-password-control';
-import { MqttSettings } from './settings-context';
+import { MqttEncoding, MqttSettings } from './settings-context';
 
 export function MqttSettingsCard({
   mqtt,
@@ -51,6 +51,27 @@ export function MqttSettingsCard({
     });
   };
 
+  const handleEncodingChange = (event: React.ChangeEvent<HTMLSelectElement>) => {
+    setMqtt({
+      ...mqtt,
+      encoding: event.currentTarget.value as MqttEncoding,
+    });
+  };
+
+  const handlePublishWindowChange = (event: React.ChangeEvent<HTMLInputElement>) => {
+    setMqtt({
+      ...mqtt,
+      publishWindowSec: parseInt(event.currentTarget.value, 10) || 1,
+    });
+  };
+
+  const handleRawSamplesChange = (event: React.ChangeEvent<HTMLInputElement>) => {
+    setMqtt({
+      ...mqtt,
+      rawSamples: event.currentTarget.checked,
+    });
+  };
+
   const handleDeviceIdChange = (event: React.ChangeEvent<HTMLInputElement>) => {
     setMqtt({
       ...mqtt,
@@ -118,6 +139,37 @@ export function MqttSettingsCard({
                 Hint: losant/{mqtt.deviceId || '{device_id}'}/state
               </Form.Text>
             </Form.Group>
+            <Form.Group className="mb-3">
+              <Form.Label>Payload encoding</Form.Label>
+              <Form.Select
+                value={mqtt.encoding || 'json'}
+                onChange={handleEncodingChange}
+              >
+                <option value="json">JSON</option>
+                <option value="msgpack">MessagePack (smaller)</option>
+              </Form.Select>
+            </Form.Group>
+            <Form.Group className="mb-3">
+              <Form.Label>Publish every (s)</Form.Label>
+              <Form.Control
+                type="number"
+                min={1}
+                value={mqtt.publishWindowSec ?? 60}
+                onChange={handlePublishWindowChange}
+              />
+              <Form.Text className="text-muted">
+                Pressure is sampled about twice a second, each message has
+                min/max/mean/last of the window.
+              </Form.Text>
+            </Form.Group>
+            <Form.Check
+              className="mb-3"
+              type="switch"
+              id="mqtt-raw-samples"
+              label="Include raw samples"
+              checked={mqtt.rawSamples ?? false}
+              onChange={handleRawSamplesChange}
+            />
           </Form>
         </Card.Body>
       </Card>
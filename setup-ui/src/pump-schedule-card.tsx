@@ -5,6 +5,7 @@ import { useEffect, useState } from 'preact/hooks';
 
 const BAD_DURATION_SECONDS = 1200; // 20 minutes
 const WARNING_DURATION_SECONDS = 300; // 5 minutes
+const WEEKDAYS = ['S', 'M', 'T', 'W', 'T', 'F', 'S']; // 0 = Sunday
 
 interface PumpScheduleCardProps {
   pumpSchedule: PumpSchedule;
@@ -68,6 +69,22 @@ export function PumpScheduleCard({ pumpSchedule, setPumpSchedule, onScheduleTidy
     setPumpSchedule({ ...pumpSchedule, pump: updatedPump });
   };
 
+  const isOnDay = (pumping: ScheduledPumping, day: number) =>
+    !pumping.days || pumping.days.length === 0 || pumping.days.includes(day);
+
+  const sharesDay = (a: ScheduledPumping, b: ScheduledPumping) =>
+    WEEKDAYS.some((_, day) => isOnDay(a, day) && isOnDay(b, day));
+
+  const handleDayToggle = (index: number, day: number) => {
+    const updatedPump = [...pumpSchedule.pump];
+    const pumping = updatedPump[index];
+    const days = WEEKDAYS.map((_, d) => d).filter((d) => isOnDay(pumping, d) !== (d === day));
+    if (days.length === 0) return; // Keep at least one day
+    // All days selected is stored as no restriction.
+    updatedPump[index] = { ...pumping, days: days.length === WEEKDAYS.length ? [] : days };
+    setPumpSchedule({ ...pumpSchedule, pump: updatedPump });
+  };
+
   const calculateDuration = (start: TriggerTime, end: TriggerTime) => {
     const startSeconds = hmsToSeconds(start);
     const endSeconds = hmsToSeconds(end);
@@ -115,12 +132,11 @@ export function PumpScheduleCard({ pumpSchedule, setPumpSchedule, onScheduleTidy
         return aStartSeconds - bStartSeconds;
       });
 
-    // Remove overlapping durations
+    // Remove durations overlapping an earlier one on the same weekday
     updatedPump = updatedPump.filter((pumping, index, array) => {
-      if (index === 0) return true;
-      const prevEndSeconds = hmsToSeconds(array[index - 1].end);
       const currentStartSeconds = hmsToSeconds(pumping.start);
-      return currentStartSeconds >= prevEndSeconds;
+      return array.slice(0, index).every((prev) =>
+        !sharesDay(prev, pumping) || currentStartSeconds >= hmsToSeconds(prev.end));
     });
 
     return { ...schedule, pump: updatedPump };
@@ -170,6 +186,7 @@ export function PumpScheduleCard({ pumpSchedule, setPumpSchedule, onScheduleTidy
                 <th className="header-time-start">Start Time (HH:MM:SS)</th>
                 <th>End Time (HH:MM:SS)</th>
                 <th>Duration</th>
+                <th>Days</th>
                 <th></th>
               </tr>
             </thead>
@@ -243,6 +260,21 @@ export function PumpScheduleCard({ pumpSchedule, setPumpSchedule, onScheduleTidy
                     <td className={durationClass}>
                       {formattedDuration}
                     </td>
+                    <td>
+                      <div className="d-flex">
+                        {WEEKDAYS.map((label, day) => (
+                          <Button
+                            key={day}
+                            size="sm"
+                            className="me-1 day-toggle"
+                            variant={isOnDay(pumping, day) ? 'primary' : 'outline-secondary'}
+                            onClick={() => handleDayToggle(index, day)}
+                          >
+                            {label}
+                          </Button>
+                        ))}
+                      </div>
+                    </td>
                     <td>
                       <Button variant="danger" onClick={() => handleRemoveRow(index)}>
                         <span className="bwfont">&#x02716;</span>
@@ -20,8 +20,13 @@ export interface MqttSettings {
   password: string;
   deviceId: string;
   topic: string;
+  encoding?: MqttEncoding; // Default: 'json'
+  publishWindowSec?: number; // Default: 60
+  rawSamples?: boolean; // Default: false
 }
 
+export type MqttEncoding = 'json' | 'msgpack';
+
 export interface Settings {
   wifi: WifiSettings;
   ntp: NtpSettings;
@@ -37,6 +42,8 @@ export interface TriggerTime {
 export interface ScheduledPumping {
   start: TriggerTime;
   end: TriggerTime;
+  // Weekdays (0 = Sunday) the interval applies to, every day if missing/empty.
+  days?: number[];
 }
 
 export interface PumpSchedule {
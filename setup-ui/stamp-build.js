@@ -0,0 +1,37 @@
+// After vite build: copies the bundle to ../data_src and stamps it with a
+// hash of the sources, compress_files.py refuses a bundle older than them.
+import { createHash } from 'node:crypto';
+import { copyFileSync, readdirSync, readFileSync, writeFileSync } from 'node:fs';
+import { join, relative, sep } from 'node:path';
+import { fileURLToPath } from 'node:url';
+
+const here = fileURLToPath(new URL('.', import.meta.url));
+const dataSrc = join(here, '..', 'data_src');
+
+// The same files, in the same order, as source_hash() in compress_files.py.
+function sources(dir) {
+  return readdirSync(dir, { withFileTypes: true }).flatMap((entry) => {
+    const path = join(dir, entry.name);
+    return entry.isDirectory() ? sources(path) : [path];
+  });
+}
+
+const files = [
+  ...['index.html', 'package.json', 'vite.config.ts'].map((f) => join(here, f)),
+  ...readdirSync(here)
+    .filter((f) => /^tsconfig.*\.json$/.test(f))
+    .map((f) => join(here, f)),
+  ...sources(join(here, 'src')),
+]
+  .map((path) => [relative(here, path).split(sep).join('/'), path])
+  .sort(([a], [b]) => (a < b ? -1 : a > b ? 1 : 0));
+
+const hash = createHash('sha256');
+for (const [name, path] of files) {
+  hash.update(name + '\0');
+  hash.update(readFileSync(path, 'utf8').replace(/\r/g, '') + '\0');
+}
+
+copyFileSync(join(here, 'dist', 'index.html'), join(dataSrc, 'setup.html'));
+writeFileSync(join(dataSrc, 'setup-ui.sha256'), hash.digest('hex') + '\n');
+console.log('setup-ui: dist/index.html -> data_src/setup.html, stamped');
@@ -0,0 +1,57 @@
+#include "clock_discipline.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+int64_t DriftMicros(int64_t rtc_us, int32_t ppm_q16) {
+  // Whole seconds and the rest separately, so days of RTC time at 500 ppm
+  // stay far from overflowing int64_t.
+  const int64_t seconds = rtc_us / 1000000LL;
+  const int64_t rest_us = rtc_us % 1000000LL;
+  return (seconds * ppm_q16 + rest_us * ppm_q16 / 1000000LL) / 65536;
+}
+
+void ClockDiscipline::SetDrift(int32_t ppm_q16) {
+  drift_q16_ = std::clamp(ppm_q16, -kMaxDriftPpm * 65536, kMaxDriftPpm * 65536);
+}
+
+void ClockDiscipline::AddSample(int64_t ntp_us, int64_t rtc_us) {
+  const int64_t dt_us = rtc_us - answer_rtc_us_;
+  if (has_answer_ && dt_us > 0) {
+    last_error_us_ = ntp_us - TimeAt(rtc_us);
+    if (std::abs(last_error_us_) > kStepErrorUs) {
+      poll_s_ = kMinPollS;
+      good_count_ = 0;
+    } else {
+      // The RTC gained -error more than the drift says: that over dt is the
+      // drift error in ppm, weighted by dt / (dt + time constant).
+      const int64_t error_q16 = -last_error_us_ * (1000000LL << 16) / dt_us;
+      const int64_t dt_s = std::max<int64_t>(1, dt_us / 1000000LL);
+      const int64_t weight_q16 = (dt_s << 16) / (dt_s + kFllTimeConstantS);
+      SetDrift(static_cast<int32_t>(std::clamp<int64_t>(
+          drift_q16_ + ((error_q16 * weight_q16) >> 16), INT32_MIN,
+          INT32_MAX)));
+
+      if (std::abs(last_error_us_) > kBadErrorUs) {
+        poll_s_ = std::max(kMinPollS, poll_s_ / 2);
+        good_count_ = 0;
+      } else if (std::abs(last_error_us_) < kGoodErrorUs &&
+                 ++good_count_ >= kGoodToBackOff) {
+        poll_s_ = std::min(kMaxPollS, poll_s_ * 2);
+        good_count_ = 0;
+      }
+    }
+  }
+  // The answer is the new reference, the error is not carried along.
+  has_answer_ = true;
+  answer_time_us_ = ntp_us;
+  answer_rtc_us_ = rtc_us;
+}
+
+int64_t ClockDiscipline::TimeAt(int64_t rtc_us) const {
+  if (!has_answer_) {
+    return 0;
+  }
+  const int64_t since_us = rtc_us - answer_rtc_us_;
+  return answer_time_us_ + since_us - DriftMicros(since_us, drift_q16_);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+// Disciplines the RTC against NTP answers. A frequency locked loop learns how
+// fast the RTC runs (its drift, in ppm as Q16.16 fixed point) so the time can
+// be extrapolated between answers, and the better that works the longer the
+// poll interval gets, from kMinPollS up to kMaxPollS.
+//
+// The model is the last answer plus the drift since:
+//
+//   time(rtc) = answer_time + (rtc - answer_rtc) - DriftMicros(rtc - answer_rtc)
+//
+// Each answer then tells how far the extrapolation was off. Divided by the time
+// since the previous one that is the drift still unaccounted for, which goes
+// into the estimate with a weight growing with the interval, so the estimate
+// has the same time constant (kFllTimeConstantS) however often we poll.
+
+#include <cstdint>
+
+// RTC drift at ppm_q16 over rtc_us of RTC time, usec. Positive drift means
+// the RTC runs fast.
+int64_t DriftMicros(int64_t rtc_us, int32_t ppm_q16);
+
+class ClockDiscipline {
+ public:
+  static constexpr int32_t kMinPollS = 16;
+  static constexpr int32_t kMaxPollS = 16384;  // ~4.5 h
+  // Way more than any crystal, anything beyond is a broken measurement.
+  static constexpr int32_t kMaxDriftPpm = 500;
+
+  // Starts from a drift learned before, e.g. kept in NVS.
+  void SetDrift(int32_t ppm_q16);
+  // An NTP answer: server time and the RtcMicros() it came in at.
+  void AddSample(int64_t ntp_us, int64_t rtc_us);
+  // Estimated time at RTC time rtc_us, 0 before the first answer.
+  int64_t TimeAt(int64_t rtc_us) const;
+
+  int32_t DriftPpmQ16() const { return drift_q16_; }
+  int32_t PollIntervalS() const { return poll_s_; }
+  // How far the last answer was from the extrapolation, usec.
+  int64_t LastErrorUs() const { return last_error_us_; }
+
+ private:
+  // Answers closer than this to the extrapolation count as good, a few good
+  // ones in a row double the poll interval.
+  static constexpr int64_t kGoodErrorUs = 5000;
+  static constexpr int kGoodToBackOff = 3;
+  // Further off than this halves it again.
+  static constexpr int64_t kBadErrorUs = 20000;
+  // Further off than this the clock was stepped (or the RTC reset), the drift
+  // measurement would be garbage so only the phase is taken.
+  static constexpr int64_t kStepErrorUs = 500000;
+  static constexpr int64_t kFllTimeConstantS = 1024;
+
+  bool has_answer_ = false;
+  int64_t answer_time_us_ = 0;
+  int64_t answer_rtc_us_ = 0;
+  int32_t drift_q16_ = 0;
+  int32_t poll_s_ = kMinPollS;
+  int good_count_ = 0;
+  int64_t last_error_us_ = 0;
+};
@@ -1,68 +1,116 @@
 #include "config.h"
 
 #include <ArduinoJson.h>
-#include <FS.h>
-#include <SPIFFS.h>
-#include <bits/unique_ptr.h>
 
+#include <algorithm>
 #include <cstring>
 
+#include "hal.h"
+#include "logger.h"
+
 namespace {
 
 // Clock arithmetic mod (negative values are wrapped around)
 // e.g. -1 % 24 = 23
 constexpr int SafeMod(int value, int mod) { return (value % mod + mod) % mod; }
 
-size_t SumStringStorageLengths(const JsonVariant v) {
-  if (v.is<const char *>()) {
-    const char *str = v.as<const char *>();
-    return str ? strlen(str) + 1 : 0;  // Safely handle null strings
-  } else if (v.is<JsonObject>() || v.is<JsonArray>()) {
-    size_t totalStringLength = 0;
-    for (JsonPair item :
-         v.as<JsonObject>()) {  // Works for both objects and arrays
-      totalStringLength += SumStringStorageLengths(item.value());
+// Config string fields and the JSON values they get, collected while parsing
+// so the string arena can be sized in one go before anything is interned.
+class PendingStrings {
+ public:
+  void Add(const char **field, const char *value) {
+    if (count_ == kMaxFields) {
+      overflow_ = true;
+      return;
     }
-    return totalStringLength;
+    fields_[count_] = field;
+    values_[count_] = value;
+    bytes_ += strlen(value) + 1;
+    count_++;
   }
-  // Ignore non-string scalar types (e.g., integers, floats, booleans)
-  return 0;
-}
-char const *Intern(const char *str, String &string_table) {
-  char const *found = static_cast<char const *>(memmem(
-      string_table.c_str(), string_table.length() + 1, str, strlen(str) + 1));
-  if (found) {
-    return found;  // Return existing position if string is already in the table
-  }
-  if (string_table.length()) {
-    string_table.concat('\0');  // Ensure null-terminated before next
-  }
-  found = string_table.c_str() + string_table.length();
-  string_table.concat(str);
-  return found;
+
+  // A field was added past kMaxFields and left out.
+  bool Overflow() const { return overflow_; }
+
+  void InternInto(StringArena &arena) const {
+    arena.Reserve(bytes_, count_);
+    for (size_t i = 0; i < count_; ++i) {
+      *fields_[i] = arena.Intern(values_[i]);
+    }
+  }
+
+ private:
+  static constexpr size_t kMaxFields = Config::kStringFields;
+  const char **fields_[kMaxFields];
+  const char *values_[kMaxFields];
+  size_t count_ = 0;
+  size_t bytes_ = 0;
+  bool overflow_ = false;
 };
 
+bool SameString(const char *a, const char *b) {
+  return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
+bool SameSchedule(const PumpSchedule &a, const PumpSchedule &b) {
+  if (a.SwitchCount() != b.SwitchCount() ||
+      a.OnAtWeekStart() != b.OnAtWeekStart()) {
+    return false;
+  }
+  for (int i = 0; i < a.SwitchCount(); ++i) {
+    if (a.Switch(i) != b.Switch(i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 }  // namespace
 
 int Config::SafeHMSToSecondOfUtcDay(int h, int m, int s) {
   return SafeMod(h, 24) * 3600 + SafeMod(m, 60) * 60 + SafeMod(s, 60);
 }
 
+bool Config::ParseIp(const char *text, uint8_t (&ip)[4]) {
+  uint8_t parsed[4] = {};
+  if (*text != '\0') {
+    for (int i = 0; i < 4; ++i) {
+      if (i > 0 && *text++ != '.') {
+        return false;
+      }
+      int value = 0;
+      int digits = 0;
+      for (; *text >= '0' && *text <= '9' && digits < 3; ++text, ++digits) {
+        value = value * 10 + (*text - '0');
+      }
+      if (digits == 0 || value > 255) {
+        return false;
+      }
+      parsed[i] = value;
+    }
+    if (*text != '\0') {
+      return false;
+    }
+  }
+  memcpy(ip, parsed, sizeof(parsed));
+  return true;
+}
+
 std::unique_ptr<Config> Config::CreateFromJsonFile(const char file[]) {
-  if (!SPIFFS.begin(true)) {
-    Serial.println("Failed to mount SPIFFS");
+  if (!hal::FsMount()) {
+    LOG_ERROR(kLogConfig, "Failed to mount SPIFFS\n");
     return nullptr;
   }
 
-  File configFile = SPIFFS.open(file, "r");
+  hal::File configFile = hal::File::Open(file, "r");
   if (!configFile) {
-    Serial.printf("Failed to open config file: %s\n", file);
+    LOG_ERROR(kLogConfig, "Failed to open config file: %s\n", file);
     return nullptr;
   }
 
-  size_t size = configFile.size() + 1;
+  size_t size = configFile.Size() + 1;
   if (size == 0) {
-    Serial.println("Config file is empty");
+    LOG_ERROR(kLogConfig, "Config file is empty\n");
     return nullptr;
   }
 
@@ -73,104 +121,166 @@ std::unique_ptr<Config> Config::CreateFromJsonFile(const char file[]) {
 
   {
     std::unique_ptr<char[]> buffer(new char[size]);
-    configFile.readBytes(buffer.get(), size);
+    configFile.Read(buffer.get(), size - 1);
     buffer[size - 1] = '\0';  // Null-terminate the string
-    configFile.close();
+    configFile.Close();
 
     DeserializationError error = deserializeJson(jsonDoc, buffer.get());
     if (error) {
-      Serial.printf("Failed to parse config file: %s\n", error.c_str());
+      LOG_ERROR(kLogConfig, "Failed to parse config file: %s\n",
+                error.c_str());
       return nullptr;
     }
     // Free parse buffer.
   }
 
-  // Walk through jsonDoc and sum up the length of all strings
-  size_t totalStringLength =
-      SumStringStorageLengths(jsonDoc.as<JsonVariant>()) +
-      32;  // Magic number for builtin constants like "pool.ntp.org"
-  Serial.printf("Sum of string lengths in JSON: %zu\n", totalStringLength);
-
-  config->string_table.reserve(totalStringLength);
-
-  auto intern = [&](const char *str) {
-    return Intern(str, config->string_table);
+  // The JSON document goes away on return, so its strings are copied to the
+  // arena once parsing is done.
+  PendingStrings strings;
+  auto intern = [&](const char *&field, const char *value) {
+    strings.Add(&field, value);
   };
 
   // Parse WiFi configuration
   JsonObject wifi = jsonDoc["wifi"];
   if (!wifi.isNull()) {
-    config->wifi.ssid = intern(wifi["ssid"] | "");
-    config->wifi.password = intern(wifi["password"] | "");
+    intern(config->wifi.ssid, wifi["ssid"] | "");
+    intern(config->wifi.password, wifi["password"] | "");
+    // The validator turned away anything but addresses, a bad one stays DHCP.
+    if (!ParseIp(wifi["ip"] | "", config->wifi.ip) ||
+        !ParseIp(wifi["gateway"] | "", config->wifi.gateway) ||
+        !ParseIp(wifi["netmask"] | "", config->wifi.netmask) ||
+        !ParseIp(wifi["dns"] | "", config->wifi.dns)) {
+      LOG_WARN(kLogConfig, "Bad static IP, using DHCP\n");
+      memset(config->wifi.ip, 0, sizeof(config->wifi.ip));
+    }
   }
 
   // Parse NTP configuration
   JsonObject ntp = jsonDoc["ntp"];
   if (!ntp.isNull()) {
-    config->ntp.server = intern(ntp["server"] | "pool.ntp.org");
+    intern(config->ntp.server, ntp["server"] | "pool.ntp.org");
   }
 
   // Parse MQTT configuration
   JsonObject mqtt = jsonDoc["mqtt"];
   if (!mqtt.isNull()) {
-    config->mqtt.broker = intern(mqtt["broker"] | "");
+    intern(config->mqtt.broker, mqtt["broker"] | "");
     config->mqtt.port = mqtt["port"] | 1883;
-    config->mqtt.user = intern(mqtt["user"] | "");
-    config->mqtt.password = intern(mqtt["password"] | "");
-    config->mqtt.device_id = intern(mqtt["deviceId"] | "");
-    config->mqtt.topic = intern(mqtt["topic"] | "");
+    intern(config->mqtt.user, mqtt["user"] | "");
+    intern(config->mqtt.password, mqtt["password"] | "");
+    intern(config->mqtt.device_id, mqtt["deviceId"] | "");
+    intern(config->mqtt.topic, mqtt["topic"] | "");
+    config->mqtt.encoding = strcmp(mqtt["encoding"] | "json", "msgpack") == 0
+                                ? MqttEncoding::kMsgPack
+                                : MqttEncoding::kJson;
+    config->mqtt.publish_window_s = std::max(1, mqtt["publishWindowSec"] | 60);
+    config->mqtt.raw_samples = mqtt["rawSamples"] | false;
   }
 
-  // Parse pump schedule
+  JsonObject api = jsonDoc["api"];
+  if (!api.isNull()) {
+    intern(config->api.token, api["token"] | "");
+  }
+
+  // Parse pump schedule, intervals are in local time and by default on every
+  // day, "days" can limit them to some weekdays (0 = Sunday).
   JsonObject pumpSchedule = jsonDoc["pumpSchedule"];
   if (!pumpSchedule.isNull()) {
-    config->schedule.interval_count = 0;
-
     config->utc_offset =
         pumpSchedule["utcOffset"] | 0;  // Default to 0 if missing
     
     JsonArray pump = pumpSchedule["pump"];
+    bool schedule_full = false;
     for (JsonObject interval : pump) {
-      if (config->schedule.interval_count >= Config::kMaxIntervals) {
-        Serial.println("Too many pump intervals, truncating");
-        break;
-      }
-      Config::Schedule::Interval &currentInterval =
-          config->schedule.intervals[config->schedule.interval_count++];
       const JsonObject start = interval["start"];
       const JsonObject end = interval["end"];
-      if (!start.isNull() && !end.isNull()) {
-        currentInterval.start_sec = Config::SafeHMSToSecondOfUtcDay(
-            (start["hour"] | 0) - config->utc_offset, start["minute"] | 0,
-            start["second"] | 0);
-        currentInterval.end_sec = Config::SafeHMSToSecondOfUtcDay(
-            (end["hour"] | 0) - config->utc_offset, end["minute"] | 0,
-            end["second"] | 0);
+      if (start.isNull() || end.isNull()) {
+        continue;
+      }
+      const int start_sec = Config::SafeHMSToSecondOfUtcDay(
+          start["hour"] | 0, start["minute"] | 0, start["second"] | 0);
+      const int end_sec = Config::SafeHMSToSecondOfUtcDay(
+          end["hour"] | 0, end["minute"] | 0, end["second"] | 0);
+      // Crosses midnight if end < start.
+      const int length_sec = SafeMod(end_sec - start_sec, 86400);
+
+      int day_mask = 0;
+      for (JsonVariant day : interval["days"].as<JsonArray>()) {
+        day_mask |= 1 << SafeMod(day.as<int>(), 7);
+      }
+      for (int day = 0; day < 7; ++day) {
+        if (day_mask && !(day_mask & (1 << day))) {
+          continue;
+        }
+        const int week_start_sec = SafeMod(
+            day * 86400 + start_sec - config->utc_offset * 3600, 7 * 86400);
+        if (!config->schedule.Add(week_start_sec * 1000, length_sec * 1000)) {
+          LOG_WARN(kLogConfig,
+                   "Pump schedule full, ignoring rest of the intervals\n");
+          schedule_full = true;
+          break;
+        }
+      }
+      if (schedule_full) {
+        break;
       }
     }
   }
-  Serial.printf("Use of string table: %zu\n", config->string_table.length());
-  if (totalStringLength < config->string_table.length()) {
-    // How did this happen...?
-    Serial.println(
-        "String table grew, so pointers may be invalid, reboot in 10");
-    delay(10000);
-    ESP.restart();
-  }
-  // for (const char ch : config->string_table) {
-  //   Serial.print(ch == 0 ? '|' : ch);
-  // }
-  // Serial.println();
-  
+  config->schedule.Finish();
+
+  if (strings.Overflow()) {
+    LOG_ERROR(kLogConfig, "More config strings than Config::kStringFields\n");
+    return nullptr;
+  }
+  strings.InternInto(config->strings);
+  LOG_INFO(kLogConfig, "Config strings: %zu, %zu bytes\n",
+           config->strings.Count(), config->strings.Bytes());
+
   return config;
 }
 
+Config::Changes Config::Diff(const Config &from, const Config &to) {
+  Changes changes;
+  changes.wifi = !SameString(from.wifi.ssid, to.wifi.ssid) ||
+                 !SameString(from.wifi.password, to.wifi.password) ||
+                 memcmp(from.wifi.ip, to.wifi.ip, 4) != 0 ||
+                 memcmp(from.wifi.gateway, to.wifi.gateway, 4) != 0 ||
+                 memcmp(from.wifi.netmask, to.wifi.netmask, 4) != 0 ||
+                 memcmp(from.wifi.dns, to.wifi.dns, 4) != 0;
+  changes.ntp = !SameString(from.ntp.server, to.ntp.server);
+  changes.mqtt_connection =
+      !SameString(from.mqtt.broker, to.mqtt.broker) ||
+      from.mqtt.port != to.mqtt.port ||
+      !SameString(from.mqtt.user, to.mqtt.user) ||
+      !SameString(from.mqtt.password, to.mqtt.password) ||
+      !SameString(from.mqtt.device_id, to.mqtt.device_id) ||
+      !SameString(from.mqtt.topic, to.mqtt.topic);
+  changes.mqtt_publish = from.mqtt.encoding != to.mqtt.encoding ||
+                         from.mqtt.publish_window_s != to.mqtt.publish_window_s ||
+                         from.mqtt.raw_samples != to.mqtt.raw_samples;
+  changes.schedule = !SameSchedule(from.schedule, to.schedule);
+  changes.api = !SameString(from.api.token, to.api.token);
+  return changes;
+}
+
 void Config::PrintConfigOnSerial() const {
   Serial.println("** Configuration **");
   Serial.println("wifi");
   Serial.printf("  ssid = %s\n", wifi.ssid ? wifi.ssid : "(not set)");
   Serial.printf("  password = %s\n",
                 wifi.password ? wifi.password : "(not set)");
+  if (wifi.ip[0] == 0) {
+    Serial.println("  ip = (DHCP)");
+  } else {
+    auto print_ip = [](const char *name, const uint8_t (&ip)[4]) {
+      Serial.printf("  %s = %d.%d.%d.%d\n", name, ip[0], ip[1], ip[2], ip[3]);
+    };
+    print_ip("ip", wifi.ip);
+    print_ip("gateway", wifi.gateway);
+    print_ip("netmask", wifi.netmask);
+    print_ip("dns", wifi.dns);
+  }
 
   Serial.println("ntp");
   Serial.printf("  server = %s\n", ntp.server ? ntp.server : "(not set)");
@@ -184,14 +294,22 @@ void Config::PrintConfigOnSerial() const {
   Serial.printf("  device_id = %s\n",
                 mqtt.device_id ? mqtt.device_id : "(not set)");
   Serial.printf("  topic = %s\n", mqtt.topic ? mqtt.topic : "(not set)");
+  Serial.printf("  encoding = %s\n",
+                mqtt.encoding == MqttEncoding::kMsgPack ? "msgpack" : "json");
+  Serial.printf("  publish_window_s = %d\n", mqtt.publish_window_s);
+  Serial.printf("  raw_samples = %d\n", mqtt.raw_samples);
+
+  Serial.println("api");
+  Serial.printf("  token = %s\n",
+                api.token && api.token[0] ? "(set)" : "(not set)");
 
   Serial.println("schedule");
-  Serial.printf("  interval_count = %d\n", schedule.interval_count);
-  for (int i = 0; i < schedule.interval_count; ++i) {
-    const auto &interval = schedule.intervals[i];
-    Serial.printf("  - interval %d\n", i + 1);
-    Serial.printf("      start_sec = %d\n", interval.start_sec);
-    Serial.printf("      end_sec = %d\n", interval.end_sec);
+  Serial.printf("  on_at_week_start = %d\n", schedule.OnAtWeekStart());
+  Serial.printf("  switch_count = %d\n", schedule.SwitchCount());
+  for (int i = 0; i < schedule.SwitchCount(); ++i) {
+    const int sec = schedule.Switch(i) / 1000;
+    Serial.printf("  - day %d %02d:%02d:%02d UTC\n", sec / 86400,
+                  sec % 86400 / 3600, sec % 3600 / 60, sec % 60);
   }
   Serial.printf("  utcOffset = %d\n", utc_offset);
   Serial.println("***");
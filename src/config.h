@@ -1,11 +1,14 @@
+#pragma once
+
+#include <cstddef>
 #include <memory>
-#include <ArduinoJson.h>
+
+#include "pump_schedule.h"
+#include "string_arena.h"
 
 // Holds the current configuration for the device.
 class Config {
  private:
-  static constexpr int kMaxIntervals = 20;          // Maximum number of pump intervals
-
   Config() = default;
   Config(const Config&) = delete;
   Config(Config&&) = delete;
@@ -16,21 +19,56 @@ class Config {
   // Handles negative values and wraps overflows correctly (e.g. minute 62 becomes minute 2).
   static int SafeHMSToSecondOfUtcDay(int h, int m, int s);
 
+  // Parses a dotted quad like "192.168.1.20" into ip. "" is 0.0.0.0.
+  static bool ParseIp(const char *text, uint8_t (&ip)[4]);
+
   // Loads or nullptr if failed.
   static std::unique_ptr<Config> CreateFromJsonFile(const char file[]);
 
+  // Loads the binary snapshot of json_file (see config_snapshot.cpp) if it is
+  // there and up to date, else parses the JSON and writes a new snapshot.
+  // Returns nullptr if both failed.
+  static std::unique_ptr<Config> Load(const char json_file[],
+                                      const char snapshot_file[]);
+
+  // Saves this config, as parsed from json_file, as a binary snapshot.
+  bool WriteSnapshot(const char json_file[], const char snapshot_file[]) const;
+
   // Prints the configuration in a YAML-like format to Serial.
   void PrintConfigOnSerial() const;
 
+  // What a hot reload from one config to another has to redo.
+  struct Changes {
+    bool wifi;             // SSID, password or static IP.
+    bool ntp;              // Server.
+    bool mqtt_connection;  // Broker, credentials or topic.
+    bool mqtt_publish;     // Encoding, window or raw samples.
+    bool schedule;         // Pump switches (after the UTC offset).
+    bool api;              // Token.
+  };
+  static Changes Diff(const Config &from, const Config &to);
+
   struct Wifi {
     const char *ssid;
     const char *password;
+    // Static IP, "ip", "gateway", "netmask" and "dns" in the JSON. Without an
+    // ip (0.0.0.0) the address comes from DHCP.
+    uint8_t ip[4];
+    uint8_t gateway[4];
+    uint8_t netmask[4];
+    uint8_t dns[4];
   };
 
   struct Ntp {
     const char *server;
   };
 
+  // How the MQTT payload is encoded, "encoding" in the JSON.
+  enum class MqttEncoding : uint8_t {
+    kJson,     // "json", minified
+    kMsgPack,  // "msgpack", same document as MessagePack
+  };
+
   struct Mqtt {
     const char *broker;
     int port;
@@ -38,23 +76,32 @@ class Config {
     const char *password;
     const char *device_id;
     const char *topic;
+    MqttEncoding encoding = MqttEncoding::kJson;
+    // Pressure samples are batched and published once per window.
+    int publish_window_s = 60;
+    // Include the samples themselves, not only min/max/mean/last.
+    bool raw_samples = false;
   };
 
-  struct Schedule {
-    // Note: seconds start from 0 on day starting at 0:00 UTC.
-    struct Interval {
-      int start_sec;
-      int end_sec;
-    };
-    Interval intervals[kMaxIntervals];  // Use kMaxIntervals for flexibility
-    int interval_count;
+  // The settings API on the station interface, "api" in the JSON, see
+  // SetupUI::StartApi(). Off without a token.
+  struct Api {
+    const char *token = nullptr;
   };
 
   Wifi wifi;
   Ntp ntp;
   Mqtt mqtt;
-  Schedule schedule;
+  Api api;
+  // How many of the const char * fields above CreateFromJsonFile() fills.
+  static constexpr size_t kStringFields = 9;
+  // Pump intervals of all weekdays merged, in UTC.
+  PumpSchedule schedule;
  private:
-  String string_table;  // String table for storing interned strings of the config.
+  static std::unique_ptr<Config> CreateFromSnapshot(const char file[],
+                                                    uint32_t json_size,
+                                                    uint32_t json_crc);
+
+  StringArena strings;  // Owns the strings the fields above point to.
   int utc_offset;  // UTC offset in hours
 };
@@ -0,0 +1,244 @@
+// Binary snapshot of a parsed Config, so booting does not need to parse JSON.
+//
+// Layout (native endianness, it is only read by the firmware that wrote it):
+//   SnapshotHeader
+//   SnapshotBody    fixed size, strings as offsets into the string table
+//   int32_t[]       pump switches, SnapshotHeader::switch_count of them
+//   char[]          string table, NUL separated
+//
+// The switches go from and to the heap, never the stack: this runs on the
+// network task for a hot reload.
+//
+// The header records size and CRC-32 of the JSON it was made from. A snapshot
+// with another version, body size or source JSON is stale and ignored.
+
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "config.h"
+#include "crc32.h"
+#include "hal.h"
+
+namespace {
+
+constexpr uint32_t kSnapshotMagic = 0x46434847;  // "GHCF"
+// Bump when the meaning of SnapshotBody changes.
+constexpr uint16_t kSnapshotVersion = 7;
+constexpr uint32_t kNoString = UINT32_MAX;
+// Sanity limit before allocating for the string table.
+constexpr uint32_t kMaxStringsSize = 4096;
+
+struct SnapshotHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t body_size;
+  uint32_t switch_count;
+  uint32_t json_size;
+  uint32_t json_crc;
+  uint32_t strings_size;
+  uint32_t payload_crc;  // Over body, switches and strings.
+};
+
+struct SnapshotBody {
+  uint32_t wifi_ssid;
+  uint32_t wifi_password;
+  uint8_t wifi_ip[4];
+  uint8_t wifi_gateway[4];
+  uint8_t wifi_netmask[4];
+  uint8_t wifi_dns[4];
+  uint32_t ntp_server;
+  uint32_t mqtt_broker;
+  int32_t mqtt_port;
+  uint32_t mqtt_user;
+  uint32_t mqtt_password;
+  uint32_t mqtt_device_id;
+  uint32_t mqtt_topic;
+  int32_t mqtt_encoding;
+  int32_t mqtt_publish_window_s;
+  int32_t mqtt_raw_samples;
+  uint32_t api_token;
+  int32_t utc_offset;
+  int32_t schedule_on_at_week_start;
+};
+
+static_assert(sizeof(SnapshotBody) <= UINT16_MAX, "body_size is 16 bit");
+
+}  // namespace
+
+std::unique_ptr<Config> Config::CreateFromSnapshot(const char file[],
+                                                   uint32_t json_size,
+                                                   uint32_t json_crc) {
+  hal::File snapshot = hal::File::Open(file, "r");
+  if (!snapshot) {
+    return nullptr;
+  }
+  struct {
+    SnapshotHeader header;
+    SnapshotBody body;
+  } fixed;
+  static_assert(sizeof(fixed) < 256, "fixed is on the stack");
+  if (snapshot.Read(&fixed, sizeof(fixed)) != sizeof(fixed) ||
+      fixed.header.strings_size == 0 ||
+      fixed.header.strings_size > kMaxStringsSize ||
+      fixed.header.magic != kSnapshotMagic ||
+      fixed.header.version != kSnapshotVersion ||
+      fixed.header.body_size != sizeof(SnapshotBody) ||
+      fixed.header.switch_count >
+          static_cast<uint32_t>(PumpSchedule::kMaxSwitches) ||
+      fixed.header.json_size != json_size ||
+      fixed.header.json_crc != json_crc) {
+    Serial.println("Config snapshot is stale");
+    return nullptr;
+  }
+
+  const SnapshotBody &body = fixed.body;
+  std::vector<int32_t> switches(fixed.header.switch_count);
+  const uint32_t switches_size = switches.size() * sizeof(int32_t);
+  const uint32_t strings_size = fixed.header.strings_size;
+  std::unique_ptr<char[]> strings(new char[strings_size]);
+  auto config = std::make_unique<Config>();
+  if (snapshot.Read(switches.data(), switches_size) != switches_size ||
+      snapshot.Read(strings.get(), strings_size) != strings_size ||
+      Crc32(strings.get(), strings_size,
+            Crc32(switches.data(), switches_size,
+                  Crc32(&body, sizeof(body)))) != fixed.header.payload_crc ||
+      strings[strings_size - 1] != '\0' ||
+      !config->schedule.Restore(body.schedule_on_at_week_start,
+                                std::move(switches))) {
+    Serial.println("Config snapshot is corrupt");
+    return nullptr;
+  }
+
+  config->strings.Reserve(strings_size, kStringFields);
+  auto str = [&](uint32_t offset) -> const char * {
+    return offset < strings_size ? config->strings.Intern(&strings[offset])
+                                 : nullptr;
+  };
+  config->wifi.ssid = str(body.wifi_ssid);
+  config->wifi.password = str(body.wifi_password);
+  memcpy(config->wifi.ip, body.wifi_ip, 4);
+  memcpy(config->wifi.gateway, body.wifi_gateway, 4);
+  memcpy(config->wifi.netmask, body.wifi_netmask, 4);
+  memcpy(config->wifi.dns, body.wifi_dns, 4);
+  config->ntp.server = str(body.ntp_server);
+  config->mqtt.broker = str(body.mqtt_broker);
+  config->mqtt.port = body.mqtt_port;
+  config->mqtt.user = str(body.mqtt_user);
+  config->mqtt.password = str(body.mqtt_password);
+  config->mqtt.device_id = str(body.mqtt_device_id);
+  config->mqtt.topic = str(body.mqtt_topic);
+  config->mqtt.encoding = static_cast<MqttEncoding>(body.mqtt_encoding);
+  config->mqtt.publish_window_s = body.mqtt_publish_window_s;
+  config->mqtt.raw_samples = body.mqtt_raw_samples;
+  config->api.token = str(body.api_token);
+  config->utc_offset = body.utc_offset;
+  return config;
+}
+
+bool Config::WriteSnapshot(const char json_file[],
+                           const char snapshot_file[]) const {
+  SnapshotHeader header = {};
+  header.magic = kSnapshotMagic;
+  header.version = kSnapshotVersion;
+  header.body_size = sizeof(SnapshotBody);
+  header.switch_count = schedule.SwitchCount();
+  if (!FileSizeAndCrc(json_file, header.json_size, header.json_crc)) {
+    return false;
+  }
+
+  // Strings are written in field order, the arena dedups them again on load.
+  std::string table;
+  auto offset = [&](const char *str) {
+    if (!str) {
+      return kNoString;
+    }
+    const uint32_t start = table.size();
+    table.append(str, strlen(str) + 1);
+    return start;
+  };
+  SnapshotBody body;
+  memset(static_cast<void *>(&body), 0, sizeof(body));  // No uninitialized padding in the CRC.
+  body.wifi_ssid = offset(wifi.ssid);
+  body.wifi_password = offset(wifi.password);
+  memcpy(body.wifi_ip, wifi.ip, 4);
+  memcpy(body.wifi_gateway, wifi.gateway, 4);
+  memcpy(body.wifi_netmask, wifi.netmask, 4);
+  memcpy(body.wifi_dns, wifi.dns, 4);
+  body.ntp_server = offset(ntp.server);
+  body.mqtt_broker = offset(mqtt.broker);
+  body.mqtt_port = mqtt.port;
+  body.mqtt_user = offset(mqtt.user);
+  body.mqtt_password = offset(mqtt.password);
+  body.mqtt_device_id = offset(mqtt.device_id);
+  body.mqtt_topic = offset(mqtt.topic);
+  body.mqtt_encoding = static_cast<int32_t>(mqtt.encoding);
+  body.mqtt_publish_window_s = mqtt.publish_window_s;
+  body.mqtt_raw_samples = mqtt.raw_samples;
+  body.api_token = offset(api.token);
+  body.utc_offset = utc_offset;
+  body.schedule_on_at_week_start = schedule.OnAtWeekStart();
+  if (table.empty()) {
+    table.push_back('\0');  // So the table always ends in a NUL.
+  }
+  header.strings_size = table.size();
+  const uint32_t switches_size = header.switch_count * sizeof(int32_t);
+  header.payload_crc =
+      Crc32(table.data(), header.strings_size,
+            Crc32(schedule.Switches(), switches_size,
+                  Crc32(&body, sizeof(body))));
+
+  // Write aside and rename, a half written snapshot must never look valid.
+  const std::string temp_file = std::string(snapshot_file) + ".tmp";
+  hal::File file = hal::File::Open(temp_file.c_str(), "w");
+  if (!file) {
+    return false;
+  }
+  const bool written =
+      file.Write(&header, sizeof(header)) == sizeof(header) &&
+      file.Write(&body, sizeof(body)) == sizeof(body) &&
+      file.Write(schedule.Switches(), switches_size) == switches_size &&
+      file.Write(table.data(), header.strings_size) ==
+          header.strings_size;
+  file.Close();
+  hal::FsRemove(snapshot_file);
+  if (!written || !hal::FsRename(temp_file.c_str(), snapshot_file)) {
+    hal::FsRemove(temp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<Config> Config::Load(const char json_file[],
+                                     const char snapshot_file[]) {
+  const uint32_t start_us = hal::Micros();
+  if (!hal::FsMount()) {
+    Serial.println("Failed to mount SPIFFS");
+    return nullptr;
+  }
+  uint32_t json_size = 0;
+  uint32_t json_crc = 0;
+  if (!FileSizeAndCrc(json_file, json_size, json_crc)) {
+    Serial.printf("Failed to open config file: %s\n", json_file);
+    return nullptr;
+  }
+
+  std::unique_ptr<Config> config =
+      CreateFromSnapshot(snapshot_file, json_size, json_crc);
+  if (config) {
+    Serial.printf("Config loaded from snapshot in %lu us\n",
+                  static_cast<unsigned long>(hal::Micros() - start_us));
+    return config;
+  }
+
+  config = CreateFromJsonFile(json_file);
+  if (config) {
+    Serial.printf("Config parsed from JSON in %lu us\n",
+                  static_cast<unsigned long>(hal::Micros() - start_us));
+    if (!config->WriteSnapshot(json_file, snapshot_file)) {
+      Serial.println("Failed to write config snapshot");
+    }
+  }
+  return config;
+}
@@ -0,0 +1,65 @@
+#include "config_upload.h"
+
+#include "crc32.h"
+
+void ConfigUpload::Begin(size_t length) {
+  file_.Close();
+  validator_ = ConfigValidator();
+  length_ = length;
+  size_ = 0;
+  crc_ = 0;
+  valid_ = true;
+  written_ = length <= kMaxBytes;
+  if (written_) {
+    file_ = hal::File::Open(temp_path_, "w");
+    written_ = static_cast<bool>(file_);
+  }
+}
+
+void ConfigUpload::Write(const uint8_t *data, size_t size) {
+  size_ += size;
+  // No use writing what will not be committed anyway.
+  if (!valid_ || !written_) {
+    return;
+  }
+  valid_ = validator_.Feed(reinterpret_cast<const char *>(data), size);
+  written_ = file_.Write(data, size) == size;
+  crc_ = Crc32(data, size, crc_);
+}
+
+void ConfigUpload::Abort() {
+  file_.Close();
+  hal::FsRemove(temp_path_);
+  valid_ = written_ = false;
+}
+
+ConfigUpload::Result ConfigUpload::Commit() {
+  file_.Close();
+  Result result = Result::kSaved;
+  uint32_t size = 0;
+  uint32_t crc = 0;
+  if (length_ > kMaxBytes) {
+    result = Result::kTooLarge;
+  } else if (!valid_ || !validator_.Finish() || size_ != length_) {
+    result = Result::kInvalid;
+  } else if (!written_) {
+    result = Result::kFailed;
+  } else if (FileSizeAndCrc(kConfigJsonPath, size, crc) && size == size_ &&
+             crc == crc_) {
+    result = Result::kUnchanged;  // E.g. a retained message on reconnect.
+  } else {
+    if (hal::FsExists(kConfigJsonPath)) {
+      hal::FsRemove(kConfigBackupPath);
+      if (!hal::FsRename(kConfigJsonPath, kConfigBackupPath)) {
+        result = Result::kFailed;
+      }
+    }
+    if (result == Result::kSaved &&
+        !hal::FsRename(temp_path_, kConfigJsonPath)) {
+      result = Result::kFailed;
+    }
+  }
+  hal::FsRemove(temp_path_);
+  valid_ = written_ = false;
+  return result;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+// A new /config.json on its way in, from the setup UI or the MQTT config
+// topic. It is written to a temp file and checked by ConfigValidator as it
+// comes in, so it needs no RAM of its own however long the schedule is, and
+// Commit() only swaps it in if it is complete and valid.
+
+#include <cstddef>
+#include <cstdint>
+
+#include "config_validator.h"
+#include "hal.h"
+
+constexpr char kConfigJsonPath[] = "/config.json";
+// The config the last commit replaced, booted if /config.json is gone.
+constexpr char kConfigBackupPath[] = "/config.bak.json";
+
+class ConfigUpload {
+ public:
+  static constexpr size_t kMaxBytes = 16384;
+
+  enum class Result { kSaved, kUnchanged, kInvalid, kTooLarge, kFailed };
+
+  // temp_path must outlive the upload, one per source so they can not mix.
+  explicit ConfigUpload(const char *temp_path) : temp_path_(temp_path) {}
+
+  // Starts over with a document of length bytes.
+  void Begin(size_t length);
+  void Write(const uint8_t *data, size_t size);
+  // Drops what came so far.
+  void Abort();
+  // Replaces /config.json if the document is valid and differs from it. The
+  // current one is kept as the last known good, and wherever power is cut one
+  // of the two is left to boot from.
+  Result Commit();
+  // Why the document is invalid.
+  const char *Error() const { return validator_.Error(); }
+
+ private:
+  const char *temp_path_;
+  hal::File file_;
+  ConfigValidator validator_;
+  size_t length_ = 0;
+  size_t size_ = 0;
+  uint32_t crc_ = 0;
+  bool valid_ = false;
+  bool written_ = false;
+};
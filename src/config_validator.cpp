@@ -0,0 +1,394 @@
+#include "config_validator.h"
+
+#include <cctype>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "config.h"
+
+namespace {
+
+// Required top level objects, Config leaves their fields unset without them.
+const char *const kRootKeys[] = {"wifi", "ntp", "mqtt", "pumpSchedule"};
+constexpr uint8_t kAllRootKeys = (1 << 4) - 1;
+
+bool IsSpace(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+// JSON number grammar: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+bool IsNumber(const char *s) {
+  if (*s == '-') {
+    s++;
+  }
+  if (*s == '0') {
+    s++;
+  } else if (IsDigit(*s)) {
+    while (IsDigit(*s)) s++;
+  } else {
+    return false;
+  }
+  if (*s == '.') {
+    s++;
+    if (!IsDigit(*s)) return false;
+    while (IsDigit(*s)) s++;
+  }
+  if (*s == 'e' || *s == 'E') {
+    s++;
+    if (*s == '+' || *s == '-') s++;
+    if (!IsDigit(*s)) return false;
+    while (IsDigit(*s)) s++;
+  }
+  return *s == '\0';
+}
+
+}  // namespace
+
+ConfigValidator::Expect ConfigValidator::FieldOf(Node parent,
+                                                 const char *key) {
+  constexpr Expect kString = {Kind::kString, Node::kAny, 0, 0};
+  constexpr Expect kIp = {Kind::kIpAddress, Node::kAny, 0, 0};
+  // Config wraps hours, minutes, seconds and weekdays around.
+  constexpr Expect kAnyInt = {Kind::kInteger, Node::kAny, INT_MIN, INT_MAX};
+  struct Field {
+    Node parent;
+    const char *key;
+    Expect expect;
+  };
+  static constexpr Field kFields[] = {
+      {Node::kRoot, "wifi", {Kind::kObject, Node::kWifi, 0, 0}},
+      {Node::kRoot, "ntp", {Kind::kObject, Node::kNtp, 0, 0}},
+      {Node::kRoot, "mqtt", {Kind::kObject, Node::kMqtt, 0, 0}},
+      {Node::kRoot, "pumpSchedule", {Kind::kObject, Node::kPumpSchedule, 0, 0}},
+      {Node::kRoot, "api", {Kind::kObject, Node::kApi, 0, 0}},
+      {Node::kWifi, "ssid", kString},
+      {Node::kWifi, "password", kString},
+      {Node::kWifi, "ip", kIp},
+      {Node::kWifi, "gateway", kIp},
+      {Node::kWifi, "netmask", kIp},
+      {Node::kWifi, "dns", kIp},
+      {Node::kNtp, "server", kString},
+      {Node::kMqtt, "broker", kString},
+      {Node::kMqtt, "port", {Kind::kInteger, Node::kAny, 1, 65535}},
+      {Node::kMqtt, "user", kString},
+      {Node::kMqtt, "password", kString},
+      {Node::kMqtt, "deviceId", kString},
+      {Node::kMqtt, "topic", kString},
+      {Node::kMqtt, "encoding", {Kind::kEncoding, Node::kAny, 0, 0}},
+      {Node::kMqtt, "publishWindowSec", {Kind::kInteger, Node::kAny, 1, 86400}},
+      {Node::kMqtt, "rawSamples", {Kind::kBool, Node::kAny, 0, 0}},
+      {Node::kApi, "token", kString},
+      {Node::kPumpSchedule, "utcOffset", {Kind::kInteger, Node::kAny, -12, 14}},
+      {Node::kPumpSchedule, "pump", {Kind::kArray, Node::kPump, 0, 0}},
+      {Node::kInterval, "start", {Kind::kObject, Node::kTime, 0, 0}},
+      {Node::kInterval, "end", {Kind::kObject, Node::kTime, 0, 0}},
+      {Node::kInterval, "days", {Kind::kArray, Node::kDays, 0, 0}},
+      {Node::kTime, "hour", kAnyInt},
+      {Node::kTime, "minute", kAnyInt},
+      {Node::kTime, "second", kAnyInt},
+  };
+  for (const Field &field : kFields) {
+    if (field.parent == parent && strcmp(field.key, key) == 0) {
+      return field.expect;
+    }
+  }
+  return {Kind::kAny, Node::kAny, 0, 0};
+}
+
+ConfigValidator::Expect ConfigValidator::ElementOf(Node array) {
+  switch (array) {
+    case Node::kPump:
+      return {Kind::kObject, Node::kInterval, 0, 0};
+    case Node::kDays:
+      return {Kind::kInteger, Node::kAny, INT_MIN, INT_MAX};
+    default:
+      return {Kind::kAny, Node::kAny, 0, 0};
+  }
+}
+
+bool ConfigValidator::Feed(const char *data, size_t size) {
+  size_t i = 0;
+  while (i < size && state_ != State::kError) {
+    if (Step(data[i])) {
+      i++;
+      offset_++;
+    }
+  }
+  return state_ != State::kError;
+}
+
+bool ConfigValidator::Finish() {
+  if (state_ == State::kError) {
+    return false;
+  }
+  if (state_ == State::kNumber || state_ == State::kLiteral) {
+    Step(' ');  // Ends the top level value, if it was one.
+  }
+  if (state_ != State::kDone) {
+    Fail(offset_ == 0 ? "empty" : "document ends early");
+    return false;
+  }
+  return true;
+}
+
+bool ConfigValidator::Step(char c) {
+  switch (state_) {
+    case State::kString:
+      if (c == '"') {
+        EndString();
+      } else if (c == '\\') {
+        state_ = State::kEscape;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        Fail("control character in string");
+      } else {
+        Append(c);
+      }
+      return true;
+    case State::kEscape:
+      if (c == 'u') {
+        unicode_left_ = 4;
+        state_ = State::kUnicode;
+      } else if (c != '\0' && strchr("\"\\/bfnrt", c)) {
+        Append(c);  // Close enough for matching keys.
+        state_ = State::kString;
+      } else {
+        Fail("bad escape");
+      }
+      return true;
+    case State::kUnicode:
+      if (!isxdigit(static_cast<unsigned char>(c))) {
+        Fail("bad \\u escape");
+      } else if (--unicode_left_ == 0) {
+        Append('?');
+        state_ = State::kString;
+      }
+      return true;
+    case State::kNumber:
+      if (IsDigit(c) || (c != '\0' && strchr("+-.eE", c))) {
+        Append(c);
+        return true;
+      }
+      EndNumber();
+      return false;
+    case State::kLiteral:
+      if (isalpha(static_cast<unsigned char>(c))) {
+        Append(c);
+        return true;
+      }
+      EndLiteral();
+      return false;
+    default:
+      break;
+  }
+
+  if (IsSpace(c)) {
+    return true;
+  }
+  switch (state_) {
+    case State::kValueOrEnd:
+      if (c == ']') {
+        Close(c);
+        break;
+      }
+      // Fall through.
+    case State::kValue:
+      BeginValue(c);
+      break;
+    case State::kKeyOrEnd:
+      if (c == '}') {
+        Close(c);
+        break;
+      }
+      // Fall through.
+    case State::kKey:
+      if (c != '"') {
+        Fail("expected key");
+        break;
+      }
+      in_key_ = true;
+      token_length_ = 0;
+      state_ = State::kString;
+      break;
+    case State::kColon:
+      if (c == ':') {
+        state_ = State::kValue;
+      } else {
+        Fail("expected ':'");
+      }
+      break;
+    case State::kCommaOrEnd:
+      if (c == ',') {
+        if (stack_[depth_ - 1].array) {
+          expect_ = ElementOf(stack_[depth_ - 1].node);
+          state_ = State::kValue;
+        } else {
+          state_ = State::kKey;
+        }
+      } else if (c == '}' || c == ']') {
+        Close(c);
+      } else {
+        Fail("expected ',' or end");
+      }
+      break;
+    case State::kDone:
+      Fail("data after the document");
+      break;
+    default:
+      break;
+  }
+  return true;
+}
+
+void ConfigValidator::BeginValue(char c) {
+  const Kind kind = expect_.kind;
+  token_length_ = 0;
+  if (c == '{' || c == '[') {
+    const bool array = c == '[';
+    if (kind != Kind::kAny && kind != (array ? Kind::kArray : Kind::kObject)) {
+      FailValue();
+      return;
+    }
+    if (depth_ == kMaxDepth) {
+      Fail("nested too deep");
+      return;
+    }
+    if (depth_ == 1 && stack_[0].node == Node::kRoot) {
+      for (size_t i = 0; i < sizeof(kRootKeys) / sizeof(kRootKeys[0]); ++i) {
+        if (strcmp(key_, kRootKeys[i]) == 0) {
+          root_seen_ |= 1 << i;
+        }
+      }
+    }
+    stack_[depth_++] = {expect_.node, array};
+    if (array) {
+      expect_ = ElementOf(expect_.node);
+      state_ = State::kValueOrEnd;
+    } else {
+      state_ = State::kKeyOrEnd;
+    }
+  } else if (c == '"') {
+    if (kind != Kind::kAny && kind != Kind::kString &&
+        kind != Kind::kEncoding && kind != Kind::kIpAddress) {
+      FailValue();
+      return;
+    }
+    in_key_ = false;
+    state_ = State::kString;
+  } else if (c == '-' || IsDigit(c)) {
+    Append(c);
+    state_ = State::kNumber;
+  } else if (isalpha(static_cast<unsigned char>(c))) {
+    Append(c);
+    state_ = State::kLiteral;
+  } else {
+    Fail("expected a value");
+  }
+}
+
+void ConfigValidator::EndString() {
+  token_[token_length_] = '\0';
+  if (in_key_) {
+    // A cut short key is no key we know.
+    const bool whole = token_length_ < sizeof(token_) - 1;
+    expect_ = whole ? FieldOf(stack_[depth_ - 1].node, token_)
+                    : Expect{Kind::kAny, Node::kAny, 0, 0};
+    strcpy(key_, token_);
+    state_ = State::kColon;
+    return;
+  }
+  if (expect_.kind == Kind::kEncoding && strcmp(token_, "json") != 0 &&
+      strcmp(token_, "msgpack") != 0) {
+    FailValue();
+    return;
+  }
+  uint8_t ip[4];
+  if (expect_.kind == Kind::kIpAddress && !Config::ParseIp(token_, ip)) {
+    FailValue();
+    return;
+  }
+  AfterValue();
+}
+
+void ConfigValidator::EndNumber() {
+  token_[token_length_] = '\0';
+  if (token_length_ >= sizeof(token_) - 1 || !IsNumber(token_)) {
+    Fail("bad number");
+    return;
+  }
+  if (expect_.kind == Kind::kInteger) {
+    // ArduinoJson would not read 2.0 or 1e3 as an int either.
+    if (strpbrk(token_, ".eE")) {
+      FailValue();
+      return;
+    }
+    const long long value = strtoll(token_, nullptr, 10);
+    if (value < expect_.min || value > expect_.max) {
+      FailValue();
+      return;
+    }
+  } else if (expect_.kind != Kind::kAny) {
+    FailValue();
+    return;
+  }
+  AfterValue();
+}
+
+void ConfigValidator::EndLiteral() {
+  token_[token_length_] = '\0';
+  if (strcmp(token_, "null") == 0) {
+    AfterValue();  // As if missing, Config uses the default.
+  } else if (strcmp(token_, "true") == 0 || strcmp(token_, "false") == 0) {
+    if (expect_.kind != Kind::kAny && expect_.kind != Kind::kBool) {
+      FailValue();
+      return;
+    }
+    AfterValue();
+  } else {
+    Fail("bad literal");
+  }
+}
+
+void ConfigValidator::Close(char c) {
+  const Frame &frame = stack_[depth_ - 1];
+  if (c != (frame.array ? ']' : '}')) {
+    Fail("mismatched bracket");
+    return;
+  }
+  if (frame.node == Node::kRoot && root_seen_ != kAllRootKeys) {
+    for (size_t i = 0; i < sizeof(kRootKeys) / sizeof(kRootKeys[0]); ++i) {
+      if (!(root_seen_ & (1 << i))) {
+        snprintf(key_, sizeof(key_), "%s", kRootKeys[i]);
+        break;
+      }
+    }
+    snprintf(error_, sizeof(error_), "missing \"%s\"", key_);
+    state_ = State::kError;
+    return;
+  }
+  depth_--;
+  AfterValue();
+}
+
+void ConfigValidator::AfterValue() {
+  state_ = depth_ == 0 ? State::kDone : State::kCommaOrEnd;
+}
+
+void ConfigValidator::Append(char c) {
+  if (token_length_ < sizeof(token_) - 1) {
+    token_[token_length_++] = c;
+  }
+}
+
+void ConfigValidator::Fail(const char *what) {
+  snprintf(error_, sizeof(error_), "%s at byte %lu", what,
+           static_cast<unsigned long>(offset_));
+  state_ = State::kError;
+}
+
+void ConfigValidator::FailValue() {
+  snprintf(error_, sizeof(error_), "bad value for \"%s\" at byte %lu", key_,
+           static_cast<unsigned long>(offset_));
+  state_ = State::kError;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+// Checks a config JSON document while it streams in, against what
+// Config::CreateFromJsonFile reads, so an upload can go to flash chunk by chunk
+// and only replace the config if it would load.
+//
+// Memory is fixed (a nesting stack and a short token buffer) however long the
+// pump schedule is. Known keys must have the right type and range, null
+// counts as missing, unknown keys are skipped (but must still be valid JSON).
+
+#include <cstddef>
+#include <cstdint>
+
+class ConfigValidator {
+ public:
+  static constexpr int kMaxDepth = 8;
+
+  // False once the document is known to be bad, see Error().
+  bool Feed(const char *data, size_t size);
+  // True if the document fed so far is complete and valid.
+  bool Finish();
+  const char *Error() const { return error_; }
+
+ private:
+  // Where in the schema a container is.
+  enum class Node : uint8_t {
+    kAny,  // Unknown key, anything goes.
+    kRoot,
+    kWifi,
+    kNtp,
+    kMqtt,
+    kApi,
+    kPumpSchedule,
+    kPump,
+    kInterval,
+    kTime,
+    kDays,
+  };
+  enum class Kind : uint8_t { kAny, kObject, kArray, kString, kInteger, kBool,
+                              kEncoding, kIpAddress };
+  enum class State : uint8_t {
+    kValue,
+    kValueOrEnd,  // After '['.
+    kKeyOrEnd,    // After '{'.
+    kKey,
+    kColon,
+    kCommaOrEnd,
+    kString,
+    kEscape,
+    kUnicode,
+    kNumber,
+    kLiteral,
+    kDone,
+    kError,
+  };
+
+  struct Expect {
+    Kind kind;
+    Node node;  // For kObject and kArray.
+    int32_t min;
+    int32_t max;
+  };
+  struct Frame {
+    Node node;
+    bool array;
+  };
+
+  static Expect FieldOf(Node parent, const char *key);
+  static Expect ElementOf(Node array);
+
+  // False if c has to be fed again (it ended a number or literal).
+  bool Step(char c);
+  void BeginValue(char c);
+  void EndString();
+  void EndNumber();
+  void EndLiteral();
+  void Close(char c);
+  void AfterValue();
+  void Append(char c);
+  void Fail(const char *what);
+  void FailValue();
+
+  State state_ = State::kValue;
+  Expect expect_ = {Kind::kObject, Node::kRoot, 0, 0};
+  Frame stack_[kMaxDepth];
+  int depth_ = 0;
+  bool in_key_ = false;
+  uint8_t unicode_left_ = 0;
+  uint8_t root_seen_ = 0;  // Bit per required top level object.
+  size_t offset_ = 0;
+  // Current token, cut short (and then never matched) if longer.
+  char token_[24];
+  size_t token_length_ = 0;
+  char key_[24] = "";
+  char error_[64] = "";
+};
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32 (IEEE, same as zlib). Pass the previous result as crc to continue a
+// running checksum over several buffers.
+uint32_t Crc32(const void *data, size_t size, uint32_t crc = 0);
+
+// Size and CRC-32 of a whole file, streamed so it needs no heap. False if it
+// can not be opened.
+bool FileSizeAndCrc(const char path[], uint32_t &size, uint32_t &crc);
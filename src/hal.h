@@ -0,0 +1,213 @@
+#pragma once
+
+// Thin hardware abstraction layer. Everything the control loop needs from the
+// board goes through here so that the same loop can run on the ESP32
+// (hal_esp32.cpp) or natively on the host against a simulated clock
+// (hal_native.cpp, [env:native]).
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+// Just enough of the Arduino Serial object for the host build, output goes to
+// stdout.
+class HostSerial {
+ public:
+  void begin(unsigned long baud) {}
+  int printf(const char *format, ...);
+  void print(const char *str);
+  void println(const char *str = "");
+};
+extern HostSerial Serial;
+#endif
+
+namespace hal {
+
+// Time. Micros() and Millis() wrap like their Arduino counterparts.
+uint32_t Micros();
+uint32_t Millis();
+void DelayMs(uint32_t ms);
+// Real time clock, usec since Epoch (starts near 0 on boot, not disciplined).
+int64_t RtcMicros();
+// Free running CPU cycle counter for timing short stretches of code, wraps
+// (every ~18 s at 240 MHz). CyclesToMicros() converts a difference at the
+// current CPU clock, which power management may change in between.
+uint32_t CycleCount();
+uint32_t CyclesToMicros(uint32_t cycles);
+
+// Heap of byte addressable RAM, all 0 on the host.
+struct HeapInfo {
+  uint32_t free_bytes;
+  uint32_t largest_block;
+  uint32_t min_free_bytes;  // Low water mark since boot.
+};
+HeapInfo Heap();
+
+// Low power idle. IdleSleepMs() light sleeps where it can, with the radio in
+// modem sleep so the WiFi association and TCP connections survive, and returns
+// early when a wake source fires.
+enum class WakeReason { kTimeout, kGpio, kAdcThreshold };
+// wake_pin wakes when pulled low, -1 for none.
+void IdleInit(int wake_pin);
+// The network side says whether a forced light sleep, which stops both cores
+// and the radio, would cost it nothing: true only while it waits with WiFi
+// neither connected nor connecting. Without automatic light sleep
+// IdleSleepMs() forces light sleep only then, and otherwise just waits.
+//
+// That is the case on the stock Arduino core, built without CONFIG_PM_ENABLE:
+// while WiFi is connected the device never light sleeps, it waits with the
+// CPU clocked and the radio in modem sleep, tens of mA (20-68 mA by clock in
+// the datasheet) instead of about 0.8 mA. A forced light sleep would not keep
+// the association, only automatic light sleep does, see README "Sleep".
+void IdleSetNetworkIdle(bool idle);
+// Also wakes if adc_pin (-1 for none) reads outside [adc_low, adc_high].
+WakeReason IdleSleepMs(uint32_t ms, int adc_pin, int adc_low, int adc_high);
+
+// Runs body() forever in a task of its own pinned to core (0 or 1). False if
+// there is no such thing, e.g. on the host, and the caller has to interleave
+// the work with its own.
+bool StartTaskOnCore(const char *name, int core, uint32_t stack_bytes,
+                     void (*body)());
+// Core the caller runs on, 0 on the host.
+int CurrentCore();
+
+// Reboot the device, does not return.
+void Restart();
+void WatchdogStart(int reset_timeout_s);
+void WatchdogFeed();
+
+// GPIO and ADC.
+enum class PinMode { kOutput, kInputPullup };
+void ConfigurePin(int pin, PinMode mode);
+void DigitalWrite(int pin, bool high);
+bool DigitalRead(int pin);
+int AnalogRead(int pin);
+
+// Continuous sampling of one ADC pin by DMA at rate_hz (12 bit samples).
+// Keeps the CPU out of light sleep while running, and AnalogRead() must not be
+// used on any pin in between Start and Stop.
+bool AdcStreamStart(int pin, uint32_t rate_hz);
+void AdcStreamStop();
+// Up to max samples captured since the last call, oldest first. Never blocks.
+size_t AdcStreamRead(uint16_t *samples, size_t max);
+
+// WiFi station.
+//
+// Which access point a connection went to and the addresses it had. Given to
+// WifiBegin() again it skips the channel scan (bssid and channel) and DHCP
+// (ip and the rest).
+struct WifiLink {
+  uint8_t bssid[6];
+  uint8_t channel;  // 0 scans all channels for the SSID.
+  uint8_t ip[4];    // 0.0.0.0 gets an address by DHCP.
+  uint8_t gateway[4];
+  uint8_t netmask[4];
+  uint8_t dns[4];
+};
+// How long the last WifiBegin() took to associate with the access point and
+// to get to an IP, -1 while it has not (yet).
+struct WifiTimes {
+  int32_t associated_ms;
+  int32_t got_ip_ms;
+};
+bool WifiConnected();
+int WifiStatusCode();  // Raw status, for logging only.
+const char *WifiMacAddress();
+void WifiBegin(const char *ssid, const char *password, const WifiLink &link);
+void WifiDisconnect();
+// Of the current connection, false while not connected.
+bool WifiGetLink(WifiLink &link);
+WifiTimes WifiConnectTimes();
+// Soft access point instead, at ip (also the gateway) on a /24.
+void WifiStartAccessPoint(const char *ssid, const char *password,
+                          const uint8_t (&ip)[4]);
+
+// Non-blocking UDP on a single socket (SNTP, see sntp_client.h). Host names
+// are resolved in the background: SendTo() is false until the address is
+// known (and cached), so just try again a bit later.
+bool UdpOpen();  // Does nothing if already open.
+void UdpClose();
+bool UdpSendTo(const char *host, int port, const uint8_t *data, size_t size);
+// One datagram, cut to size. 0 if there is none right now, -1 if the socket
+// is not open.
+int UdpReceive(uint8_t *data, size_t size);
+
+// Non-blocking TCP client, a single connection (MQTT, see mqtt_client.h).
+// None of these wait on the network.
+enum class TcpState { kClosed, kConnecting, kConnected };
+// Starts resolving and connecting, false if that could not even start.
+bool TcpConnect(const char *host, int port);
+TcpState TcpPoll();
+// Bytes taken or read, 0 if the socket can not take or has nothing right now,
+// -1 if the connection is gone.
+int TcpSend(const uint8_t *data, size_t size);
+int TcpReceive(uint8_t *data, size_t size);
+void TcpClose();
+
+// Flash file system (SPIFFS on the device, a directory on the host).
+bool FsMount();
+bool FsExists(const char *path);
+bool FsRemove(const char *path);
+bool FsRename(const char *from, const char *to);
+
+class File {
+ public:
+  File() = default;
+  // Mode as fopen, "r", "w" or "a". Check result with operator bool.
+  static File Open(const char *path, const char *mode);
+
+  explicit operator bool() const { return impl_ != nullptr; }
+  size_t Size() const;
+  size_t Read(void *buffer, size_t size);
+  size_t Write(const void *buffer, size_t size);
+  bool Seek(size_t position);
+  void Close();
+
+  struct Impl;
+
+ private:
+  explicit File(std::shared_ptr<Impl> impl) : impl_(std::move(impl)) {}
+
+  std::shared_ptr<Impl> impl_;
+};
+
+// Firmware updates, written to the app slot that is not running (the other
+// of app0/app1) and booted from the next restart on. See ota_update.h.
+//
+// Reads the running image's slot, false past its end.
+bool OtaReadRunning(size_t offset, void *buffer, size_t size);
+// Erases room for an image of image_size bytes, drops one halfway.
+bool OtaBegin(size_t image_size);
+bool OtaWrite(const void *data, size_t size);
+// Checks the image and boots it from the next restart on.
+bool OtaEnd();
+void OtaAbort();
+// The running image proved itself, keep it. Until then the device is free to
+// go back to the one before, and does if it restarts before.
+void OtaMarkValid();
+// Goes back to the image in the other slot, restarts.
+void OtaRollback();
+
+// Small values that outlive a reboot and a new file system image (NVS on the
+// device, <fs root>.nvs next to the directory on the host). Keys are at most
+// 15 characters. Writes wear the flash, keep them rare.
+bool NvsGetInt(const char *key, int32_t &value);
+bool NvsSetInt(const char *key, int32_t value);
+// A blob of exactly size bytes (at most 64), false and data untouched if
+// there is none of that size.
+bool NvsGetBytes(const char *key, void *data, size_t size);
+bool NvsSetBytes(const char *key, const void *data, size_t size);
+
+// A few bytes in RTC memory that survive a restart, watchdog reset or deep
+// sleep but not a power cycle, and cost no flash writes. Read is false and
+// leaves data untouched unless the last Write was of the same size and is
+// intact. Nothing survives on the host.
+constexpr size_t kRtcRetainedBytes = 64;
+bool RtcRetainedRead(void *data, size_t size);
+void RtcRetainedWrite(const void *data, size_t size);
+
+}  // namespace hal
@@ -0,0 +1,677 @@
+#ifdef ARDUINO
+
+#include <ESP32Time.h>     // fbiego/ESP32Time@^2.0.6
+#include <FS.h>
+#include <Preferences.h>
+#include <SPIFFS.h>
+#include <WiFi.h>
+#include <driver/adc.h>
+#include <driver/gpio.h>
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <esp_task_wdt.h>
+#include <esp_timer.h>
+#include <lwip/dns.h>
+#include <lwip/sockets.h>
+#include <rom/ets_sys.h>
+#include <xtensa/core-macros.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include "crc32.h"
+#include "hal.h"
+
+namespace {
+
+ESP32Time rtc;
+Preferences nvs;
+bool nvs_open = false;
+
+// The SNTP socket, non-blocking.
+int udp_fd = -1;
+
+// The MQTT socket, non-blocking. Host names are resolved by lwIP's
+// asynchronous DNS, the answer comes in on the lwIP thread (OnDnsFound).
+int tcp_fd = -1;
+int tcp_port = 0;
+hal::TcpState tcp_state = hal::TcpState::kClosed;
+bool tcp_resolving = false;
+// Tells the answer to the current lookup from one to a closed socket.
+std::atomic<uint32_t> dns_generation{0};
+std::atomic<int> dns_result{0};  // 0 waiting, 1 found, -1 failed.
+ip_addr_t dns_address;
+
+// The ADC cannot wake us from light sleep on the ESP32, so sleeps with an ADC
+// threshold are cut into slices of this length and the pin checked in between.
+constexpr uint32_t kAdcPollMs = 250;
+
+// DMA buffer for AdcStream, in bytes of adc_digi_output_data_t (2 per sample).
+constexpr uint32_t kAdcStreamBufferBytes = 4096;
+constexpr uint32_t kAdcStreamFrameBytes = 256;
+
+bool adc_stream_configured = false;
+bool adc_stream_running = false;
+int8_t adc_stream_channel = -1;
+
+// Since the last WifiBegin(), set by OnWifiEvent() on the WiFi event task.
+int64_t wifi_begin_us = 0;
+std::atomic<int32_t> wifi_associated_ms{-1};
+std::atomic<int32_t> wifi_got_ip_ms{-1};
+
+// Not touched by the startup code, so it keeps what the firmware before a
+// restart left there. After a power cycle it is noise the CRC turns away.
+struct RtcRetained {
+  uint32_t size;
+  uint32_t crc;
+  uint8_t data[hal::kRtcRetainedBytes];
+};
+RTC_NOINIT_ATTR RtcRetained rtc_retained;
+
+bool auto_light_sleep = false;
+std::atomic<bool> network_idle{false};
+int idle_wake_pin = -1;
+TaskHandle_t idle_task = nullptr;
+
+// The wake pin has one interrupt type for both jobs: low level, which is what
+// wakes the chip from light sleep (edges can not), and the same interrupt
+// ends a wait while awake. Level triggered it would fire again and again
+// while the pin stays low, so it turns itself off and ArmWakePin() turns it
+// back on once the pin is high again.
+void IRAM_ATTR OnWakePin(void *arg) {
+  gpio_intr_disable(static_cast<gpio_num_t>(idle_wake_pin));
+  BaseType_t higher_priority_woken = pdFALSE;
+  if (idle_task) {
+    vTaskNotifyGiveFromISR(idle_task, &higher_priority_woken);
+  }
+  portYIELD_FROM_ISR(higher_priority_woken);
+}
+
+void OnWifiEvent(arduino_event_id_t event) {
+  const int32_t ms = (esp_timer_get_time() - wifi_begin_us) / 1000;
+  if (event == ARDUINO_EVENT_WIFI_STA_CONNECTED) {
+    wifi_associated_ms.store(ms);
+  } else if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+    wifi_got_ip_ms.store(ms);
+  }
+}
+
+IPAddress ToIpAddress(const uint8_t (&ip)[4]) {
+  return IPAddress(ip[0], ip[1], ip[2], ip[3]);
+}
+
+void FromIpAddress(const IPAddress &address, uint8_t (&ip)[4]) {
+  for (int i = 0; i < 4; ++i) {
+    ip[i] = address[i];
+  }
+}
+
+// True if the pin is high and so armed to wake us when it goes low.
+bool ArmWakePin() {
+  if (idle_wake_pin < 0) {
+    return false;
+  }
+  const gpio_num_t pin = static_cast<gpio_num_t>(idle_wake_pin);
+  if (digitalRead(idle_wake_pin) == LOW) {
+    gpio_wakeup_disable(pin);  // Or light sleep would end right away.
+    return false;
+  }
+  gpio_wakeup_enable(pin, GPIO_INTR_LOW_LEVEL);
+  gpio_intr_enable(pin);
+  return true;
+}
+
+// UdpSendTo() only needs the answer in lwIP's DNS cache.
+void OnUdpDnsFound(const char *name, const ip_addr_t *address, void *arg) {}
+
+void OnDnsFound(const char *name, const ip_addr_t *address, void *arg) {
+  if (reinterpret_cast<uintptr_t>(arg) != dns_generation.load()) {
+    return;
+  }
+  if (address) {
+    dns_address = *address;
+  }
+  dns_result.store(address ? 1 : -1);
+}
+
+bool TcpOpen(const ip_addr_t &address) {
+  if (!IP_IS_V4(&address)) {
+    return false;
+  }
+  tcp_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (tcp_fd < 0) {
+    return false;
+  }
+  fcntl(tcp_fd, F_SETFL, fcntl(tcp_fd, F_GETFL, 0) | O_NONBLOCK);
+  const int one = 1;
+  setsockopt(tcp_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  sockaddr_in peer = {};
+  peer.sin_family = AF_INET;
+  peer.sin_port = htons(tcp_port);
+  peer.sin_addr.s_addr = ip_2_ip4(&address)->addr;
+  if (connect(tcp_fd, reinterpret_cast<sockaddr *>(&peer), sizeof(peer)) ==
+      0) {
+    tcp_state = hal::TcpState::kConnected;
+  } else if (errno == EINPROGRESS) {
+    tcp_state = hal::TcpState::kConnecting;
+  } else {
+    close(tcp_fd);
+    tcp_fd = -1;
+    return false;
+  }
+  return true;
+}
+
+bool NvsOpen() {
+  if (!nvs_open) {
+    nvs_open = nvs.begin("pumpctl", false);
+  }
+  return nvs_open;
+}
+
+}  // namespace
+
+struct hal::File::Impl {
+  fs::File file;
+};
+
+namespace hal {
+
+uint32_t Micros() { return micros(); }
+uint32_t Millis() { return millis(); }
+void DelayMs(uint32_t ms) { delay(ms); }
+int64_t RtcMicros() { return rtc.getEpoch() * 1000000LL + rtc.getMicros(); }
+uint32_t CycleCount() { return XTHAL_GET_CCOUNT(); }
+// The ROM keeps the current frequency, frequency scaling updates it.
+uint32_t CyclesToMicros(uint32_t cycles) {
+  return cycles / ets_get_cpu_frequency();
+}
+
+HeapInfo Heap() {
+  return {heap_caps_get_free_size(MALLOC_CAP_8BIT),
+          heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+          heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT)};
+}
+
+void IdleInit(int wake_pin) {
+  // Automatic light sleep: the idle task sleeps until the next FreeRTOS timeout
+  // when nothing is runnable. Only available if the SDK was built with
+  // CONFIG_PM_ENABLE and tickless idle, otherwise we keep plain delay().
+  esp_pm_config_esp32_t pm_config = {};
+  pm_config.max_freq_mhz = 240;
+  pm_config.min_freq_mhz = 80;
+  pm_config.light_sleep_enable = true;
+  auto_light_sleep = esp_pm_configure(&pm_config) == ESP_OK;
+  // Modem sleep wakes the radio for every DTIM beacon, keeping the association
+  // (and so the MQTT TCP connection) alive.
+  WiFi.setSleep(WIFI_PS_MIN_MODEM);
+
+  idle_task = xTaskGetCurrentTaskHandle();
+  idle_wake_pin = wake_pin;
+  if (wake_pin >= 0) {
+    // Not attachInterrupt(), it would set the pin back to edge triggered.
+    const gpio_num_t pin = static_cast<gpio_num_t>(wake_pin);
+    gpio_install_isr_service(0);  // Fails harmlessly if already installed.
+    gpio_wakeup_enable(pin, GPIO_INTR_LOW_LEVEL);
+    gpio_isr_handler_add(pin, OnWakePin, nullptr);
+    esp_sleep_enable_gpio_wakeup();
+  }
+  Serial.printf("IDLE: auto light sleep %s\n",
+                auto_light_sleep
+                    ? "enabled"
+                    : "not available, light sleep only while WiFi is down");
+}
+
+void IdleSetNetworkIdle(bool idle) { network_idle = idle; }
+
+WakeReason IdleSleepMs(uint32_t ms, int adc_pin, int adc_low, int adc_high) {
+  Serial.flush();  // UART output would be cut by light sleep.
+  uint32_t left = ms;
+  while (left > 0) {
+    const uint32_t slice = adc_pin >= 0 ? std::min(left, kAdcPollMs) : left;
+    ArmWakePin();
+    if (auto_light_sleep || !network_idle || adc_stream_running) {
+      // The notify from OnWakePin ends the wait early. With automatic light
+      // sleep the idle task sleeps in here.
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(slice));
+    } else {
+      // Nothing on the network core or ADC capture to lose, so sleep
+      // explicitly. The network task's next timeout waits for the wake.
+      esp_sleep_enable_timer_wakeup(slice * 1000ULL);
+      esp_light_sleep_start();
+    }
+    left -= slice;
+    if (idle_wake_pin >= 0 && digitalRead(idle_wake_pin) == LOW) {
+      return WakeReason::kGpio;
+    }
+    if (adc_pin >= 0 && !adc_stream_running) {
+      const int value = analogRead(adc_pin);
+      if (value < adc_low || value > adc_high) {
+        return WakeReason::kAdcThreshold;
+      }
+    }
+  }
+  return WakeReason::kTimeout;
+}
+
+bool StartTaskOnCore(const char *name, int core, uint32_t stack_bytes,
+                     void (*body)()) {
+  auto run = [](void *arg) {
+    reinterpret_cast<void (*)()>(arg)();
+    vTaskDelete(nullptr);
+  };
+  // Same priority as loop(), it is the core that keeps them apart.
+  return xTaskCreatePinnedToCore(run, name, stack_bytes,
+                                 reinterpret_cast<void *>(body), 1, nullptr,
+                                 core) == pdPASS;
+}
+
+int CurrentCore() { return xPortGetCoreID(); }
+
+void Restart() { ESP.restart(); }
+
+void WatchdogStart(int reset_timeout_s) {
+  // Configure to exevute panic = restart on timeout.
+  esp_task_wdt_init(reset_timeout_s, /*panic=*/true);
+  esp_task_wdt_add(nullptr);  // nullpr = this task.
+}
+
+void WatchdogFeed() { esp_task_wdt_reset(); }
+
+void ConfigurePin(int pin, PinMode mode) {
+  pinMode(pin, mode == PinMode::kOutput ? OUTPUT : INPUT_PULLUP);
+}
+void DigitalWrite(int pin, bool high) { digitalWrite(pin, high); }
+bool DigitalRead(int pin) { return digitalRead(pin) == HIGH; }
+int AnalogRead(int pin) { return analogRead(pin); }
+
+bool AdcStreamStart(int pin, uint32_t rate_hz) {
+  if (!adc_stream_configured) {
+    // The DMA path (I2S0 on the ESP32) only serves ADC1, GPIO 32..39.
+    adc_stream_channel = digitalPinToAnalogChannel(pin);
+    if (adc_stream_channel < 0 || adc_stream_channel >= ADC1_CHANNEL_MAX) {
+      return false;
+    }
+    adc_digi_init_config_t init_config = {};
+    init_config.max_store_buf_size = kAdcStreamBufferBytes;
+    init_config.conv_num_each_intr = kAdcStreamFrameBytes;
+    init_config.adc1_chan_mask = BIT(adc_stream_channel);
+    if (adc_digi_initialize(&init_config) != ESP_OK) {
+      return false;
+    }
+    adc_digi_pattern_config_t pattern = {};
+    pattern.atten = ADC_ATTEN_DB_11;  // Same as analogRead().
+    pattern.channel = adc_stream_channel;
+    pattern.unit = 0;  // ADC1
+    pattern.bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+    adc_digi_configuration_t config = {};
+    config.conv_limit_en = 1;  // Required on the ESP32.
+    config.conv_limit_num = 250;
+    config.pattern_num = 1;
+    config.adc_pattern = &pattern;
+    config.sample_freq_hz = rate_hz;
+    config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+    config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+    if (adc_digi_controller_configure(&config) != ESP_OK) {
+      adc_digi_deinitialize();
+      return false;
+    }
+    adc_stream_configured = true;
+  }
+  adc_stream_running = adc_digi_start() == ESP_OK;
+  return adc_stream_running;
+}
+
+void AdcStreamStop() {
+  if (adc_stream_running) {
+    adc_digi_stop();
+    adc_stream_running = false;
+  }
+}
+
+size_t AdcStreamRead(uint16_t *samples, size_t max) {
+  adc_digi_output_data_t
+      frame[kAdcStreamFrameBytes / sizeof(adc_digi_output_data_t)];
+  size_t count = 0;
+  while (adc_stream_running && count < max) {
+    const uint32_t want =
+        std::min(sizeof(frame), (max - count) * sizeof(frame[0]));
+    uint32_t got = 0;
+    // ESP_ERR_INVALID_STATE only says the ring overflowed, data is still good.
+    const esp_err_t err = adc_digi_read_bytes(
+        reinterpret_cast<uint8_t *>(frame), want, &got, 0);
+    if ((err != ESP_OK && err != ESP_ERR_INVALID_STATE) || got == 0) {
+      break;
+    }
+    for (uint32_t i = 0; i < got / sizeof(frame[0]); ++i) {
+      if (frame[i].type1.channel == adc_stream_channel) {
+        samples[count++] = frame[i].type1.data;
+      }
+    }
+  }
+  return count;
+}
+
+bool WifiConnected() { return WiFi.status() == WL_CONNECTED; }
+int WifiStatusCode() { return WiFi.status(); }
+const char *WifiMacAddress() {
+  static String mac;
+  mac = WiFi.macAddress();
+  return mac.c_str();
+}
+void WifiBegin(const char *ssid, const char *password, const WifiLink &link) {
+  static bool set_up = false;
+  if (!set_up) {
+    WiFi.onEvent(OnWifiEvent);
+    // Or begin() writes every new BSSID and channel to flash.
+    WiFi.persistent(false);
+    set_up = true;
+  }
+  wifi_associated_ms.store(-1);
+  wifi_got_ip_ms.store(-1);
+  wifi_begin_us = esp_timer_get_time();
+  if (link.ip[0] != 0) {
+    WiFi.config(ToIpAddress(link.ip), ToIpAddress(link.gateway),
+                ToIpAddress(link.netmask), ToIpAddress(link.dns));
+  } else {
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);  // Back to DHCP.
+  }
+  if (link.channel != 0) {
+    WiFi.begin(ssid, password, link.channel, link.bssid);
+  } else {
+    WiFi.begin(ssid, password);
+  }
+}
+void WifiDisconnect() { WiFi.disconnect(); }
+bool WifiGetLink(WifiLink &link) {
+  const uint8_t *bssid = WiFi.BSSID();
+  if (WiFi.status() != WL_CONNECTED || !bssid) {
+    return false;
+  }
+  memcpy(link.bssid, bssid, sizeof(link.bssid));
+  link.channel = WiFi.channel();
+  FromIpAddress(WiFi.localIP(), link.ip);
+  FromIpAddress(WiFi.gatewayIP(), link.gateway);
+  FromIpAddress(WiFi.subnetMask(), link.netmask);
+  FromIpAddress(WiFi.dnsIP(), link.dns);
+  return true;
+}
+WifiTimes WifiConnectTimes() {
+  return {wifi_associated_ms.load(), wifi_got_ip_ms.load()};
+}
+void WifiStartAccessPoint(const char *ssid, const char *password,
+                          const uint8_t (&ip)[4]) {
+  const IPAddress address(ip[0], ip[1], ip[2], ip[3]);
+  WiFi.softAP(ssid, password);
+  WiFi.softAPConfig(address, address, IPAddress(255, 255, 255, 0));
+  Serial.print("Access Point started, IP Address: ");
+  Serial.println(WiFi.softAPIP());
+}
+
+bool UdpOpen() {
+  if (udp_fd < 0) {
+    udp_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (udp_fd >= 0) {
+      fcntl(udp_fd, F_SETFL, fcntl(udp_fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+  }
+  return udp_fd >= 0;
+}
+
+void UdpClose() {
+  if (udp_fd >= 0) {
+    close(udp_fd);
+    udp_fd = -1;
+  }
+}
+
+bool UdpSendTo(const char *host, int port, const uint8_t *data, size_t size) {
+  ip_addr_t address;
+  if (udp_fd < 0 ||
+      dns_gethostbyname(host, &address, OnUdpDnsFound, nullptr) != ERR_OK ||
+      !IP_IS_V4(&address)) {
+    return false;
+  }
+  sockaddr_in peer = {};
+  peer.sin_family = AF_INET;
+  peer.sin_port = htons(port);
+  peer.sin_addr.s_addr = ip_2_ip4(&address)->addr;
+  return sendto(udp_fd, data, size, 0, reinterpret_cast<sockaddr *>(&peer),
+                sizeof(peer)) == static_cast<int>(size);
+}
+
+int UdpReceive(uint8_t *data, size_t size) {
+  if (udp_fd < 0) {
+    return -1;
+  }
+  const int received = recv(udp_fd, data, size, 0);
+  if (received >= 0) {
+    return received;
+  }
+  return errno == EWOULDBLOCK || errno == EAGAIN ? 0 : -1;
+}
+
+bool TcpConnect(const char *host, int port) {
+  TcpClose();
+  tcp_port = port;
+  dns_result.store(0);
+  ip_addr_t address;
+  const err_t err =
+      dns_gethostbyname(host, &address, OnDnsFound,
+                        reinterpret_cast<void *>(dns_generation.load()));
+  if (err == ERR_OK) {
+    return TcpOpen(address);  // An IP address, or cached.
+  }
+  if (err != ERR_INPROGRESS) {
+    return false;
+  }
+  tcp_resolving = true;
+  tcp_state = TcpState::kConnecting;
+  return true;
+}
+
+TcpState TcpPoll() {
+  if (tcp_resolving) {
+    const int result = dns_result.load();
+    if (result == 0) {
+      return TcpState::kConnecting;
+    }
+    tcp_resolving = false;
+    if (result < 0 || !TcpOpen(dns_address)) {
+      tcp_state = TcpState::kClosed;
+    }
+    return tcp_state;
+  }
+  if (tcp_state == TcpState::kConnecting) {
+    // Writable once the connect finished, one way or the other.
+    fd_set writable;
+    FD_ZERO(&writable);
+    FD_SET(tcp_fd, &writable);
+    timeval no_wait = {0, 0};
+    if (select(tcp_fd + 1, nullptr, &writable, nullptr, &no_wait) > 0) {
+      int error = 0;
+      socklen_t length = sizeof(error);
+      getsockopt(tcp_fd, SOL_SOCKET, SO_ERROR, &error, &length);
+      tcp_state = error == 0 ? TcpState::kConnected : TcpState::kClosed;
+    }
+  }
+  return tcp_state;
+}
+
+int TcpSend(const uint8_t *data, size_t size) {
+  if (tcp_state != TcpState::kConnected) {
+    return -1;
+  }
+  const int n = send(tcp_fd, data, size, MSG_DONTWAIT);
+  if (n >= 0) {
+    return n;
+  }
+  if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    return 0;
+  }
+  tcp_state = TcpState::kClosed;
+  return -1;
+}
+
+int TcpReceive(uint8_t *data, size_t size) {
+  if (tcp_state != TcpState::kConnected) {
+    return -1;
+  }
+  const int n = recv(tcp_fd, data, size, MSG_DONTWAIT);
+  if (n > 0) {
+    return n;
+  }
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  tcp_state = TcpState::kClosed;  // 0 is the peer closing.
+  return -1;
+}
+
+void TcpClose() {
+  if (tcp_fd >= 0) {
+    close(tcp_fd);
+    tcp_fd = -1;
+  }
+  tcp_state = TcpState::kClosed;
+  tcp_resolving = false;
+  dns_generation++;  // Ignore a lookup still on its way.
+}
+
+bool FsMount() { return SPIFFS.begin(true); }
+bool FsExists(const char *path) { return SPIFFS.exists(path); }
+bool FsRemove(const char *path) { return SPIFFS.remove(path); }
+bool FsRename(const char *from, const char *to) {
+  return SPIFFS.rename(from, to);
+}
+
+File File::Open(const char *path, const char *mode) {
+  fs::File file = SPIFFS.open(path, mode);
+  if (!file) {
+    return File();
+  }
+  return File(std::make_shared<Impl>(Impl{file}));
+}
+
+size_t File::Size() const { return impl_ ? impl_->file.size() : 0; }
+size_t File::Read(void *buffer, size_t size) {
+  return impl_ ? impl_->file.read(static_cast<uint8_t *>(buffer), size) : 0;
+}
+size_t File::Write(const void *buffer, size_t size) {
+  return impl_ ? impl_->file.write(static_cast<const uint8_t *>(buffer), size)
+               : 0;
+}
+bool File::Seek(size_t position) {
+  return impl_ && impl_->file.seek(position);
+}
+void File::Close() {
+  if (impl_) {
+    impl_->file.close();
+    impl_.reset();
+  }
+}
+
+bool NvsGetInt(const char *key, int32_t &value) {
+  if (!NvsOpen() || !nvs.isKey(key)) {
+    return false;
+  }
+  value = nvs.getInt(key);
+  return true;
+}
+
+bool NvsSetInt(const char *key, int32_t value) {
+  return NvsOpen() && nvs.putInt(key, value) == sizeof(value);
+}
+
+bool NvsGetBytes(const char *key, void *data, size_t size) {
+  return NvsOpen() && nvs.isKey(key) && nvs.getBytesLength(key) == size &&
+         nvs.getBytes(key, data, size) == size;
+}
+
+bool NvsSetBytes(const char *key, const void *data, size_t size) {
+  return NvsOpen() && nvs.putBytes(key, data, size) == size;
+}
+
+bool RtcRetainedRead(void *data, size_t size) {
+  if (rtc_retained.size != size || size > sizeof(rtc_retained.data) ||
+      rtc_retained.crc != Crc32(rtc_retained.data, size)) {
+    return false;
+  }
+  memcpy(data, rtc_retained.data, size);
+  return true;
+}
+
+void RtcRetainedWrite(const void *data, size_t size) {
+  size = std::min(size, sizeof(rtc_retained.data));
+  memcpy(rtc_retained.data, data, size);
+  rtc_retained.size = size;
+  rtc_retained.crc = Crc32(rtc_retained.data, size);
+}
+
+namespace {
+esp_ota_handle_t ota_handle = 0;
+const esp_partition_t *ota_partition = nullptr;
+}  // namespace
+
+bool OtaReadRunning(size_t offset, void *buffer, size_t size) {
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  return running && offset + size <= running->size &&
+         esp_partition_read(running, offset, buffer, size) == ESP_OK;
+}
+
+bool OtaBegin(size_t image_size) {
+  OtaAbort();
+  ota_partition = esp_ota_get_next_update_partition(nullptr);
+  if (!ota_partition || image_size > ota_partition->size) {
+    return false;
+  }
+  // Erases just the sectors the image needs.
+  return esp_ota_begin(ota_partition, image_size, &ota_handle) == ESP_OK;
+}
+
+bool OtaWrite(const void *data, size_t size) {
+  return ota_handle && esp_ota_write(ota_handle, data, size) == ESP_OK;
+}
+
+bool OtaEnd() {
+  if (!ota_handle) {
+    return false;
+  }
+  // Checks the image's own header and hash as well.
+  const esp_err_t err = esp_ota_end(ota_handle);
+  ota_handle = 0;
+  return err == ESP_OK && esp_ota_set_boot_partition(ota_partition) == ESP_OK;
+}
+
+void OtaAbort() {
+  if (ota_handle) {
+    esp_ota_abort(ota_handle);
+    ota_handle = 0;
+  }
+}
+
+void OtaMarkValid() { esp_ota_mark_app_valid_cancel_rollback(); }
+
+void OtaRollback() {
+  // Marks this image invalid where the bootloader tracks that, only returns
+  // if there is no such state (or nothing to go back to).
+  esp_ota_mark_app_invalid_rollback_and_reboot();
+  const esp_partition_t *other = esp_ota_get_next_update_partition(nullptr);
+  if (other) {
+    esp_ota_set_boot_partition(other);
+  }
+  esp_restart();
+}
+
+}  // namespace hal
+
+// The Arduino core marks a new image valid before setup() unless this says
+// the firmware does it itself, see hal::OtaMarkValid().
+extern "C" bool verifyRollbackLater() { return true; }
+
+#endif  // ARDUINO
@@ -0,0 +1,898 @@
+#ifndef ARDUINO
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "hal.h"
+#include "hal_sim.h"
+
+HostSerial Serial;
+
+namespace {
+
+constexpr int kNumPins = 40;
+constexpr int kWlConnected = 3;     // Same codes as Arduino WiFi.status().
+constexpr int kWlDisconnected = 6;
+constexpr uint32_t kAdcPollMs = 250;  // Same slicing as hal_esp32.cpp
+// The simulated access point and the address its DHCP server hands out.
+constexpr uint8_t kSimBssid[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0xaa};
+constexpr uint8_t kSimLeaseIp[4] = {192, 168, 1, 50};
+
+struct SimState {
+  hal::sim::Options options;
+  int64_t now_us = 0;
+
+  hal::sim::AdcSource adc_source;
+  // AdcStream: pin (-1 if stopped), rate and the next sample to hand out.
+  int adc_stream_pin = -1;
+  uint32_t adc_stream_hz = 0;
+  int64_t adc_stream_start_us = 0;
+  int64_t adc_stream_index = 0;
+  hal::sim::EdgeHook edge_hook;
+  bool pin_level[kNumPins] = {};
+
+  bool network_up = true;
+  bool wifi_begun = false;
+  int64_t wifi_begin_us = 0;
+  // When the WifiBegin() going on associates and gets its IP, -1 never.
+  int64_t wifi_associated_us = -1;
+  int64_t wifi_got_ip_us = -1;
+  uint8_t wifi_static_ip[4] = {};
+
+  // The SNTP socket, answered by the stand-in servers in UdpSendTo().
+  bool udp_open = false;
+  std::map<std::string, int64_t> dns_done_us;  // When a lookup finishes.
+  struct Datagram {
+    int64_t arrive_us;
+    std::string bytes;
+  };
+  std::vector<Datagram> udp_inbox;
+
+  // NVS, read from the file on first use and written through. Values as
+  // they are in the file.
+  bool nvs_loaded = false;
+  std::map<std::string, std::string> nvs;
+
+  // The MQTT socket, to the broker simulated below or, with
+  // options.real_broker, a real one.
+  hal::TcpState tcp_state = hal::TcpState::kClosed;
+  int64_t tcp_connected_us = 0;  // When the simulated connect completes.
+  std::string tcp_sent;          // Client bytes the broker has not parsed.
+  std::string tcp_replies;       // Simulated broker bytes not received yet.
+  int tcp_fd = -1;
+  std::vector<std::string> subscribed_topics;  // On this connection.
+  // By topic suffix, see sim::PublishRetained().
+  std::map<std::string, std::string> retained;
+  // Last payload the firmware published on each topic.
+  std::map<std::string, std::string> published;
+
+  int idle_wake_pin = -1;
+
+  // Update being written to <fs_root>.ota.
+  FILE *ota_file = nullptr;
+  size_t ota_size = 0;
+  size_t ota_written = 0;
+
+  int watchdog_timeout_s = 0;
+  int64_t watchdog_fed_us = 0;
+
+  hal::sim::Counters counters;
+};
+
+SimState &State() {
+  static SimState state;
+  return state;
+}
+
+void AdvanceMicros(int64_t us) {
+  SimState &s = State();
+  if (s.options.real_broker) {
+    usleep(us);
+  }
+  s.now_us += us;
+  s.counters.slept_us += us;
+  if (s.watchdog_timeout_s > 0 &&
+      s.now_us - s.watchdog_fed_us > s.watchdog_timeout_s * 1000000LL) {
+    Serial.println("SIM: watchdog expired");
+    hal::Restart();
+  }
+}
+
+std::string FsPath(const char *path) {
+  return std::string(State().options.fs_root) + path;
+}
+
+// "key value" lines, next to the file system directory so it survives a new
+// one like NVS survives flashing SPIFFS. Blobs are "x" and their bytes in hex.
+std::string NvsPath() { return std::string(State().options.fs_root) + ".nvs"; }
+
+std::map<std::string, std::string> &Nvs() {
+  SimState &s = State();
+  if (!s.nvs_loaded) {
+    s.nvs_loaded = true;
+    if (FILE *f = fopen(NvsPath().c_str(), "r")) {
+      char key[16];
+      char value[2 * 64 + 2];
+      while (fscanf(f, "%15s %129s", key, value) == 2) {
+        s.nvs[key] = value;
+      }
+      fclose(f);
+    }
+  }
+  return s.nvs;
+}
+
+bool NvsSet(const char *key, const std::string &value) {
+  auto &nvs = Nvs();
+  nvs[key] = value;
+  FILE *f = fopen(NvsPath().c_str(), "w");
+  if (!f) {
+    return false;
+  }
+  for (const auto &entry : nvs) {
+    fprintf(f, "%s %s\n", entry.first.c_str(), entry.second.c_str());
+  }
+  return fclose(f) == 0;
+}
+
+void CloseTcp() {
+  SimState &s = State();
+  if (s.tcp_fd >= 0) {
+    close(s.tcp_fd);
+    s.tcp_fd = -1;
+  }
+  s.tcp_state = hal::TcpState::kClosed;
+  s.tcp_sent.clear();
+  s.tcp_replies.clear();
+  s.subscribed_topics.clear();
+}
+
+bool EndsWith(const std::string &s, const std::string &suffix) {
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Queues a QoS 0 PUBLISH from the simulated broker.
+void BrokerPublish(const std::string &topic, const std::string &payload,
+                   bool retain) {
+  SimState &s = State();
+  std::string packet(1, static_cast<char>(0x30 | (retain ? 1 : 0)));
+  size_t length = 2 + topic.size() + payload.size();
+  do {
+    const uint8_t byte = length & 0x7f;
+    length >>= 7;
+    packet += static_cast<char>(byte | (length ? 0x80 : 0));
+  } while (length);
+  packet += static_cast<char>(topic.size() >> 8);
+  packet += static_cast<char>(topic.size() & 0xff);
+  packet += topic;
+  packet += payload;
+  s.tcp_replies += packet;
+}
+
+// The simulated broker: takes the complete MQTT packets off tcp_sent, counts
+// publishes and, unless a real broker does it, answers them.
+void BrokerReceive(bool reply) {
+  SimState &s = State();
+  std::string &in = s.tcp_sent;
+  while (in.size() >= 2) {
+    size_t length = 0;
+    size_t at = 1;
+    int shift = 0;
+    uint8_t byte;
+    do {
+      if (at >= in.size()) {
+        return;
+      }
+      byte = in[at++];
+      length |= (byte & 0x7f) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    if (in.size() < at + length) {
+      return;
+    }
+    const uint8_t header = in[0];
+    const uint8_t *body = reinterpret_cast<const uint8_t *>(in.data()) + at;
+    switch (header >> 4) {
+      case 1:  // CONNECT
+        s.counters.mqtt_connects++;
+        s.tcp_replies.append("\x20\x02\x00\x00", 4);
+        break;
+      case 3: {  // PUBLISH
+        const int qos = (header >> 1) & 3;
+        const size_t topic = body[0] << 8 | body[1];
+        s.counters.mqtt_publishes++;
+        s.counters.mqtt_duplicates += (header & 0x08) != 0;
+        const size_t payload_at = 2 + topic + (qos > 0 ? 2 : 0);
+        s.counters.mqtt_payload_bytes += length - payload_at;
+        s.published[std::string(reinterpret_cast<const char *>(body) + 2,
+                                topic)]
+            .assign(reinterpret_cast<const char *>(body) + payload_at,
+                    length - payload_at);
+        if (qos > 0) {
+          const char puback[4] = {0x40, 0x02,
+                                  static_cast<char>(body[2 + topic]),
+                                  static_cast<char>(body[3 + topic])};
+          s.tcp_replies.append(puback, 4);
+        }
+        break;
+      }
+      case 8: {  // SUBSCRIBE, one topic as the client sends it
+        const size_t topic = body[2] << 8 | body[3];
+        const char suback[5] = {static_cast<char>(0x90), 0x03,
+                                static_cast<char>(body[0]),
+                                static_cast<char>(body[1]), 0x00};
+        s.tcp_replies.append(suback, 5);
+        s.subscribed_topics.emplace_back(
+            reinterpret_cast<const char *>(body) + 4, topic);
+        for (const auto &retained : s.retained) {
+          if (EndsWith(s.subscribed_topics.back(), retained.first)) {
+            BrokerPublish(s.subscribed_topics.back(), retained.second, true);
+          }
+        }
+        break;
+      }
+      case 12:  // PINGREQ
+        s.tcp_replies.append("\xd0\x00", 2);
+        break;
+      case 14:  // DISCONNECT
+        in.clear();
+        CloseTcp();
+        return;
+    }
+    in.erase(0, at + length);
+  }
+  if (!reply) {
+    s.tcp_replies.clear();
+  }
+}
+
+// With options.real_broker, a plain non-blocking socket. The name lookup
+// blocks, but this is the host.
+bool RealTcpConnect(const char *host, int port) {
+  SimState &s = State();
+  addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *result = nullptr;
+  const std::string service = std::to_string(port);
+  if (getaddrinfo(host, service.c_str(), &hints, &result) != 0) {
+    return false;
+  }
+  s.tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (s.tcp_fd < 0) {
+    freeaddrinfo(result);
+    return false;
+  }
+  fcntl(s.tcp_fd, F_SETFL, fcntl(s.tcp_fd, F_GETFL, 0) | O_NONBLOCK);
+  const int one = 1;
+  setsockopt(s.tcp_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  const int rc = connect(s.tcp_fd, result->ai_addr, result->ai_addrlen);
+  freeaddrinfo(result);
+  if (rc != 0 && errno != EINPROGRESS) {
+    CloseTcp();
+    return false;
+  }
+  s.tcp_state = rc == 0 ? hal::TcpState::kConnected
+                        : hal::TcpState::kConnecting;
+  return true;
+}
+
+}  // namespace
+
+int HostSerial::printf(const char *format, ...) {
+  if (State().options.quiet) {
+    return 0;
+  }
+  va_list args;
+  va_start(args, format);
+  int n = vprintf(format, args);
+  va_end(args);
+  return n;
+}
+
+void HostSerial::print(const char *str) { printf("%s", str); }
+void HostSerial::println(const char *str) { printf("%s\n", str); }
+
+struct hal::File::Impl {
+  ~Impl() {
+    if (file) {
+      fclose(file);
+    }
+  }
+  FILE *file = nullptr;
+};
+
+namespace hal {
+namespace sim {
+
+void Init(const Options &options) {
+  State() = SimState();
+  State().options = options;
+}
+
+int64_t NowMicros() { return State().now_us; }
+
+int64_t TrueEpochMicros() {
+  return State().options.start_epoch_s * 1000000LL + State().now_us;
+}
+
+void SetAdcSource(AdcSource source) { State().adc_source = std::move(source); }
+void SetEdgeHook(EdgeHook hook) { State().edge_hook = std::move(hook); }
+
+void SetNetworkUp(bool up) {
+  State().network_up = up;
+  if (!up) {
+    CloseTcp();
+    State().udp_inbox.clear();
+  }
+}
+
+bool Publish(const std::string &suffix, const std::string &payload) {
+  SimState &s = State();
+  if (s.tcp_fd >= 0 || s.tcp_state != TcpState::kConnected) {
+    return false;
+  }
+  for (const std::string &topic : s.subscribed_topics) {
+    if (EndsWith(topic, suffix)) {
+      BrokerPublish(topic, payload, false);
+      return true;
+    }
+  }
+  return false;
+}
+
+void PublishRetained(const std::string &suffix, const std::string &payload) {
+  State().retained[suffix] = payload;
+  Publish(suffix, payload);
+}
+
+std::string LastPublished(const std::string &suffix) {
+  for (const auto &published : State().published) {
+    if (EndsWith(published.first, suffix)) {
+      return published.second;
+    }
+  }
+  return "";
+}
+
+const Counters &GetCounters() { return State().counters; }
+
+}  // namespace sim
+
+uint32_t Micros() { return static_cast<uint32_t>(State().now_us); }
+uint32_t Millis() { return static_cast<uint32_t>(State().now_us / 1000); }
+
+void DelayMs(uint32_t ms) {
+  State().counters.delay_calls++;
+  AdvanceMicros(ms * 1000LL);
+}
+
+int64_t RtcMicros() {
+  const int64_t now = State().now_us;
+  return now + now * State().options.rtc_drift_ppm / 1000000LL;
+}
+
+// Host nanoseconds: what code costs here, the simulated clock stands still
+// while it runs.
+uint32_t CycleCount() {
+  return static_cast<uint32_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+uint32_t CyclesToMicros(uint32_t cycles) { return cycles / 1000; }
+
+HeapInfo Heap() { return {0, 0, 0}; }
+
+void IdleInit(int wake_pin) { State().idle_wake_pin = wake_pin; }
+
+// The network tasks run in loop() here, between the sleeps.
+void IdleSetNetworkIdle(bool idle) {}
+
+WakeReason IdleSleepMs(uint32_t ms, int adc_pin, int adc_low, int adc_high) {
+  SimState &s = State();
+  s.counters.idle_sleeps++;
+  uint32_t left = ms;
+  while (left > 0) {
+    const uint32_t slice = adc_pin >= 0 ? std::min(left, kAdcPollMs) : left;
+    // A running ADC stream keeps us out of light sleep, as on the ESP32.
+    const bool streaming = s.adc_stream_pin >= 0;
+    AdvanceMicros(slice * 1000LL +
+                  (streaming ? 0 : s.options.light_sleep_wake_us));
+    left -= slice;
+    if (s.idle_wake_pin >= 0 && !DigitalRead(s.idle_wake_pin)) {
+      s.counters.idle_wakes_gpio++;
+      return WakeReason::kGpio;
+    }
+    if (adc_pin >= 0 && !streaming) {
+      const int value = AnalogRead(adc_pin);
+      if (value < adc_low || value > adc_high) {
+        s.counters.idle_wakes_adc++;
+        return WakeReason::kAdcThreshold;
+      }
+    }
+  }
+  return WakeReason::kTimeout;
+}
+
+// Single threaded, so the simulation stays deterministic.
+bool StartTaskOnCore(const char *name, int core, uint32_t stack_bytes,
+                     void (*body)()) {
+  return false;
+}
+
+int CurrentCore() { return 0; }
+
+void Restart() { throw sim::RestartRequested(); }
+
+void WatchdogStart(int reset_timeout_s) {
+  State().watchdog_timeout_s = reset_timeout_s;
+  State().watchdog_fed_us = State().now_us;
+}
+
+void WatchdogFeed() { State().watchdog_fed_us = State().now_us; }
+
+void ConfigurePin(int pin, PinMode mode) {
+  if (mode == PinMode::kInputPullup && pin >= 0 && pin < kNumPins) {
+    State().pin_level[pin] = true;
+  }
+}
+
+void DigitalWrite(int pin, bool high) {
+  SimState &s = State();
+  if (pin < 0 || pin >= kNumPins || s.pin_level[pin] == high) {
+    return;
+  }
+  s.pin_level[pin] = high;
+  if (s.edge_hook) {
+    s.edge_hook(pin, high, s.now_us);
+  }
+}
+
+bool DigitalRead(int pin) {
+  return pin >= 0 && pin < kNumPins && State().pin_level[pin];
+}
+
+int AnalogRead(int pin) {
+  return State().adc_source ? State().adc_source(pin, State().now_us) : 0;
+}
+
+bool AdcStreamStart(int pin, uint32_t rate_hz) {
+  SimState &s = State();
+  s.adc_stream_pin = pin;
+  s.adc_stream_hz = rate_hz;
+  s.adc_stream_start_us = s.now_us;
+  s.adc_stream_index = 0;
+  return true;
+}
+
+void AdcStreamStop() { State().adc_stream_pin = -1; }
+
+size_t AdcStreamRead(uint16_t *samples, size_t max) {
+  SimState &s = State();
+  size_t count = 0;
+  while (s.adc_stream_pin >= 0 && count < max) {
+    const int64_t t_us = s.adc_stream_start_us +
+                         s.adc_stream_index * 1000000 / s.adc_stream_hz;
+    if (t_us > s.now_us) {
+      break;
+    }
+    const int value = s.adc_source ? s.adc_source(s.adc_stream_pin, t_us) : 0;
+    samples[count++] = static_cast<uint16_t>(std::min(std::max(value, 0), 4095));
+    s.adc_stream_index++;
+  }
+  return count;
+}
+
+bool WifiConnected() {
+  const SimState &s = State();
+  return s.network_up && s.wifi_begun && s.wifi_got_ip_us >= 0 &&
+         s.now_us >= s.wifi_got_ip_us;
+}
+
+int WifiStatusCode() { return WifiConnected() ? kWlConnected : kWlDisconnected; }
+
+const char *WifiMacAddress() { return "02:00:00:00:00:01"; }
+
+// One access point, on options.wifi_channel. A link to any other never
+// associates, like the real one would not.
+void WifiBegin(const char *ssid, const char *password, const WifiLink &link) {
+  SimState &s = State();
+  const sim::Options &o = s.options;
+  s.wifi_begun = true;
+  s.wifi_begin_us = s.now_us;
+  s.wifi_associated_us = s.wifi_got_ip_us = -1;
+  memcpy(s.wifi_static_ip, link.ip, sizeof(link.ip));
+  s.counters.wifi_begins++;
+  if (link.channel != 0 &&
+      (link.channel != o.wifi_channel ||
+       memcmp(link.bssid, kSimBssid, sizeof(kSimBssid)) != 0)) {
+    return;
+  }
+  s.wifi_associated_us =
+      s.now_us + (link.channel != 0 ? 0 : o.wifi_scan_ms * 1000LL) +
+      o.wifi_associate_ms * 1000LL;
+  s.wifi_got_ip_us =
+      s.wifi_associated_us + (link.ip[0] != 0 ? 0 : o.wifi_dhcp_ms * 1000LL);
+}
+
+void WifiDisconnect() {
+  State().wifi_begun = false;
+  CloseTcp();
+}
+
+bool WifiGetLink(WifiLink &link) {
+  const SimState &s = State();
+  if (!WifiConnected()) {
+    return false;
+  }
+  memcpy(link.bssid, kSimBssid, sizeof(link.bssid));
+  link.channel = s.options.wifi_channel;
+  if (s.wifi_static_ip[0] != 0) {
+    memcpy(link.ip, s.wifi_static_ip, sizeof(link.ip));
+  } else {
+    memcpy(link.ip, kSimLeaseIp, sizeof(link.ip));
+  }
+  const uint8_t gateway[4] = {192, 168, 1, 1};
+  const uint8_t netmask[4] = {255, 255, 255, 0};
+  memcpy(link.gateway, gateway, sizeof(gateway));
+  memcpy(link.netmask, netmask, sizeof(netmask));
+  memcpy(link.dns, gateway, sizeof(gateway));
+  return true;
+}
+
+WifiTimes WifiConnectTimes() {
+  const SimState &s = State();
+  auto since_begin = [&](int64_t at_us) {
+    return at_us >= 0 && s.now_us >= at_us && s.network_up
+               ? static_cast<int32_t>((at_us - s.wifi_begin_us) / 1000)
+               : -1;
+  };
+  return {since_begin(s.wifi_associated_us), since_begin(s.wifi_got_ip_us)};
+}
+
+void WifiStartAccessPoint(const char *ssid, const char *password,
+                          const uint8_t (&ip)[4]) {
+  Serial.printf("Access point %s (simulated)\n", ssid);
+}
+
+bool UdpOpen() {
+  State().udp_open = true;
+  return true;
+}
+
+void UdpClose() {
+  State().udp_open = false;
+  State().udp_inbox.clear();
+}
+
+// Every host is an SNTP server, after a first lookup of options.dns_ms. The
+// answer comes back options.ntp_delay_us plus up to options.ntp_jitter_us of
+// queueing each way later, from the reference clock (or off by
+// options.ntp_falseticker_ms for that one host).
+bool UdpSendTo(const char *host, int port, const uint8_t *data, size_t size) {
+  SimState &s = State();
+  if (!s.udp_open || !WifiConnected()) {
+    return false;
+  }
+  auto lookup = s.dns_done_us.find(host);
+  if (lookup == s.dns_done_us.end()) {
+    s.dns_done_us[host] = s.now_us + s.options.dns_ms * 1000LL;
+    return false;
+  }
+  if (lookup->second > s.now_us) {
+    return false;
+  }
+  s.counters.ntp_requests++;
+  if (port != 123 || size < 48) {
+    return true;  // Nobody there.
+  }
+  auto one_way_us = [&] {
+    const int jitter_us = s.options.ntp_jitter_us;
+    return s.options.ntp_delay_us + (jitter_us > 0 ? rand() % jitter_us : 0);
+  };
+  const int64_t received_us = s.now_us + one_way_us();
+  const int64_t sent_us = received_us + 50;
+  const int64_t error_us = s.options.ntp_falseticker &&
+                                   !strcmp(host, s.options.ntp_falseticker)
+                               ? s.options.ntp_falseticker_ms * 1000LL
+                               : 0;
+  // Seconds since 1900 . 32 bit fraction.
+  auto timestamp = [&](int64_t t_us) {
+    const int64_t epoch_us =
+        s.options.start_epoch_s * 1000000LL + t_us + error_us;
+    const uint64_t seconds = epoch_us / 1000000 + 2208988800LL;
+    const uint64_t fraction = ((epoch_us % 1000000) << 32) / 1000000;
+    return seconds << 32 | fraction;
+  };
+  std::string reply(48, '\0');
+  reply[0] = 0 << 6 | 4 << 3 | 4;  // Version 4, server.
+  reply[1] = 2;                    // Stratum.
+  reply.replace(24, 8, reinterpret_cast<const char *>(data) + 40, 8);
+  const uint64_t stamps[2] = {timestamp(received_us), timestamp(sent_us)};
+  for (int i = 0; i < 2; ++i) {
+    for (int b = 0; b < 8; ++b) {
+      reply[32 + i * 8 + b] = static_cast<char>(stamps[i] >> (56 - b * 8));
+    }
+  }
+  s.udp_inbox.push_back({sent_us + one_way_us(), reply});
+  return true;
+}
+
+int UdpReceive(uint8_t *data, size_t size) {
+  SimState &s = State();
+  if (!s.udp_open) {
+    return -1;
+  }
+  auto next = s.udp_inbox.end();
+  for (auto it = s.udp_inbox.begin(); it != s.udp_inbox.end(); ++it) {
+    if (it->arrive_us <= s.now_us &&
+        (next == s.udp_inbox.end() || it->arrive_us < next->arrive_us)) {
+      next = it;
+    }
+  }
+  if (next == s.udp_inbox.end()) {
+    return 0;
+  }
+  const size_t length = std::min(size, next->bytes.size());
+  memcpy(data, next->bytes.data(), length);
+  s.udp_inbox.erase(next);
+  return static_cast<int>(length);
+}
+
+bool TcpConnect(const char *host, int port) {
+  SimState &s = State();
+  CloseTcp();
+  if (!WifiConnected()) {
+    return false;
+  }
+  if (s.options.real_broker) {
+    return RealTcpConnect(host, port);
+  }
+  s.tcp_state = TcpState::kConnecting;
+  s.tcp_connected_us = s.now_us + s.options.tcp_connect_ms * 1000LL;
+  return true;
+}
+
+TcpState TcpPoll() {
+  SimState &s = State();
+  if (s.tcp_state == TcpState::kClosed) {
+    return s.tcp_state;
+  }
+  if (!WifiConnected()) {
+    CloseTcp();
+  } else if (s.tcp_state == TcpState::kConnecting) {
+    if (s.tcp_fd >= 0) {
+      pollfd pfd = {s.tcp_fd, POLLOUT, 0};
+      if (poll(&pfd, 1, 0) > 0) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(s.tcp_fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error == 0) {
+          s.tcp_state = TcpState::kConnected;
+        } else {
+          CloseTcp();
+        }
+      }
+    } else if (s.now_us >= s.tcp_connected_us) {
+      s.tcp_state = TcpState::kConnected;
+    }
+  }
+  return s.tcp_state;
+}
+
+int TcpSend(const uint8_t *data, size_t size) {
+  SimState &s = State();
+  if (TcpPoll() != TcpState::kConnected) {
+    return -1;
+  }
+  if (s.tcp_fd >= 0) {
+    const ssize_t n = send(s.tcp_fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      CloseTcp();
+      return -1;
+    }
+    size = n;
+  }
+  s.tcp_sent.append(reinterpret_cast<const char *>(data), size);
+  BrokerReceive(s.tcp_fd < 0);
+  return size;
+}
+
+int TcpReceive(uint8_t *data, size_t size) {
+  SimState &s = State();
+  if (TcpPoll() != TcpState::kConnected) {
+    return -1;
+  }
+  if (s.tcp_fd >= 0) {
+    const ssize_t n = recv(s.tcp_fd, data, size, MSG_DONTWAIT);
+    if (n > 0) {
+      return n;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    CloseTcp();
+    return -1;
+  }
+  size = std::min(size, s.tcp_replies.size());
+  memcpy(data, s.tcp_replies.data(), size);
+  s.tcp_replies.erase(0, size);
+  return size;
+}
+
+void TcpClose() { CloseTcp(); }
+
+bool FsMount() { return true; }
+
+bool FsExists(const char *path) {
+  FILE *file = fopen(FsPath(path).c_str(), "rb");
+  if (file) {
+    fclose(file);
+  }
+  return file != nullptr;
+}
+
+bool FsRemove(const char *path) { return remove(FsPath(path).c_str()) == 0; }
+
+bool FsRename(const char *from, const char *to) {
+  return rename(FsPath(from).c_str(), FsPath(to).c_str()) == 0;
+}
+
+File File::Open(const char *path, const char *mode) {
+  const std::string binary_mode = std::string(mode) + "b";
+  FILE *file = fopen(FsPath(path).c_str(), binary_mode.c_str());
+  if (!file) {
+    return File();
+  }
+  auto impl = std::make_shared<Impl>();
+  impl->file = file;
+  return File(impl);
+}
+
+size_t File::Size() const {
+  if (!impl_) {
+    return 0;
+  }
+  const long position = ftell(impl_->file);
+  fseek(impl_->file, 0, SEEK_END);
+  const long size = ftell(impl_->file);
+  fseek(impl_->file, position, SEEK_SET);
+  return size;
+}
+
+size_t File::Read(void *buffer, size_t size) {
+  return impl_ ? fread(buffer, 1, size, impl_->file) : 0;
+}
+
+size_t File::Write(const void *buffer, size_t size) {
+  return impl_ ? fwrite(buffer, 1, size, impl_->file) : 0;
+}
+
+bool File::Seek(size_t position) {
+  return impl_ && fseek(impl_->file, position, SEEK_SET) == 0;
+}
+
+void File::Close() { impl_.reset(); }
+
+bool NvsGetInt(const char *key, int32_t &value) {
+  const auto &nvs = Nvs();
+  const auto it = nvs.find(key);
+  if (it == nvs.end() || it->second[0] == 'x') {
+    return false;
+  }
+  value = atoi(it->second.c_str());
+  return true;
+}
+
+bool NvsSetInt(const char *key, int32_t value) {
+  return NvsSet(key, std::to_string(value));
+}
+
+bool NvsGetBytes(const char *key, void *data, size_t size) {
+  const auto &nvs = Nvs();
+  const auto it = nvs.find(key);
+  if (it == nvs.end() || it->second[0] != 'x' ||
+      it->second.size() != 1 + 2 * size) {
+    return false;
+  }
+  uint8_t *bytes = static_cast<uint8_t *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    bytes[i] = strtoul(it->second.substr(1 + 2 * i, 2).c_str(), nullptr, 16);
+  }
+  return true;
+}
+
+bool NvsSetBytes(const char *key, const void *data, size_t size) {
+  std::string value = "x";
+  char hex[3];
+  for (size_t i = 0; i < size; ++i) {
+    snprintf(hex, sizeof(hex), "%02x", static_cast<const uint8_t *>(data)[i]);
+    value += hex;
+  }
+  return NvsSet(key, value);
+}
+
+// A restart of the simulation is a new process, so RTC memory is as after a
+// power cycle and the firmware falls back to NVS.
+bool RtcRetainedRead(void *data, size_t size) { return false; }
+void RtcRetainedWrite(const void *data, size_t size) {}
+
+bool OtaReadRunning(size_t offset, void *buffer, size_t size) {
+  FILE *f = fopen(State().options.running_image, "rb");
+  if (!f) {
+    return false;
+  }
+  const bool ok = fseek(f, offset, SEEK_SET) == 0 &&
+                  fread(buffer, 1, size, f) == size;
+  fclose(f);
+  return ok;
+}
+
+bool OtaBegin(size_t image_size) {
+  OtaAbort();
+  SimState &s = State();
+  s.ota_file = fopen((std::string(s.options.fs_root) + ".ota").c_str(), "wb");
+  s.ota_size = image_size;
+  s.ota_written = 0;
+  return s.ota_file != nullptr;
+}
+
+bool OtaWrite(const void *data, size_t size) {
+  SimState &s = State();
+  if (!s.ota_file || s.ota_written + size > s.ota_size) {
+    return false;
+  }
+  s.ota_written += size;
+  return fwrite(data, 1, size, s.ota_file) == size;
+}
+
+bool OtaEnd() {
+  SimState &s = State();
+  if (!s.ota_file) {
+    return false;
+  }
+  const bool ok = fclose(s.ota_file) == 0 && s.ota_written == s.ota_size;
+  s.ota_file = nullptr;
+  s.counters.ota_images += ok;
+  return ok;
+}
+
+void OtaAbort() {
+  SimState &s = State();
+  if (s.ota_file) {
+    fclose(s.ota_file);
+    s.ota_file = nullptr;
+  }
+}
+
+void OtaMarkValid() { State().counters.ota_marked_valid++; }
+
+void OtaRollback() {
+  State().counters.ota_rollbacks++;
+  Restart();
+}
+
+}  // namespace hal
+
+#endif  // !ARDUINO
@@ -0,0 +1,98 @@
+#pragma once
+
+// Controls for the simulated hardware of the host build, only available when
+// not building for ARDUINO. Time only moves when the firmware sleeps, so a day
+// of operation runs in however long the loop() calls themselves take.
+
+#ifndef ARDUINO
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace hal {
+namespace sim {
+
+struct Options {
+  int64_t start_epoch_s = 1748736000;  // 2025-06-01 00:00:00 UTC
+  // RTC crystal error, positive means the RTC runs fast.
+  int rtc_drift_ppm = 0;
+  // SNTP stand-in servers: one-way network delay, plus up to ntp_jitter_us
+  // of queueing (uniform) on each way. The server named ntp_falseticker is
+  // off by ntp_falseticker_ms.
+  int ntp_delay_us = 15000;
+  int ntp_jitter_us = 0;
+  const char *ntp_falseticker = nullptr;
+  int ntp_falseticker_ms = 0;
+  int dns_ms = 30;
+  // WiFi: a scan of all channels, associating and DHCP. A link cached from
+  // an earlier run skips the scan (and with its IP, DHCP), but only connects
+  // while the access point is still on the channel it was on.
+  int wifi_scan_ms = 2000;
+  int wifi_associate_ms = 150;
+  int wifi_dhcp_ms = 350;
+  int wifi_channel = 6;
+  int tcp_connect_ms = 30;
+  // Connect to the configured MQTT broker for real instead of the simulated
+  // one. Time then runs at wall clock speed.
+  bool real_broker = false;
+  // Extra time IdleSleepMs() takes to come back out of light sleep.
+  int light_sleep_wake_us = 1000;
+  const char *fs_root = "sim_fs";
+  // What hal::OtaReadRunning() reads, updates go to <fs_root>.ota.
+  const char *running_image = "/proc/self/exe";
+  bool quiet = false;  // Drop Serial output.
+};
+
+// Thrown by hal::Restart() so the driver can decide what to do.
+struct RestartRequested {};
+
+void Init(const Options &options);
+
+// Simulated monotonic time since boot, usec.
+int64_t NowMicros();
+// Reference ("true") time, usec since Epoch. What NTP hands out.
+int64_t TrueEpochMicros();
+
+// Value returned by AnalogRead(pin) at simulated time t_us.
+using AdcSource = std::function<int(int pin, int64_t t_us)>;
+void SetAdcSource(AdcSource source);
+
+// Called on every level change of an output pin.
+using EdgeHook = std::function<void(int pin, bool high, int64_t t_us)>;
+void SetEdgeHook(EdgeHook hook);
+
+// Take WiFi (and so NTP and MQTT) up or down.
+void SetNetworkUp(bool up);
+
+// Publishes payload on the topic the firmware subscribed to that ends in
+// suffix, e.g. "/config". False if it is not connected or not subscribed.
+bool Publish(const std::string &suffix, const std::string &payload);
+// The same, retained: now if it can, and on every later SUBSCRIBE.
+void PublishRetained(const std::string &suffix, const std::string &payload);
+// Payload of the last publish of the firmware on a topic ending in suffix,
+// empty if none.
+std::string LastPublished(const std::string &suffix);
+
+struct Counters {
+  int64_t delay_calls = 0;
+  int64_t slept_us = 0;
+  int64_t idle_sleeps = 0;
+  int64_t idle_wakes_gpio = 0;
+  int64_t idle_wakes_adc = 0;
+  int64_t mqtt_connects = 0;
+  int64_t mqtt_publishes = 0;
+  int64_t mqtt_duplicates = 0;  // Sent again after a reconnect.
+  int64_t mqtt_payload_bytes = 0;
+  int64_t wifi_begins = 0;
+  int64_t ntp_requests = 0;
+  int64_t ota_images = 0;  // Written, checked and set to boot.
+  int64_t ota_marked_valid = 0;
+  int64_t ota_rollbacks = 0;
+};
+const Counters &GetCounters();
+
+}  // namespace sim
+}  // namespace hal
+
+#endif  // ARDUINO
@@ -0,0 +1,556 @@
+#include "http_server.h"
+
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef ARDUINO
+#include <lwip/sockets.h>
+#else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // lwIP has no SIGPIPE to suppress.
+#endif
+
+namespace {
+
+const char *StatusText(int status) {
+  switch (status) {
+    case 200:
+      return "OK";
+    case 204:
+      return "No Content";
+    case 304:
+      return "Not Modified";
+    case 400:
+      return "Bad Request";
+    case 401:
+      return "Unauthorized";
+    case 404:
+      return "Not Found";
+    case 409:
+      return "Conflict";
+    case 413:
+      return "Payload Too Large";
+    case 431:
+      return "Request Header Fields Too Large";
+    case 500:
+      return "Internal Server Error";
+    default:
+      return "Unknown";
+  }
+}
+
+// Copies src[0, length) as a string, cut short to fit.
+void CopyField(char *dest, size_t size, const char *src, size_t length) {
+  length = std::min(length, size - 1);
+  memcpy(dest, src, length);
+  dest[length] = '\0';
+}
+
+void SetNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+bool WouldBlock() { return errno == EAGAIN || errno == EWOULDBLOCK; }
+
+}  // namespace
+
+bool HttpRequest::Query(const char *name, char *value, size_t size) const {
+  const size_t name_length = strlen(name);
+  const char *p = query;
+  while (*p) {
+    const char *end = strchr(p, '&');
+    if (!end) {
+      end = p + strlen(p);
+    }
+    if (static_cast<size_t>(end - p) >= name_length &&
+        !strncmp(p, name, name_length) &&
+        (p + name_length == end || p[name_length] == '=')) {
+      const char *start = p + name_length + (p + name_length < end ? 1 : 0);
+      CopyField(value, size, start, end - start);
+      return true;
+    }
+    p = *end ? end + 1 : end;
+  }
+  return false;
+}
+
+void HttpResponse::Reset(bool keep_alive) {
+  headers_length_ = out_length_ = out_sent_ = body_left_ = 0;
+  static_body_ = nullptr;
+  file_.Close();
+  keep_alive_ = keep_alive;
+  started_ = false;
+  on_sent_ = nullptr;
+}
+
+void HttpResponse::AddHeader(const char *name, const char *value) {
+  const int n = snprintf(headers_ + headers_length_,
+                         sizeof(headers_) - headers_length_, "%s: %s\r\n",
+                         name, value);
+  if (n > 0 && headers_length_ + n < sizeof(headers_)) {
+    headers_length_ += n;
+  }
+}
+
+bool HttpResponse::WriteHead(int status, const char *content_type,
+                             size_t length) {
+  started_ = true;
+  // 204 and 304 have no body, so no Content-Type or Content-Length either (a
+  // 304 one would have to be that of the 200).
+  char entity[96] = "";
+  if (status != 204 && status != 304) {
+    snprintf(entity, sizeof(entity),
+             "Content-Type: %s\r\nContent-Length: %u\r\n", content_type,
+             static_cast<unsigned>(length));
+  }
+  const int n = snprintf(
+      out_, sizeof(out_), "HTTP/1.1 %d %s\r\n%sConnection: %s\r\n%.*s\r\n",
+      status, StatusText(status), entity, keep_alive_ ? "keep-alive" : "close",
+      static_cast<int>(headers_length_), headers_);
+  out_length_ = n > 0 ? std::min<size_t>(n, sizeof(out_)) : 0;
+  out_sent_ = 0;
+  return n > 0 && static_cast<size_t>(n) < sizeof(out_);
+}
+
+void HttpResponse::Send(int status, const char *content_type,
+                        const char *body) {
+  const size_t length = strlen(body);
+  if (!WriteHead(status, content_type, length) ||
+      out_length_ + length > sizeof(out_)) {
+    headers_length_ = 0;
+    keep_alive_ = false;
+    WriteHead(500, "text/plain", 0);
+    return;
+  }
+  memcpy(out_ + out_length_, body, length);
+  out_length_ += length;
+}
+
+void HttpResponse::SendStatic(int status, const char *content_type,
+                              const uint8_t *body, size_t length) {
+  WriteHead(status, content_type, length);
+  static_body_ = body;
+  body_left_ = length;
+}
+
+void HttpResponse::SendFile(int status, const char *content_type,
+                            hal::File file) {
+  const size_t length = file ? file.Size() : 0;
+  WriteHead(status, content_type, length);
+  file_ = file;
+  body_left_ = length;
+}
+
+bool HttpResponse::Pending() {
+  if (out_sent_ < out_length_) {
+    return true;
+  }
+  out_length_ = out_sent_ = 0;
+  if (body_left_ == 0) {
+    return false;
+  }
+  const size_t chunk = std::min(body_left_, sizeof(out_));
+  if (static_body_) {
+    memcpy(out_, static_body_, chunk);
+    static_body_ += chunk;
+    out_length_ = chunk;
+  } else {
+    out_length_ = file_.Read(out_, chunk);
+    if (out_length_ == 0) {
+      // File shorter than it said, the client has to see the connection end.
+      keep_alive_ = false;
+      body_left_ = 0;
+      return false;
+    }
+  }
+  body_left_ -= out_length_;
+  return true;
+}
+
+HttpServer::~HttpServer() {
+  if (connections_) {
+    for (int i = 0; i < kMaxConnections; ++i) {
+      if (connections_[i].fd >= 0) {
+        Close(connections_[i]);
+      }
+    }
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+  }
+}
+
+bool HttpServer::On(const HttpRoute &route) {
+  if (num_routes_ == kMaxRoutes) {
+    return false;
+  }
+  routes_[num_routes_++] = route;
+  return true;
+}
+
+bool HttpServer::RequireToken(const char *token) {
+  token_required_ = true;
+  const bool fits = strlen(token) < sizeof(token_);
+  CopyField(token_, sizeof(token_), token, fits ? strlen(token) : 0);
+  return fits;
+}
+
+bool HttpServer::Start(int port) {
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) {
+    return false;
+  }
+  const int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  socklen_t length = sizeof(address);
+  if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&address), length) != 0 ||
+      listen(listen_fd_, kMaxConnections) != 0 ||
+      getsockname(listen_fd_, reinterpret_cast<sockaddr *>(&address),
+                  &length) != 0) {
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  SetNonBlocking(listen_fd_);
+  port_ = ntohs(address.sin_port);
+  connections_.reset(new Connection[kMaxConnections]);
+  return true;
+}
+
+void HttpServer::Poll(int timeout_ms) {
+  if (listen_fd_ < 0) {
+    hal::DelayMs(timeout_ms);
+    return;
+  }
+  fd_set readable;
+  fd_set writable;
+  FD_ZERO(&readable);
+  FD_ZERO(&writable);
+  int max_fd = -1;
+  bool free_slot = false;
+  // Only connections in the sets are looked at after select().
+  int polled[kMaxConnections];
+  const uint32_t now = hal::Millis();
+  for (int i = 0; i < kMaxConnections; ++i) {
+    Connection &connection = connections_[i];
+    if (connection.fd >= 0 &&
+        now - connection.last_active_ms > kIdleTimeoutMs) {
+      Close(connection);
+    }
+    polled[i] = connection.fd;
+    if (connection.fd < 0) {
+      free_slot = true;
+      continue;
+    }
+    FD_SET(connection.fd,
+           connection.stage == Stage::kRespond ? &writable : &readable);
+    max_fd = std::max(max_fd, connection.fd);
+  }
+  if (free_slot) {
+    // Otherwise new connections wait in the backlog.
+    FD_SET(listen_fd_, &readable);
+    max_fd = std::max(max_fd, listen_fd_);
+  }
+
+  timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+  if (select(max_fd + 1, &readable, &writable, nullptr, &timeout) <= 0) {
+    return;
+  }
+  for (int i = 0; i < kMaxConnections; ++i) {
+    Connection &connection = connections_[i];
+    if (polled[i] < 0 || connection.fd != polled[i]) {
+      continue;
+    }
+    if (FD_ISSET(polled[i], &readable)) {
+      Read(connection);
+    } else if (FD_ISSET(polled[i], &writable)) {
+      Write(connection);
+      // Pipelined requests waited for the response to finish.
+      if (connection.fd >= 0 && connection.stage == Stage::kIdle) {
+        Process(connection);
+      }
+    }
+  }
+  if (free_slot && FD_ISSET(listen_fd_, &readable)) {
+    Accept();
+  }
+}
+
+void HttpServer::Accept() {
+  for (int i = 0; i < kMaxConnections; ++i) {
+    Connection &connection = connections_[i];
+    if (connection.fd >= 0) {
+      continue;
+    }
+    const int fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0) {
+      return;
+    }
+    SetNonBlocking(fd);
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    connection.fd = fd;
+    connection.stage = Stage::kIdle;
+    connection.in_length = 0;
+    connection.last_active_ms = hal::Millis();
+  }
+}
+
+void HttpServer::Read(Connection &connection) {
+  const int n = recv(connection.fd, connection.in + connection.in_length,
+                     kInBytes - connection.in_length, MSG_DONTWAIT);
+  if (n <= 0) {
+    if (n < 0 && WouldBlock()) {
+      return;
+    }
+    Close(connection);  // 0 is the client closing.
+    return;
+  }
+  connection.in_length += n;
+  connection.last_active_ms = hal::Millis();
+  Process(connection);
+}
+
+void HttpServer::Process(Connection &connection) {
+  while (connection.fd >= 0 && connection.stage != Stage::kRespond) {
+    if (connection.stage != Stage::kBody) {
+      const char *end = nullptr;
+      for (size_t i = 3; i < connection.in_length; ++i) {
+        if (!memcmp(connection.in + i - 3, "\r\n\r\n", 4)) {
+          end = connection.in + i + 1;
+          break;
+        }
+      }
+      if (!end) {
+        connection.stage = connection.in_length ? Stage::kHead : Stage::kIdle;
+        if (connection.in_length == kInBytes) {
+          connection.response.Reset(false);
+          connection.response.Send(431, "text/plain", "Header too large");
+          connection.stage = Stage::kRespond;
+          Write(connection);
+        }
+        return;
+      }
+      const size_t head_length = end - connection.in;
+      const bool parsed = ParseHead(connection, head_length);
+      connection.in_length -= head_length;
+      memmove(connection.in, end, connection.in_length);
+      if (!parsed) {
+        connection.response.Reset(false);
+        connection.response.Send(400, "text/plain", "Bad request");
+        connection.stage = Stage::kRespond;
+        Write(connection);
+        return;
+      }
+      // Nobody wants the body of an unknown path, the connection is closed
+      // after the 404 instead.
+      connection.body_left =
+          connection.route ? connection.request.content_length : 0;
+      connection.stage = Stage::kBody;
+    }
+
+    // Body, as far as we have it.
+    const size_t n = std::min(connection.in_length, connection.body_left);
+    const HttpRoute *route = connection.route;
+    if (n > 0 && route && route->body) {
+      route->body(connection.request,
+                  reinterpret_cast<const uint8_t *>(connection.in), n);
+    }
+    connection.in_length -= n;
+    memmove(connection.in, connection.in + n, connection.in_length);
+    connection.body_left -= n;
+    if (connection.body_left > 0) {
+      return;
+    }
+    Respond(connection);
+  }
+}
+
+bool HttpServer::ParseHead(Connection &connection, size_t head_length) {
+  HttpRequest &request = connection.request;
+  request = HttpRequest();
+  connection.route = nullptr;
+  const char *p = connection.in;
+  const char *end = connection.in + head_length;
+
+  // Request line.
+  const char *line_end = static_cast<const char *>(memchr(p, '\r', end - p));
+  const char *space = static_cast<const char *>(memchr(p, ' ', line_end - p));
+  if (!space) {
+    return false;
+  }
+  if (space - p == 3 && !memcmp(p, "GET", 3)) {
+    request.method = HttpMethod::kGet;
+  } else if (space - p == 4 && !memcmp(p, "POST", 4)) {
+    request.method = HttpMethod::kPost;
+  }
+  const char *target = space + 1;
+  const char *target_end =
+      static_cast<const char *>(memchr(target, ' ', line_end - target));
+  if (!target_end) {
+    return false;
+  }
+  const char *question =
+      static_cast<const char *>(memchr(target, '?', target_end - target));
+  const char *path_end = question ? question : target_end;
+  if (static_cast<size_t>(path_end - target) >= sizeof(request.path)) {
+    return false;
+  }
+  CopyField(request.path, sizeof(request.path), target, path_end - target);
+  if (question) {
+    CopyField(request.query, sizeof(request.query), question + 1,
+              target_end - question - 1);
+  }
+  request.keep_alive = strncmp(target_end + 1, "HTTP/1.0", 8) != 0;
+
+  // Headers.
+  for (p = line_end + 2; p < end - 2; p = line_end + 2) {
+    line_end = static_cast<const char *>(memchr(p, '\r', end - p));
+    const char *colon =
+        static_cast<const char *>(memchr(p, ':', line_end - p));
+    if (!colon) {
+      return false;
+    }
+    const char *value = colon + 1;
+    while (value < line_end && *value == ' ') {
+      value++;
+    }
+    const size_t name_length = colon - p;
+    const size_t value_length = line_end - value;
+    auto is = [&](const char *name) {
+      return name_length == strlen(name) && !strncasecmp(p, name, name_length);
+    };
+    if (is("Content-Length")) {
+      request.content_length = strtoul(value, nullptr, 10);
+    } else if (is("Connection")) {
+      if (!strncasecmp(value, "close", 5)) {
+        request.keep_alive = false;
+      } else if (!strncasecmp(value, "keep-alive", 10)) {
+        request.keep_alive = true;
+      }
+    } else if (is("If-None-Match")) {
+      CopyField(request.if_none_match, sizeof(request.if_none_match), value,
+                value_length);
+    } else if (is("Accept-Encoding")) {
+      CopyField(request.accept_encoding, sizeof(request.accept_encoding),
+                value, value_length);
+    } else if (is("Authorization")) {
+      CopyField(request.authorization, sizeof(request.authorization), value,
+                value_length);
+    }
+  }
+
+  for (int i = 0; i < num_routes_; ++i) {
+    if (routes_[i].method == request.method &&
+        !strcmp(routes_[i].path, request.path)) {
+      connection.route = &routes_[i];
+      break;
+    }
+  }
+  connection.unauthorized = token_required_ && !Authorized(request);
+  if (connection.unauthorized) {
+    connection.route = nullptr;  // Nor does it get the body.
+  }
+  if (!connection.route && request.content_length > 0) {
+    request.keep_alive = false;
+  }
+  return true;
+}
+
+bool HttpServer::Authorized(const HttpRequest &request) const {
+  constexpr char kScheme[] = "Bearer ";
+  constexpr size_t kSchemeLength = sizeof(kScheme) - 1;
+  if (!token_[0] ||
+      strncasecmp(request.authorization, kScheme, kSchemeLength) != 0) {
+    return false;
+  }
+  const char *given = request.authorization + kSchemeLength;
+  const size_t length = strlen(token_);
+  if (strlen(given) != length) {
+    return false;
+  }
+  // Compares every byte, so the time taken does not tell how much matched.
+  uint8_t differ = 0;
+  for (size_t i = 0; i < length; ++i) {
+    differ |= given[i] ^ token_[i];
+  }
+  return differ == 0;
+}
+
+void HttpServer::Respond(Connection &connection) {
+  HttpResponse &response = connection.response;
+  response.Reset(connection.request.keep_alive);
+  if (connection.unauthorized) {
+    response.AddHeader("WWW-Authenticate", "Bearer");
+    response.Send(401, "text/plain", "Unauthorized");
+  } else if (connection.route) {
+    connection.route->handle(connection.request, response);
+  } else {
+    response.Send(404, "text/plain", "Not found");
+  }
+  if (!response.started()) {
+    response.Send(500, "text/plain", "No response");
+  }
+  connection.stage = Stage::kRespond;
+  Write(connection);
+}
+
+void HttpServer::Write(Connection &connection) {
+  HttpResponse &response = connection.response;
+  while (response.Pending()) {
+    const int n = send(connection.fd, response.out_ + response.out_sent_,
+                       response.out_length_ - response.out_sent_,
+                       MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (!WouldBlock()) {
+        Close(connection);
+      }
+      return;  // select() tells when there is room again.
+    }
+    response.out_sent_ += n;
+    connection.last_active_ms = hal::Millis();
+  }
+
+  // All out.
+  response.file_.Close();
+  void (*on_sent)() = response.on_sent_;
+  response.on_sent_ = nullptr;
+  if (response.keep_alive_) {
+    connection.stage = Stage::kIdle;
+  } else {
+    Close(connection);
+  }
+  if (on_sent) {
+    on_sent();
+  }
+}
+
+void HttpServer::Close(Connection &connection) {
+  if (connection.stage == Stage::kBody && connection.route &&
+      connection.route->body) {
+    connection.route->body(connection.request, nullptr, 0);
+  }
+  close(connection.fd);
+  connection.fd = -1;
+  connection.stage = Stage::kIdle;
+  connection.in_length = 0;
+  connection.route = nullptr;
+  connection.response.Reset(true);
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+// Small event-driven HTTP/1.1 server for the setup UI.
+//
+// One task runs everything from Poll(), which waits in select() until a socket
+// is ready (so the CPU idles in between) and then moves every connection along
+// without blocking on any of them. Up to kMaxConnections are served at once,
+// with keep-alive and pipelining, so the parallel requests of the UI do not
+// queue behind each other.
+//
+// Memory is fixed per connection: the request head has to fit kInBytes,
+// bodies are handed to the route in chunks as they arrive, and responses are
+// streamed from a file or static data through a kOutBytes buffer.
+//
+// Written against BSD sockets, which lwIP provides on the ESP32, so the same
+// code runs on the host (see sim_main.cpp --load-test).
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "hal.h"
+
+enum class HttpMethod { kGet, kPost, kOther };
+
+struct HttpRequest {
+  HttpMethod method = HttpMethod::kOther;
+  char path[64] = "";
+  char query[96] = "";
+  size_t content_length = 0;
+  bool keep_alive = true;
+  // The headers routes look at, cut short if longer.
+  char if_none_match[48] = "";
+  char accept_encoding[64] = "";
+  char authorization[80] = "";
+  // For the route's own use while the body comes in.
+  void *state = nullptr;
+
+  // Value of a query parameter, false if it is not there.
+  bool Query(const char *name, char *value, size_t size) const;
+};
+
+class HttpResponse {
+ public:
+  static constexpr size_t kOutBytes = 1536;
+
+  // Adds a header line to the response, call before Send*().
+  void AddHeader(const char *name, const char *value);
+  // Small bodies, copied.
+  void Send(int status, const char *content_type, const char *body = "");
+  // body must stay valid until sent, e.g. static data.
+  void SendStatic(int status, const char *content_type, const uint8_t *body,
+                  size_t length);
+  // Streams the whole file.
+  void SendFile(int status, const char *content_type, hal::File file);
+  // Runs once the response went out, e.g. to reboot after saying so.
+  void OnSent(void (*callback)()) { on_sent_ = callback; }
+
+  bool started() const { return started_; }
+
+ private:
+  friend class HttpServer;
+
+  void Reset(bool keep_alive);
+  bool WriteHead(int status, const char *content_type, size_t length);
+  // Fills out_ from the body source, false when everything is out.
+  bool Pending();
+
+  char headers_[160];
+  size_t headers_length_ = 0;
+  char out_[kOutBytes];
+  size_t out_length_ = 0;
+  size_t out_sent_ = 0;
+  const uint8_t *static_body_ = nullptr;
+  hal::File file_;
+  size_t body_left_ = 0;
+  bool keep_alive_ = true;
+  bool started_ = false;
+  void (*on_sent_)() = nullptr;
+};
+
+struct HttpRoute {
+  HttpMethod method;
+  const char *path;
+  // Called once the whole request (and body) is in.
+  void (*handle)(HttpRequest &request, HttpResponse &response);
+  // Optional, gets the body in chunks as it arrives. Called with nullptr
+  // if the connection goes away before the body is complete.
+  void (*body)(HttpRequest &request, const uint8_t *data, size_t size);
+};
+
+class HttpServer {
+ public:
+  static constexpr int kMaxConnections = 4;
+  static constexpr size_t kInBytes = 1024;
+  static constexpr int kMaxRoutes = 16;
+  // Keep-alive connections idle for this long are closed to free the slot.
+  static constexpr uint32_t kIdleTimeoutMs = 15000;
+
+  HttpServer() = default;
+  ~HttpServer();
+
+  // Routes must be added before Start(), paths match exactly.
+  bool On(const HttpRoute &route);
+  // From now on every request needs "Authorization: Bearer <token>", or gets
+  // a 401 before its route (or its body) sees it. An empty token lets nobody
+  // in, so does one too long to keep, which returns false. Without a call
+  // nothing is checked, as in setup mode.
+  bool RequireToken(const char *token);
+  // Listens on port (0 for any, see Port()).
+  bool Start(int port);
+  int Port() const { return port_; }
+  // Waits up to timeout_ms for something to do, then does it.
+  void Poll(int timeout_ms);
+
+ private:
+  enum class Stage { kIdle, kHead, kBody, kRespond };
+
+  struct Connection {
+    int fd = -1;
+    Stage stage = Stage::kIdle;
+    uint32_t last_active_ms = 0;
+    char in[kInBytes];
+    size_t in_length = 0;
+    size_t body_left = 0;
+    const HttpRoute *route = nullptr;
+    bool unauthorized = false;
+    HttpRequest request;
+    HttpResponse response;
+  };
+
+  void Accept();
+  void Read(Connection &connection);
+  void Write(Connection &connection);
+  // Runs the request state machine on what is in the input buffer.
+  void Process(Connection &connection);
+  bool ParseHead(Connection &connection, size_t head_length);
+  bool Authorized(const HttpRequest &request) const;
+  void Respond(Connection &connection);
+  void Close(Connection &connection);
+
+  HttpRoute routes_[kMaxRoutes];
+  int num_routes_ = 0;
+  bool token_required_ = false;
+  char token_[65] = "";
+  int listen_fd_ = -1;
+  int port_ = 0;
+  std::unique_ptr<Connection[]> connections_;
+};
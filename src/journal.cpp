@@ -0,0 +1,306 @@
+#include "journal.h"
+
+#include <algorithm>
+#include <string>
+
+#include "crc32.h"
+#include "logger.h"
+
+namespace {
+
+constexpr uint32_t kSegmentMagic = 0x314A4847;  // "GHJ1"
+constexpr uint16_t kRecordMagic = 0x5247;       // "GR"
+
+struct SegmentHeader {
+  uint32_t magic;
+  uint32_t sequence;  // Higher is newer.
+};
+
+// Followed by length bytes of payload and their CRC-32.
+struct RecordHeader {
+  uint16_t magic;
+  uint16_t length;
+};
+
+constexpr size_t RecordSize(size_t length) {
+  return sizeof(RecordHeader) + length + sizeof(uint32_t);
+}
+
+// Where CutTornTail() writes aside.
+std::string TempPath(const char *path) { return std::string(path) + ".tmp"; }
+
+}  // namespace
+
+Journal::Journal(const char *path_a, const char *path_b, size_t segment_bytes)
+    : segments_{{path_a}, {path_b}}, segment_bytes_(segment_bytes) {}
+
+void Journal::Scan() {
+  if (scanned_) {
+    return;
+  }
+  scanned_ = true;
+  const bool intact[2] = {ScanSegment(segments_[0]),
+                          ScanSegment(segments_[1])};
+  if (segments_[0].exists && segments_[1].exists) {
+    newer_ = segments_[1].sequence > segments_[0].sequence ? 1 : 0;
+  } else {
+    newer_ = segments_[1].exists ? 1 : 0;
+  }
+  appendable_ = segments_[newer_].exists && intact[newer_];
+  read_segment_ = segments_[Older()].exists ? Older() : newer_;
+  read_offset_ = sizeof(SegmentHeader);
+  read_records_ = 0;
+  LOG_INFO(kLogJournal, "Journal: %lu records pending\n",
+           static_cast<unsigned long>(Pending()));
+}
+
+bool Journal::ScanSegment(Segment &segment) {
+  segment.exists = false;
+  segment.size = 0;
+  segment.records = 0;
+  const std::string temp = TempPath(segment.path);
+  if (!hal::FsExists(segment.path) && hal::FsExists(temp.c_str())) {
+    // Reset between removing the torn segment and renaming its copy.
+    hal::FsRename(temp.c_str(), segment.path);
+  }
+  hal::File file = hal::File::Open(segment.path, "r");
+  if (!file) {
+    return true;
+  }
+  SegmentHeader header;
+  if (file.Read(&header, sizeof(header)) != sizeof(header) ||
+      header.magic != kSegmentMagic) {
+    file.Close();
+    hal::FsRemove(segment.path);
+    return true;
+  }
+  segment.exists = true;
+  segment.sequence = header.sequence;
+  segment.size = sizeof(header);
+
+  // Up to the first record that is cut short or does not check out.
+  RecordHeader record;
+  while (file.Read(&record, sizeof(record)) == sizeof(record) &&
+         record.magic == kRecordMagic &&
+         segment.size + RecordSize(record.length) <= segment_bytes_) {
+    uint8_t buffer[64];
+    uint32_t crc = 0;
+    size_t left = record.length;
+    while (left > 0) {
+      const size_t n = file.Read(buffer, std::min(left, sizeof(buffer)));
+      if (n == 0) {
+        break;
+      }
+      crc = Crc32(buffer, n, crc);
+      left -= n;
+    }
+    uint32_t stored_crc;
+    if (left > 0 || file.Read(&stored_crc, sizeof(stored_crc)) !=
+                        sizeof(stored_crc) ||
+        stored_crc != crc) {
+      break;
+    }
+    segment.size += RecordSize(record.length);
+    segment.records++;
+  }
+  const bool intact = segment.size == file.Size();
+  if (!intact) {
+    LOG_WARN(kLogJournal, "Journal: %s cut short at %u bytes\n", segment.path,
+             static_cast<unsigned>(segment.size));
+  }
+  return intact;
+}
+
+bool Journal::CutTornTail(Segment &segment) {
+  // Write aside and rename, the file system can not truncate.
+  const std::string temp = TempPath(segment.path);
+  hal::File from = hal::File::Open(segment.path, "r");
+  if (!from) {
+    return false;
+  }
+  hal::File to = hal::File::Open(temp.c_str(), "w");
+  bool copied = static_cast<bool>(to);
+  uint8_t buffer[64];
+  for (size_t left = segment.size; copied && left > 0;) {
+    const size_t n = from.Read(buffer, std::min(left, sizeof(buffer)));
+    copied = n > 0 && to.Write(buffer, n) == n;
+    left -= n;
+  }
+  from.Close();
+  to.Close();
+  if (!copied || !hal::FsRemove(segment.path)) {
+    hal::FsRemove(temp.c_str());
+    return false;
+  }
+  if (!hal::FsRename(temp.c_str(), segment.path)) {
+    return false;  // ScanSegment() takes the copy after a reboot.
+  }
+  LOG_INFO(kLogJournal, "Journal: cut %s back to %u bytes\n", segment.path,
+           static_cast<unsigned>(segment.size));
+  return true;
+}
+
+bool Journal::Rotate() {
+  int target = newer_;
+  if (segments_[newer_].exists) {
+    target = Older();
+    if (segments_[target].exists) {
+      const uint32_t lost = segments_[target].records -
+                            (read_segment_ == target ? read_records_ : 0);
+      evicted_ += lost;
+      LOG_WARN(kLogJournal, "Journal: full, dropping %lu oldest records\n",
+               static_cast<unsigned long>(lost));
+      Remove(target);
+    }
+    if (read_segment_ == target) {
+      read_segment_ = newer_;
+      read_offset_ = sizeof(SegmentHeader);
+      read_records_ = 0;
+    }
+  }
+  const Segment &other = segments_[1 - target];
+  const SegmentHeader header = {kSegmentMagic,
+                                other.exists ? other.sequence + 1 : 1};
+  hal::File file = hal::File::Open(segments_[target].path, "w");
+  if (!file || file.Write(&header, sizeof(header)) != sizeof(header)) {
+    return false;
+  }
+  file.Close();
+
+  Segment &segment = segments_[target];
+  segment.exists = true;
+  segment.sequence = header.sequence;
+  segment.size = sizeof(header);
+  segment.records = 0;
+  newer_ = target;
+  appendable_ = true;
+  return true;
+}
+
+void Journal::Remove(int segment) {
+  hal::FsRemove(segments_[segment].path);
+  segments_[segment].exists = false;
+  segments_[segment].size = 0;
+  segments_[segment].records = 0;
+}
+
+bool Journal::BeginAppend(size_t length) {
+  Scan();
+  if (length > UINT16_MAX ||
+      sizeof(SegmentHeader) + RecordSize(length) > segment_bytes_) {
+    return false;
+  }
+  Segment &current = segments_[newer_];
+  if (!appendable_ && current.exists) {
+    // A torn record at its end, rotating would evict the older segment while
+    // this one still has room.
+    appendable_ = CutTornTail(current);
+  }
+  if (!appendable_ || !current.exists ||
+      current.size + RecordSize(length) > segment_bytes_) {
+    if (!Rotate()) {
+      return false;
+    }
+  }
+  append_file_ = hal::File::Open(segments_[newer_].path, "a");
+  const RecordHeader record = {kRecordMagic, static_cast<uint16_t>(length)};
+  if (!append_file_ ||
+      append_file_.Write(&record, sizeof(record)) != sizeof(record)) {
+    append_file_.Close();
+    appendable_ = false;
+    return false;
+  }
+  append_length_ = append_left_ = length;
+  append_crc_ = 0;
+  return true;
+}
+
+size_t Journal::Write(const uint8_t *data, size_t size) {
+  size = std::min(size, append_left_);
+  const size_t written = append_file_ ? append_file_.Write(data, size) : 0;
+  append_crc_ = Crc32(data, written, append_crc_);
+  append_left_ -= written;
+  return written;
+}
+
+bool Journal::EndAppend() {
+  const bool complete =
+      append_file_ && append_left_ == 0 &&
+      append_file_.Write(&append_crc_, sizeof(append_crc_)) ==
+          sizeof(append_crc_);
+  append_file_.Close();
+  if (!complete) {
+    // The rest of the segment would be unreadable after this.
+    appendable_ = false;
+    return false;
+  }
+  segments_[newer_].size += RecordSize(append_length_);
+  segments_[newer_].records++;
+  return true;
+}
+
+bool Journal::Front(size_t &length) {
+  Scan();
+  while (true) {
+    const Segment &segment = segments_[read_segment_];
+    if (segment.exists && read_offset_ < segment.size) {
+      hal::File file = hal::File::Open(segment.path, "r");
+      RecordHeader record;
+      if (!file || !file.Seek(read_offset_) ||
+          file.Read(&record, sizeof(record)) != sizeof(record)) {
+        return false;
+      }
+      length = front_length_ = record.length;
+      return true;
+    }
+    if (read_segment_ != newer_) {
+      // Older segment replayed, the newer one is next.
+      Remove(read_segment_);
+      read_segment_ = newer_;
+      read_offset_ = sizeof(SegmentHeader);
+      read_records_ = 0;
+      continue;
+    }
+    if (segment.exists && segment.records > 0) {
+      // All replayed, make sure a reboot does not send it again.
+      Remove(read_segment_);
+      appendable_ = false;
+      read_offset_ = sizeof(SegmentHeader);
+      read_records_ = 0;
+    }
+    return false;
+  }
+}
+
+bool Journal::CopyFront(size_t (*write)(const uint8_t *data, size_t size)) {
+  hal::File file = hal::File::Open(segments_[read_segment_].path, "r");
+  if (!file || !file.Seek(read_offset_ + sizeof(RecordHeader))) {
+    return false;
+  }
+  uint8_t buffer[128];
+  size_t left = front_length_;
+  while (left > 0) {
+    const size_t n = file.Read(buffer, std::min(left, sizeof(buffer)));
+    if (n == 0 || write(buffer, n) != n) {
+      return false;
+    }
+    left -= n;
+  }
+  return true;
+}
+
+void Journal::PopFront() {
+  read_offset_ += RecordSize(front_length_);
+  read_records_++;
+}
+
+uint32_t Journal::Pending() {
+  Scan();
+  uint32_t pending = 0;
+  for (int i = 0; i < 2; ++i) {
+    if (segments_[i].exists) {
+      pending += segments_[i].records - (i == read_segment_ ? read_records_ : 0);
+    }
+  }
+  return pending;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "hal.h"
+
+// Append-only store-and-forward log of MQTT payloads on the flash file system,
+// for what we could not send while the broker was unreachable.
+//
+// Records go into two segment files used in turn. When the current one is full
+// the other one, holding the oldest records, is deleted and started over, so
+// the journal never exceeds two segments, evicts oldest first and flash is only
+// ever appended to or erased a whole segment at a time. Each record ends in a
+// CRC, a record torn by a reset while writing is dropped when the segments are
+// scanned at boot, and cut off before the next append goes after it.
+//
+// How far we got replaying is only kept in RAM, but a segment is deleted once
+// it is replayed, so a reboot sends at most one segment again.
+class Journal {
+ public:
+  Journal(const char *path_a, const char *path_b, size_t segment_bytes);
+
+  // Appends a record of exactly length bytes, given by Write() calls.
+  bool BeginAppend(size_t length);
+  size_t Write(const uint8_t *data, size_t size);
+  bool EndAppend();
+
+  // Length of the oldest record not replayed yet, false if there is none.
+  bool Front(size_t &length);
+  // Passes the front record to write() in chunks, true if all of it was taken.
+  // Stays at the front until PopFront().
+  bool CopyFront(size_t (*write)(const uint8_t *data, size_t size));
+  void PopFront();
+
+  // Records not replayed yet, and records lost to eviction since boot.
+  uint32_t Pending();
+  uint32_t Evicted() const { return evicted_; }
+
+ private:
+  struct Segment {
+    const char *path = nullptr;
+    bool exists = false;
+    uint32_t sequence = 0;
+    size_t size = 0;  // Up to the end of the last intact record.
+    uint32_t records = 0;
+  };
+
+  void Scan();
+  // False if the segment has a torn record at the end.
+  bool ScanSegment(Segment &segment);
+  // Rewrites segment without what follows its last intact record.
+  bool CutTornTail(Segment &segment);
+  // Deletes the older segment and starts a new one in its place.
+  bool Rotate();
+  void Remove(int segment);
+  int Older() const { return 1 - newer_; }
+
+  Segment segments_[2];
+  const size_t segment_bytes_;
+  bool scanned_ = false;
+  int newer_ = 0;
+  // Segment written to, false also after a torn record until it is cut off.
+  bool appendable_ = false;
+
+  int read_segment_ = 0;
+  size_t read_offset_ = 0;
+  uint32_t read_records_ = 0;  // Replayed from read_segment_.
+  size_t front_length_ = 0;
+
+  hal::File append_file_;
+  size_t append_length_ = 0;
+  size_t append_left_ = 0;
+  uint32_t append_crc_ = 0;
+
+  uint32_t evicted_ = 0;
+};
@@ -0,0 +1,420 @@
+#include "logger.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <strings.h>
+
+Logger logger;
+
+namespace {
+
+const char *const kModuleNames[kNumLogModules] = {
+    "main",   "wifi",    "ntp", "time", "mqtt", "pressure",
+    "config", "journal", "ota",
+};
+
+const char *const kLevelNames[] = {"error", "warn", "info", "debug"};
+
+// An argument read back from LogRecord::data.
+struct Arg {
+  uint8_t type = 0;
+  int64_t i = 0;
+  uint64_t u = 0;
+  double d = 0;
+  char s[LogRecord::kMaxStringBytes + 1] = "";
+
+  long long AsSigned() const {
+    return type == 'i' ? i : type == 'u' ? static_cast<long long>(u)
+                         : type == 'd' ? static_cast<long long>(d)
+                                       : 0;
+  }
+  unsigned long long AsUnsigned() const {
+    return type == 'u' ? u : type == 'i' ? static_cast<unsigned long long>(i)
+                         : type == 'd' ? static_cast<unsigned long long>(d)
+                                       : 0;
+  }
+  double AsDouble() const {
+    return type == 'd' ? d : type == 'i' ? i : type == 'u' ? u : 0;
+  }
+};
+
+bool ReadVarint(const uint8_t *&p, const uint8_t *end, uint64_t &value) {
+  value = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    const uint8_t byte = *p++;
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ReadArg(const uint8_t *&p, const uint8_t *end, Arg &arg) {
+  if (p >= end) {
+    return false;
+  }
+  arg.type = *p++;
+  uint64_t value;
+  switch (arg.type) {
+    case 'i':
+      if (!ReadVarint(p, end, value)) {
+        return false;
+      }
+      arg.i = static_cast<int64_t>(value >> 1) ^
+              -static_cast<int64_t>(value & 1);
+      return true;
+    case 'u':
+      return ReadVarint(p, end, arg.u);
+    case 'd':
+      if (end - p < 8) {
+        return false;
+      }
+      memcpy(&arg.d, p, 8);
+      p += 8;
+      return true;
+    case 's': {
+      if (p >= end || end - p - 1 < *p) {
+        return false;
+      }
+      const size_t length = *p++;
+      memcpy(arg.s, p, length);
+      arg.s[length] = '\0';
+      p += length;
+      return true;
+    }
+  }
+  return false;
+}
+
+void PutU32(uint8_t *p, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = value >> (8 * i);
+  }
+}
+
+uint32_t FormatId(const char *format) {
+  return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(format));
+}
+
+int ParseLevel(const char *name, size_t length) {
+  if (length == 1 && name[0] >= '1' && name[0] <= '4') {
+    return name[0] - '0';
+  }
+  for (int level = 0; level < 4; ++level) {
+    if (strlen(kLevelNames[level]) == length &&
+        !strncasecmp(name, kLevelNames[level], length)) {
+      return level + 1;
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+
+void LogRecord::AddVarint(uint8_t type, uint64_t value) {
+  uint8_t bytes[11];
+  size_t n = 0;
+  bytes[n++] = type;
+  do {
+    bytes[n] = value & 0x7f;
+    value >>= 7;
+    bytes[n++] |= value ? 0x80 : 0;
+  } while (value);
+  if (full || size + n > kDataBytes) {
+    full = true;
+    return;
+  }
+  memcpy(data + size, bytes, n);
+  size += n;
+}
+
+void LogRecord::AddSigned(int64_t value) {
+  // Zigzag, so small negative numbers stay small too.
+  AddVarint('i', static_cast<uint64_t>(value) << 1 ^
+                     static_cast<uint64_t>(value >> 63));
+}
+
+void LogRecord::AddUnsigned(uint64_t value) { AddVarint('u', value); }
+
+void LogRecord::Add(double value) {
+  if (full || kDataBytes - size < 9) {
+    full = true;
+    return;
+  }
+  data[size] = 'd';
+  memcpy(data + size + 1, &value, 8);
+  size += 9;
+}
+
+void LogRecord::Add(const char *value) {
+  if (!value) {
+    value = "(null)";
+  }
+  const size_t room = kDataBytes - size;
+  if (full || room < 2) {
+    full = true;
+    return;
+  }
+  const size_t length = std::min({strlen(value), kMaxStringBytes, room - 2});
+  data[size] = 's';
+  data[size + 1] = length;
+  memcpy(data + size + 2, value, length);
+  size += 2 + length;
+}
+
+Logger::Logger() {
+  for (uint8_t &level : levels_) {
+    level = LOG_LEVEL;
+  }
+}
+
+bool Logger::SetLevels(const char *levels) {
+  bool ok = true;
+  const char *p = levels ? levels : "";
+  while (*p) {
+    p += strspn(p, ", ");
+    const size_t length = strcspn(p, ", ");
+    if (length == 0) {
+      break;
+    }
+    const char *equals = static_cast<const char *>(memchr(p, '=', length));
+    const int level =
+        equals ? ParseLevel(equals + 1, p + length - equals - 1) : 0;
+    bool matched = false;
+    for (int module = 0; level && equals && module < kNumLogModules;
+         ++module) {
+      const size_t name_length = equals - p;
+      if ((name_length == 1 && *p == '*') ||
+          (strlen(kModuleNames[module]) == name_length &&
+           !strncasecmp(p, kModuleNames[module], name_length))) {
+        levels_[module] = level;
+        matched = true;
+      }
+    }
+    ok &= matched;
+    p += length;
+  }
+  return ok;
+}
+
+const char *Logger::ModuleName(LogModule module) {
+  return module < kNumLogModules ? kModuleNames[module] : "?";
+}
+
+void Logger::SetFile(const char *path, const char *old_path, size_t file_bytes,
+                     int file_level) {
+  file_path_ = path;
+  old_file_path_ = old_path;
+  file_bytes_ = file_bytes;
+  file_level_ = file_bytes ? file_level : 0;
+}
+
+uint32_t Logger::Dropped() const {
+  return dropped_[0].load(std::memory_order_relaxed) +
+         dropped_[1].load(std::memory_order_relaxed);
+}
+
+void Logger::Submit(const LogRecord &record) {
+  if (!deferred_) {
+    Emit(record);
+    file_.Close();
+    return;
+  }
+  const int core = hal::CurrentCore() & 1;
+  if (!rings_[core].Push(record)) {
+    dropped_[core].fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+bool Logger::Drain(size_t max_records, void (*line)(int level, LogModule module,
+                                                   const char *text)) {
+  const uint32_t dropped = Dropped();
+  if (dropped != dropped_reported_) {
+    const uint32_t count = dropped - dropped_reported_;
+    dropped_reported_ = dropped;
+    snprintf(text_, sizeof(text_), "LOG: %lu records dropped\n",
+             static_cast<unsigned long>(count));
+    Serial.print(text_);
+    if (file_level_ >= LOG_LEVEL_WARN && OpenFile()) {
+      uint8_t bytes[5] = {'L'};
+      PutU32(bytes + 1, count);
+      file_.Write(bytes, sizeof(bytes));
+    }
+  }
+
+  for (size_t n = 0; n < max_records; ++n) {
+    // Oldest first across both cores.
+    const LogRecord *front[2] = {rings_[0].Front(), rings_[1].Front()};
+    if (!front[0] && !front[1]) {
+      break;
+    }
+    const int ring =
+        !front[0] ? 1
+        : !front[1] ? 0
+                    : static_cast<int32_t>(front[1]->time_ms -
+                                           front[0]->time_ms) < 0;
+    LogRecord record;
+    rings_[ring].Pop(record);
+    Emit(record);
+    if (line) {
+      line(record.level, static_cast<LogModule>(record.module), text_);
+    }
+  }
+  file_.Close();
+  return rings_[0].Front() || rings_[1].Front();
+}
+
+void Logger::Emit(const LogRecord &record) {
+  Format(record, text_, sizeof(text_));
+  Serial.print(text_);
+  if (record.level <= file_level_) {
+    AppendToFile(record);
+  }
+}
+
+bool Logger::OpenFile() {
+  if (file_) {
+    return true;
+  }
+  file_ = hal::File::Open(file_path_, "a");
+  if (file_ && file_.Size() >= file_bytes_) {
+    // Start over, keeping the full one as the old one.
+    file_.Close();
+    hal::FsRemove(old_file_path_);
+    hal::FsRename(file_path_, old_file_path_);
+    file_ = hal::File::Open(file_path_, "a");
+  }
+  if (file_ && file_.Size() == 0) {
+    memset(known_ids_, 0, sizeof(known_ids_));
+  }
+  return static_cast<bool>(file_);
+}
+
+void Logger::AppendToFile(const LogRecord &record) {
+  if (!OpenFile()) {
+    return;
+  }
+  const uint32_t id = FormatId(record.format);
+  uint32_t &known = known_ids_[(id >> 2) % kKnownIds];
+  if (known != id) {
+    // Definitions of ids from before a reboot are simply repeated, the last
+    // one counts.
+    const char *name = ModuleName(static_cast<LogModule>(record.module));
+    const size_t name_length = strlen(name);
+    const size_t format_length =
+        std::min<size_t>(strlen(record.format), 0xffff);
+    uint8_t head[8] = {'F'};
+    PutU32(head + 1, id);
+    head[5] = name_length;
+    file_.Write(head, 6);
+    file_.Write(name, name_length);
+    head[0] = format_length & 0xff;
+    head[1] = format_length >> 8;
+    file_.Write(head, 2);
+    file_.Write(record.format, format_length);
+    known = id;
+  }
+  uint8_t head[11] = {'R'};
+  PutU32(head + 1, id);
+  PutU32(head + 5, record.time_ms);
+  head[9] = record.level;
+  head[10] = record.size;
+  file_.Write(head, sizeof(head));
+  file_.Write(record.data, record.size);
+}
+
+size_t Logger::Format(const LogRecord &record, char *text, size_t size) {
+  size_t length = 0;
+  auto append = [&](const char *s, size_t n) {
+    n = std::min(n, size - 1 - length);
+    memcpy(text + length, s, n);
+    length += n;
+  };
+  const uint8_t *args = record.data;
+  const uint8_t *const args_end = record.data + record.size;
+  const char *f = record.format;
+  while (*f && length + 1 < size) {
+    if (*f != '%') {
+      const size_t n = strcspn(f, "%");
+      append(f, n);
+      f += n;
+      continue;
+    }
+    if (f[1] == '%') {
+      append("%", 1);
+      f += 2;
+      continue;
+    }
+    // Flags, width and precision are kept, length modifiers dropped since
+    // arguments are stored at full width.
+    char spec[24] = "%";
+    size_t spec_length = 1;
+    const char *p = f + 1;
+    while (*p && strchr("-+ #0123456789.", *p) &&
+           spec_length < sizeof(spec) - 4) {
+      spec[spec_length++] = *p++;
+    }
+    p += strspn(p, "hlLqjzt");
+    const char conversion = *p;
+    if (!conversion) {
+      break;
+    }
+    f = p + 1;
+    Arg arg;
+    if (!ReadArg(args, args_end, arg)) {
+      append("?", 1);
+      continue;
+    }
+    char out[64];
+    int n = 0;
+    switch (conversion) {
+      case 'd':
+      case 'i':
+        memcpy(spec + spec_length, "lld", 4);
+        n = snprintf(out, sizeof(out), spec, arg.AsSigned());
+        break;
+      case 'u':
+      case 'x':
+      case 'X':
+      case 'o':
+        spec[spec_length++] = 'l';
+        spec[spec_length++] = 'l';
+        spec[spec_length++] = conversion;
+        spec[spec_length] = '\0';
+        n = snprintf(out, sizeof(out), spec, arg.AsUnsigned());
+        break;
+      case 'c':
+        memcpy(spec + spec_length, "c", 2);
+        n = snprintf(out, sizeof(out), spec, static_cast<int>(arg.AsSigned()));
+        break;
+      case 'f':
+      case 'F':
+      case 'e':
+      case 'E':
+      case 'g':
+      case 'G':
+        spec[spec_length++] = conversion;
+        spec[spec_length] = '\0';
+        n = snprintf(out, sizeof(out), spec, arg.AsDouble());
+        break;
+      case 's':
+        memcpy(spec + spec_length, "s", 2);
+        n = snprintf(out, sizeof(out), spec, arg.s);
+        break;
+      case 'p':
+        n = snprintf(out, sizeof(out), "0x%llx", arg.AsUnsigned());
+        break;
+      default:
+        append(spec, spec_length);
+        append(&conversion, 1);
+        break;
+    }
+    append(out, std::min<size_t>(std::max(n, 0), sizeof(out) - 1));
+  }
+  text[length] = '\0';
+  return length;
+}
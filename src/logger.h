@@ -0,0 +1,182 @@
+#pragma once
+
+// Logging that stays off the hot path.
+//
+// LOG_INFO(kLogNtp, "NTP: server %s\n", name) does not format anything: it
+// copies the format pointer (which is the message's id, format strings are
+// static) and the raw arguments into a fixed size record and pushes that into a
+// lock-free ring, one per core so each ring has a single producer. Drain(),
+// from a low priority task, formats the records and writes them out: the text
+// to Serial, records at or above the file level in binary to a log file, and
+// the text to an extra sink of the caller's (e.g. MQTT). A full ring drops the
+// record (and counts it) rather than wait, so logging never holds up the pump
+// or a pressure capture.
+//
+// Levels above LOG_LEVEL compile to nothing, and each module has its own level
+// on top, see SetLevels(). Until StartDeferred() every record is written out
+// right away, so setup() and the setup mode, which have no drain task, log as
+// usual.
+//
+// The binary log is a sequence of records, all numbers little endian:
+//   'F' u32 id, u8 length, module name, u16 length, format
+//     (once per id and file, before the first record using it)
+//   'R' u32 id, u32 Millis(), u8 level, u8 length, arguments
+//   'L' u32 records dropped since the last 'L'
+// where each argument is a type byte then 'i' signed zigzag varint, 'u'
+// unsigned varint, 'd' little endian double, 's' u8 length and the bytes.
+// decode_log.py turns it back into text.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "hal.h"
+#include "spsc_queue.h"
+
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_AT(level, module, ...)                \
+  do {                                            \
+    if ((level) <= LOG_LEVEL &&                   \
+        logger.Enabled((level), (module))) {      \
+      logger.Log((level), (module), __VA_ARGS__); \
+    }                                             \
+  } while (0)
+#define LOG_ERROR(module, ...) LOG_AT(LOG_LEVEL_ERROR, module, __VA_ARGS__)
+#define LOG_WARN(module, ...) LOG_AT(LOG_LEVEL_WARN, module, __VA_ARGS__)
+#define LOG_INFO(module, ...) LOG_AT(LOG_LEVEL_INFO, module, __VA_ARGS__)
+#define LOG_DEBUG(module, ...) LOG_AT(LOG_LEVEL_DEBUG, module, __VA_ARGS__)
+
+enum LogModule : uint8_t {
+  kLogMain,
+  kLogWifi,
+  kLogNtp,
+  kLogTime,
+  kLogMqtt,
+  kLogPressure,
+  kLogConfig,
+  kLogJournal,
+  kLogOta,
+  kNumLogModules
+};
+
+struct LogRecord {
+  static constexpr size_t kDataBytes = 80;
+  static constexpr size_t kMaxStringBytes = 48;
+
+  const char *format;
+  uint32_t time_ms;
+  uint8_t level;
+  uint8_t module;
+  uint8_t size;  // Of data used.
+  bool full;     // An argument did not fit, it and the rest are left out.
+  // Arguments as in the binary log, strings cut to kMaxStringBytes. Ones left
+  // out come out as "?".
+  uint8_t data[kDataBytes];
+
+  void Add(const char *value);
+  void Add(char *value) { Add(static_cast<const char *>(value)); }
+  void Add(double value);
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value ||
+                          std::is_enum<T>::value>::type
+  Add(T value) {
+    if (std::is_signed<T>::value) {
+      AddSigned(static_cast<int64_t>(value));
+    } else {
+      AddUnsigned(static_cast<uint64_t>(value));
+    }
+  }
+  void Add(const void *value) {
+    AddUnsigned(reinterpret_cast<uintptr_t>(value));
+  }
+
+ private:
+  void AddSigned(int64_t value);
+  void AddUnsigned(uint64_t value);
+  void AddVarint(uint8_t type, uint64_t value);
+};
+
+class Logger {
+ public:
+  static constexpr size_t kRingRecords = 64;  // Per core.
+  static constexpr size_t kMaxTextBytes = 192;
+
+  Logger();
+
+  bool Enabled(int level, LogModule module) const {
+    return level <= levels_[module];
+  }
+  // Module levels from a list like "ntp=debug,mqtt=warn", "*=warn" for all.
+  // Levels are error, warn, info and debug, or 1 to 4. False if any part made
+  // no sense, the rest is taken anyway.
+  bool SetLevels(const char *levels);
+  void SetLevel(LogModule module, int level) { levels_[module] = level; }
+  static const char *ModuleName(LogModule module);
+
+  template <typename... Args>
+  void Log(int level, LogModule module, const char *format,
+           const Args &...args) {
+    LogRecord record;
+    record.format = format;
+    record.time_ms = hal::Millis();
+    record.level = level;
+    record.module = module;
+    record.size = 0;
+    record.full = false;
+    (record.Add(args), ...);
+    Submit(record);
+  }
+
+  // From here on records wait for Drain().
+  void StartDeferred() { deferred_ = true; }
+  // Binary log of the records at file_level or more urgent, kept to two files
+  // of file_bytes (path and old_path), 0 for none. Before StartDeferred().
+  void SetFile(const char *path, const char *old_path, size_t file_bytes,
+               int file_level);
+
+  // Writes out up to max_records, oldest first, and passes each one's text to
+  // line() if given. Consumer side of the rings, call from one task only.
+  // True if there are more.
+  bool Drain(size_t max_records,
+             void (*line)(int level, LogModule module, const char *text));
+  uint32_t Dropped() const;
+
+  // The record's message, cut to size. Returns its length.
+  static size_t Format(const LogRecord &record, char *text, size_t size);
+
+ private:
+  using Ring = SpscQueue<LogRecord, kRingRecords>;
+
+  void Submit(const LogRecord &record);
+  // Writes a record out, leaves its text in text_.
+  void Emit(const LogRecord &record);
+  void AppendToFile(const LogRecord &record);
+  bool OpenFile();
+
+  uint8_t levels_[kNumLogModules];
+  bool deferred_ = false;
+  Ring rings_[2];
+  std::atomic<uint32_t> dropped_[2] = {};
+  uint32_t dropped_reported_ = 0;
+  char text_[kMaxTextBytes];
+
+  const char *file_path_ = nullptr;
+  const char *old_file_path_ = nullptr;
+  size_t file_bytes_ = 0;
+  int file_level_ = 0;
+  hal::File file_;
+  // Ids whose 'F' record is in the current file, a small hash set.
+  static constexpr size_t kKnownIds = 64;
+  uint32_t known_ids_[kKnownIds] = {};
+};
+
+extern Logger logger;
@@ -1,41 +1,169 @@
-#include <Arduino.h>
-#include <ESP32Time.h>           // fbiego/ESP32Time@^2.0.6
-#include <PubSubClient.h>        // knolleary/PubSubClient@^2.8
-#include <SimpleKalmanFilter.h>  //  denyssene/SimpleKalmanFilter@^0.1.0
-#include <WiFi.h>
-#include <esp_task_wdt.h>
+#include <ArduinoJson.h>
 #include <time.h>
-#include <vector>
 
-#include "setup_ui.h"
-#include "config.h"
-
-#include "NTP.h"  // sstaub/NTP@^1.6
-
-#define PUMP_CONTROL 14
-#define PUMP_CONTROL_2 15
-
-#define TANK_PRESSURE 33
-#define LED_RED 16
-#define LED_GREEN 17
-#define LED_BLUE 18
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
 
-#define SETUP_MODE_PIN 23  // Pull low on startup to enter setup.
+#include "clock_discipline.h"
+#include "config.h"
+#include "config_upload.h"
+#include "hal.h"
+#include "journal.h"
+#include "logger.h"
+#include "mqtt_client.h"
+#include "ota_update.h"
+#include "pins.h"
+#include "pressure_filter.h"
+#include "pump_schedule.h"
+#include "sample_batch.h"
+#include "scheduler.h"
+#include "seqlock.h"
+#include "setup_ui.h"
+#include "sntp_client.h"
+#include "spsc_queue.h"
+#include "task_metrics.h"
 
 // Low enough that if we crash on pumping enabled it's not a disaster.
 // (Pump enable crash observed in the wild, probably spike from relay)
 #define WATCHDOG_TIMEOUT_S (314) 
 
 #define MQTT_KEEPALIVE_SEC 47
-#define MQTT_UPDATE_USEC 10000LL
 #define MQTT_DO_PUBLISH 1
+// Live packets and the journal go out at QoS 1, in RAM until acked.
+#define MQTT_QOS 1
+// Raw pressure samples kept per publish window (one every ~517 ms), min/max/
+// mean cover the whole window even if it is longer.
+#define MQTT_BATCH_SAMPLES 256
+// Journal records handed to the client per poll, and only while this many
+// publishes or fewer are pending, so live data always finds room.
+#define MQTT_BACKFILL_PER_POLL 2
+#define MQTT_BACKFILL_MAX_PENDING (MqttClient::kWindow / 2)
+// A config published (retained) to "<topic>" MQTT_CONFIG_SUFFIX is saved and
+// hot reloaded, like one saved through the settings API.
+#define MQTT_CONFIG_SUFFIX "/config"
+// Firmware updates (see ota_update.h) come in on "<topic>" MQTT_OTA_SUFFIX, a
+// piece of the patch per message: its offset in the patch (u32, little
+// endian) and the bytes from there, offset 0 starts over. After each piece
+// the state and the offset to go on from are published (QoS 1) on
+// "<topic>" MQTT_OTA_SUFFIX "/status", see send_ota.py. Once the new image is
+// in and the broker has everything, we restart into it.
+#define MQTT_OTA_SUFFIX "/ota"
+// A new image is on trial until the broker acks a publish, and goes back to
+// the one before if that takes over OTA_TRIAL_S or OTA_TRIAL_BOOTS boots.
+#define OTA_TRIAL_BOOTS 3
+#define OTA_TRIAL_S 900
+
+#define CONFIG_SNAPSHOT_PATH "/config.bin"
+
+// The RTC drift ClockDiscipline learned is kept in NVS, so after a reboot NTP
+// polling can back off right away. Saved again when it moved by more than
+// NTP_DRIFT_SAVE_Q16 (0.5 ppm), and only once settled at a poll interval of
+// NTP_DRIFT_SAVE_POLL_S, which keeps it to a few flash writes a day at most.
+#define NTP_DRIFT_NVS_KEY "rtc_drift"
+#define NTP_DRIFT_SAVE_Q16 32768
+#define NTP_DRIFT_SAVE_POLL_S 1024
+// While an SNTP round is out, look for answers this often. The RTC time an
+// answer is read at is its receive timestamp, so this is the most that adds
+// to its delay (and half of it to its offset, which the min-delay filter
+// mostly picks out).
+#define NTP_ANSWER_POLL_MS 2
+// The access point, channel and addresses of the last WiFi connection are kept
+// in RTC memory (across restarts) and in NVS (across power cycles, only
+// written when they changed), and the next connect goes straight to them: no
+// channel scan and, with WIFI_REUSE_LEASE, no DHCP either. If that is not
+// connected within WIFI_FAST_CONNECT_MS, a full scan with DHCP follows and
+// gets WIFI_CONNECT_MS, then the two take turns. A reused lease is not renewed
+// with the router, so this relies on it giving the same address to the same
+// MAC again (most do, reservations always); a static IP in the config is used
+// on every connect instead.
+#define WIFI_LINK_NVS_KEY "wifi_link"
+#define WIFI_REUSE_LEASE 1
+#define WIFI_FAST_CONNECT_MS 1500
+#define WIFI_CONNECT_MS 8000
+#define WIFI_CONNECT_POLL_MS 50
+// Saving settings, metrics and the log are also served on the station interface
+// while running, to requests with the config's api.token, so settings can
+// change without the setup pin and a reboot.
+#define CONFIG_API_PORT 80
+
+// Run times and lateness of the tasks (see task_metrics.h), the loop rates and
+// the heap, over windows of METRICS_WINDOW_S. The last window goes out at QoS 0
+// on "<topic>" MQTT_METRICS_SUFFIX, in the configured encoding, and is served
+// as JSON at /api/metrics. The network side collects the control side's window
+// METRICS_COLLECT_MS after both closed theirs.
+#define METRICS_WINDOW_S 300
+#define METRICS_COLLECT_MS 1000
+#define MQTT_METRICS_SUFFIX "/metrics"
+
+// Log records (see logger.h) are formatted and written out by a low priority
+// network task, at most LOG_DRAIN_PER_RUN per run and at least every
+// LOG_DRAIN_MS, so a line shows up on Serial up to that late. Per module
+// levels below LOG_LEVEL as for Logger::SetLevels(), e.g. "ntp=debug".
+#define LOG_MODULE_LEVELS ""
+#define LOG_DRAIN_PER_RUN 8
+#define LOG_DRAIN_MS 1000
+// Warnings and errors also go to "<topic>" MQTT_LOG_SUFFIX as text (QoS 0),
+// and into a binary log on flash, served at /api/log (/api/log?old=1 for the
+// one before), see decode_log.py. Two files of LOG_FILE_BYTES.
+#define LOG_MQTT_LEVEL LOG_LEVEL_WARN
+#define MQTT_LOG_SUFFIX "/log"
+#define LOG_FILE_LEVEL LOG_LEVEL_WARN
+#define LOG_FILE_PATH "/log.bin"
+#define LOG_OLD_FILE_PATH "/log.old.bin"
+#define LOG_FILE_BYTES 4096
+
+// Store-and-forward journal for packets the broker did not get, two segments
+// of this size. SPIFFS is only 128K and needs a good part of it free to work
+// well, the rest is the configs and the log.
+#define JOURNAL_PATH_A "/journal0.bin"
+#define JOURNAL_PATH_B "/journal1.bin"
+#define JOURNAL_SEGMENT_BYTES 32768
+
+// Idle in light sleep until the next task deadline instead of delay(), with the
+// radio in modem sleep.
+#define TICKLESS_IDLE 1
+// Wake up and read the pressure right away if the raw reading moves this far
+// from the estimate while we sleep.
+#define PRESSURE_WAKE_DELTA 400
+
+// Pressure is captured by ADC DMA in bursts of whole mains periods, which
+// cancels the mains pickup, with the CPU free to light sleep in between.
+#define PRESSURE_READ_MS 500LL
+#define PRESSURE_ADC_HZ 24000  // Divides by both 50 and 60 Hz.
+#define PRESSURE_MAINS_HZ 50
+#define PRESSURE_CAPTURE_PERIODS 2
+// Smoothing of the period means (weight of a new one, 1/4), and a change
+// larger than this many counts is a real step and taken at once.
+#define PRESSURE_IIR_ALPHA_Q15 8192
+#define PRESSURE_STEP_COUNTS 24
+
+// The pump task sleeps until the next scheduled switch, but at most this long.
+#define PUMP_MAX_WAIT_MS 600000LL
+// Re-evaluate the pump when the clock is corrected by more than this.
+#define PUMP_RETIME_US 1000LL
+
+// Network tasks (WiFi, NTP, MQTT) run on core 0 next to the WiFi stack, the
+// control tasks (pump, pressure, time) in loop() on core 1, so a blocking
+// connect can not hold up a pump switch or a pressure capture. They only share
+// data through the lock-free queue and snapshots below.
+#define NETWORK_CORE 0
+#define NETWORK_STACK_BYTES 8192
+// Pressure estimates on their way to the network side, ~40 s worth.
+#define PRESSURE_QUEUE_SIZE 128
+// The network side is taken as stuck (and MQTT as down, see UpdateWatchdog) if
+// its status has not been updated for this long.
+#define NETWORK_STALE_MS 120000LL
 
 constexpr int64_t MAX_SLEEP_MS = 10000;
-constexpr int64_t MIN_SLEEP_MS = 50;
+constexpr int64_t MIN_SLEEP_MS = 50;  // Only without TICKLESS_IDLE.
+// Modem sleep keeps the connection, but we still need to be awake to send
+// something within the keep-alive.
+static_assert(MAX_SLEEP_MS < MQTT_KEEPALIVE_SEC * 1000 / 2,
+              "Sleep would break the MQTT keep-alive");
 // When calculating the next event, we allow the current call to be at most this
-// much in the past. This cutoff is necessary to prevent situations where some
-// events play catchup with realtime forever (next event always going into the
-// past despite max update rate).
+// much in the past (see Scheduler::Dispatch).
 constexpr int64_t MAX_BACKLOG_MS = 100;
 
 struct StateFlags {
@@ -45,44 +173,154 @@ struct StateFlags {
   bool pumping = false;
 };
 
-struct MqttPacket {
-  int32_t tank_pressure = 0;
+// Control side -> network side, latest values.
+struct ControlStatus {
+  int32_t tank_pressure = 0;  // Latest estimate.
   int32_t sec_to_next_pump = 0;
   int64_t rtc_offset_post_init = 0;
+  int32_t rtc_drift_ppm_q16 = 0;
+};
+
+// Control side -> network side, every estimate.
+struct PressureSample {
+  int64_t time_ms;
+  int32_t value;
+};
+
+// Network side -> control side, latest values.
+struct NetworkStatus {
+  bool wifi_ok;
+  bool ntp_ok;
+  bool mqtt_ok;
+  int64_t ntp_time;
+  int64_t rtc_at_ntp_time;
+  int32_t drift_ppm_q16;
+  int64_t updated_ms;  // RTC, 0 before the first update.
+};
+
+static Seqlock<ControlStatus> control_status;
+static Seqlock<NetworkStatus> network_status;
+static SpscQueue<PressureSample, PRESSURE_QUEUE_SIZE> pressure_queue;
+
+struct MqttPacket {
+  ControlStatus status;
+  // Estimates since the last publish.
+  SampleBatch<MQTT_BATCH_SAMPLES> pressure_batch;
 
   // Increment when data send is requested (some changes do not trigger).
   int64_t version = 0;
 };
 
-void WatchdogStart(int reset_timeout_s) {
-  // Configure to exevute panic = restart on timeout.
-  esp_task_wdt_init(reset_timeout_s, /*panic=*/true);
-  esp_task_wdt_add(nullptr);  // nullpr = this task.
-}
+int64_t EpochMs() { return hal::RtcMicros() / 1000; }
+
+void WatchdogStart(int reset_timeout_s) { hal::WatchdogStart(reset_timeout_s); }
+
+void WatchdogImAlive() { hal::WatchdogFeed(); }
+
+// Network side only.
+struct WifiState {
+  hal::WifiLink cached = {};  // Tried first, channel 0 if there is none.
+  hal::WifiLink saved = {};   // What NVS has.
+  bool loaded = false;
+  bool connecting = false;
+  bool fast = false;       // The connect going on uses the cached link.
+  bool skip_fast = false;  // The last one did and failed.
+  uint32_t connect_start_ms = 0;
+  // Of the connects so far, for the metrics.
+  uint32_t connects = 0;
+  uint32_t fast_connects = 0;
+  hal::WifiTimes last = {-1, -1};
+};
+static WifiState wifi_state;
 
-void WatchdogImAlive() { esp_task_wdt_reset(); }
+// Remembers where we are connected to for the next time.
+void SaveWifiLink(WifiState &s) {
+  hal::WifiLink link;
+  if (!hal::WifiGetLink(link)) {
+    return;
+  }
+  s.cached = link;
+  hal::RtcRetainedWrite(&link, sizeof(link));
+  if (memcmp(&link, &s.saved, sizeof(link)) != 0 &&
+      hal::NvsSetBytes(WIFI_LINK_NVS_KEY, &link, sizeof(link))) {
+    s.saved = link;
+  }
+}
 
 int64_t ConnectWifi(const Config::Wifi &wifi_config, bool &wifi_ok) {
-  static bool connect_announce = true;
-  wifi_ok = WiFi.status() == WL_CONNECTED;
+  WifiState &s = wifi_state;
+  if (!s.loaded) {
+    s.loaded = true;
+    hal::NvsGetBytes(WIFI_LINK_NVS_KEY, &s.saved, sizeof(s.saved));
+    s.cached = s.saved;
+    hal::RtcRetainedRead(&s.cached, sizeof(s.cached));
+  }
+
+  wifi_ok = hal::WifiConnected();
   if (wifi_ok) {
-    if (connect_announce) {
-      Serial.println("WIFI Connected :)");
-    } else {
-      Serial.println("WIFI ok");
+    if (!s.connecting) {
+      LOG_INFO(kLogWifi, "WIFI ok\n");
+      return 10000;  // Poll every 10s
     }
-    connect_announce = false;
-    return 10000;  // Poll every 10s
+    s.connecting = false;
+    s.skip_fast = false;
+    s.last = hal::WifiConnectTimes();
+    if (s.last.got_ip_ms < 0) {  // Its event is still on the way.
+      s.last.got_ip_ms = hal::Millis() - s.connect_start_ms;
+    }
+    s.connects++;
+    s.fast_connects += s.fast;
+    LOG_INFO(kLogWifi, "WIFI Connected :) %s, associated %ld ms, IP %ld ms\n",
+             s.fast ? "fast" : "after a scan",
+             static_cast<long>(s.last.associated_ms),
+             static_cast<long>(s.last.got_ip_ms));
+    SaveWifiLink(s);
+    return 10000;
   }
 
-  connect_announce = true;
-  Serial.printf("Try connecting to %s MAC %s state %d\n", wifi_config.ssid,
-                WiFi.macAddress().c_str(), WiFi.status());
+  if (!wifi_config.ssid || !wifi_config.ssid[0]) {
+    return 60000;  // No network configured, the device runs on its own.
+  }
+  if (s.connecting) {
+    const uint32_t waited_ms = hal::Millis() - s.connect_start_ms;
+    if (waited_ms < (s.fast ? WIFI_FAST_CONNECT_MS : WIFI_CONNECT_MS)) {
+      return WIFI_CONNECT_POLL_MS;
+    }
+    // A scan after a failed fast connect, then the cached link again, the
+    // access point may just have been away.
+    s.skip_fast = s.fast;
+  }
 
-  WiFi.disconnect();
-  WiFi.begin(wifi_config.ssid, wifi_config.password);
+  s.fast = s.cached.channel != 0 && !s.skip_fast;
+  hal::WifiLink link = {};
+  if (s.fast) {
+    link = s.cached;
+#if !WIFI_REUSE_LEASE
+    memset(link.ip, 0, sizeof(link.ip));
+#endif
+  }
+  if (wifi_config.ip[0] != 0) {
+    memcpy(link.ip, wifi_config.ip, sizeof(link.ip));
+    memcpy(link.gateway, wifi_config.gateway, sizeof(link.gateway));
+    memcpy(link.netmask, wifi_config.netmask, sizeof(link.netmask));
+    memcpy(link.dns, wifi_config.dns, sizeof(link.dns));
+  }
+  LOG_INFO(kLogWifi, "Try connecting to %s MAC %s state %d%s\n",
+           wifi_config.ssid, hal::WifiMacAddress(), hal::WifiStatusCode(),
+           s.fast ? " (cached link)" : "");
 
-  return 3000;  // Retry time
+  hal::WifiDisconnect();
+  hal::WifiBegin(wifi_config.ssid, wifi_config.password, link);
+  s.connecting = true;
+  s.connect_start_ms = hal::Millis();
+  return WIFI_CONNECT_POLL_MS;
+}
+
+// Of the WiFi connects so far, for the host simulation report.
+hal::WifiTimes LastWifiConnect(uint32_t &connects, uint32_t &fast_connects) {
+  connects = wifi_state.connects;
+  fast_connects = wifi_state.fast_connects;
+  return wifi_state.last;
 }
 
 // All times in usec since Epoch.
@@ -90,134 +328,420 @@ struct SysTime {
   int64_t best_time = 0;  // Our best estimate
   uint32_t micros_at_best_time =
       0;  // Be careful with unisgned and rollover (every ~70min)!
+  // Latest NTP answer and the RTC time it came in at.
   int64_t ntp_time = 0;
   int64_t rtc_at_ntp_time = 0;
+  int32_t drift_ppm_q16 = 0;  // Of the RTC, see ClockDiscipline.
+  int64_t rtc_offset = 0;  // best_time - RTC time
 };
 
-int64_t RtcMicros(ESP32Time *rtc) {
-  return rtc->getEpoch() * 1000000LL + rtc->getMicros();
-}
-
 int64_t BestMicros(const SysTime &sys_time) {
   // Unsigned dragons here: first take the uint32_t difference, which will
   // work even when micros wrapped, then the addition casts up to int64_t
-  return (micros() - sys_time.micros_at_best_time) + sys_time.best_time;
+  return (hal::Micros() - sys_time.micros_at_best_time) + sys_time.best_time;
 }
 
+// Formats epoch seconds like "%A %T" for logging.
+const char *FormatNtpTime(int64_t epoch_s) {
+  static char buffer[32];
+  time_t t = epoch_s;
+  strftime(buffer, sizeof(buffer), "%A %T", gmtime(&t));
+  return buffer;
+}
+
+static SntpClient sntp_client;
+
+// Runs an SNTP round whenever the clock discipline's poll interval is up and
+// feeds it what survived the sample filter.
 int64_t ConnectNtp(const Config::Ntp &ntp_config, const StateFlags &state_flags,
-                   bool &ntp_ok, SysTime &sys_time, ESP32Time *rtc) {
-  static WiFiUDP wifiUdp;
-  static NTP ntp(wifiUdp);
+                   bool &ntp_ok, ClockDiscipline &clock, SysTime &sys_time) {
+  static int32_t saved_drift_q16 = INT32_MIN;
+  if (saved_drift_q16 == INT32_MIN) {
+    int32_t drift_q16 = 0;
+    saved_drift_q16 = hal::NvsGetInt(NTP_DRIFT_NVS_KEY, drift_q16) ? drift_q16
+                                                                   : 0;
+    clock.SetDrift(saved_drift_q16);
+    sys_time.drift_ppm_q16 = clock.DriftPpmQ16();
+    LOG_INFO(kLogNtp, "NTP: RTC drift %.3f ppm from NVS\n",
+             drift_q16 / 65536.0);
+  }
+
   if (state_flags.wifi_ok && !ntp_ok) {
-    Serial.println("NTP connect attempt ");
-    ntp.begin(ntp_config.server);
+    LOG_INFO(kLogNtp, "NTP connect attempt\n");
+    sntp_client.Begin(ntp_config.server);
+    for (size_t i = 0; i < sntp_client.NumServers(); ++i) {
+      LOG_INFO(kLogNtp, "NTP: server %s\n", sntp_client.ServerName(i));
+    }
     ntp_ok = true;
-    return 1000;
+    return 0;
   } else if (!state_flags.wifi_ok) {
-    Serial.println("NTP no wifi ");
-    ntp.stop();
+    LOG_INFO(kLogNtp, "NTP no wifi\n");
+    sntp_client.Stop();
     ntp_ok = false;
     return 1000;
-  } else {
-    ntp.update();
-    const int64_t new_ntp_time = ntp.epoch() * 1000000LL;
-    if (new_ntp_time != sys_time.ntp_time) {
-      sys_time.ntp_time = new_ntp_time;
-      sys_time.rtc_at_ntp_time = RtcMicros(rtc);
-      Serial.print("NTP: @  ");
-      Serial.println(ntp.formattedTime("%A %T"));
-    } else {
-      Serial.print("NTP: Strange, did not change  - ignoring! @ ");
-      Serial.println(ntp.formattedTime("%A %T"));
+  }
+
+  if (!sntp_client.RoundRunning()) {
+    // Nothing goes out while the names are still being resolved.
+    return sntp_client.StartRound() ? NTP_ANSWER_POLL_MS : 1000;
+  }
+  if (!sntp_client.Poll()) {
+    return NTP_ANSWER_POLL_MS;
+  }
+  int64_t epoch_us = 0;
+  int64_t rtc_us = 0;
+  if (!sntp_client.Result(epoch_us, rtc_us)) {
+    LOG_INFO(kLogNtp,
+             "NTP: nothing new, %zu of %zu answered, %zu falsetickers\n",
+             sntp_client.Answers(), sntp_client.NumServers(),
+             sntp_client.Falsetickers());
+    return sntp_client.Answers() ? clock.PollIntervalS() * 1000LL
+                                 : ClockDiscipline::kMinPollS * 1000LL;
+  }
+  clock.AddSample(epoch_us, rtc_us);
+  sys_time.ntp_time = epoch_us;
+  sys_time.rtc_at_ntp_time = rtc_us;
+  sys_time.drift_ppm_q16 = clock.DriftPpmQ16();
+  LOG_INFO(kLogNtp, "NTP: @ %s delay %lld us, error %lld us, drift %.3f ppm, "
+           "%zu of %zu answered, %zu falsetickers, next in %ld s\n",
+           FormatNtpTime(epoch_us / 1000000LL),
+           sntp_client.ResultDelayUs(), clock.LastErrorUs(),
+           clock.DriftPpmQ16() / 65536.0, sntp_client.Answers(),
+           sntp_client.NumServers(), sntp_client.Falsetickers(),
+           static_cast<long>(clock.PollIntervalS()));
+  if (clock.PollIntervalS() >= NTP_DRIFT_SAVE_POLL_S &&
+      std::abs(clock.DriftPpmQ16() - saved_drift_q16) > NTP_DRIFT_SAVE_Q16) {
+    saved_drift_q16 = clock.DriftPpmQ16();
+    hal::NvsSetInt(NTP_DRIFT_NVS_KEY, saved_drift_q16);
+  }
+  return clock.PollIntervalS() * 1000LL;
+}
+
+static MqttClient mqtt_client;
+// Set once a new /config.json is in place, by the settings API or the MQTT
+// config topic. Both run on the network side, like ReloadConfig().
+static bool config_reload_requested = false;
+
+size_t MqttWrite(const uint8_t *data, size_t size) {
+  return mqtt_client.Write(data, size);
+}
+
+// ArduinoJson writer that goes straight into the open MQTT publish.
+struct MqttPayloadWriter {
+  size_t write(uint8_t c) { return MqttWrite(&c, 1); }
+  size_t write(const uint8_t *data, size_t size) {
+    return MqttWrite(data, size);
+  }
+};
+
+// Same for the record being appended to the journal.
+struct JournalWriter {
+  Journal &journal;
+  size_t write(uint8_t c) { return journal.Write(&c, 1); }
+  size_t write(const uint8_t *data, size_t size) {
+    return journal.Write(data, size);
+  }
+};
+
+void BuildPayload(const Config::Mqtt &mqtt_config, const MqttPacket &packet,
+                  JsonDocument &doc) {
+  const auto &batch = packet.pressure_batch;
+  JsonObject data = doc["data"].to<JsonObject>();
+  data["ping-count"] = packet.version;
+  data["tank-pressure"] =
+      batch.Count() ? batch.Last() : packet.status.tank_pressure;
+  data["sec-to-next-pump"] = packet.status.sec_to_next_pump;
+  data["rtc-offset-post-init"] = packet.status.rtc_offset_post_init;
+  data["rtc-drift-ppm"] = packet.status.rtc_drift_ppm_q16 / 65536.0;
+  if (batch.Count()) {
+    // When the last sample was taken, tells replayed batches apart.
+    data["time-ms"] = batch.At(batch.Size() - 1).time_ms;
+    data["tank-pressure-min"] = batch.Min();
+    data["tank-pressure-max"] = batch.Max();
+    data["tank-pressure-mean"] = batch.Mean();
+    data["sample-count"] = batch.Count();
+  }
+  if (mqtt_config.raw_samples && batch.Size()) {
+    // Times relative to the first, so they stay small.
+    const int64_t start_ms = batch.At(0).time_ms;
+    data["samples-start-ms"] = start_ms;
+    JsonArray times = data["samples-ms"].to<JsonArray>();
+    JsonArray values = data["samples"].to<JsonArray>();
+    for (size_t i = 0; i < batch.Size(); ++i) {
+      times.add(batch.At(i).time_ms - start_ms);
+      values.add(batch.At(i).value);
     }
-    return 20000;
   }
 }
 
+// Serializes twice, once to measure and once into the destination, which is
+// cheaper than holding the payload in RAM.
+template <typename Writer>
+size_t SerializePayload(const JsonDocument &doc, bool msgpack, Writer &writer) {
+  return msgpack ? serializeMsgPack(doc, writer) : serializeJson(doc, writer);
+}
+
+size_t MeasurePayload(const JsonDocument &doc, bool msgpack) {
+  return msgpack ? measureMsgPack(doc) : measureJson(doc);
+}
+
+bool PublishPacket(const Config::Mqtt &mqtt_config, const MqttPacket &packet) {
+  JsonDocument doc;
+  BuildPayload(mqtt_config, packet, doc);
+  const bool msgpack = mqtt_config.encoding == Config::MqttEncoding::kMsgPack;
+  const size_t length = MeasurePayload(doc, msgpack);
+  if (!mqtt_client.BeginPublish(mqtt_config.topic, length, MQTT_QOS)) {
+    return false;
+  }
+  MqttPayloadWriter writer;
+  const size_t written = SerializePayload(doc, msgpack, writer);
+  return mqtt_client.EndPublish() && written == length;
+}
+
+// Keeps the packet to publish later, it goes out byte for byte as it would
+// have now.
+bool JournalPacket(const Config::Mqtt &mqtt_config, const MqttPacket &packet,
+                   Journal &journal) {
+  JsonDocument doc;
+  BuildPayload(mqtt_config, packet, doc);
+  const bool msgpack = mqtt_config.encoding == Config::MqttEncoding::kMsgPack;
+  const size_t length = MeasurePayload(doc, msgpack);
+  if (!journal.BeginAppend(length)) {
+    return false;
+  }
+  JournalWriter writer{journal};
+  SerializePayload(doc, msgpack, writer);
+  return journal.EndAppend();
+}
+
+// Hands the oldest journal record to the client, false if there was none or
+// no room for it.
+bool ReplayJournal(const Config::Mqtt &mqtt_config, Journal &journal) {
+  size_t length;
+  if (!journal.Front(length) ||
+      !mqtt_client.BeginPublish(mqtt_config.topic, length, MQTT_QOS)) {
+    return false;
+  }
+  const bool copied = journal.CopyFront(MqttWrite);
+  if (!mqtt_client.EndPublish() || !copied) {
+    return false;
+  }
+  journal.PopFront();
+  return true;
+}
+
+// A config on the MQTT config topic, saved the way the settings API does.
+static ConfigUpload mqtt_config_upload("/config.mqtt.json");
+
+void MqttConfigBegin(size_t length) { mqtt_config_upload.Begin(length); }
+
+void MqttConfigData(const uint8_t *data, size_t size) {
+  mqtt_config_upload.Write(data, size);
+}
+
+void MqttConfigEnd(bool complete) {
+  if (!complete) {
+    mqtt_config_upload.Abort();
+    return;
+  }
+  switch (mqtt_config_upload.Commit()) {
+    case ConfigUpload::Result::kSaved:
+      LOG_INFO(kLogMqtt, "MQTT new config saved\n");
+      config_reload_requested = true;
+      break;
+    case ConfigUpload::Result::kUnchanged:
+      break;  // The retained one again, after a reconnect.
+    case ConfigUpload::Result::kInvalid:
+      LOG_WARN(kLogMqtt, "MQTT config invalid: %s\n",
+               mqtt_config_upload.Error());
+      break;
+    case ConfigUpload::Result::kTooLarge:
+      LOG_WARN(kLogMqtt, "MQTT config too large\n");
+      break;
+    case ConfigUpload::Result::kFailed:
+      LOG_WARN(kLogMqtt, "MQTT config not saved, file system\n");
+      break;
+  }
+}
+
+// A patch on the MQTT OTA topic, see MQTT_OTA_SUFFIX.
+static DeltaPatch mqtt_ota;
+static OtaTrial ota_trial;
+static uint8_t mqtt_ota_offset[4];
+static size_t mqtt_ota_offset_read = 0;
+static bool mqtt_ota_take = false;  // The message is the next piece.
+static bool mqtt_ota_report = false;  // Status to publish.
+
+void MqttOtaBegin(size_t length) {
+  mqtt_ota_offset_read = 0;
+  mqtt_ota_take = false;
+}
+
+void MqttOtaData(const uint8_t *data, size_t size) {
+  for (; size > 0 && mqtt_ota_offset_read < sizeof(mqtt_ota_offset); --size) {
+    mqtt_ota_offset[mqtt_ota_offset_read++] = *data++;
+    if (mqtt_ota_offset_read < sizeof(mqtt_ota_offset)) {
+      continue;
+    }
+    const uint32_t offset =
+        mqtt_ota_offset[0] | mqtt_ota_offset[1] << 8 |
+        mqtt_ota_offset[2] << 16 |
+        static_cast<uint32_t>(mqtt_ota_offset[3]) << 24;
+    if (offset == 0) {
+      mqtt_ota.Begin();
+    }
+    // Anything else is a repeat, or came after one that got lost. The sender
+    // goes on from the offset in the status either way.
+    mqtt_ota_take = mqtt_ota.status() == DeltaPatch::Status::kReceiving &&
+                    offset == mqtt_ota.Received();
+  }
+  if (mqtt_ota_take && size > 0) {
+    mqtt_ota.Write(data, size);
+  }
+}
+
+void MqttOtaEnd(bool complete) { mqtt_ota_report = true; }
+
+bool PublishOtaStatus(const Config::Mqtt &mqtt_config) {
+  static const char *const kStates[] = {"idle", "receiving", "done", "failed"};
+  char topic[128];
+  snprintf(topic, sizeof(topic), "%s" MQTT_OTA_SUFFIX "/status",
+           mqtt_config.topic);
+  char payload[128];
+  const int length = snprintf(
+      payload, sizeof(payload),
+      "{\"state\":\"%s\",\"offset\":%lu,\"error\":\"%s\"}",
+      kStates[static_cast<int>(mqtt_ota.status())],
+      static_cast<unsigned long>(mqtt_ota.Received()), mqtt_ota.Error());
+  if (!mqtt_client.BeginPublish(topic, length, MQTT_QOS)) {
+    return false;
+  }
+  mqtt_client.Write(reinterpret_cast<const uint8_t *>(payload), length);
+  return mqtt_client.EndPublish();
+}
+
+static char mqtt_log_topic[128];
+
+// Log lines at LOG_MQTT_LEVEL or more urgent, while connected. Lost if the
+// client has no room.
+void PublishLogLine(int level, LogModule module, const char *text) {
+  if (level > LOG_MQTT_LEVEL || !mqtt_client.Connected() || !MQTT_DO_PUBLISH) {
+    return;
+  }
+  const size_t length = strlen(text);
+  if (mqtt_client.BeginPublish(mqtt_log_topic, length, 0)) {
+    mqtt_client.Write(reinterpret_cast<const uint8_t *>(text), length);
+    mqtt_client.EndPublish();
+  }
+}
+
+// Points the client at the config, again after every reload (it keeps the
+// string pointers).
+void ConfigureMqttClient(const Config::Mqtt &mqtt_config) {
+  static char config_topic[128];
+  static char ota_topic[128];
+  mqtt_client.SetServer(mqtt_config.broker, mqtt_config.port);
+  mqtt_client.SetCredentials(mqtt_config.device_id, mqtt_config.user,
+                             mqtt_config.password);
+  mqtt_client.SetKeepAlive(MQTT_KEEPALIVE_SEC);
+  snprintf(config_topic, sizeof(config_topic), "%s" MQTT_CONFIG_SUFFIX,
+           mqtt_config.topic);
+  snprintf(mqtt_log_topic, sizeof(mqtt_log_topic), "%s" MQTT_LOG_SUFFIX,
+           mqtt_config.topic);
+  snprintf(ota_topic, sizeof(ota_topic), "%s" MQTT_OTA_SUFFIX,
+           mqtt_config.topic);
+  mqtt_client.Subscribe(config_topic,
+                        {MqttConfigBegin, MqttConfigData, MqttConfigEnd});
+  mqtt_client.Subscribe(ota_topic, {MqttOtaBegin, MqttOtaData, MqttOtaEnd});
+}
+
 int64_t UpdateMqtt(const Config::Mqtt &mqtt_config,
                    const StateFlags &state_flags, bool &mqtt_ok,
-                   const MqttPacket &packet) {
-  static bool connect_announce = true;
-  static int is_connected_polls_left = 0;
-  static int publish_failure_count = 0;
-  static int64_t sent_version = 0;
-
-  static WiFiClient wifiClient;
-  static PubSubClient client(mqtt_config.broker, mqtt_config.port, wifiClient);
-  static char message[2048];  // TODO: send buffer in client is 256
-
-  if (packet.version <= sent_version) {
-    // No new data yet.
-    return 100;
-  }
-
-  if (!state_flags.wifi_ok) {
-    client.disconnect();
-    mqtt_ok = false;
-    is_connected_polls_left = 0;
-    Serial.println("MQTT no wifi");
-    return 1000;
-  } else if (state_flags.wifi_ok && !mqtt_ok && is_connected_polls_left < 1) {
-    Serial.printf("MQTT connect attempt for packet %lld -> %lld\n",
-                  sent_version, packet.version);
-    client.disconnect();  // Just to be sure
-    client.setKeepAlive(MQTT_KEEPALIVE_SEC);
-    client.connect(mqtt_config.device_id, mqtt_config.user,
-                   mqtt_config.password);
-    client.setBufferSize(512);
-    is_connected_polls_left = 100;
-    return 500;
-  } else if (state_flags.wifi_ok && !mqtt_ok && is_connected_polls_left > 0) {
-    bool old_mqtt_ok = mqtt_ok;
-    mqtt_ok = client.connected();
-    if (is_connected_polls_left < 20) {
-      Serial.printf("MQTT connected polls left %ld old_ok=%d ok=%d\n",
-                    is_connected_polls_left, old_mqtt_ok, mqtt_ok);
+                   MqttPacket &packet) {
+  static Journal journal(JOURNAL_PATH_A, JOURNAL_PATH_B, JOURNAL_SEGMENT_BYTES);
+  static int64_t window_end_ms = 0;
+  static bool client_init = false;
+
+  if (!client_init) {
+    ConfigureMqttClient(mqtt_config);
+    client_init = true;
+  }
+
+  const int64_t window_ms = mqtt_config.publish_window_s * 1000LL;
+  const int64_t now_ms = hal::RtcMicros() / 1000;
+  if (window_end_ms == 0) {
+    window_end_ms = now_ms + window_ms;
+  }
+
+  int64_t next_ms = 1000;
+  if (state_flags.wifi_ok) {
+    mqtt_client.Start(now_ms);
+    next_ms = mqtt_client.Poll(now_ms);
+  } else {
+    if (mqtt_ok) {
+      LOG_INFO(kLogMqtt, "MQTT no wifi\n");
     }
-    is_connected_polls_left = mqtt_ok ? 0 : is_connected_polls_left - 1;
-    return 500;
-  } else if (state_flags.wifi_ok && mqtt_ok) {
-    bool old_mqtt_ok = mqtt_ok;
-    mqtt_ok = client.connected();
-    if (!mqtt_ok) {
-      is_connected_polls_left = 0;
-      Serial.printf("MQTT disconnected %d -> %d\n", old_mqtt_ok, mqtt_ok);
-      return 5000;  // Retry in 5s
+    mqtt_client.Stop();
+  }
+  mqtt_ok = mqtt_client.Connected();
+
+  if (now_ms >= window_end_ms) {
+    if (packet.pressure_batch.Count()) {
+      // Into the client if it is connected and has room, otherwise keep it in
+      // the journal for later.
+      bool queued = false;
+      if (mqtt_ok && MQTT_DO_PUBLISH) {
+        LOG_INFO(kLogMqtt, "MQTT sending %lld\n", packet.version);
+        queued = PublishPacket(mqtt_config, packet);
+      } else if (mqtt_ok) {
+        LOG_INFO(kLogMqtt, "MQTT FAKE sending %lld\n", packet.version);
+        queued = true;
+      }
+      if (!queued && !JournalPacket(mqtt_config, packet, journal)) {
+        LOG_WARN(kLogMqtt, "MQTT failed to journal packet\n");
+      }
+      // Get it on its way right away.
+      next_ms = std::min<int64_t>(next_ms, mqtt_client.Poll(now_ms));
     }
-    bool success = false;
-    if (MQTT_DO_PUBLISH) {
-      Serial.printf("MQTT sending %lld\n", packet.version);
-      snprintf(message, sizeof(message),
-               R"({ 
-  "data": { 
-    "ping-count": %lld, 
-    "tank-pressure": %ld,
-    "sec-to-next-pump": %ld,
-    "rtc-offset-post-init": %lld
-  } 
-  })",
-               packet.version, packet.tank_pressure, packet.sec_to_next_pump,
-               packet.rtc_offset_post_init);
-      success = client.publish(mqtt_config.topic, message);
-    } else {
-      Serial.printf("MQTT FAKE sending %lld\n", packet.version);
-      success = true;
+    packet.pressure_batch.Clear();
+    window_end_ms = std::max(window_end_ms + window_ms, now_ms + 1);
+  }
+
+  if (mqtt_ok) {
+    // Catch up on what the journal holds, pipelined, but leaving room for
+    // the live data.
+    for (int i = 0; i < MQTT_BACKFILL_PER_POLL &&
+                    mqtt_client.Pending() < MQTT_BACKFILL_MAX_PENDING &&
+                    ReplayJournal(mqtt_config, journal);
+         ++i) {
+      next_ms = std::min<int64_t>(next_ms, mqtt_client.Poll(now_ms));
     }
-    sent_version = packet.version;
-    publish_failure_count = success ? 0 : publish_failure_count + 1;
-    if (publish_failure_count > 10) {
-      Serial.printf("MQTT subsequent publish failures\n");
-      publish_failure_count = 0;
-      is_connected_polls_left = 0;
-      mqtt_ok = false;
-      return 5000;
+    if (mqtt_ota_report && PublishOtaStatus(mqtt_config)) {
+      mqtt_ota_report = false;
+      next_ms = std::min<int64_t>(next_ms, mqtt_client.Poll(now_ms));
     }
-    return MQTT_UPDATE_USEC;
   }
 
-  Serial.printf("MQTT bad state %d,%d,%d\n", state_flags.wifi_ok, mqtt_ok,
-                is_connected_polls_left);
-  return 1000;
+  if (ota_trial.Running()) {
+    if (mqtt_client.Acked() > 0) {
+      ota_trial.Pass();
+    } else if (hal::Millis() / 1000 > OTA_TRIAL_S) {
+      // Straight out, the log would not be drained before the restart.
+      Serial.println("OTA: no MQTT ack on trial, rolling back");
+      ota_trial.Fail();
+    }
+  }
+  // Into the new image once the broker has the status and everything before
+  // it. What the window has so far waits in the journal.
+  if (mqtt_ota.status() == DeltaPatch::Status::kDone && !mqtt_ota_report &&
+      mqtt_client.Pending() == 0) {
+    if (packet.pressure_batch.Count()) {
+      JournalPacket(mqtt_config, packet, journal);
+    }
+    Serial.println("OTA: restarting into the new image");
+    hal::Restart();
+  }
+  return std::max<int64_t>(1, std::min(next_ms, window_end_ms - now_ms));
 }
 
 int64_t UpdateLeds(const StateFlags &state_flags) {
@@ -238,31 +762,70 @@ int64_t UpdateLeds(const StateFlags &state_flags) {
   if (blink && !is_blink) {
     led = -1;
   }
-  digitalWrite(LED_RED, led == 0);
-  digitalWrite(LED_GREEN, led == 1);
-  digitalWrite(LED_BLUE, led == 2);
+  hal::DigitalWrite(LED_RED, led == 0);
+  hal::DigitalWrite(LED_GREEN, led == 1);
+  hal::DigitalWrite(LED_BLUE, led == 2);
 
   is_blink = !is_blink;
   return 250L;
 }
 
-int64_t ReadTankPressure(MqttPacket &packet) {
+int64_t ReadTankPressure(const SysTime &sys_time, ControlStatus &status) {
+  constexpr uint32_t kSamplesPerPeriod = PRESSURE_ADC_HZ / PRESSURE_MAINS_HZ;
+  static_assert(PRESSURE_ADC_HZ % PRESSURE_MAINS_HZ == 0,
+                "Integrating whole mains periods needs whole samples");
+  // Whole periods plus slack for the DMA to hand over its last frame.
+  constexpr int64_t kCaptureMs =
+      PRESSURE_CAPTURE_PERIODS * 1000 / PRESSURE_MAINS_HZ + 10;
+  static MainsIntegrator integrator(kSamplesPerPeriod);
+  static StepIir filter(PRESSURE_IIR_ALPHA_Q15, PRESSURE_STEP_COUNTS * 16);
+  static bool capturing = false;
   static int debug_print_count = 0;
-  static SimpleKalmanFilter pressureKalmanFilter(100, 100, 0.1);
-  int tank_pressure_raw = analogRead(TANK_PRESSURE);
-  int estimated_pressure = static_cast<int>(
-      pressureKalmanFilter.updateEstimate(tank_pressure_raw) + 0.5);
-  packet.tank_pressure = estimated_pressure;
-  packet.version++;
+  static uint32_t dropped = 0;
+
+  if (!capturing) {
+    capturing = hal::AdcStreamStart(TANK_PRESSURE, PRESSURE_ADC_HZ);
+    if (capturing) {
+      integrator.Reset();
+      return kCaptureMs;
+    }
+  }
+
+  int periods = 0;
+  if (capturing) {
+    uint16_t block[256];
+    int32_t means_q4[4];
+    size_t n;
+    while ((n = hal::AdcStreamRead(block, 256)) > 0) {
+      const size_t produced = integrator.Process(block, n, means_q4, 4);
+      for (size_t i = 0; i < produced; ++i) {
+        filter.Update(means_q4[i]);
+      }
+      periods += produced;
+    }
+    hal::AdcStreamStop();
+    capturing = false;
+  } else {
+    // No DMA, take a single (noisy) sample rather than nothing.
+    filter.Update(hal::AnalogRead(TANK_PRESSURE) * 16);
+    periods = 1;
+  }
+
+  const int estimated_pressure = RoundQ4(filter.Estimate());
+  status.tank_pressure = estimated_pressure;
+  if (!pressure_queue.Push({BestMicros(sys_time) / 1000, estimated_pressure})) {
+    dropped++;  // Network side stuck, it is only missing from the batch.
+  }
   if ((debug_print_count++) % 4 == 0) {
-    Serial.printf("READ pressure %ld (raw %ld) @ %lld\n", packet.tank_pressure,
-                  tank_pressure_raw, packet.version);
+    LOG_INFO(kLogPressure, "READ pressure %ld (%d periods) dropped %lu\n",
+             status.tank_pressure, periods,
+             static_cast<unsigned long>(dropped));
   }
-  return 517LL;  // few ms extra to try to catch cancelling 50hz noise
+  return PRESSURE_READ_MS - (periods > 0 ? kCaptureMs : 0);
 }
 
 int64_t TimeKeeper(const StateFlags &state_flags, SysTime &sys_time,
-                   MqttPacket &mqtt, ESP32Time *rtc) {
+                   ControlStatus &status) {
   constexpr int64_t kMaxAdjustRateUsPerS = 100000LL;  // 10 % = 100000
   static int initial_loops = 4;
   static int64_t initial_rtc_offset = 0;
@@ -270,22 +833,26 @@ int64_t TimeKeeper(const StateFlags &state_flags, SysTime &sys_time,
   static int64_t previous_offset;
   static int64_t previous_offset_calc_time_rtc;
 
-  int64_t rtc_time = RtcMicros(rtc);
+  int64_t rtc_time = hal::RtcMicros();
   sys_time.best_time = rtc_time + rtc_offset;
-  sys_time.micros_at_best_time = micros();
+  sys_time.rtc_offset = rtc_offset;
+  sys_time.micros_at_best_time = hal::Micros();
 
-  if (!state_flags.ntp_ok) {
+  if (sys_time.rtc_at_ntp_time == 0) {
     return 1000;  // No ntp, no can adjust.
   }
 
-  // Update rtc offset using NTP
-  int64_t new_offset = sys_time.ntp_time - sys_time.rtc_at_ntp_time;
-  const int64_t rtc_now = RtcMicros(rtc);
+  // Update rtc offset using the last NTP answer and the drift since, which
+  // also keeps the clock right while NTP is down.
+  const int64_t rtc_now = hal::RtcMicros();
+  int64_t new_offset =
+      sys_time.ntp_time - sys_time.rtc_at_ntp_time -
+      DriftMicros(rtc_now - sys_time.rtc_at_ntp_time, sys_time.drift_ppm_q16);
   if (initial_rtc_offset == 0LL || initial_loops-- > 0) {
     rtc_offset = previous_offset = initial_rtc_offset = new_offset;
     previous_offset_calc_time_rtc = rtc_now;
-    Serial.printf("TIME: Initial offset is %.6f (%lld)\n",
-                  initial_rtc_offset / 1e6L, initial_rtc_offset);
+    LOG_INFO(kLogTime, "TIME: Initial offset is %.6f (%lld)\n",
+             initial_rtc_offset / 1e6L, initial_rtc_offset);
   } else {
     // int64 (1e18) has enough range here for 1e3s * 1e6 us/s * 1e6 adjust
     int64_t max_adjust =
@@ -296,61 +863,45 @@ int64_t TimeKeeper(const StateFlags &state_flags, SysTime &sys_time,
     previous_offset = rtc_offset;
     previous_offset_calc_time_rtc = rtc_now;
     rtc_offset = new_offset;
-    Serial.printf("TIME: Adjusted offset initial+ %.6f (%lld)\n",
-                  (rtc_offset - initial_rtc_offset) / 1e6L, rtc_offset);
+    LOG_INFO(kLogTime, "TIME: Adjusted offset initial+ %.6f (%lld)\n",
+             (rtc_offset - initial_rtc_offset) / 1e6L, rtc_offset);
   }
 
-  mqtt.rtc_offset_post_init = rtc_offset - initial_rtc_offset;
+  status.rtc_offset_post_init = rtc_offset - initial_rtc_offset;
+  status.rtc_drift_ppm_q16 = sys_time.drift_ppm_q16;
   return 5000;  // ZZZ more in final.
 }
 
-int64_t PumpControl(const Config::Schedule &schedule, bool &state_pumping,
-                    const SysTime &sys_time, MqttPacket &mqtt_packet) {
-  time_t best_time_s = BestMicros(sys_time) / 1000000LL;
-  tm *dt = gmtime(&best_time_s);
-
-  int time_of_day_s =
-      Config::SafeHMSToSecondOfUtcDay(dt->tm_hour, dt->tm_min, dt->tm_sec);
-
-  int min_next_s = 100000;
-  bool active = false;
-  for (int i_index = 0; i_index < schedule.interval_count; i_index++) {
-    const Config::Schedule::Interval &i = schedule.intervals[i_index];
-    // Are we in the interval with ascending start to end ?
-    bool in_asc_interval = std::min(i.start_sec, i.end_sec) <= time_of_day_s &&
-                           time_of_day_s < std::max(i.start_sec, i.end_sec);
-    // Active if in interval, or complement if start < end (interval crosses
-    // 24h).
-    active |= (i.start_sec <= i.end_sec ? in_asc_interval : !in_asc_interval);
-    // Serial.printf("PUMP: Check %d < %d < %d in int %d act = %d ?\n",
-    //               i.start_sec, time_of_day_s, i.end_sec,
-    //               (int)in_asc_interval, (int)active);
-    int start_dist_s = (i.start_sec - time_of_day_s + 86400) % 86400;
-    min_next_s = std::min(min_next_s, start_dist_s);
-  }
+int64_t PumpControl(const PumpSchedule &schedule, bool &state_pumping,
+                    const SysTime &sys_time, ControlStatus &status) {
+  const PumpSchedule::State state =
+      schedule.At(PumpSchedule::MsOfWeek(BestMicros(sys_time) / 1000));
 
-  digitalWrite(PUMP_CONTROL, active);
-  digitalWrite(PUMP_CONTROL_2, active);
-  state_pumping = active;
+  hal::DigitalWrite(PUMP_CONTROL, state.on);
+  hal::DigitalWrite(PUMP_CONTROL_2, state.on);
+  state_pumping = state.on;
 
-  mqtt_packet.sec_to_next_pump = active ? 0 : min_next_s;
+  status.sec_to_next_pump = state.on ? 0 : state.ms_to_next / 1000;
 
-  return 500;
+  // Wake up right at the next switch. The cap is just in case, TimeKeeper
+  // moving the clock also makes us due (see LoopContext::pump_rtc_offset).
+  return std::min<int64_t>(state.ms_to_next, PUMP_MAX_WAIT_MS);
 }
 
-int64_t UpdateSerial(const SysTime &sys_time, ESP32Time *rtc) {
+int64_t UpdateSerial(const SysTime &sys_time) {
   // Serial.print(rtc->getTime("SERIAL: RTC=%Y-%m-%d %H:%M:%S"));
   // Serial.printf(".%03d\n", rtc->getMillis());
 
-  Serial.printf("SERIAL: SysTime{best=%lld,ntp=%lld,rtc@ntp=%lld}\n",
-                sys_time.best_time, sys_time.ntp_time,
-                sys_time.rtc_at_ntp_time);
+  LOG_INFO(kLogTime, "SERIAL: SysTime{best=%lld,ntp=%lld,rtc@ntp=%lld}\n",
+           sys_time.best_time, sys_time.ntp_time,
+           sys_time.rtc_at_ntp_time);
 
   time_t best_epoch = sys_time.best_time / 1000000LL;
   tm *dt = gmtime(&best_epoch);
-  Serial.printf("SERIAL: BestTime %04ld-%02ld-%02ld %02ld:%02ld:%02ld.%06lld\n",
-                dt->tm_year + 1900L, dt->tm_mon + 1L, dt->tm_mday, dt->tm_hour,
-                dt->tm_min, dt->tm_sec, sys_time.best_time % 1000000LL);
+  LOG_INFO(kLogTime,
+           "SERIAL: BestTime %04ld-%02ld-%02ld %02ld:%02ld:%02ld.%06lld\n",
+           dt->tm_year + 1900L, dt->tm_mon + 1L, dt->tm_mday, dt->tm_hour,
+           dt->tm_min, dt->tm_sec, sys_time.best_time % 1000000LL);
 
   return 5000L;
 }
@@ -363,7 +914,7 @@ int64_t UpdateWatchdog(const StateFlags &state_flags) {
   constexpr uint32_t kMaxTimeSinceMqttAliveMs = (11 * 3600 + 3117) * 1000L;
 
   static uint32_t mqtt_seen_alive_ms = -1L;
-  const uint32_t now = millis();
+  const uint32_t now = hal::Millis();
   // Note: technically this means we can ignore a dead mqtt longer than
   // the interval if we were just about to expire and then wrapped around
   // in this case we can get up to 2 * kMaxTimeSinceMqttAliveMs
@@ -378,99 +929,575 @@ int64_t UpdateWatchdog(const StateFlags &state_flags) {
   return 1000L;
 }
 
-static std::unique_ptr<Config> config(nullptr);
+// Double buffered for hot reloads: the network side loads a new config into
+// the spare slot and bumps config_generation, the control side moves over at
+// the start of its next loop() and acks with control_config_generation, and
+// only then is the old slot freed.
+static std::unique_ptr<Config> config_slots[2];
+static std::atomic<uint32_t> config_generation{0};
+static std::atomic<uint32_t> control_config_generation{0};
+
+const Config *ActiveConfig() {
+  return config_slots[config_generation.load(std::memory_order_acquire) % 2]
+      .get();
+}
+
+// State of the control tasks in loop(), core 1.
+struct ControlContext {
+  const Config *config;
+  uint32_t config_generation = 0;
+  // Network flags copied in from network_status.
+  StateFlags state_flags;
+  SysTime sys_time;
+  ControlStatus status;
+  // SysTime::rtc_offset the pump timed its next wake-up with.
+  int64_t pump_rtc_offset = 0;
+  // Of the current metrics window.
+  uint32_t loops = 0;
+  int64_t metrics_start_ms = 0;
+};
+
+// State of the network tasks, core 0.
+struct NetworkContext {
+  const Config *config;
+  StateFlags state_flags;  // Except pumping.
+  ClockDiscipline clock;
+  SysTime ntp_time;  // Just ntp_time, rtc_at_ntp_time and drift_ppm_q16.
+  MqttPacket mqtt_packet;
+  // Of the current metrics window.
+  uint32_t loops = 0;
+  int64_t metrics_start_ms = 0;
+};
+
+// The task tables, most urgent first.
+enum ControlTask : size_t {
+  kWatchdogTask,
+  kPumpControlTask,
+  kReadPressureTask,
+  kTimeKeeperTask,
+  kLedsTask,
+  kSerialTask,
+  kControlMetricsTask,
+  kNumControlTasks
+};
+
+constexpr TaskDescriptor kControlTasks[kNumControlTasks] = {
+    // name, priority, budget_ms
+    {"watchdog", 0, 1},  //
+    {"pump", 0, 1},
+    {"pressure", 0, 1},
+    {"timekeeper", 0, 2},
+    {"leds", 1, 1},
+    {"serial", 1, 20},  // ~2 lines at 115200 baud
+    {"metrics", 1, 1},
+};
+
+enum NetworkTask : size_t {
+  kWifiTask,
+  kNtpTask,
+  kMqttTask,
+  kNetworkMetricsTask,
+  kLogTask,
+  kNumNetworkTasks
+};
+
+constexpr TaskDescriptor kNetworkTasks[kNumNetworkTasks] = {
+    // name, priority, budget_ms
+    {"wifi", 0, 50},
+    {"ntp", 0, 2},      // Never waits on the network
+    {"mqtt", 0, 5},     // Never waits on the network
+    {"metrics", 1, 5},  // Never waits on the network
+    {"log", 3, 20},     // ~2 lines at 115200 baud
+};
+
+static Scheduler<ControlContext, kNumControlTasks> control_scheduler(
+    kControlTasks, MAX_BACKLOG_MS);
+static Scheduler<NetworkContext, kNumNetworkTasks> network_scheduler(
+    kNetworkTasks, MAX_BACKLOG_MS);
+// False on the host, where loop() runs the network tasks too.
+static bool network_task_started = false;
+
+// Worst start lateness of each task so far, for the host simulation report.
+size_t LoopTaskLateness(const char *names[], int64_t max_lateness_ms[]) {
+  size_t n = 0;
+  for (size_t i = 0; i < kNumControlTasks; ++i, ++n) {
+    names[n] = kControlTasks[i].name;
+    max_lateness_ms[n] = control_scheduler.MaxLatenessMs(i);
+  }
+  for (size_t i = 0; i < kNumNetworkTasks; ++i, ++n) {
+    names[n] = kNetworkTasks[i].name;
+    max_lateness_ms[n] = network_scheduler.MaxLatenessMs(i);
+  }
+  return n;
+}
+
+// A closed metrics window of one side's tasks.
+template <size_t N>
+struct CoreMetrics {
+  int64_t end_ms;  // Epoch, 0 before the first window closed.
+  int64_t window_ms;
+  uint32_t loops;  // Of loop() or NetworkStep().
+  TaskMetrics tasks[N];
+};
+
+static Seqlock<CoreMetrics<kNumControlTasks>> control_metrics;
+// Only touched on the network side.
+static CoreMetrics<kNumNetworkTasks> network_metrics;
+
+// Closes the context's metrics window and starts the next. The first call
+// just starts one.
+template <typename Context, size_t N>
+bool CloseMetricsWindow(Scheduler<Context, N> &scheduler, Context &c,
+                        CoreMetrics<N> &metrics) {
+  const int64_t now_ms = EpochMs();
+  const bool closed = c.metrics_start_ms != 0;
+  if (closed) {
+    metrics.end_ms = now_ms;
+    metrics.window_ms = now_ms - c.metrics_start_ms;
+    metrics.loops = c.loops;
+#if TASK_METRICS
+    for (size_t i = 0; i < N; ++i) {
+      metrics.tasks[i] = scheduler.Metrics(i);
+    }
+    scheduler.ResetMetrics();
+#endif
+  }
+  c.loops = 0;
+  c.metrics_start_ms = now_ms;
+  return closed;
+}
+
+// Per task [runs, mean run us, max run us, mean late ms, max late ms, late
+// jitter ms, backlog clamps, [run time histogram]].
+template <size_t N>
+void AddTaskMetrics(const TaskDescriptor (&tasks)[N],
+                    const CoreMetrics<N> &metrics, JsonObject out) {
+  for (size_t i = 0; i < N; ++i) {
+    const TaskMetrics &task = metrics.tasks[i];
+    const char *name = tasks[i].name;
+    JsonArray values = out[name].to<JsonArray>();
+    values.add(task.runs);
+    values.add(task.RunUsMean());
+    values.add(task.run_us_max);
+    values.add(std::round(task.LateMsMean() * 10) / 10);
+    values.add(task.late_ms_max);
+    values.add(std::round(task.JitterMs() * 10) / 10);
+    values.add(task.backlog_clamps);
+    JsonArray histogram = values.add<JsonArray>();
+    for (uint32_t count : task.run_buckets) {
+      histogram.add(count);
+    }
+  }
+}
+
+double LoopHz(uint32_t loops, int64_t window_ms) {
+  return window_ms > 0 ? std::round(loops * 10000.0 / window_ms) / 10 : 0;
+}
+
+void BuildMetrics(const CoreMetrics<kNumControlTasks> &control,
+                  JsonDocument &doc) {
+  const CoreMetrics<kNumNetworkTasks> &network = network_metrics;
+  doc["window-s"] = network.window_ms / 1000;
+  JsonArray loop_hz = doc["loop-hz"].to<JsonArray>();
+  loop_hz.add(LoopHz(control.loops, control.window_ms));
+  loop_hz.add(LoopHz(network.loops, network.window_ms));
+  const hal::HeapInfo heap = hal::Heap();
+  JsonArray heap_values = doc["heap"].to<JsonArray>();
+  heap_values.add(heap.free_bytes);
+  heap_values.add(heap.largest_block);
+  heap_values.add(heap.min_free_bytes);
+  AddTaskMetrics(kControlTasks, control, doc["control"].to<JsonObject>());
+  AddTaskMetrics(kNetworkTasks, network, doc["network"].to<JsonObject>());
+  JsonArray wifi = doc["wifi"].to<JsonArray>();
+  wifi.add(wifi_state.connects);
+  wifi.add(wifi_state.fast_connects);
+  wifi.add(wifi_state.last.associated_ms);
+  wifi.add(wifi_state.last.got_ip_ms);
+}
+
+// QoS 0, a lost window is not worth a retry or the journal.
+bool PublishMetrics(const Config::Mqtt &mqtt_config,
+                    const CoreMetrics<kNumControlTasks> &control) {
+  char topic[128];
+  snprintf(topic, sizeof(topic), "%s" MQTT_METRICS_SUFFIX, mqtt_config.topic);
+  JsonDocument doc;
+  BuildMetrics(control, doc);
+  const bool msgpack = mqtt_config.encoding == Config::MqttEncoding::kMsgPack;
+  const size_t length = MeasurePayload(doc, msgpack);
+  if (!mqtt_client.BeginPublish(topic, length, 0)) {
+    return false;
+  }
+  MqttPayloadWriter writer;
+  const size_t written = SerializePayload(doc, msgpack, writer);
+  return mqtt_client.EndPublish() && written == length;
+}
+
+void HandleLog(HttpRequest &request, HttpResponse &response) {
+  char value[4];
+  const bool old = request.Query("old", value, sizeof(value));
+  hal::File file =
+      hal::File::Open(old ? LOG_OLD_FILE_PATH : LOG_FILE_PATH, "r");
+  if (!file) {
+    response.Send(404, "text/plain", "No log");
+    return;
+  }
+  response.SendFile(200, "application/octet-stream", file);
+}
+
+void HandleMetrics(HttpRequest &request, HttpResponse &response) {
+  if (network_metrics.end_ms == 0) {
+    response.Send(503, "text/plain", "No metrics window closed yet");
+    return;
+  }
+  JsonDocument doc;
+  BuildMetrics(control_metrics.Read(), doc);
+  char body[HttpResponse::kOutBytes];
+  if (measureJson(doc) >= sizeof(body)) {
+    response.Send(500, "text/plain", "Metrics too large");
+    return;
+  }
+  serializeJson(doc, body, sizeof(body));
+  response.Send(200, "application/json", body);
+}
+
+template <>
+struct TaskBody<ControlContext, kWatchdogTask> {
+  static int64_t Run(ControlContext &c) {
+    return UpdateWatchdog(c.state_flags);
+  }
+};
+template <>
+struct TaskBody<ControlContext, kPumpControlTask> {
+  static int64_t Run(ControlContext &c) {
+    c.pump_rtc_offset = c.sys_time.rtc_offset;
+    return PumpControl(c.config->schedule, c.state_flags.pumping, c.sys_time,
+                       c.status);
+  }
+};
+template <>
+struct TaskBody<ControlContext, kReadPressureTask> {
+  static int64_t Run(ControlContext &c) {
+    return ReadTankPressure(c.sys_time, c.status);
+  }
+};
+template <>
+struct TaskBody<ControlContext, kTimeKeeperTask> {
+  static int64_t Run(ControlContext &c) {
+    const int64_t next_ms = TimeKeeper(c.state_flags, c.sys_time, c.status);
+    // The pump sleeps until the next switch by the clock it saw, re-time it
+    // if the clock moved since.
+    if (std::abs(c.sys_time.rtc_offset - c.pump_rtc_offset) >
+        PUMP_RETIME_US) {
+      control_scheduler.MakeDue(kPumpControlTask, hal::RtcMicros() / 1000);
+    }
+    return next_ms;
+  }
+};
+template <>
+struct TaskBody<ControlContext, kLedsTask> {
+  static int64_t Run(ControlContext &c) { return UpdateLeds(c.state_flags); }
+};
+template <>
+struct TaskBody<ControlContext, kSerialTask> {
+  static int64_t Run(ControlContext &c) { return UpdateSerial(c.sys_time); }
+};
+template <>
+struct TaskBody<ControlContext, kControlMetricsTask> {
+  static int64_t Run(ControlContext &c) {
+    CoreMetrics<kNumControlTasks> metrics = {};
+    if (CloseMetricsWindow(control_scheduler, c, metrics)) {
+      control_metrics.Write(metrics);
+    }
+    return METRICS_WINDOW_S * 1000LL;
+  }
+};
+template <>
+struct TaskBody<NetworkContext, kWifiTask> {
+  static int64_t Run(NetworkContext &c) {
+    return ConnectWifi(c.config->wifi, c.state_flags.wifi_ok);
+  }
+};
+template <>
+struct TaskBody<NetworkContext, kNtpTask> {
+  static int64_t Run(NetworkContext &c) {
+    return ConnectNtp(c.config->ntp, c.state_flags, c.state_flags.ntp_ok,
+                      c.clock, c.ntp_time);
+  }
+};
+template <>
+struct TaskBody<NetworkContext, kMqttTask> {
+  static int64_t Run(NetworkContext &c) {
+    return UpdateMqtt(c.config->mqtt, c.state_flags, c.state_flags.mqtt_ok,
+                      c.mqtt_packet);
+  }
+};
+template <>
+struct TaskBody<NetworkContext, kLogTask> {
+  static int64_t Run(NetworkContext &c) {
+    return logger.Drain(LOG_DRAIN_PER_RUN, PublishLogLine) ? 0 : LOG_DRAIN_MS;
+  }
+};
+template <>
+struct TaskBody<NetworkContext, kNetworkMetricsTask> {
+  static int64_t Run(NetworkContext &c) {
+    if (!CloseMetricsWindow(network_scheduler, c, network_metrics)) {
+      // Starts a bit after the control side, so its window is in when ours
+      // closes.
+      return METRICS_WINDOW_S * 1000LL + METRICS_COLLECT_MS;
+    }
+    const CoreMetrics<kNumControlTasks> control = control_metrics.Read();
+    const hal::HeapInfo heap = hal::Heap();
+    LOG_INFO(kLogMain,
+             "METRICS: loops %.1f/%.1f Hz, heap %lu free %lu largest\n",
+             LoopHz(control.loops, control.window_ms),
+             LoopHz(network_metrics.loops, network_metrics.window_ms),
+             static_cast<unsigned long>(heap.free_bytes),
+             static_cast<unsigned long>(heap.largest_block));
+    if (c.state_flags.mqtt_ok && MQTT_DO_PUBLISH &&
+        !PublishMetrics(c.config->mqtt, control)) {
+      LOG_WARN(kLogMqtt, "MQTT metrics not sent\n");
+    }
+    return METRICS_WINDOW_S * 1000LL;
+  }
+};
+
+// Moves the control tasks over to a config the network side reloaded. Only
+// the pump uses it: it looks at the new schedule right away and, where that
+// says the same as the old one, the outputs do not change.
+void PickUpConfig(ControlContext &c) {
+  const uint32_t generation = config_generation.load(std::memory_order_acquire);
+  if (generation == c.config_generation) {
+    return;
+  }
+  c.config = config_slots[generation % 2].get();
+  c.config_generation = generation;
+  control_scheduler.MakeDue(kPumpControlTask, EpochMs());
+  control_config_generation.store(generation, std::memory_order_release);
+}
+
+static SetupUI config_api;
+static bool config_api_tried = false;
+static bool config_api_started = false;
+
+// Swaps in the /config.json saved while running and redoes only what changed:
+// WiFi, NTP and MQTT reconnect if their settings did, the pump just follows the
+// new schedule. TimeKeeper is not touched, so the clock stays converged.
+void ReloadConfig(NetworkContext &c) {
+  const uint32_t generation = config_generation.load(std::memory_order_relaxed);
+  if (control_config_generation.load(std::memory_order_acquire) != generation) {
+    return;  // The control side still has the previous swap to pick up.
+  }
+  config_reload_requested = false;
+  std::unique_ptr<Config> &spare = config_slots[(generation + 1) % 2];
+  spare = Config::Load(kConfigJsonPath, CONFIG_SNAPSHOT_PATH);
+  if (!spare) {
+    LOG_WARN(kLogConfig, "CONFIG reload failed, keeping the current one\n");
+    return;
+  }
+  const Config &fresh = *spare;
+  const Config::Changes changes = Config::Diff(*c.config, fresh);
+  LOG_INFO(kLogConfig,
+           "CONFIG reload: wifi %d ntp %d mqtt %d/%d schedule %d api %d\n",
+           changes.wifi, changes.ntp, changes.mqtt_connection,
+           changes.mqtt_publish, changes.schedule, changes.api);
+
+  const int64_t now_ms = EpochMs();
+  if (changes.wifi) {
+    // Another network or static IP, the cached link would be stale.
+    wifi_state.cached = {};
+    wifi_state.connecting = false;
+    hal::WifiDisconnect();
+    c.state_flags.wifi_ok = false;
+    network_scheduler.MakeDue(kWifiTask, now_ms);
+  }
+  if (changes.ntp && c.state_flags.ntp_ok) {
+    sntp_client.Stop();
+    c.state_flags.ntp_ok = false;
+    network_scheduler.MakeDue(kNtpTask, now_ms);
+  }
+  if (changes.mqtt_connection) {
+    mqtt_client.Stop();  // Keeps what is not acked yet.
+  }
+  if (changes.api) {
+    if (config_api_started) {
+      config_api.SetToken(fresh.api.token ? fresh.api.token : "");
+    } else {
+      config_api_tried = false;  // Now it may have a token to start with.
+    }
+  }
+  ConfigureMqttClient(fresh.mqtt);
+  network_scheduler.MakeDue(kMqttTask, now_ms);
+
+  c.config = &fresh;
+  config_generation.store(generation + 1, std::memory_order_release);
+}
+
+// One round of the network tasks, returns the next deadline (epoch ms).
+int64_t NetworkStep() {
+  static NetworkContext context{ActiveConfig()};
+  context.loops++;
+  if (!config_api_tried && context.state_flags.wifi_ok) {
+    config_api_tried = true;
+    const char *token = context.config->api.token;
+    if (!token || !token[0]) {
+      LOG_INFO(kLogConfig, "Settings API off, no api token in the config\n");
+    } else {
+      config_api.OnSettingsSaved([] { config_reload_requested = true; });
+      config_api.On({HttpMethod::kGet, "/api/metrics", HandleMetrics, nullptr});
+      config_api.On({HttpMethod::kGet, "/api/log", HandleLog, nullptr});
+      config_api_started = config_api.StartApi(CONFIG_API_PORT, token);
+      LOG_INFO(kLogConfig, "Settings API %s on port %d\n",
+               config_api_started ? "listening" : "FAILED", CONFIG_API_PORT);
+    }
+  }
+  if (config_api_started) {
+    config_api.Poll(0);
+  }
+  if (config_reload_requested) {
+    ReloadConfig(context);
+  }
+  // Once the control side moved over, nothing uses the previous config.
+  const uint32_t generation = config_generation.load(std::memory_order_relaxed);
+  if (control_config_generation.load(std::memory_order_acquire) == generation) {
+    config_slots[(generation + 1) % 2].reset();
+  }
+
+  MqttPacket &packet = context.mqtt_packet;
+  packet.status = control_status.Read();
+  PressureSample sample;
+  while (pressure_queue.Pop(sample)) {
+    packet.pressure_batch.Add(sample.time_ms, sample.value);
+    packet.version++;
+  }
+
+  const int64_t next_epoch_ms = network_scheduler.Dispatch(context, EpochMs);
+
+  const StateFlags &flags = context.state_flags;
+  network_status.Write({flags.wifi_ok, flags.ntp_ok, flags.mqtt_ok,
+                        context.ntp_time.ntp_time,
+                        context.ntp_time.rtc_at_ntp_time,
+                        context.ntp_time.drift_ppm_q16, EpochMs()});
+  return next_epoch_ms;
+}
+
+void NetworkTaskBody() {
+  while (true) {
+    hal::IdleSetNetworkIdle(false);
+    const int64_t next_epoch_ms = NetworkStep();
+    // Plain wait, the radio sleeps on its own and the control core decides
+    // about light sleep, forced only while we say we are idle. A settings API
+    // request cuts it short.
+    const int64_t wait_ms = std::max<int64_t>(
+        1, std::min(next_epoch_ms - EpochMs(), MAX_SLEEP_MS));
+    hal::IdleSetNetworkIdle(!hal::WifiConnected() && !wifi_state.connecting);
+    if (config_api_started) {
+      config_api.Poll(wait_ms);
+    } else {
+      hal::DelayMs(wait_ms);
+    }
+  }
+}
 
 void setup() {
-  pinMode(PUMP_CONTROL, OUTPUT);
-  pinMode(PUMP_CONTROL_2, OUTPUT);
+  hal::ConfigurePin(PUMP_CONTROL, hal::PinMode::kOutput);
+  hal::ConfigurePin(PUMP_CONTROL_2, hal::PinMode::kOutput);
   // Just in case we are in a bad state on boot, turn off pump.
-  digitalWrite(PUMP_CONTROL, LOW);
-  digitalWrite(PUMP_CONTROL_2, LOW);
+  hal::DigitalWrite(PUMP_CONTROL, false);
+  hal::DigitalWrite(PUMP_CONTROL_2, false);
   
-  pinMode(LED_RED, OUTPUT);
-  pinMode(LED_GREEN, OUTPUT);
-  pinMode(LED_BLUE, OUTPUT);
-  pinMode(SETUP_MODE_PIN, INPUT_PULLUP);
+  hal::ConfigurePin(LED_RED, hal::PinMode::kOutput);
+  hal::ConfigurePin(LED_GREEN, hal::PinMode::kOutput);
+  hal::ConfigurePin(LED_BLUE, hal::PinMode::kOutput);
+  hal::ConfigurePin(SETUP_MODE_PIN, hal::PinMode::kInputPullup);
 
   Serial.begin(115200);
+  logger.SetLevels(LOG_MODULE_LEVELS);
+  logger.SetFile(LOG_FILE_PATH, LOG_OLD_FILE_PATH, LOG_FILE_BYTES,
+                 LOG_FILE_LEVEL);
 
   WatchdogStart(WATCHDOG_TIMEOUT_S);
+  hal::IdleInit(SETUP_MODE_PIN);
 
-  if (digitalRead(SETUP_MODE_PIN) == LOW) {
+  if (!hal::DigitalRead(SETUP_MODE_PIN)) {
     Serial.println("Entering setup mode...");
     SetupUI setup_ui;
     setup_ui.run();
     return;  // Exit loop to prevent further execution in setup mode
   }
 
-  config = Config::CreateFromJsonFile("/config.json");
-  if (!config) {
-    Serial.println("Configuration not loaded. :/");
-  } else {
-    config->PrintConfigOnSerial();
+  // Before anything that could crash a new image, so those boots count.
+  ota_trial.Boot(OTA_TRIAL_BOOTS);
+  config_slots[0] = Config::Load(kConfigJsonPath, CONFIG_SNAPSHOT_PATH);
+  if (!config_slots[0]) {
+    // Saving keeps the config it replaced, in case the new one is gone.
+    LOG_WARN(kLogConfig, "Trying last known good config\n");
+    config_slots[0] = Config::Load(kConfigBackupPath, CONFIG_SNAPSHOT_PATH);
   }
+  if (!config_slots[0]) {
+    LOG_ERROR(kLogConfig, "Configuration not loaded. :/\n");
+    return;
+  }
+  config_slots[0]->PrintConfigOnSerial();
+
+  // The network side drains the log from here on.
+  logger.StartDeferred();
+  network_task_started = hal::StartTaskOnCore(
+      "network", NETWORK_CORE, NETWORK_STACK_BYTES, NetworkTaskBody);
+  LOG_INFO(kLogMain, "Network tasks %s\n",
+           network_task_started ? "on core 0" : "in loop()");
 }
 
 void loop() {
-  if (!config) {
-    Serial.println("No config, resetting in 5 :/");
-    sleep(5000);
-    ESP.restart();
-  }
-
-  static StateFlags state_flags;
-  static SysTime sys_time;
-  static struct {
-    int64_t wifi = 0;
-    int64_t leds = 0;
-    int64_t ntp = 0;
-    int64_t timekeeper = 0;
-    int64_t serial = 0;
-    int64_t mqtt = 0;
-    int64_t read_pressure = 0;
-    int64_t pump_control = 0;
-    int64_t watchdog_update = 0;
-  } next_calls_ms;
-
-  static ESP32Time rtc;
-  static MqttPacket mqtt_packet;
-
-  int64_t epoch_ms = rtc.getEpoch() * 1000L + rtc.getMillis();
-  int64_t next_epoch_ms = epoch_ms + MAX_SLEEP_MS;
-
-  auto dispatch = [&](int64_t &next_ms, std::function<int64_t()> fn) {
-    next_ms = std::max(next_ms, epoch_ms - MAX_BACKLOG_MS);
-    if (epoch_ms > next_ms) {
-      next_ms += fn();
-    }
-    next_epoch_ms = std::min(next_ms, next_epoch_ms);
-  };
-
-  dispatch(next_calls_ms.leds, std::bind(UpdateLeds, std::cref(state_flags)));
-  dispatch(next_calls_ms.wifi, std::bind(ConnectWifi, std::cref(config->wifi),
-                                         std::ref(state_flags.wifi_ok)));
-  dispatch(next_calls_ms.ntp,
-           std::bind(ConnectNtp, std::cref(config->ntp), std::cref(state_flags),
-                     std::ref(state_flags.ntp_ok), std::ref(sys_time), &rtc));
-  dispatch(next_calls_ms.timekeeper,
-           std::bind(TimeKeeper, std::cref(state_flags), std::ref(sys_time),
-                     std::ref(mqtt_packet), &rtc));
-  dispatch(next_calls_ms.mqtt,
-           std::bind(UpdateMqtt, std::cref(config->mqtt), std::cref(state_flags),
-                     std::ref(state_flags.mqtt_ok), std::cref(mqtt_packet)));
-  dispatch(next_calls_ms.read_pressure,
-           std::bind(ReadTankPressure, std::ref(mqtt_packet)));
-  dispatch(next_calls_ms.pump_control,
-           std::bind(PumpControl, std::cref(config->schedule),
-                     std::ref(state_flags.pumping), std::cref(sys_time),
-                     std::ref(mqtt_packet)));
-
-  dispatch(next_calls_ms.serial,
-           std::bind(UpdateSerial, std::cref(sys_time), &rtc));
-  dispatch(next_calls_ms.watchdog_update,
-            std::bind(UpdateWatchdog, std::cref(state_flags)));
- 
-  epoch_ms = rtc.getEpoch() * 1000L + rtc.getMillis();
-  delay(
-      std::max(MIN_SLEEP_MS, std::min(next_epoch_ms - epoch_ms, MAX_SLEEP_MS)));
+  if (!ActiveConfig()) {
+    LOG_ERROR(kLogConfig, "No config, resetting in 5 :/\n");
+    hal::DelayMs(5000);
+    hal::Restart();
+  }
+
+  static ControlContext context{ActiveConfig()};
+  context.loops++;
+  PickUpConfig(context);
+  const NetworkStatus network = network_status.Read();
+  // Without news from the network side MQTT counts as down, so the watchdog
+  // eventually gets us out of a hung network task too.
+  const bool network_alive =
+      network.updated_ms > 0 && EpochMs() - network.updated_ms < NETWORK_STALE_MS;
+  context.state_flags.wifi_ok = network.wifi_ok;
+  context.state_flags.ntp_ok = network.ntp_ok;
+  context.state_flags.mqtt_ok = network.mqtt_ok && network_alive;
+  context.sys_time.ntp_time = network.ntp_time;
+  context.sys_time.rtc_at_ntp_time = network.rtc_at_ntp_time;
+  context.sys_time.drift_ppm_q16 = network.drift_ppm_q16;
+
+  int64_t next_epoch_ms = control_scheduler.Dispatch(context, EpochMs);
+  control_status.Write(context.status);
+  if (!network_task_started) {
+    next_epoch_ms = std::min(next_epoch_ms, NetworkStep());
+  }
+
+  if (!TICKLESS_IDLE) {
+    hal::DelayMs(std::max(MIN_SLEEP_MS,
+                          std::min(next_epoch_ms - EpochMs(), MAX_SLEEP_MS)));
+    return;
+  }
+
+  const int64_t sleep_ms = std::min(next_epoch_ms - EpochMs(), MAX_SLEEP_MS);
+  if (sleep_ms <= 0) {
+    return;
+  }
+  const int pressure = context.status.tank_pressure;
+  switch (hal::IdleSleepMs(sleep_ms, TANK_PRESSURE,
+                           pressure - PRESSURE_WAKE_DELTA,
+                           pressure + PRESSURE_WAKE_DELTA)) {
+    case hal::WakeReason::kGpio:
+      // Straight out, the log would not be drained before the restart.
+      Serial.println("Setup pin pulled low, restarting into setup mode");
+      hal::Restart();
+      break;
+    case hal::WakeReason::kAdcThreshold:
+      control_scheduler.MakeDue(kReadPressureTask, EpochMs());
+      break;
+    case hal::WakeReason::kTimeout:
+      break;
+  }
 }
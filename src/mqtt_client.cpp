@@ -0,0 +1,613 @@
+#include "mqtt_client.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "hal.h"
+#include "logger.h"
+
+namespace {
+
+// Packet types, high nibble of the fixed header.
+constexpr uint8_t kConnect = 1;
+constexpr uint8_t kConnack = 2;
+constexpr uint8_t kPublish = 3;
+constexpr uint8_t kPuback = 4;
+constexpr uint8_t kSubscribe = 8;
+constexpr uint8_t kSuback = 9;
+constexpr uint8_t kPingreq = 12;
+constexpr uint8_t kPingresp = 13;
+constexpr uint8_t kDisconnect = 14;
+constexpr uint8_t kDupFlag = 0x08;
+
+// How often Poll() wants to run while something is on its way.
+constexpr int64_t kBusyPollMs = 20;
+// TCP connect plus CONNACK.
+constexpr int64_t kConnectTimeoutMs = 10000;
+constexpr int64_t kMinBackoffMs = 1000;
+constexpr int64_t kMaxBackoffMs = 64000;
+// Per Poll(), a TCP segment's worth.
+constexpr size_t kMaxSendBytes = 1460;
+constexpr size_t kMaxReceiveBytes = 256;
+// Retained messages come right after the SUBACK, keep polling for them.
+constexpr int64_t kRetainedWaitMs = 2000;
+
+size_t EncodeLength(uint32_t length, uint8_t *out) {
+  size_t n = 0;
+  do {
+    uint8_t byte = length & 0x7f;
+    length >>= 7;
+    out[n++] = byte | (length ? 0x80 : 0);
+  } while (length);
+  return n;
+}
+
+uint8_t *PutString(uint8_t *out, const char *str, size_t length) {
+  *out++ = length >> 8;
+  *out++ = length & 0xff;
+  memcpy(out, str, length);
+  return out + length;
+}
+
+bool Present(const char *str) { return str && *str; }
+
+}  // namespace
+
+void MqttClient::SetServer(const char *broker, int port) {
+  broker_ = broker;
+  port_ = port;
+}
+
+void MqttClient::SetCredentials(const char *client_id, const char *user,
+                                const char *password) {
+  client_id_ = client_id ? client_id : "";
+  user_ = user;
+  password_ = password;
+}
+
+void MqttClient::SetKeepAlive(int keep_alive_s) { keep_alive_s_ = keep_alive_s; }
+
+bool MqttClient::Subscribe(const char *topic, const Subscriber &subscriber) {
+  size_t i = 0;
+  while (i < num_subscriptions_ && subscriptions_[i].topic != topic) {
+    i++;
+  }
+  if (i == kMaxSubscriptions) {
+    return false;
+  }
+  if (i == num_subscriptions_) {
+    num_subscriptions_++;
+    if (state_ == State::kConnected) {
+      subscribe_pending_ |= 1u << i;
+    }
+  }
+  subscriptions_[i] = {topic, subscriber, 0};
+  return true;
+}
+
+void MqttClient::Start(int64_t now_ms) {
+  if (state_ == State::kStopped) {
+    state_ = State::kBackoff;
+    retry_ms_ = now_ms;
+  }
+}
+
+void MqttClient::Stop() {
+  if (state_ == State::kStopped) {
+    return;
+  }
+  if (state_ == State::kConnected && control_length_ == 0) {
+    // Best effort, a socket that can not take two bytes right now is gone
+    // anyway.
+    const uint8_t disconnect[2] = {kDisconnect << 4, 0};
+    hal::TcpSend(disconnect, sizeof(disconnect));
+  }
+  Close();
+  state_ = State::kStopped;
+  backoff_ms_ = 0;
+}
+
+void MqttClient::Close() {
+  hal::TcpClose();
+  control_length_ = control_sent_ = 0;
+  if (rx_stage_ != 0 && rx_in_payload_ && rx_subscriber_ &&
+      rx_subscriber_->end) {
+    rx_subscriber_->end(false);
+  }
+  rx_stage_ = 0;
+  rx_in_payload_ = false;
+  ping_outstanding_ = false;
+  subscribe_pending_ = 0;
+  // QoS 1 goes out again on the next connection, flagged as a duplicate if
+  // the broker may have seen it. QoS 0 that made it out is done.
+  for (size_t i = 0; i < num_messages_; ++i) {
+    Message &message = messages_[i];
+    if (message.id == 0 || message.acked) {
+      continue;
+    }
+    if (message.sent || (i == sending_ && sending_sent_ > 0)) {
+      store_[message.offset] |= kDupFlag;
+    }
+    message.sent = false;
+  }
+  sending_ = sending_sent_ = 0;
+}
+
+void MqttClient::Fail(const char *reason, int64_t now_ms) {
+  Close();
+  backoff_ms_ = std::clamp(backoff_ms_ * 2, kMinBackoffMs, kMaxBackoffMs);
+  retry_ms_ = now_ms + backoff_ms_;
+  state_ = State::kBackoff;
+  LOG_WARN(kLogMqtt, "MQTT %s, %u pending, retry in %lld ms\n", reason,
+           static_cast<unsigned>(num_messages_), backoff_ms_);
+}
+
+void MqttClient::Connect(int64_t now_ms) {
+  state_since_ms_ = now_ms;
+  if (!hal::TcpConnect(broker_, port_)) {
+    Fail("can not connect", now_ms);
+    return;
+  }
+  state_ = State::kTcpConnecting;
+}
+
+void MqttClient::QueueConnect() {
+  const bool has_user = Present(user_);
+  const bool has_password = has_user && Present(password_);
+  const size_t id_length = strlen(client_id_);
+  const size_t user_length = has_user ? strlen(user_) : 0;
+  const size_t password_length = has_password ? strlen(password_) : 0;
+  const uint32_t remaining = 10 + 2 + id_length +
+                             (has_user ? 2 + user_length : 0) +
+                             (has_password ? 2 + password_length : 0);
+  if (remaining + 5 > sizeof(control_)) {
+    Fail("client id/user/password too long", state_since_ms_);
+    return;
+  }
+  uint8_t *out = control_;
+  *out++ = kConnect << 4;
+  out += EncodeLength(remaining, out);
+  out = PutString(out, "MQTT", 4);
+  *out++ = 4;  // Protocol level 3.1.1.
+  // Clean session, what is not acked we send again ourselves.
+  *out++ = 0x02 | (has_user ? 0x80 : 0) | (has_password ? 0x40 : 0);
+  *out++ = keep_alive_s_ >> 8;
+  *out++ = keep_alive_s_ & 0xff;
+  out = PutString(out, client_id_, id_length);
+  if (has_user) {
+    out = PutString(out, user_, user_length);
+  }
+  if (has_password) {
+    out = PutString(out, password_, password_length);
+  }
+  control_length_ = out - control_;
+  control_sent_ = 0;
+}
+
+void MqttClient::QueueSubscribe() {
+  // One topic per SUBSCRIBE, the lowest pending first.
+  size_t i = 0;
+  while (!(subscribe_pending_ & (1u << i))) {
+    i++;
+  }
+  Subscription &subscription = subscriptions_[i];
+  const size_t topic_length = strlen(subscription.topic);
+  const uint32_t remaining = 2 + 2 + topic_length + 1;
+  if (remaining + 5 > sizeof(control_)) {
+    LOG_WARN(kLogMqtt, "MQTT subscribe topic too long\n");
+    subscribe_pending_ &= ~(1u << i);
+    return;
+  }
+  if (control_length_ > 0) {
+    return;  // Next time.
+  }
+  uint8_t *out = control_;
+  *out++ = kSubscribe << 4 | 0x02;
+  out += EncodeLength(remaining, out);
+  subscription.id = next_id_;
+  *out++ = next_id_ >> 8;
+  *out++ = next_id_ & 0xff;
+  next_id_ = next_id_ == UINT16_MAX ? 1 : next_id_ + 1;
+  out = PutString(out, subscription.topic, topic_length);
+  *out++ = 0;  // QoS 0, nothing to ack on our side.
+  control_length_ = out - control_;
+  control_sent_ = 0;
+  subscribe_pending_ &= ~(1u << i);
+}
+
+bool MqttClient::QueueControl(const uint8_t *packet, size_t length) {
+  if (control_length_ > 0) {
+    return false;
+  }
+  memcpy(control_, packet, length);
+  control_length_ = length;
+  control_sent_ = 0;
+  return true;
+}
+
+int64_t MqttClient::Poll(int64_t now_ms) {
+  switch (state_) {
+    case State::kStopped:
+      return 1000;
+    case State::kBackoff:
+      if (now_ms < retry_ms_) {
+        return retry_ms_ - now_ms;
+      }
+      Connect(now_ms);
+      break;
+    case State::kTcpConnecting:
+      switch (hal::TcpPoll()) {
+        case hal::TcpState::kConnected:
+          state_ = State::kWaitConnack;
+          QueueConnect();
+          break;
+        case hal::TcpState::kClosed:
+          Fail("can not reach broker", now_ms);
+          break;
+        case hal::TcpState::kConnecting:
+          if (now_ms - state_since_ms_ > kConnectTimeoutMs) {
+            Fail("connect timed out", now_ms);
+          }
+          break;
+      }
+      break;
+    case State::kWaitConnack:
+    case State::kConnected:
+      if (hal::TcpPoll() != hal::TcpState::kConnected) {
+        Fail("connection lost", now_ms);
+        break;
+      }
+      Send(now_ms);
+      if (state_ != State::kBackoff) {
+        Receive(now_ms);
+      }
+      if (state_ == State::kWaitConnack &&
+          now_ms - state_since_ms_ > kConnectTimeoutMs) {
+        Fail("no CONNACK", now_ms);
+      } else if (state_ == State::kConnected) {
+        if (subscribe_pending_) {
+          QueueSubscribe();
+        }
+        if (now_ms - last_rx_ms_ > keep_alive_s_ * 1500LL) {
+          Fail("broker went silent", now_ms);
+        } else if (now_ms - last_tx_ms_ >= keep_alive_s_ * 1000LL &&
+                   !ping_outstanding_) {
+          const uint8_t ping[2] = {kPingreq << 4, 0};
+          ping_outstanding_ = QueueControl(ping, sizeof(ping));
+        }
+      }
+      break;
+  }
+  Compact();
+
+  switch (state_) {
+    case State::kStopped:
+      return 1000;
+    case State::kBackoff:
+      return std::max<int64_t>(retry_ms_ - now_ms, 1);
+    case State::kConnected:
+      if (!Busy() && now_ms >= busy_until_ms_) {
+        return std::max<int64_t>(keep_alive_s_ * 1000LL - (now_ms - last_tx_ms_),
+                                 1);
+      }
+      return kBusyPollMs;
+    default:
+      return kBusyPollMs;
+  }
+}
+
+void MqttClient::Send(int64_t now_ms) {
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  if (control_length_ > 0) {
+    data = control_ + control_sent_;
+    size = control_length_ - control_sent_;
+  } else if (state_ == State::kConnected) {
+    while (sending_ < num_messages_ && messages_[sending_].sent) {
+      sending_++;
+    }
+    if (sending_ == num_messages_) {
+      return;
+    }
+    if (sending_sent_ == 0) {
+      size_t unacked = 0;
+      for (size_t i = 0; i < sending_; ++i) {
+        unacked += messages_[i].id != 0 && !messages_[i].acked;
+      }
+      if (unacked >= kWindow) {
+        return;
+      }
+    }
+    const Message &message = messages_[sending_];
+    data = store_ + message.offset + sending_sent_;
+    size = message.length - sending_sent_;
+  } else {
+    return;
+  }
+
+  const int n = hal::TcpSend(data, std::min(size, kMaxSendBytes));
+  if (n < 0) {
+    Fail("send failed", now_ms);
+    return;
+  }
+  if (n == 0) {
+    return;
+  }
+  last_tx_ms_ = now_ms;
+  if (control_length_ > 0) {
+    control_sent_ += n;
+    if (control_sent_ == control_length_) {
+      control_length_ = control_sent_ = 0;
+    }
+  } else {
+    sending_sent_ += n;
+    Message &message = messages_[sending_];
+    if (sending_sent_ == message.length) {
+      message.sent = true;
+      sending_++;
+      sending_sent_ = 0;
+    }
+  }
+}
+
+void MqttClient::Receive(int64_t now_ms) {
+  uint8_t buffer[kMaxReceiveBytes];
+  const int n = hal::TcpReceive(buffer, sizeof(buffer));
+  if (n < 0) {
+    Fail("connection closed", now_ms);
+    return;
+  }
+  for (int i = 0; i < n; ++i) {
+    const uint8_t byte = buffer[i];
+    bool complete = false;
+    switch (rx_stage_) {
+      case 0:
+        rx_header_ = byte;
+        rx_length_ = rx_shift_ = rx_read_ = 0;
+        rx_payload_at_ = 2;  // Topic length first.
+        rx_in_payload_ = false;
+        rx_subscriber_ = nullptr;
+        rx_stage_ = 1;
+        break;
+      case 1:
+        rx_length_ |= (byte & 0x7f) << rx_shift_;
+        rx_shift_ += 7;
+        if (!(byte & 0x80)) {
+          complete = rx_length_ == 0;
+          rx_stage_ = 2;
+        } else if (rx_shift_ > 21) {
+          Fail("garbled packet", now_ms);
+          return;
+        }
+        break;
+      default:
+        if (rx_header_ >> 4 == kPublish) {
+          i += ReceivePublish(buffer + i, n - i) - 1;
+          complete = rx_read_ == rx_length_;
+          break;
+        }
+        if (rx_read_ < sizeof(rx_body_)) {
+          rx_body_[rx_read_] = byte;
+        }
+        complete = ++rx_read_ == rx_length_;
+        break;
+    }
+    if (complete) {
+      rx_stage_ = 0;
+      last_rx_ms_ = now_ms;
+      HandlePacket(rx_header_, now_ms);
+      if (state_ == State::kBackoff) {
+        return;
+      }
+    }
+  }
+}
+
+size_t MqttClient::ReceivePublish(const uint8_t *data, size_t size) {
+  size = std::min<size_t>(size, rx_length_ - rx_read_);
+  size_t used = 0;
+  // Topic, matched against the subscriptions byte by byte as it comes in,
+  // and packet id.
+  while (used < size && rx_read_ < rx_payload_at_) {
+    const uint8_t byte = data[used];
+    if (rx_read_ < 2) {
+      rx_body_[rx_read_] = byte;
+    } else if (rx_read_ < 2 + rx_topic_length_) {
+      for (size_t i = 0; i < num_subscriptions_; ++i) {
+        if ((rx_topic_match_ & (1u << i)) &&
+            subscriptions_[i].topic[rx_read_ - 2] != byte) {
+          rx_topic_match_ &= ~(1u << i);
+        }
+      }
+    }
+    rx_read_++;
+    used++;
+    if (rx_read_ == 2) {
+      rx_topic_length_ = rx_body_[0] << 8 | rx_body_[1];
+      rx_payload_at_ += rx_topic_length_ + ((rx_header_ & 0x06) ? 2 : 0);
+      rx_topic_match_ = 0;
+      for (size_t i = 0; i < num_subscriptions_; ++i) {
+        if (strlen(subscriptions_[i].topic) == rx_topic_length_) {
+          rx_topic_match_ |= 1u << i;
+        }
+      }
+    }
+  }
+  if (rx_read_ < rx_payload_at_ || rx_payload_at_ > rx_length_) {
+    return used;
+  }
+  if (!rx_in_payload_) {
+    rx_in_payload_ = true;
+    for (size_t i = 0; i < num_subscriptions_ && !rx_subscriber_; ++i) {
+      if (rx_topic_match_ & (1u << i)) {
+        rx_subscriber_ = &subscriptions_[i].subscriber;
+      }
+    }
+    if (rx_subscriber_ && rx_subscriber_->begin) {
+      rx_subscriber_->begin(rx_length_ - rx_payload_at_);
+    }
+  }
+  if (used < size && rx_subscriber_ && rx_subscriber_->data) {
+    rx_subscriber_->data(data + used, size - used);
+  }
+  rx_read_ += size - used;
+  return size;
+}
+
+void MqttClient::HandlePacket(uint8_t header, int64_t now_ms) {
+  switch (header >> 4) {
+    case kConnack:
+      if (state_ != State::kWaitConnack) {
+        break;
+      }
+      if (rx_length_ < 2 || rx_body_[1] != 0) {
+        LOG_WARN(kLogMqtt, "MQTT connection refused, code %d\n",
+                 rx_length_ < 2 ? -1 : rx_body_[1]);
+        Fail("refused", now_ms);
+        break;
+      }
+      state_ = State::kConnected;
+      backoff_ms_ = 0;
+      subscribe_pending_ = (1u << num_subscriptions_) - 1;
+      LOG_INFO(kLogMqtt, "MQTT connected to %s:%d in %lld ms, %u pending\n",
+               broker_, port_, now_ms - state_since_ms_,
+               static_cast<unsigned>(num_messages_));
+      break;
+    case kPuback: {
+      const uint16_t id = rx_body_[0] << 8 | rx_body_[1];
+      for (size_t i = 0; i < num_messages_; ++i) {
+        if (messages_[i].id == id && messages_[i].sent &&
+            !messages_[i].acked) {
+          messages_[i].acked = true;
+          acked_++;
+          break;
+        }
+      }
+      break;
+    }
+    case kPingresp:
+      ping_outstanding_ = false;
+      break;
+    case kSuback:
+      if (rx_length_ < 3 || rx_body_[2] == 0x80) {
+        const uint16_t id = rx_body_[0] << 8 | rx_body_[1];
+        for (size_t i = 0; i < num_subscriptions_; ++i) {
+          if (subscriptions_[i].id == id) {
+            LOG_WARN(kLogMqtt, "MQTT subscribe to %s refused\n",
+                     subscriptions_[i].topic);
+          }
+        }
+      }
+      busy_until_ms_ = now_ms + kRetainedWaitMs;
+      break;
+    case kPublish:
+      // QoS 0 as subscribed, so there is nothing to ack.
+      if (rx_in_payload_ && rx_subscriber_ && rx_subscriber_->end) {
+        rx_subscriber_->end(true);
+      }
+      rx_in_payload_ = false;
+      rx_subscriber_ = nullptr;
+      break;
+    default:
+      break;
+  }
+}
+
+size_t MqttClient::StoreUsed() const {
+  if (num_messages_ == 0) {
+    return 0;
+  }
+  const Message &last = messages_[num_messages_ - 1];
+  return last.offset + last.length;
+}
+
+bool MqttClient::Busy() const {
+  if (control_length_ > 0 || subscribe_pending_ || rx_stage_ != 0) {
+    return true;
+  }
+  for (size_t i = 0; i < num_messages_; ++i) {
+    if (!messages_[i].sent || (messages_[i].id != 0 && !messages_[i].acked)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void MqttClient::Compact() {
+  if (open_) {
+    return;
+  }
+  size_t done = 0;
+  while (done < num_messages_ && (messages_[done].id == 0
+                                      ? messages_[done].sent
+                                      : messages_[done].acked)) {
+    done++;
+  }
+  if (done == 0) {
+    return;
+  }
+  const size_t used = StoreUsed();
+  const size_t drop = done < num_messages_ ? messages_[done].offset : used;
+  memmove(store_, store_ + drop, used - drop);
+  for (size_t i = done; i < num_messages_; ++i) {
+    messages_[i - done] = messages_[i];
+    messages_[i - done].offset -= drop;
+  }
+  num_messages_ -= done;
+  // Only skipped, done messages can be ahead of the send position.
+  sending_ = sending_ > done ? sending_ - done : 0;
+}
+
+bool MqttClient::BeginPublish(const char *topic, size_t length, int qos) {
+  if (open_) {
+    return false;
+  }
+  const size_t topic_length = strlen(topic);
+  const uint32_t remaining = 2 + topic_length + (qos > 0 ? 2 : 0) + length;
+  uint8_t header[5];
+  header[0] = kPublish << 4 | (qos > 0 ? 0x02 : 0);
+  const size_t header_length = 1 + EncodeLength(remaining, header + 1);
+  const size_t total = header_length + remaining;
+  Compact();
+  if (num_messages_ == kMaxMessages || StoreUsed() + total > kStoreBytes) {
+    return false;
+  }
+
+  const size_t offset = StoreUsed();
+  uint8_t *out = store_ + offset;
+  memcpy(out, header, header_length);
+  out = PutString(out + header_length, topic, topic_length);
+  uint16_t id = 0;
+  if (qos > 0) {
+    id = next_id_;
+    next_id_ = next_id_ == UINT16_MAX ? 1 : next_id_ + 1;
+    *out++ = id >> 8;
+    *out++ = id & 0xff;
+  }
+  open_message_ = {static_cast<uint32_t>(offset), static_cast<uint32_t>(total),
+                   id, false, false};
+  open_position_ = out - store_;
+  open_left_ = length;
+  open_ = true;
+  return true;
+}
+
+size_t MqttClient::Write(const uint8_t *data, size_t size) {
+  size = std::min(size, open_ ? open_left_ : 0);
+  memcpy(store_ + open_position_, data, size);
+  open_position_ += size;
+  open_left_ -= size;
+  return size;
+}
+
+bool MqttClient::EndPublish() {
+  if (!open_) {
+    return false;
+  }
+  open_ = false;
+  if (open_left_ != 0) {
+    return false;
+  }
+  messages_[num_messages_++] = open_message_;
+  return true;
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+// MQTT 3.1.1 client as a non-blocking state machine over hal::Tcp*, for
+// publishing only.
+//
+// Nothing in here waits on the network. Poll() moves the connection along by
+// at most one socket send and one receive of bounded size, and a publish only
+// copies into a RAM store, so every call returns in a bounded (small) time and
+// an unreachable broker costs nothing but reconnect attempts, which back off
+// exponentially.
+//
+// Publishes are sent in order, pipelined. QoS 1 ones stay in the store until
+// the broker acks them, with at most kWindow sent and not acked yet, and are
+// sent again (with DUP set) after a reconnect. QoS 0 ones are dropped once
+// written to the socket.
+//
+// A few topics can be subscribed to (at QoS 0), incoming payloads are handed
+// over in pieces as they arrive, so they can be any size.
+
+#include <cstddef>
+#include <cstdint>
+
+class MqttClient {
+ public:
+  static constexpr size_t kStoreBytes = 8192;
+  static constexpr size_t kMaxMessages = 16;
+  static constexpr size_t kWindow = 4;
+  static constexpr size_t kMaxSubscriptions = 2;
+
+  void SetServer(const char *broker, int port);
+  // Strings must outlive the client.
+  void SetCredentials(const char *client_id, const char *user,
+                      const char *password);
+  void SetKeepAlive(int keep_alive_s);
+
+  // Connects, and keeps reconnecting, until Stop(). Start() on a started
+  // client does nothing.
+  void Start(int64_t now_ms);
+  // Closes the connection, publishes not acked yet are kept.
+  void Stop();
+  // Does the next bit of work, returns ms until it wants to be polled again.
+  int64_t Poll(int64_t now_ms);
+
+  // CONNACK received and the connection still up.
+  bool Connected() const { return state_ == State::kConnected; }
+  // Publishes not done yet (QoS 1 not acked, QoS 0 not sent).
+  size_t Pending() const { return num_messages_; }
+  uint32_t Acked() const { return acked_; }
+
+  // Incoming publishes on the subscribed topic. begin() gets the payload
+  // length, data() the payload in order, end() whether all of it came (false
+  // if the connection dropped halfway).
+  struct Subscriber {
+    void (*begin)(size_t length);
+    void (*data)(const uint8_t *data, size_t size);
+    void (*end)(bool complete);
+  };
+  // Subscribed again on every connect, topic must outlive the client. The
+  // same topic (pointer) again only replaces the subscriber. False if there
+  // is no room for another one.
+  bool Subscribe(const char *topic, const Subscriber &subscriber);
+
+  // Publishes a payload of exactly length bytes given by Write() calls. False
+  // if the store has no room for it, nothing is queued then.
+  bool BeginPublish(const char *topic, size_t length, int qos);
+  size_t Write(const uint8_t *data, size_t size);
+  // False if the payload came out short, the publish is dropped then.
+  bool EndPublish();
+
+ private:
+  enum class State { kStopped, kBackoff, kTcpConnecting, kWaitConnack,
+                     kConnected };
+
+  struct Message {
+    uint32_t offset;  // Into store_, the whole PUBLISH packet.
+    uint32_t length;
+    uint16_t id;  // 0 for QoS 0.
+    bool sent;    // Fully written to the socket (this connection or before).
+    bool acked;
+  };
+
+  void Connect(int64_t now_ms);
+  void QueueConnect();
+  void Fail(const char *reason, int64_t now_ms);
+  // Closes the socket and rewinds what was sent for a new connection.
+  void Close();
+  bool QueueControl(const uint8_t *packet, size_t length);
+  void Send(int64_t now_ms);
+  void Receive(int64_t now_ms);
+  void HandlePacket(uint8_t header, int64_t now_ms);
+  // Takes what belongs to the incoming PUBLISH, returns how many bytes.
+  size_t ReceivePublish(const uint8_t *data, size_t size);
+  void QueueSubscribe();
+  // Drops leading messages that are done and moves the rest down.
+  void Compact();
+  size_t StoreUsed() const;
+  bool Busy() const;
+
+  const char *broker_ = "";
+  int port_ = 1883;
+  const char *client_id_ = "";
+  const char *user_ = nullptr;
+  const char *password_ = nullptr;
+  int keep_alive_s_ = 60;
+
+  State state_ = State::kStopped;
+  int64_t state_since_ms_ = 0;
+  int64_t retry_ms_ = 0;
+  int64_t backoff_ms_ = 0;
+  int64_t last_tx_ms_ = 0;
+  int64_t last_rx_ms_ = 0;
+  bool ping_outstanding_ = false;
+
+  struct Subscription {
+    const char *topic;
+    Subscriber subscriber;
+    uint16_t id;  // Of the last SUBSCRIBE, to tell SUBACKs apart.
+  };
+  Subscription subscriptions_[kMaxSubscriptions] = {};
+  size_t num_subscriptions_ = 0;
+  // Bit per subscription, SUBSCRIBE to queue once there is room.
+  uint32_t subscribe_pending_ = 0;
+  int64_t busy_until_ms_ = 0;       // Poll often until then.
+
+  // CONNECT, SUBSCRIBE or PINGREQ on its way out, goes before the store.
+  uint8_t control_[320];
+  size_t control_length_ = 0;
+  size_t control_sent_ = 0;
+
+  uint8_t store_[kStoreBytes];
+  Message messages_[kMaxMessages];
+  size_t num_messages_ = 0;
+  size_t sending_ = 0;       // Message being written to the socket.
+  size_t sending_sent_ = 0;  // Bytes of it written so far.
+  uint16_t next_id_ = 1;
+  uint32_t acked_ = 0;
+
+  // Publish being filled by Write(), not in messages_ yet.
+  bool open_ = false;
+  Message open_message_;
+  size_t open_position_ = 0;
+  size_t open_left_ = 0;
+
+  // Incoming packet: fixed header byte, remaining length (varint), the first
+  // bytes of the body (all we need of the packets we handle).
+  int rx_stage_ = 0;
+  uint8_t rx_header_ = 0;
+  uint32_t rx_length_ = 0;
+  uint32_t rx_shift_ = 0;
+  uint32_t rx_read_ = 0;
+  uint8_t rx_body_[4];
+  // PUBLISH only, where the payload starts and whether we got that far.
+  uint32_t rx_payload_at_ = 0;
+  bool rx_in_payload_ = false;
+  // Bit per subscription whose topic matches the topic read so far, then the
+  // subscriber the payload goes to (nullptr if none).
+  uint32_t rx_topic_length_ = 0;
+  uint32_t rx_topic_match_ = 0;
+  const Subscriber *rx_subscriber_ = nullptr;
+};
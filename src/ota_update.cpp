@@ -0,0 +1,318 @@
+#include "ota_update.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include "hal.h"
+#include "logger.h"
+
+namespace {
+
+constexpr char kMagic[4] = {'G', 'H', 'D', '1'};
+// Boots of the image on trial so far plus one, 0 or missing if none is.
+constexpr char kTrialKey[] = "ota_trial";
+
+constexpr uint32_t kWindowMask = (1u << DeltaPatch::kWindowBits) - 1;
+constexpr int kReferenceBits =
+    1 + DeltaPatch::kWindowBits + DeltaPatch::kCountBits;
+
+uint32_t GetU32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+}  // namespace
+
+void DeltaPatch::Begin() {
+  Abort();
+  work_.reset(new (std::nothrow) Work());
+  status_ = Status::kReceiving;
+  error_ = "";
+  received_ = 0;
+  bits_ = 0;
+  bit_count_ = 0;
+  window_at_ = 0;
+  arguments_read_ = arguments_needed_ = 0;
+  in_data_ = false;
+  old_cached_ = 0;
+  out_length_ = 0;
+  written_ = 0;
+  if (!work_) {
+    Fail("out of memory");
+  }
+}
+
+void DeltaPatch::Abort() {
+  if (status_ == Status::kReceiving) {
+    hal::OtaAbort();
+  }
+  status_ = Status::kIdle;
+  work_.reset();
+}
+
+void DeltaPatch::Fail(const char *error) {
+  hal::OtaAbort();
+  error_ = error;
+  status_ = Status::kFailed;
+  work_.reset();
+  LOG_WARN(kLogOta, "OTA: failed at patch byte %lu, %s\n",
+           static_cast<unsigned long>(received_), error);
+}
+
+DeltaPatch::Status DeltaPatch::Write(const uint8_t *data, size_t size) {
+  if (status_ != Status::kReceiving) {
+    return status_;
+  }
+  size_t used = 0;
+  if (received_ < kHeaderBytes && !Header(data, size, used)) {
+    return status_;
+  }
+  received_ += size - used;
+  Work &work = *work_;
+  for (; used < size && status_ == Status::kReceiving; ++used) {
+    bits_ = bits_ << 8 | data[used];
+    bit_count_ += 8;
+    while (status_ == Status::kReceiving && bit_count_ > 0) {
+      if (bits_ >> (bit_count_ - 1) & 1) {
+        if (bit_count_ < 9) {
+          break;
+        }
+        bit_count_ -= 9;
+        const uint8_t byte = bits_ >> bit_count_;
+        work.window[window_at_++ & kWindowMask] = byte;
+        Put(byte);
+        continue;
+      }
+      if (bit_count_ < kReferenceBits) {
+        break;
+      }
+      bit_count_ -= kReferenceBits;
+      const uint32_t reference = bits_ >> bit_count_;
+      const uint32_t distance =
+          (reference >> kCountBits & kWindowMask) + 1;
+      uint32_t count = (reference & ((1u << kCountBits) - 1)) + 1;
+      if (distance > window_at_) {
+        Fail("corrupt patch");
+        break;
+      }
+      while (count-- > 0 && status_ == Status::kReceiving) {
+        const uint8_t byte = work.window[(window_at_ - distance) & kWindowMask];
+        work.window[window_at_++ & kWindowMask] = byte;
+        Put(byte);
+      }
+    }
+  }
+  return status_;
+}
+
+bool DeltaPatch::Header(const uint8_t *data, size_t size, size_t &used) {
+  used = std::min(size, kHeaderBytes - received_);
+  memcpy(header_ + received_, data, used);
+  received_ += used;
+  if (received_ < kHeaderBytes) {
+    return true;
+  }
+  if (memcmp(header_, kMagic, sizeof(kMagic)) != 0) {
+    Fail("not a patch");
+    return false;
+  }
+  old_size_ = GetU32(header_ + 4);
+  new_size_ = GetU32(header_ + 8 + Sha256::kDigestBytes);
+
+  // Applied to anything but the image it was made from, it would make a
+  // broken one, so that is checked first.
+  Sha256 &sha = work_->sha;
+  sha.Reset();
+  for (uint32_t at = 0; at < old_size_; at += kChunkBytes) {
+    const size_t n = std::min<size_t>(kChunkBytes, old_size_ - at);
+    if (!hal::OtaReadRunning(at, work_->out, n)) {
+      Fail("patch is for a larger image");
+      return false;
+    }
+    sha.Update(work_->out, n);
+  }
+  uint8_t digest[Sha256::kDigestBytes];
+  sha.Final(digest);
+  if (memcmp(digest, header_ + 8, sizeof(digest)) != 0) {
+    Fail("patch is for another image");
+    return false;
+  }
+  sha.Reset();
+  if (!hal::OtaBegin(new_size_)) {
+    Fail("no room for the new image");
+    return false;
+  }
+  LOG_INFO(kLogOta, "OTA: patching the %lu byte image into %lu bytes\n",
+           static_cast<unsigned long>(old_size_),
+           static_cast<unsigned long>(new_size_));
+  return true;
+}
+
+bool DeltaPatch::Put(uint8_t byte) {
+  if (in_data_) {
+    uint8_t value = byte;
+    if (operation_ == 'A') {
+      uint8_t old;
+      if (!OldByte(old_at_++, old)) {
+        return false;
+      }
+      value += old;
+    }
+    if (!Emit(value)) {
+      return false;
+    }
+    in_data_ = --left_ > 0;
+    return true;
+  }
+  if (arguments_read_ < arguments_needed_) {
+    arguments_[arguments_read_++] = byte;
+    return arguments_read_ < arguments_needed_ || StartOperation();
+  }
+  operation_ = byte;
+  arguments_read_ = 0;
+  switch (operation_) {
+    case 'C':
+    case 'A':
+      arguments_needed_ = 8;
+      return true;
+    case 'I':
+      arguments_needed_ = 4;
+      return true;
+    case 'E':
+      Finish();
+      return false;
+  }
+  Fail("corrupt patch");
+  return false;
+}
+
+bool DeltaPatch::StartOperation() {
+  const uint32_t length = GetU32(arguments_ + (operation_ == 'I' ? 0 : 4));
+  if (operation_ != 'I') {
+    old_at_ = GetU32(arguments_);
+    if (old_at_ > old_size_ || length > old_size_ - old_at_) {
+      Fail("patch reads past the old image");
+      return false;
+    }
+  }
+  if (operation_ == 'C') {
+    return CopyOld(old_at_, length);
+  }
+  left_ = length;
+  in_data_ = left_ > 0;
+  return true;
+}
+
+bool DeltaPatch::Emit(uint8_t byte) {
+  if (written_ + out_length_ >= new_size_) {
+    Fail("patch writes past the new image");
+    return false;
+  }
+  work_->out[out_length_++] = byte;
+  return out_length_ < kChunkBytes || Flush();
+}
+
+bool DeltaPatch::Flush() {
+  if (out_length_ == 0) {
+    return true;
+  }
+  work_->sha.Update(work_->out, out_length_);
+  if (!hal::OtaWrite(work_->out, out_length_)) {
+    Fail("flash write failed");
+    return false;
+  }
+  written_ += out_length_;
+  out_length_ = 0;
+  return true;
+}
+
+bool DeltaPatch::CopyOld(uint32_t offset, uint32_t length) {
+  if (length > new_size_ - written_ - out_length_) {
+    Fail("patch writes past the new image");
+    return false;
+  }
+  while (length > 0) {
+    const size_t n = std::min<size_t>(length, kChunkBytes - out_length_);
+    if (!hal::OtaReadRunning(offset, work_->out + out_length_, n)) {
+      Fail("can not read the running image");
+      return false;
+    }
+    offset += n;
+    length -= n;
+    out_length_ += n;
+    if (out_length_ == kChunkBytes && !Flush()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DeltaPatch::OldByte(uint32_t offset, uint8_t &byte) {
+  if (offset - old_cached_at_ >= old_cached_) {
+    const size_t n = std::min<size_t>(sizeof(work_->old), old_size_ - offset);
+    if (!hal::OtaReadRunning(offset, work_->old, n)) {
+      Fail("can not read the running image");
+      return false;
+    }
+    old_cached_at_ = offset;
+    old_cached_ = n;
+  }
+  byte = work_->old[offset - old_cached_at_];
+  return true;
+}
+
+void DeltaPatch::Finish() {
+  if (!Flush()) {
+    return;
+  }
+  if (written_ != new_size_) {
+    Fail("patch ends before the new image does");
+    return;
+  }
+  uint8_t digest[Sha256::kDigestBytes];
+  work_->sha.Final(digest);
+  if (memcmp(digest, header_ + 12 + Sha256::kDigestBytes, sizeof(digest))) {
+    Fail("new image does not match its SHA-256");
+    return;
+  }
+  if (!hal::OtaEnd()) {
+    Fail("new image rejected");
+    return;
+  }
+  OtaTrial::Arm();
+  status_ = Status::kDone;
+  work_.reset();
+  LOG_INFO(kLogOta, "OTA: new image of %lu bytes boots next\n",
+           static_cast<unsigned long>(new_size_));
+}
+
+void OtaTrial::Arm() { hal::NvsSetInt(kTrialKey, 1); }
+
+void OtaTrial::Boot(int max_boots) {
+  int32_t boots = 0;
+  if (!hal::NvsGetInt(kTrialKey, boots) || boots <= 0) {
+    return;
+  }
+  if (boots > max_boots) {
+    LOG_ERROR(kLogOta, "OTA: new image failed %d boots, rolling back\n",
+              max_boots);
+    Fail();
+  }
+  hal::NvsSetInt(kTrialKey, boots + 1);
+  running_ = true;
+  LOG_INFO(kLogOta, "OTA: new image on trial, boot %ld of %d\n",
+           static_cast<long>(boots), max_boots);
+}
+
+void OtaTrial::Pass() {
+  running_ = false;
+  hal::NvsSetInt(kTrialKey, 0);
+  hal::OtaMarkValid();
+  LOG_INFO(kLogOta, "OTA: new image passed its trial\n");
+}
+
+void OtaTrial::Fail() {
+  running_ = false;
+  hal::NvsSetInt(kTrialKey, 0);
+  hal::OtaRollback();
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+// Firmware updates as deltas against the running image, so a release costs
+// kilobytes over the greenhouse link instead of the whole ~1 MB image.
+//
+// make_delta.py diffs two firmware.bin builds into a patch, which is streamed
+// through DeltaPatch in pieces of any size (an HTTP body in setup mode, MQTT
+// chunks otherwise). The patch is decompressed and applied on the fly: the
+// new image goes straight into the app slot that is not running, kChunkBytes
+// at a time, while its SHA-256 is computed. Only if that matches, and the
+// image passes the bootloader's own checks, is it set to boot. RAM use is
+// fixed (~6.5 KB, only while a patch is on its way) however big the image.
+//
+// Patch format, numbers little endian:
+//   "GHD1", u32 old size, old SHA-256, u32 new size, new SHA-256
+// then LZSS compressed (see below) operations, bsdiff style:
+//   'C' u32 old offset, u32 length             copy from the old image
+//   'A' u32 old offset, u32 length, the bytes  old image plus the bytes
+//                                              (mod 256), mostly 0 where only
+//                                              addresses moved
+//   'I' u32 length, the bytes                  new bytes
+//   'E'                                        end
+// LZSS as heatshrink does it, bits MSB first: 1 and 8 bits is a literal, 0,
+// kWindowBits of distance - 1 and kCountBits of length - 1 repeats bytes of
+// the last 2^kWindowBits output.
+//
+// A new image boots on trial, see OtaTrial.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "sha256.h"
+
+class DeltaPatch {
+ public:
+  static constexpr size_t kHeaderBytes = 4 + 2 * (4 + Sha256::kDigestBytes);
+  static constexpr int kWindowBits = 11;
+  static constexpr int kCountBits = 7;
+  // Written to flash at a time, a sector.
+  static constexpr size_t kChunkBytes = 4096;
+
+  enum class Status {
+    kIdle,
+    kReceiving,
+    kDone,    // The new image is set to boot, restart to run it.
+    kFailed,  // See Error(), nothing changed.
+  };
+
+  // Starts over with a new patch, dropping one halfway.
+  void Begin();
+  // The next size bytes of the patch.
+  Status Write(const uint8_t *data, size_t size);
+  // Drops the patch, e.g. when the connection went away.
+  void Abort();
+
+  Status status() const { return status_; }
+  const char *Error() const { return error_; }
+  // Bytes of the patch taken so far, where the next piece has to start.
+  size_t Received() const { return received_; }
+
+ private:
+  // Only while a patch is on its way.
+  struct Work {
+    Sha256 sha;
+    uint8_t window[1 << kWindowBits];
+    uint8_t out[kChunkBytes];
+    uint8_t old[256];
+  };
+
+  void Fail(const char *error);
+  bool Header(const uint8_t *data, size_t size, size_t &used);
+  // Decompressed patch byte, false once done or failed.
+  bool Put(uint8_t byte);
+  bool StartOperation();
+  bool Emit(uint8_t byte);
+  bool Flush();
+  bool CopyOld(uint32_t offset, uint32_t length);
+  bool OldByte(uint32_t offset, uint8_t &byte);
+  void Finish();
+
+  Status status_ = Status::kIdle;
+  const char *error_ = "";
+  size_t received_ = 0;
+  std::unique_ptr<Work> work_;
+
+  uint8_t header_[kHeaderBytes];
+  uint32_t old_size_ = 0;
+  uint32_t new_size_ = 0;
+
+  // LZSS: bits not decoded yet and where the window continues.
+  uint32_t bits_ = 0;
+  int bit_count_ = 0;
+  uint32_t window_at_ = 0;
+
+  // Operation being decoded, its argument bytes and what is left of it.
+  uint8_t operation_ = 0;
+  uint8_t arguments_[8];
+  size_t arguments_read_ = 0;
+  size_t arguments_needed_ = 0;
+  bool in_data_ = false;
+  uint32_t old_at_ = 0;
+  uint32_t left_ = 0;
+
+  // Which bytes of the old image are in Work::old.
+  uint32_t old_cached_at_ = 0;
+  uint32_t old_cached_ = 0;
+  size_t out_length_ = 0;
+  uint32_t written_ = 0;
+};
+
+// A new image is on trial from its first boot until it shows it can get its
+// data out, which main.cpp takes as the broker acking a publish. It goes back
+// to the image before if it restarts (crashes, watchdog) too often or runs out
+// of time first. The boots are counted in NVS.
+class OtaTrial {
+ public:
+  // A new image is set to boot, it starts on trial.
+  static void Arm();
+  // Early on every normal boot. Rolls back, and does not return, if the image
+  // is on trial and this would be boot max_boots + 1.
+  void Boot(int max_boots);
+  bool Running() const { return running_; }
+  // Keeps the image.
+  void Pass();
+  // Goes back to the image before, does not return.
+  void Fail();
+
+ private:
+  bool running_ = false;
+};
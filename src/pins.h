@@ -0,0 +1,13 @@
+#pragma once
+
+// GPIO assignment of the controller board.
+
+#define PUMP_CONTROL 14
+#define PUMP_CONTROL_2 15
+
+#define TANK_PRESSURE 33
+#define LED_RED 16
+#define LED_GREEN 17
+#define LED_BLUE 18
+
+#define SETUP_MODE_PIN 23  // Pull low on startup to enter setup.
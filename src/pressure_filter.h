@@ -0,0 +1,92 @@
+#pragma once
+
+// Fixed point filter pipeline from raw 12 bit ADC samples to a pressure
+// estimate, no floats and a handful of integer ops per sample:
+//
+//   samples -> MainsIntegrator -> StepIir -> estimate
+//
+// MainsIntegrator averages over whole mains periods, which cancels the mains
+// pickup and all its harmonics exactly (its response has zeros at every
+// multiple of the mains frequency). StepIir then smooths what is left, but
+// jumps straight to a new level when the input moves further than noise can
+// explain, so a real pressure step shows up at once.
+//
+// Values after the integrator are counts in Q4 (1/16 count resolution).
+// Everything is header only so the kernels can be driven from any sample
+// source, the ADC stream on the device or synthetic data on the host.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+class MainsIntegrator {
+ public:
+  // e.g. 24000 Hz / 50 Hz = 480. Pick a rate that divides evenly.
+  explicit MainsIntegrator(uint32_t samples_per_period)
+      : samples_per_period_(samples_per_period) {}
+
+  // Drops a partly summed period, e.g. after a gap in the samples.
+  void Reset() {
+    sum_ = 0;
+    count_ = 0;
+  }
+
+  // Feeds samples, writes the mean (Q4) of each period completed to out and
+  // returns how many there were (at most max_out, the rest are dropped).
+  size_t Process(const uint16_t *samples, size_t n, int32_t *out,
+                 size_t max_out) {
+    size_t produced = 0;
+    for (size_t i = 0; i < n; ++i) {
+      sum_ += samples[i];
+      if (++count_ == samples_per_period_) {
+        if (produced < max_out) {
+          // Rounded, the sum stays far from overflow for any sane period.
+          out[produced++] =
+              static_cast<int32_t>((sum_ * 16 + count_ / 2) / count_);
+        }
+        Reset();
+      }
+    }
+    return produced;
+  }
+
+ private:
+  const uint32_t samples_per_period_;
+  uint32_t sum_ = 0;
+  uint32_t count_ = 0;
+};
+
+class StepIir {
+ public:
+  // alpha_q15: weight of a new value (32768 = 1.0). step_q4: a difference to
+  // the estimate larger than this is taken as a real change.
+  StepIir(int32_t alpha_q15, int32_t step_q4)
+      : alpha_q15_(alpha_q15), step_q4_(step_q4) {}
+
+  // Returns the new estimate, Q4.
+  int32_t Update(int32_t value_q4) {
+    // The state keeps 12 more fraction bits so small steps do not get lost.
+    const int32_t value = value_q4 << kExtraBits;
+    if (!primed_ || std::abs(value_q4 - Estimate()) > step_q4_) {
+      state_ = value;
+      primed_ = true;
+    } else {
+      state_ += static_cast<int32_t>(
+          (static_cast<int64_t>(value - state_) * alpha_q15_) >> 15);
+    }
+    return Estimate();
+  }
+
+  int32_t Estimate() const { return state_ >> kExtraBits; }
+
+ private:
+  static constexpr int kExtraBits = 12;
+
+  const int32_t alpha_q15_;
+  const int32_t step_q4_;
+  int32_t state_ = 0;
+  bool primed_ = false;
+};
+
+// Q4 counts to the nearest whole count.
+constexpr int32_t RoundQ4(int32_t value_q4) { return (value_q4 + 8) >> 4; }
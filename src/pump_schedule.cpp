@@ -0,0 +1,113 @@
+#include "pump_schedule.h"
+
+#include <algorithm>
+#include <utility>
+
+int32_t PumpSchedule::MsOfWeek(int64_t epoch_ms) {
+  constexpr int64_t kThursday = 4;
+  return (epoch_ms + kThursday * kDayMs) % kWeekMs;
+}
+
+bool PumpSchedule::Add(int32_t start_ms, int32_t length_ms) {
+  if (length_ms <= 0) {
+    return true;
+  }
+  length_ms = std::min(length_ms, kWeekMs);
+  const int32_t end_ms = start_ms + length_ms;
+  if (end_ms <= kWeekMs) {
+    return AddRun(start_ms, end_ms);
+  }
+  return AddRun(start_ms, kWeekMs) && AddRun(0, end_ms - kWeekMs);
+}
+
+bool PumpSchedule::AddRun(int32_t start_ms, int32_t end_ms) {
+  const int count = SwitchCount();
+  // Runs overlapping or touching the new one, [first, last) in pairs.
+  int first = 0;
+  while (first < count && switches_[first + 1] < start_ms) {
+    first += 2;
+  }
+  int last = first;
+  while (last < count && switches_[last] <= end_ms) {
+    last += 2;
+  }
+  if (first < last) {
+    start_ms = std::min(start_ms, switches_[first]);
+    end_ms = std::max(end_ms, switches_[last - 2 + 1]);
+  }
+  if (count - (last - first) + 2 > kMaxSwitches) {
+    return false;
+  }
+  switches_.erase(switches_.begin() + first, switches_.begin() + last);
+  switches_.insert(switches_.begin() + first, {start_ms, end_ms});
+  return true;
+}
+
+void PumpSchedule::Finish() {
+  // A run from Sunday 00:00 means we start on and its start is no switch,
+  // same for a run up to the end of the week.
+  on_at_week_start_ = !switches_.empty() && switches_.front() == 0;
+  if (on_at_week_start_) {
+    switches_.erase(switches_.begin());
+  }
+  if (!switches_.empty() && switches_.back() == kWeekMs) {
+    switches_.pop_back();
+  }
+  switches_.shrink_to_fit();
+  BuildHourIndex();
+}
+
+bool PumpSchedule::Restore(bool on_at_week_start,
+                           std::vector<int32_t> switches) {
+  bool valid = switches.size() <= static_cast<size_t>(kMaxSwitches);
+  int32_t previous = -1;
+  for (size_t i = 0; valid && i < switches.size(); ++i) {
+    valid = switches[i] > previous && switches[i] < kWeekMs;
+    previous = switches[i];
+  }
+  switches_ = valid ? std::move(switches) : std::vector<int32_t>();
+  on_at_week_start_ = valid && on_at_week_start;
+  BuildHourIndex();
+  return valid;
+}
+
+void PumpSchedule::BuildHourIndex() {
+  const int count = SwitchCount();
+  int i = 0;
+  for (int hour = 0; hour <= 7 * 24; ++hour) {
+    while (i < count && switches_[i] < hour * kHourMs) {
+      ++i;
+    }
+    hour_index_[hour] = i;
+  }
+}
+
+int PumpSchedule::Passed(int32_t ms_of_week) const {
+  // The switches of this hour, an hour later is the first one after it.
+  const int hour = ms_of_week / kHourMs;
+  const auto first = switches_.begin() + hour_index_[hour];
+  const auto last = switches_.begin() + hour_index_[hour + 1];
+  return std::upper_bound(first, last, ms_of_week) - switches_.begin();
+}
+
+PumpSchedule::State PumpSchedule::At(int32_t ms_of_week) const {
+  if (switches_.empty()) {
+    return {on_at_week_start_, kWeekMs};
+  }
+  // Each switch passed since the start of the week toggles.
+  const int passed = Passed(ms_of_week);
+  const bool on = on_at_week_start_ != (passed % 2 == 1);
+  const int32_t next = passed < SwitchCount() ? switches_[passed]
+                                              : switches_.front() + kWeekMs;
+  return {on, next - ms_of_week};
+}
+
+int32_t PumpSchedule::MsSinceSwitch(int32_t ms_of_week) const {
+  if (switches_.empty()) {
+    return kWeekMs;
+  }
+  const int passed = Passed(ms_of_week);
+  const int32_t previous =
+      passed > 0 ? switches_[passed - 1] : switches_.back() - kWeekMs;
+  return ms_of_week - previous;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// When the pump runs over a week, stored as the sorted times at which the pump
+// switches so the pump task can look up the state and sleep until exactly the
+// next switch instead of polling.
+//
+// Intervals are merged as they are added, so the switches grow with the
+// number of separate on-periods per week, not with how many (overlapping)
+// intervals are configured, and Finish() trims them to that.
+class PumpSchedule {
+ public:
+  static constexpr int32_t kHourMs = 3600 * 1000;
+  static constexpr int32_t kDayMs = 24 * kHourMs;
+  static constexpr int32_t kWeekMs = 7 * kDayMs;
+  // What the hour index can address.
+  static constexpr int kMaxSwitches = UINT16_MAX;
+
+  // UTC ms since Sunday 00:00 for an Epoch time (1.1.1970 was a Thursday).
+  static int32_t MsOfWeek(int64_t epoch_ms);
+
+  // Turns the pump on for [start_ms, start_ms + length_ms) of the UTC week,
+  // wrapping from Saturday into Sunday. False if there was no room.
+  bool Add(int32_t start_ms, int32_t length_ms);
+  // Call once after the last Add().
+  void Finish();
+  // Sets the finished state as SwitchCount()/Switch()/OnAtWeekStart() gave
+  // it, false (and empty) if switches is not ascending within the week.
+  bool Restore(bool on_at_week_start, std::vector<int32_t> switches);
+
+  struct State {
+    bool on;
+    // Until the state changes, kWeekMs if it never does.
+    int32_t ms_to_next;
+  };
+  State At(int32_t ms_of_week) const;
+  // How long ago the state last changed, kWeekMs if it never does.
+  int32_t MsSinceSwitch(int32_t ms_of_week) const;
+
+  int SwitchCount() const { return static_cast<int>(switches_.size()); }
+  int32_t Switch(int i) const { return switches_[i]; }
+  const int32_t *Switches() const { return switches_.data(); }
+  bool OnAtWeekStart() const { return on_at_week_start_; }
+
+ private:
+  bool AddRun(int32_t start_ms, int32_t end_ms);
+  void BuildHourIndex();
+  // Number of switches at or before ms_of_week.
+  int Passed(int32_t ms_of_week) const;
+
+  // While adding: flattened sorted disjoint on-runs [start, end) pairs. After
+  // Finish(): ascending ms of the week where the pump toggles.
+  std::vector<int32_t> switches_;
+  // State between Sunday 00:00 and the first switch.
+  bool on_at_week_start_ = false;
+  // First switch in each hour of the week, a lookup binary searches only the
+  // switches of its hour.
+  uint16_t hour_index_[7 * 24 + 1] = {};
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// Samples collected between two publishes: min/max/mean/last over every sample
+// added, plus the latest N samples with their timestamps in a ring buffer, so
+// a long window costs no more memory and loses only raw samples, never stats.
+template <size_t N>
+class SampleBatch {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+ public:
+  struct Sample {
+    int64_t time_ms;
+    int32_t value;
+  };
+
+  void Add(int64_t time_ms, int32_t value) {
+    if (size_ == N) {
+      first_ = (first_ + 1) & (N - 1);  // Overwrite the oldest.
+    } else {
+      size_++;
+    }
+    samples_[(first_ + size_ - 1) & (N - 1)] = {time_ms, value};
+    min_ = count_ ? std::min(min_, value) : value;
+    max_ = count_ ? std::max(max_, value) : value;
+    sum_ += value;
+    last_ = value;
+    count_++;
+  }
+
+  void Clear() {
+    first_ = size_ = 0;
+    count_ = 0;
+    sum_ = 0;
+  }
+
+  // All samples since Clear(), Min() etc. are only valid if not 0.
+  uint32_t Count() const { return count_; }
+  int32_t Min() const { return min_; }
+  int32_t Max() const { return max_; }
+  float Mean() const { return count_ ? static_cast<float>(sum_) / count_ : 0; }
+  int32_t Last() const { return last_; }
+
+  // Samples still held, At(0) is the oldest.
+  size_t Size() const { return size_; }
+  const Sample &At(size_t i) const { return samples_[(first_ + i) & (N - 1)]; }
+
+ private:
+  Sample samples_[N];
+  size_t first_ = 0;
+  size_t size_ = 0;
+  uint32_t count_ = 0;
+  int64_t sum_ = 0;
+  int32_t min_ = 0;
+  int32_t max_ = 0;
+  int32_t last_ = 0;
+};
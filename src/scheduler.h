@@ -0,0 +1,225 @@
+#pragma once
+
+// Deadline ordered scheduler for the cooperative tasks of loop().
+//
+// Tasks are described by a constexpr TaskDescriptor table and run through
+// TaskBody<Context, I> specializations, so dispatching needs no std::function,
+// no heap and no virtual calls. Each priority level keeps its tasks in a small
+// binary min-heap on deadline (earliest deadline first within a level), and a
+// due task never waits behind a due task of a less urgent level.
+//
+// With TASK_METRICS every run is timed and recorded, see Metrics().
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "hal.h"
+#include "task_metrics.h"
+
+struct TaskDescriptor {
+  const char *name;
+  // 0 is most urgent, must be < kMaxTaskPriorities.
+  uint8_t priority;
+  // Worst case run time we expect of the task. A task that would still be
+  // running when a more urgent task becomes due is held back once, so the
+  // urgent one gets to go first.
+  int32_t budget_ms;
+};
+
+constexpr int kMaxTaskPriorities = 4;
+
+// Specialize for every task index I of the table:
+//   static int64_t Run(Context &context);
+// returning ms until the task wants to run again.
+template <typename Context, size_t I>
+struct TaskBody;
+
+template <typename Context, size_t N>
+class Scheduler {
+  static_assert(N <= 32, "Task sets are tracked in a uint32_t");
+
+ public:
+  Scheduler(const TaskDescriptor (&tasks)[N], int64_t max_backlog_ms)
+      : tasks_(tasks), max_backlog_ms_(max_backlog_ms) {
+    // All deadlines are equal to start with, which is trivially a valid heap.
+    for (size_t i = 0; i < N; ++i) {
+      const int level = tasks[i].priority;
+      heap_[level][size_[level]++] = i;
+    }
+  }
+
+  // Runs every due task at most once, most urgent first, and returns the
+  // earliest deadline (ms) left afterwards. now_ms() is called before each
+  // pick since tasks take time.
+  //
+  // A task's next deadline is its previous one plus what it returned, but we
+  // allow the previous one to be at most max_backlog_ms in the past. This
+  // prevents tasks playing catchup with realtime forever.
+  template <typename NowFn>
+  int64_t Dispatch(Context &context, NowFn now_ms) {
+    if (!started_) {
+      // Everything is due on the first call.
+      std::fill(deadline_ms_, deadline_ms_ + N, now_ms());
+      started_ = true;
+    }
+    uint32_t ran = 0;
+    int level;
+    while ((level = PickLevel(now_ms(), ran)) >= 0) {
+      const uint8_t task = heap_[level][0];
+      const int64_t now = now_ms();
+      ran |= 1u << task;
+      deferred_ &= ~(1u << task);
+      const int64_t late_ms = now - deadline_ms_[task];
+      max_lateness_ms_[task] = std::max(max_lateness_ms_[task], late_ms);
+#if TASK_METRICS
+      const uint32_t start_cycles = hal::CycleCount();
+#endif
+      const int64_t next_ms = Run(context, task, std::make_index_sequence<N>());
+#if TASK_METRICS
+      const uint32_t run_us =
+          hal::CyclesToMicros(hal::CycleCount() - start_cycles);
+      metrics_[task].Record(run_us, late_ms, late_ms > max_backlog_ms_);
+#endif
+      deadline_ms_[task] =
+          std::max(deadline_ms_[task], now - max_backlog_ms_) + next_ms;
+      SiftDown(level);
+    }
+    return NextDeadlineMs();
+  }
+
+  // A held back task is due again when the more urgent one it let go first
+  // is, not at its own deadline, which already passed.
+  int64_t NextDeadlineMs() const {
+    int64_t next = INT64_MAX;
+    for (int level = 0; level < kMaxTaskPriorities; ++level) {
+      if (size_[level] == 0) {
+        continue;
+      }
+      const uint8_t task = heap_[level][0];
+      int64_t deadline = deadline_ms_[task];
+      if (deferred_ & (1u << task)) {
+        deadline = std::max(deadline, UrgentDeadline(level));
+      }
+      next = std::min(next, deadline);
+    }
+    return next;
+  }
+
+  // Pulls the deadline of task in to now_ms, e.g. when an event woke us.
+  void MakeDue(size_t task, int64_t now_ms) {
+    if (deadline_ms_[task] <= now_ms) {
+      return;
+    }
+    deadline_ms_[task] = now_ms;
+    SiftUp(tasks_[task].priority, task);
+  }
+
+  int64_t DeadlineMs(size_t task) const { return deadline_ms_[task]; }
+  // Worst start time past the deadline seen so far.
+  int64_t MaxLatenessMs(size_t task) const { return max_lateness_ms_[task]; }
+  const TaskDescriptor &Descriptor(size_t task) const { return tasks_[task]; }
+
+#if TASK_METRICS
+  // Since the last ResetMetrics(), which a task may call from its Run() (its
+  // own run then counts towards the new period).
+  const TaskMetrics &Metrics(size_t task) const { return metrics_[task]; }
+  void ResetMetrics() { std::fill(metrics_, metrics_ + N, TaskMetrics()); }
+#endif
+
+ private:
+  // Level whose earliest task should run now, or -1 if none should.
+  int PickLevel(int64_t now, uint32_t ran) {
+    for (int level = 0; level < kMaxTaskPriorities; ++level) {
+      if (size_[level] == 0) {
+        continue;
+      }
+      const uint8_t task = heap_[level][0];
+      const uint32_t bit = 1u << task;
+      if (deadline_ms_[task] > now || (ran & bit)) {
+        continue;
+      }
+      if (!(deferred_ & bit) &&
+          UrgentDeadlineBefore(level, now + tasks_[task].budget_ms)) {
+        // Let the more urgent task go first, we run right after it.
+        deferred_ |= bit;
+        return -1;
+      }
+      return level;
+    }
+    return -1;
+  }
+
+  bool UrgentDeadlineBefore(int level, int64_t time_ms) const {
+    return UrgentDeadline(level) < time_ms;
+  }
+
+  // Earliest deadline of the levels more urgent than level.
+  int64_t UrgentDeadline(int level) const {
+    int64_t earliest = INT64_MAX;
+    for (int urgent = 0; urgent < level; ++urgent) {
+      if (size_[urgent]) {
+        earliest = std::min(earliest, deadline_ms_[heap_[urgent][0]]);
+      }
+    }
+    return earliest;
+  }
+
+  // Restores the heap after the deadline at the top of level grew.
+  void SiftDown(int level) {
+    uint8_t *heap = heap_[level];
+    const size_t size = size_[level];
+    size_t i = 0;
+    while (true) {
+      size_t earliest = i;
+      for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < size;
+           ++child) {
+        if (deadline_ms_[heap[child]] < deadline_ms_[heap[earliest]]) {
+          earliest = child;
+        }
+      }
+      if (earliest == i) {
+        return;
+      }
+      std::swap(heap[i], heap[earliest]);
+      i = earliest;
+    }
+  }
+
+  // Restores the heap after the deadline of task shrunk.
+  void SiftUp(int level, size_t task) {
+    uint8_t *heap = heap_[level];
+    size_t i = std::find(heap, heap + size_[level], task) - heap;
+    while (i > 0) {
+      const size_t parent = (i - 1) / 2;
+      if (deadline_ms_[heap[parent]] <= deadline_ms_[heap[i]]) {
+        return;
+      }
+      std::swap(heap[i], heap[parent]);
+      i = parent;
+    }
+  }
+
+  // Compiles to a compare chain (or jump table) over the task bodies.
+  template <size_t... I>
+  static int64_t Run(Context &context, size_t task, std::index_sequence<I...>) {
+    int64_t next_ms = 0;
+    ((task == I ? (next_ms = TaskBody<Context, I>::Run(context), true)
+                : false) ||
+     ...);
+    return next_ms;
+  }
+
+  const TaskDescriptor (&tasks_)[N];
+  const int64_t max_backlog_ms_;
+  int64_t deadline_ms_[N] = {};
+  int64_t max_lateness_ms_[N] = {};
+#if TASK_METRICS
+  TaskMetrics metrics_[N] = {};
+#endif
+  uint8_t heap_[kMaxTaskPriorities][N] = {};
+  uint8_t size_[kMaxTaskPriorities] = {};
+  uint32_t deferred_ = 0;
+  bool started_ = false;
+};
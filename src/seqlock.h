@@ -0,0 +1,55 @@
+#pragma once
+
+// Latest value of a small struct written by one task and read by others
+// without locks. The writer never waits; a reader that overlaps a write simply
+// reads again, which is fine for a few dozen bytes written now and then.
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+template <typename T>
+class Seqlock {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Seqlock copies T as raw words");
+
+ public:
+  Seqlock() { Write(T()); }
+
+  // Single writer only.
+  void Write(const T &value) {
+    uint32_t words[kWords] = {};
+    memcpy(words, &value, sizeof(T));
+    const uint32_t seq = seq_.load(std::memory_order_relaxed);
+    seq_.store(seq + 1, std::memory_order_relaxed);  // Odd: write going on.
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kWords; ++i) {
+      words_[i].store(words[i], std::memory_order_relaxed);
+    }
+    seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  T Read() const {
+    uint32_t words[kWords];
+    uint32_t before;
+    uint32_t after;
+    do {
+      before = seq_.load(std::memory_order_acquire);
+      for (size_t i = 0; i < kWords; ++i) {
+        words[i] = words_[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = seq_.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    T value;
+    memcpy(&value, words, sizeof(T));
+    return value;
+  }
+
+ private:
+  static constexpr size_t kWords = (sizeof(T) + 3) / 4;
+
+  std::atomic<uint32_t> seq_{0};
+  std::atomic<uint32_t> words_[kWords] = {};
+};
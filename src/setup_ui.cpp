@@ -1,43 +1,24 @@
 #include "setup_ui.h"
 
-#include <SPIFFS.h>
-#include <WebServer.h>
-#include <WiFi.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <strings.h>
+
+#include "config_upload.h"
+#include "hal.h"
+#include "ota_update.h"
+#include "setup_ui_assets.h"
 
 namespace {
-const char* kSetupHtmlPath = "/setup.html.gz";
-const char* kConfigJsonPath = "/config.json";
-const char* kPostBodyArgName = "plain";
+const char* kConfigTempPath = "/config.tmp.json";
 const char* ssid = "Greenhouse";
 const char* password = "Tomatoes";
-const IPAddress local_ip(192, 168, 42, 1);
-const IPAddress gateway(192, 168, 42, 1);
-const IPAddress subnet(255, 255, 255, 0);
+const uint8_t local_ip[4] = {192, 168, 42, 1};
 const int kPort = 80;
 
-void RunWebServer() {
-  WebServer server(kPort);
-
-  server.on("/", HTTP_GET, [&]() {
-    if (SPIFFS.exists(kSetupHtmlPath)) {
-      File file = SPIFFS.open(kSetupHtmlPath, "r");
-      // streamFile adds server.sendHeader("Content-Encoding", "gzip", true);
-      server.streamFile(file, "text/html");
-      file.close();
-    } else {
-      server.send(404, "text/plain", "File not found");
-    }
-  });
-
-  server.on("/api/settings", HTTP_GET, [&]() {
-    if (SPIFFS.exists(kConfigJsonPath)) {
-      File file = SPIFFS.open(kConfigJsonPath, "r");
-      String settings = file.readString();
-      file.close();
-      server.send(200, "application/json", settings);
-      Serial.println("Responded with configs loaded from file.");
-    } else {
-      server.send(200, "application/json", R"({
+const char kDefaultSettings[] = R"({
         "wifi": {
           "ssid": "",
           "password": ""
@@ -51,103 +32,287 @@ void RunWebServer() {
           "user": "",
           "password": "",
           "deviceId": "",
-          "topic": ""
+          "topic": "",
+          "encoding": "json",
+          "publishWindowSec": 60,
+          "rawSamples": false
         },
         "pumpSchedule": {
           "pump": [],
           "utcOffset": 3
         }
-      })");
-      Serial.println("Responded with empty config (no file?).");
-    }
-  });
+      })";
 
-  server.on("/api/save-settings", HTTP_POST, [&]() {
-    if (server.hasArg(kPostBodyArgName)) {
-      String body = server.arg(kPostBodyArgName);
-      File file = SPIFFS.open("/config.json", "w");
-      if (file) {
-        Serial.println("Saving settings...");
-        file.print(body);
-        file.close();
-        server.send(200, "text/plain", "Settings saved");
-        Serial.println("Settings saved successfully");
-      } else {
-        server.send(500, "text/plain", "Failed to save settings");
-      }
-    } else {
-      server.send(400, "text/plain", "Bad Request");
-      Serial.println("FAILED to save settings");
+// True if the Accept-Encoding list has coding, and not with q=0.
+bool AcceptsEncoding(const char* header, const char* coding) {
+  const size_t length = strlen(coding);
+  const char* p = header;
+  while (*p) {
+    p += strspn(p, " ,");
+    const size_t token = strcspn(p, " ;,");
+    if (token == length && strncasecmp(p, coding, length) == 0) {
+      const char* end = p + strcspn(p, ",");
+      const char* q = strstr(p, "q=");
+      return !(q && q < end && strtod(q + 2, nullptr) == 0);
     }
-  });
-
-  server.on("/api/reboot", HTTP_POST, [&]() {
-    Serial.println("Reboot requested!");
-    server.send(200, "text/plain", "Rebooting...");
-    delay(1000);
-    ESP.restart();
-  });
+    p += strcspn(p, ",");
+  }
+  return false;
+}
 
-  server.on("/api/factory", HTTP_GET, [&]() {
-    if (!server.hasArg("reset")) {
-      server.send(400, "text/plain", "Missing parameter");
-      return;
+// The UI is compiled in (see compress_files.py), so it goes out straight from
+// flash and always matches the firmware. It is sent with a strong ETag
+// (content hash + encoding) and the browser revalidates it with
+// If-None-Match, which costs a 304 instead of ~50K over the soft AP.
+void HandleAsset(HttpRequest& request, HttpResponse& response) {
+  const EmbeddedAsset* asset = nullptr;
+  for (const EmbeddedAsset& candidate : kEmbeddedAssets) {
+    if (strcmp(candidate.path, request.path) == 0) {
+      asset = &candidate;
     }
+  }
+  if (!asset) {
+    response.Send(404, "text/plain", "File not found");
+    return;
+  }
+  // Browsers only offer br over HTTPS, gzip is what they usually get here.
+  const bool br = AcceptsEncoding(request.accept_encoding, "br");
+  response.AddHeader("Vary", "Accept-Encoding");
+  char etag[40];
+  snprintf(etag, sizeof(etag), "\"%s-%s\"", asset->etag, br ? "br" : "gz");
+  response.AddHeader("ETag", etag);
+  response.AddHeader("Cache-Control", "no-cache");
+  if (strstr(request.if_none_match, etag) ||
+      strcmp(request.if_none_match, "*") == 0) {
+    response.Send(304, asset->content_type);
+    return;
+  }
+  response.AddHeader("Content-Encoding", br ? "br" : "gzip");
+  response.SendStatic(200, asset->content_type, br ? asset->br : asset->gzip,
+                      br ? asset->br_length : asset->gzip_length);
+}
 
-    String body = server.arg("doit");
-    if (body != "42") {
-      server.send(400, "text/plain", "Invalid parameter value");
-      return;
-    }
+void HandleGetSettings(HttpRequest& request, HttpResponse& response) {
+  hal::File file = hal::File::Open(kConfigJsonPath, "r");
+  if (!file) {
+    file = hal::File::Open(kConfigBackupPath, "r");  // Cut off mid save.
+  }
+  if (file) {
+    response.SendFile(200, "application/json", file);
+    Serial.println("Responded with configs loaded from file.");
+  } else {
+    response.SendStatic(200, "application/json",
+                        reinterpret_cast<const uint8_t*>(kDefaultSettings),
+                        sizeof(kDefaultSettings) - 1);
+    Serial.println("Responded with empty config (no file?).");
+  }
+}
 
-    if (!SPIFFS.exists(kConfigJsonPath)) {
-      server.send(404, "text/plain", "Config file not found");
-      return;
-    }
+// A save-settings body on its way in. One at a time, a second request in the
+// meantime gets a 409.
+ConfigUpload settings_upload(kConfigTempPath);
+const HttpRequest* settings_owner = nullptr;
+void (*settings_saved)() = nullptr;
 
-    if (SPIFFS.remove(kConfigJsonPath)) {
-      server.send(200, "text/plain", "Config file deleted");
-    } else {
-      server.send(500, "text/plain", "Failed to delete config file");
+void SaveSettingsBody(HttpRequest& request, const uint8_t* data, size_t size) {
+  if (!request.state) {
+    request.state = &settings_upload;
+    if (settings_owner) {
+      return;  // Not ours to write, only drained.
     }
-  });
+    settings_owner = &request;
+    settings_upload.Begin(request.content_length);
+  }
+  if (settings_owner != &request) {
+    return;
+  }
+  if (!data) {
+    settings_upload.Abort();  // Connection gone.
+    settings_owner = nullptr;
+    return;
+  }
+  settings_upload.Write(data, size);
+}
+
+void HandleSaveSettings(HttpRequest& request, HttpResponse& response) {
+  if (request.content_length == 0) {
+    response.Send(400, "text/plain", "Bad Request");
+    Serial.println("FAILED to save settings");
+    return;
+  }
+  if (settings_owner != &request) {
+    response.Send(409, "text/plain", "Another save is in progress");
+    return;
+  }
+  settings_owner = nullptr;
+  char message[96];
+  switch (settings_upload.Commit()) {
+    case ConfigUpload::Result::kSaved:
+      response.Send(200, "text/plain", "Settings saved");
+      Serial.printf("Settings saved successfully, %lu bytes\n",
+                    static_cast<unsigned long>(request.content_length));
+      if (settings_saved) {
+        settings_saved();
+      }
+      break;
+    case ConfigUpload::Result::kUnchanged:
+      response.Send(200, "text/plain", "Settings unchanged");
+      break;
+    case ConfigUpload::Result::kTooLarge:
+      response.Send(413, "text/plain", "Settings too large");
+      break;
+    case ConfigUpload::Result::kInvalid:
+      snprintf(message, sizeof(message), "Invalid settings: %s",
+               settings_upload.Error());
+      response.Send(400, "text/plain", message);
+      Serial.printf("FAILED to save settings, %s\n", message);
+      break;
+    case ConfigUpload::Result::kFailed:
+      response.Send(500, "text/plain", "Failed to save settings");
+      Serial.println("FAILED to save settings, file system");
+      break;
+  }
+}
 
-  server.on("/ping", [&]() {
-    char buffer[32];
-    snprintf(buffer, sizeof(buffer), "Pong @ %d.", millis());
-    server.send(200, "text/plain", buffer); 
+void HandleReboot(HttpRequest& request, HttpResponse& response) {
+  Serial.println("Reboot requested!");
+  response.Send(200, "text/plain", "Rebooting...");
+  response.OnSent([] {
+    hal::DelayMs(1000);  // Let the response leave.
+    hal::Restart();
   });
+}
 
-  server.begin();
-  Serial.printf("Web server started at: %s:%d\n",
-                WiFi.softAPIP().toString().c_str(), kPort);
+// A firmware patch posted to /api/ota, see ota_update.h. One at a time too.
+DeltaPatch ota_patch;
+const HttpRequest* ota_owner = nullptr;
 
-  while (true) {
-    server.handleClient();
+void OtaBody(HttpRequest& request, const uint8_t* data, size_t size) {
+  if (!request.state) {
+    request.state = &ota_patch;
+    if (ota_owner) {
+      return;
+    }
+    ota_owner = &request;
+    ota_patch.Begin();
+  }
+  if (ota_owner != &request) {
+    return;
   }
+  if (!data) {
+    ota_patch.Abort();
+    ota_owner = nullptr;
+    return;
+  }
+  ota_patch.Write(data, size);
 }
-void WifiAccessPoint() {
-  // Start WiFi in Access Point mode
-  WiFi.softAP(ssid, password);
 
-  // Configure the Access Point IP address
-  WiFi.softAPConfig(local_ip, gateway, subnet);
+void HandleOta(HttpRequest& request, HttpResponse& response) {
+  if (request.content_length == 0) {
+    response.Send(400, "text/plain", "Bad Request");
+    return;
+  }
+  if (ota_owner != &request) {
+    response.Send(409, "text/plain", "Another update is in progress");
+    return;
+  }
+  ota_owner = nullptr;
+  char message[96];
+  switch (ota_patch.status()) {
+    case DeltaPatch::Status::kDone:
+      Serial.println("Update installed, rebooting into it");
+      response.Send(200, "text/plain", "Update installed, rebooting...");
+      response.OnSent([] {
+        hal::DelayMs(1000);
+        hal::Restart();
+      });
+      break;
+    case DeltaPatch::Status::kFailed:
+      snprintf(message, sizeof(message), "Update failed: %s",
+               ota_patch.Error());
+      response.Send(400, "text/plain", message);
+      break;
+    default:
+      ota_patch.Abort();
+      response.Send(400, "text/plain", "Update failed: patch cut short");
+      break;
+  }
+}
 
-  // Log the IP address
-  if (SPIFFS.begin(true)) {
-    Serial.println("SPIFFS mounted successfully");
+void HandleFactory(HttpRequest& request, HttpResponse& response) {
+  char value[8];
+  if (!request.Query("reset", value, sizeof(value))) {
+    response.Send(400, "text/plain", "Missing parameter");
+    return;
+  }
+  if (!request.Query("doit", value, sizeof(value)) || strcmp(value, "42")) {
+    response.Send(400, "text/plain", "Invalid parameter value");
+    return;
+  }
+  if (!hal::FsExists(kConfigJsonPath)) {
+    response.Send(404, "text/plain", "Config file not found");
+    return;
+  }
+  hal::FsRemove(kConfigBackupPath);  // Or it would be booted instead.
+  if (hal::FsRemove(kConfigJsonPath)) {
+    response.Send(200, "text/plain", "Config file deleted");
   } else {
-    Serial.println("SPIFFS mount failed");
+    response.Send(500, "text/plain", "Failed to delete config file");
   }
+}
 
-  Serial.println("Access Point started");
-  Serial.print("IP Address: ");
-  Serial.println(WiFi.softAPIP());
+void HandlePing(HttpRequest& request, HttpResponse& response) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "Pong @ %lu.",
+           static_cast<unsigned long>(hal::Millis()));
+  response.Send(200, "text/plain", buffer);
 }
 
 }  // namespace
 
+void SetupUI::OnSettingsSaved(void (*callback)()) { settings_saved = callback; }
+
+bool SetupUI::Start(int port) {
+  for (const EmbeddedAsset& asset : kEmbeddedAssets) {
+    server_.On({HttpMethod::kGet, asset.path, HandleAsset, nullptr});
+  }
+  server_.On({HttpMethod::kGet, "/api/settings", HandleGetSettings, nullptr});
+  server_.On({HttpMethod::kPost, "/api/save-settings", HandleSaveSettings,
+              SaveSettingsBody});
+  server_.On({HttpMethod::kPost, "/api/reboot", HandleReboot, nullptr});
+  server_.On({HttpMethod::kGet, "/api/factory", HandleFactory, nullptr});
+  server_.On({HttpMethod::kGet, "/ping", HandlePing, nullptr});
+  return server_.Start(port);
+}
+
+bool SetupUI::StartApi(int port, const char* token) {
+  if (!server_.RequireToken(token)) {
+    return false;
+  }
+  server_.On({HttpMethod::kPost, "/api/save-settings", HandleSaveSettings,
+              SaveSettingsBody});
+  return server_.Start(port);
+}
+
+bool SetupUI::AddOtaRoute() {
+  return server_.On({HttpMethod::kPost, "/api/ota", HandleOta, OtaBody});
+}
+
 void SetupUI::run() {
-  WifiAccessPoint();
-  RunWebServer();
+  hal::WifiStartAccessPoint(ssid, password, local_ip);
+  if (hal::FsMount()) {
+    Serial.println("SPIFFS mounted successfully");
+  } else {
+    Serial.println("SPIFFS mount failed");
+  }
+  if (!AddOtaRoute() || !Start(kPort)) {
+    Serial.println("Web server failed to start");
+    return;
+  }
+  Serial.printf("Web server started on port %d\n", Port());
+
+  // Sleeps in select() until a client needs something.
+  while (true) {
+    Poll(1000);
+  }
 }
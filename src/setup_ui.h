@@ -1,7 +1,34 @@
+#pragma once
+
+#include "http_server.h"
+
 class SetupUI {
 public:
     SetupUI() = default;
     ~SetupUI() = default;
 
+    // Soft access point and the setup web server, does not return.
     void run();
+
+    // Just the web server, e.g. on the host. Port 0 picks a free one.
+    bool Start(int port);
+    // The settings API next to the controller on the station interface: only
+    // POST /api/save-settings and the On() routes, each request with the
+    // token (see HttpServer::RequireToken()). No UI, no settings to read back
+    // (they hold the passwords), no reboot or factory reset.
+    bool StartApi(int port, const char* token);
+    // A new token for StartApi()'s server, "" locks it. False if too long.
+    bool SetToken(const char* token) { return server_.RequireToken(token); }
+    // Runs after a new /config.json is in place, e.g. to reload it.
+    void OnSettingsSaved(void (*callback)());
+    // Routes besides the setup UI's own, before Start().
+    bool On(const HttpRoute& route) { return server_.On(route); }
+    // POST /api/ota takes a firmware patch (see ota_update.h) and restarts
+    // into the new image. Only in setup mode, MQTT brings them otherwise.
+    bool AddOtaRoute();
+    int Port() const { return server_.Port(); }
+    void Poll(int timeout_ms) { server_.Poll(timeout_ms); }
+
+private:
+    HttpServer server_;
 };
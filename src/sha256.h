@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// SHA-256, fed in pieces. Plain C++ so the host build checks the same hashes
+// as the device.
+class Sha256 {
+ public:
+  static constexpr size_t kDigestBytes = 32;
+
+  Sha256() { Reset(); }
+  void Reset();
+  void Update(const void *data, size_t size);
+  // Writes the digest, Reset() before hashing something else.
+  void Final(uint8_t digest[kDigestBytes]);
+
+ private:
+  void Block(const uint8_t *block);
+
+  uint32_t state_[8];
+  uint64_t length_;  // Bytes so far.
+  uint8_t buffer_[64];
+  size_t buffered_;
+};
@@ -0,0 +1,576 @@
+// Left out of pio test builds, which bring their own main().
+#if !defined(ARDUINO) && !defined(PIO_UNIT_TESTING)
+
+// Host driver for [env:native]: runs setup() and loop() against the simulated
+// hardware in hal_native.cpp and reports how the control loop behaved.
+//
+//   .pio/build/native/program --fs sim_fs --days 7 --drift-ppm 30
+//
+// With --max-lateness-ms it exits with 2 if any task started later than that
+// after its deadline, e.g. because idle sleep overslept. --outage 2 1.5 takes
+// the network down from hour 2 to 3.5. --real-broker publishes to the broker
+// in the config (e.g. a local mosquitto) instead of the simulated one, in real
+// time.
+//
+// The config is read from <fs>/config.json, same format as on the device.
+// Every host name answers SNTP, after --ntp-delay-us (default 15000) each way
+// plus up to --ntp-jitter-us of queueing; --ntp-falseticker 2.pool.ntp.org 200
+// makes that one 200 ms off. The RTC drift the clock discipline learns is kept
+// in <fs>.nvs like on the device in NVS, delete it to start over.
+//
+// WiFi connects take a 2 s channel scan, 150 ms to associate and 350 ms of
+// DHCP. The access point and lease of the last connect are kept in <fs>.nvs
+// too, so the next run with the same --fs connects without the scan and DHCP
+// (see the wifi line of the report). --wifi-channel 11 moves the access point
+// away from the default channel 6, which the cached link then misses.
+//
+// --reload-config config2.json 5 publishes <fs>/config2.json on the MQTT
+// config topic at hour 5, to check the hot reload: pump edges are judged
+// against the new schedule from then on, and the counters show what
+// reconnected.
+//
+// --ota-patch update.ghd 3 sends that patch (from make_delta.py) over MQTT at
+// hour 3 as send_ota.py does, and the run ends with the restart into the new
+// image. The running image is this program, so make the patch against it.
+// The next run with the same --fs boots that image on trial: it passes once
+// the broker acks a publish, and with an --outage over OTA_TRIAL_S instead
+// rolls back (see the ota line of the report).
+//
+// --load-test 10 instead serves the setup UI (settings from <fs>) locally and
+// keeps --connections N (default 4) keep-alive clients busy with its /api
+// endpoints for 10 s, then reports requests per second and latency.
+// --serve 8080 just serves it, for working on the UI, with /api/ota as in
+// setup mode.
+//
+// --filter-check instead runs the pressure filter kernels on synthetic samples
+// with 50 and 60 Hz mains pickup and exits with 3 if they let noise through or
+// respond to a step too slowly.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "hal.h"
+#include "hal_sim.h"
+#include "pins.h"
+#include "pressure_filter.h"
+#include "setup_ui.h"
+
+void setup();
+void loop();
+size_t LoopTaskLateness(const char *names[], int64_t max_lateness_ms[]);
+hal::WifiTimes LastWifiConnect(uint32_t &connects, uint32_t &fast_connects);
+
+namespace {
+
+struct Args {
+  hal::sim::Options options;
+  double days = 1.0;
+  // Fail (exit 2) if a task started later than this after its deadline.
+  int64_t max_lateness_ms = -1;
+  // Network down for [outage_start_h, outage_end_h) of simulated time.
+  double outage_start_h = 0;
+  double outage_end_h = 0;
+  bool filter_check = false;
+  double load_test_s = 0;
+  int connections = 4;
+  int serve_port = 0;
+  // Published on the MQTT config topic at reload_config_h.
+  const char *reload_config = nullptr;
+  double reload_config_h = 0;
+  // Sent on the MQTT OTA topic from ota_patch_h on.
+  const char *ota_patch = nullptr;
+  double ota_patch_h = 0;
+};
+
+Args ParseArgs(int argc, char *argv[]) {
+  Args args;
+  args.options.quiet = true;
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "--days") && has_value) {
+      args.days = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--fs") && has_value) {
+      args.options.fs_root = argv[++i];
+    } else if (!strcmp(argv[i], "--drift-ppm") && has_value) {
+      args.options.rtc_drift_ppm = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--ntp-delay-us") && has_value) {
+      args.options.ntp_delay_us = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--ntp-jitter-us") && has_value) {
+      args.options.ntp_jitter_us = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--ntp-falseticker") && i + 2 < argc) {
+      args.options.ntp_falseticker = argv[++i];
+      args.options.ntp_falseticker_ms = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--wifi-channel") && has_value) {
+      args.options.wifi_channel = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--start") && has_value) {
+      args.options.start_epoch_s = atoll(argv[++i]);
+    } else if (!strcmp(argv[i], "--max-lateness-ms") && has_value) {
+      args.max_lateness_ms = atoll(argv[++i]);
+    } else if (!strcmp(argv[i], "--outage") && i + 2 < argc) {
+      args.outage_start_h = atof(argv[++i]);
+      args.outage_end_h = args.outage_start_h + atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--reload-config") && i + 2 < argc) {
+      args.reload_config = argv[++i];
+      args.reload_config_h = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--ota-patch") && i + 2 < argc) {
+      args.ota_patch = argv[++i];
+      args.ota_patch_h = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--real-broker")) {
+      args.options.real_broker = true;
+    } else if (!strcmp(argv[i], "--load-test") && has_value) {
+      args.load_test_s = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--serve") && has_value) {
+      args.serve_port = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--connections") && has_value) {
+      args.connections = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--filter-check")) {
+      args.filter_check = true;
+    } else if (!strcmp(argv[i], "--verbose")) {
+      args.options.quiet = false;
+    } else {
+      fprintf(stderr,
+              "usage: %s [--days N] [--fs DIR] [--drift-ppm N] "
+              "[--ntp-delay-us N] [--ntp-jitter-us N] "
+              "[--ntp-falseticker HOST MS] [--wifi-channel N] "
+              "[--start EPOCH] "
+              "[--max-lateness-ms N] [--outage START_H HOURS] "
+              "[--reload-config FILE HOUR] [--ota-patch FILE HOUR] "
+              "[--real-broker] "
+              "[--load-test SECONDS [--connections N]] [--serve PORT] "
+              "[--filter-check] "
+              "[--verbose]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+  return args;
+}
+
+// Tank pressure around 1800 counts with 50 Hz mains pickup and some noise.
+int SyntheticPressure(int pin, int64_t t_us) {
+  const double mains = 40.0 * sin(2 * M_PI * 50.0 * t_us / 1e6);
+  const double noise = (rand() % 21) - 10;
+  return static_cast<int>(1800 + mains + noise);
+}
+
+void PrintPercentiles(const char *name, std::vector<int64_t> values) {
+  if (values.empty()) {
+    printf("SIM: %s n=0\n", name);
+    return;
+  }
+  std::sort(values.begin(), values.end());
+  int64_t sum = 0;
+  for (int64_t v : values) {
+    sum += v;
+  }
+  auto at = [&](double q) {
+    return values[std::min(values.size() - 1,
+                           static_cast<size_t>(q * values.size()))];
+  };
+  printf("SIM: %s n=%zu mean=%lld p50=%lld p99=%lld max=%lld\n", name,
+         values.size(), static_cast<long long>(sum / values.size()),
+         static_cast<long long>(at(0.5)), static_cast<long long>(at(0.99)),
+         static_cast<long long>(values.back()));
+}
+
+// Plays send_ota.py: the next piece of the patch once the status says the
+// last one is in, the same again if none came for a while.
+class OtaSender {
+ public:
+  static constexpr size_t kPieceBytes = 4096;
+  static constexpr int64_t kRetryUs = 30000000;
+
+  bool Load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+      return false;
+    }
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+      patch_.append(buffer, n);
+    }
+    fclose(f);
+    return true;
+  }
+
+  void Poll() {
+    if (finished_) {
+      return;
+    }
+    const std::string status = hal::sim::LastPublished("/ota/status");
+    size_t offset = 0;
+    if (const char *at = strstr(status.c_str(), "\"offset\":")) {
+      offset = strtoul(at + 9, nullptr, 10);
+    }
+    if (status.find("\"failed\"") != std::string::npos) {
+      printf("SIM: ota patch refused: %s\n", status.c_str());
+      finished_ = true;
+      return;
+    }
+    if (status.find("\"done\"") != std::string::npos) {
+      finished_ = true;
+      return;
+    }
+    const int64_t now_us = hal::sim::NowMicros();
+    if (offset >= patch_.size() ||
+        (offset == sent_offset_ && now_us - sent_us_ < kRetryUs)) {
+      return;
+    }
+    std::string piece(4, '\0');
+    for (int i = 0; i < 4; ++i) {
+      piece[i] = static_cast<char>(offset >> (8 * i));
+    }
+    piece += patch_.substr(offset, kPieceBytes);
+    if (hal::sim::Publish("/ota", piece)) {
+      sent_offset_ = offset;
+      sent_us_ = now_us;
+    }
+  }
+
+ private:
+  std::string patch_;
+  size_t sent_offset_ = SIZE_MAX;
+  int64_t sent_us_ = 0;
+  bool finished_ = false;
+};
+
+// Feeds the pressure pipeline as main.cpp does (24 kHz, bursts of two mains
+// periods every 500 ms) with a 100 count step half way, returns false if it
+// does worse than it should.
+bool CheckPressureFilter(int mains_hz) {
+  constexpr int kRateHz = 24000;
+  constexpr int kReads = 400;
+  constexpr int kStepRead = kReads / 2;
+  MainsIntegrator integrator(kRateHz / mains_hz);
+  StepIir filter(8192, 24 * 16);
+  const int burst = 2 * kRateHz / mains_hz;
+  std::vector<uint16_t> samples(burst);
+  std::vector<int32_t> means(4);
+  double sum_sq = 0;
+  int settled_n = 0;
+  int step_reads = -1;
+  int64_t ns = 0;
+  for (int read = 0; read < kReads; ++read) {
+    const double level = read < kStepRead ? 1800 : 1700;
+    for (int i = 0; i < burst; ++i) {
+      // Mains pickup with its 3rd harmonic, plus white noise.
+      const double t = (read * 0.5) + static_cast<double>(i) / kRateHz;
+      const double w = 2 * M_PI * mains_hz * t;
+      samples[i] = static_cast<uint16_t>(level + 40 * sin(w) +
+                                         10 * sin(3 * w) + (rand() % 41) - 20);
+    }
+    const auto t0 = std::chrono::steady_clock::now();
+    integrator.Reset();
+    const size_t n = integrator.Process(samples.data(), burst, means.data(),
+                                        means.size());
+    for (size_t i = 0; i < n; ++i) {
+      filter.Update(means[i]);
+    }
+    ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - t0)
+              .count();
+    const double error = filter.Estimate() / 16.0 - level;
+    if (read >= kStepRead && step_reads < 0 && std::abs(error) <= 1) {
+      step_reads = read - kStepRead + 1;
+    }
+    if ((read > 20 && read < kStepRead) || read > kStepRead + 20) {
+      sum_sq += error * error;
+      settled_n++;
+    }
+  }
+  const double rms = sqrt(sum_sq / settled_n);
+  const bool ok = rms < 1.0 && step_reads >= 0 && step_reads <= 2;
+  printf("SIM: filter %d Hz mains: rms error %.2f counts, step within 1 count "
+         "after %d reads, %.1f ns/sample%s\n",
+         mains_hz, rms, step_reads,
+         static_cast<double>(ns) / (static_cast<double>(kReads) * burst),
+         ok ? "" : " FAIL");
+  return ok;
+}
+
+// One keep-alive client of the load test: requests the paths in turn until
+// deadline, adds the latency of each (us) to latency_us, returns the errors.
+int LoadTestClient(int port, std::chrono::steady_clock::time_point deadline,
+                   std::vector<int64_t> &latency_us) {
+  const char *paths[] = {"/api/settings", "/ping"};
+  int errors = 0;
+  int fd = -1;
+  std::string response;
+  for (size_t n = 0; std::chrono::steady_clock::now() < deadline; ++n) {
+    if (fd < 0) {
+      fd = socket(AF_INET, SOCK_STREAM, 0);
+      sockaddr_in address = {};
+      address.sin_family = AF_INET;
+      address.sin_port = htons(port);
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      if (connect(fd, reinterpret_cast<sockaddr *>(&address),
+                  sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+        errors++;
+        continue;
+      }
+    }
+    char request[128];
+    const int length = snprintf(request, sizeof(request),
+                                "GET %s HTTP/1.1\r\nHost: setup\r\n\r\n",
+                                paths[n % 2]);
+    const auto t0 = std::chrono::steady_clock::now();
+    bool ok = send(fd, request, length, 0) == length;
+    // Head, then as much body as Content-Length says.
+    response.clear();
+    size_t body_at = std::string::npos;
+    size_t total = 0;
+    char buffer[2048];
+    while (ok && (body_at == std::string::npos || response.size() < total)) {
+      const ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+      ok = got > 0;
+      if (!ok) {
+        break;
+      }
+      response.append(buffer, got);
+      if (body_at == std::string::npos) {
+        const size_t end = response.find("\r\n\r\n");
+        if (end != std::string::npos) {
+          body_at = end + 4;
+          const size_t field = response.find("Content-Length: ");
+          total = body_at + (field < end ? atol(response.c_str() + field + 16)
+                                         : 0);
+        }
+      }
+    }
+    ok = ok && response.compare(0, 12, "HTTP/1.1 200") == 0;
+    if (!ok) {
+      close(fd);
+      fd = -1;
+      errors++;
+      continue;
+    }
+    latency_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - t0)
+                             .count());
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return errors;
+}
+
+// Setup UI web server on a local port against `connections` clients.
+int RunLoadTest(double seconds, int connections) {
+  SetupUI setup_ui;
+  if (!setup_ui.Start(0)) {
+    fprintf(stderr, "load test: can not listen\n");
+    return 1;
+  }
+  std::atomic<bool> stop{false};
+  std::thread server([&] {
+    while (!stop) {
+      setup_ui.Poll(50);
+    }
+  });
+
+  const auto start = std::chrono::steady_clock::now();
+  const auto deadline =
+      start + std::chrono::microseconds(static_cast<int64_t>(seconds * 1e6));
+  std::vector<std::vector<int64_t>> latency_us(connections);
+  std::vector<int> errors(connections);
+  std::vector<std::thread> clients;
+  for (int i = 0; i < connections; ++i) {
+    clients.emplace_back([&, i] {
+      errors[i] = LoadTestClient(setup_ui.Port(), deadline, latency_us[i]);
+    });
+  }
+  for (std::thread &client : clients) {
+    client.join();
+  }
+  const double wall_s = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+  stop = true;
+  server.join();
+
+  std::vector<int64_t> all;
+  int total_errors = 0;
+  for (int i = 0; i < connections; ++i) {
+    all.insert(all.end(), latency_us[i].begin(), latency_us[i].end());
+    total_errors += errors[i];
+  }
+  printf("SIM: load test %d connections, %.1f s: %zu requests (%.0f/s), "
+         "%d errors\n",
+         connections, wall_s, all.size(), all.size() / wall_s, total_errors);
+  PrintPercentiles("http_latency_us", all);
+  return total_errors == 0 && !all.empty() ? 0 : 4;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  const Args args = ParseArgs(argc, argv);
+  if (args.filter_check) {
+    const bool ok_50 = CheckPressureFilter(50);
+    const bool ok_60 = CheckPressureFilter(60);
+    return ok_50 && ok_60 ? 0 : 3;
+  }
+  hal::sim::Init(args.options);
+  if (args.load_test_s > 0) {
+    return RunLoadTest(args.load_test_s, args.connections);
+  }
+  if (args.serve_port > 0) {
+    SetupUI setup_ui;
+    if (!setup_ui.AddOtaRoute() || !setup_ui.Start(args.serve_port)) {
+      fprintf(stderr, "serve: can not listen on %d\n", args.serve_port);
+      return 1;
+    }
+    try {
+      while (true) {
+        setup_ui.Poll(1000);
+      }
+    } catch (const hal::sim::RestartRequested &) {
+      printf("SIM: restart requested, ota images=%lld\n",
+             static_cast<long long>(hal::sim::GetCounters().ota_images));
+      return 0;
+    }
+  }
+  hal::sim::SetAdcSource(SyntheticPressure);
+
+  // Reference copy of the schedule to judge the pump edges against.
+  std::unique_ptr<Config> reference = Config::CreateFromJsonFile("/config.json");
+
+  std::vector<int64_t> edge_latency_ms;
+  hal::sim::SetEdgeHook([&](int pin, bool high, int64_t t_us) {
+    if (pin != PUMP_CONTROL || !reference) {
+      return;
+    }
+    // How late the edge is relative to the nearest switch in the schedule,
+    // negative if early.
+    const int64_t ms_of_week =
+        PumpSchedule::MsOfWeek(hal::sim::TrueEpochMicros() / 1000);
+    const int64_t since_ms = reference->schedule.MsSinceSwitch(ms_of_week);
+    const int64_t to_next_ms = reference->schedule.At(ms_of_week).ms_to_next;
+    edge_latency_ms.push_back(since_ms <= to_next_ms ? since_ms : -to_next_ms);
+  });
+
+  // The config to reload, as it is in the file system.
+  std::string reload_path;
+  std::string reload_json;
+  if (args.reload_config) {
+    reload_path = std::string("/") + args.reload_config;
+    hal::File file = hal::File::Open(reload_path.c_str(), "r");
+    if (!file) {
+      fprintf(stderr, "reload-config: can not open %s\n", reload_path.c_str());
+      return 1;
+    }
+    reload_json.resize(file.Size());
+    file.Read(&reload_json[0], reload_json.size());
+  }
+  bool reloaded = false;
+  OtaSender ota_sender;
+  if (args.ota_patch && !ota_sender.Load(args.ota_patch)) {
+    fprintf(stderr, "ota-patch: can not open %s\n", args.ota_patch);
+    return 1;
+  }
+
+  const int64_t end_us = static_cast<int64_t>(args.days * 86400e6);
+  std::vector<int64_t> loop_ns;
+  const auto wall_start = std::chrono::steady_clock::now();
+  try {
+    setup();
+    while (hal::sim::NowMicros() < end_us) {
+      const double hours = hal::sim::NowMicros() / 3600e6;
+      hal::sim::SetNetworkUp(hours < args.outage_start_h ||
+                             hours >= args.outage_end_h);
+      if (args.reload_config && !reloaded && hours >= args.reload_config_h) {
+        hal::sim::PublishRetained("/config", reload_json);
+        reference = Config::CreateFromJsonFile(reload_path.c_str());
+        reloaded = true;
+      }
+      if (args.ota_patch && hours >= args.ota_patch_h) {
+        ota_sender.Poll();
+      }
+      const auto t0 = std::chrono::steady_clock::now();
+      loop();
+      const auto t1 = std::chrono::steady_clock::now();
+      loop_ns.push_back(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)
+              .count());
+    }
+  } catch (const hal::sim::RestartRequested &) {
+    printf("SIM: restart requested at %.3f s\n",
+           hal::sim::NowMicros() / 1e6);
+  }
+  const double wall_s = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - wall_start)
+                            .count();
+
+  const double sim_s = hal::sim::NowMicros() / 1e6;
+  const hal::sim::Counters &counters = hal::sim::GetCounters();
+  printf("SIM: simulated %.1f s in %.3f s wall (%.0fx)\n", sim_s, wall_s,
+         sim_s / std::max(wall_s, 1e-9));
+  printf("SIM: loops=%zu (%.2f/s) slept=%.1f%%\n", loop_ns.size(),
+         loop_ns.size() / std::max(sim_s, 1e-9),
+         100.0 * counters.slept_us / std::max<int64_t>(1, hal::sim::NowMicros()));
+  printf("SIM: wifi_begins=%lld ntp_requests=%lld mqtt_connects=%lld "
+         "mqtt_publishes=%lld (%lld bytes, %lld duplicates)\n",
+         static_cast<long long>(counters.wifi_begins),
+         static_cast<long long>(counters.ntp_requests),
+         static_cast<long long>(counters.mqtt_connects),
+         static_cast<long long>(counters.mqtt_publishes),
+         static_cast<long long>(counters.mqtt_payload_bytes),
+         static_cast<long long>(counters.mqtt_duplicates));
+  uint32_t wifi_connects = 0;
+  uint32_t wifi_fast_connects = 0;
+  const hal::WifiTimes wifi_times =
+      LastWifiConnect(wifi_connects, wifi_fast_connects);
+  printf("SIM: wifi connects=%u fast=%u last associated_ms=%d got_ip_ms=%d\n",
+         static_cast<unsigned>(wifi_connects),
+         static_cast<unsigned>(wifi_fast_connects),
+         static_cast<int>(wifi_times.associated_ms),
+         static_cast<int>(wifi_times.got_ip_ms));
+  printf("SIM: idle_sleeps=%lld wakes_gpio=%lld wakes_adc=%lld\n",
+         static_cast<long long>(counters.idle_sleeps),
+         static_cast<long long>(counters.idle_wakes_gpio),
+         static_cast<long long>(counters.idle_wakes_adc));
+  printf("SIM: ota images=%lld marked_valid=%lld rollbacks=%lld\n",
+         static_cast<long long>(counters.ota_images),
+         static_cast<long long>(counters.ota_marked_valid),
+         static_cast<long long>(counters.ota_rollbacks));
+  PrintPercentiles("loop_host_ns", loop_ns);
+  PrintPercentiles("pump_edge_latency_ms", edge_latency_ms);
+  int32_t drift_q16 = 0;
+  if (hal::NvsGetInt("rtc_drift", drift_q16)) {
+    printf("SIM: rtc_drift in NVS %.3f ppm (simulated %d)\n",
+           drift_q16 / 65536.0, args.options.rtc_drift_ppm);
+  }
+
+  const char *names[32];
+  int64_t max_lateness_ms[32];
+  const size_t num_tasks = LoopTaskLateness(names, max_lateness_ms);
+  bool late = false;
+  for (size_t i = 0; i < num_tasks; ++i) {
+    const bool too_late = args.max_lateness_ms >= 0 &&
+                          max_lateness_ms[i] > args.max_lateness_ms;
+    printf("SIM: task %-10s max_lateness_ms=%lld%s\n", names[i],
+           static_cast<long long>(max_lateness_ms[i]),
+           too_late ? " TOO LATE" : "");
+    late |= too_late;
+  }
+  return late ? 2 : 0;
+}
+
+#endif  // !ARDUINO && !PIO_UNIT_TESTING
@@ -0,0 +1,268 @@
+#include "sntp_client.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+#include "hal.h"
+
+namespace {
+
+constexpr int kNtpPort = 123;
+constexpr size_t kPacketBytes = 48;
+constexpr int64_t kNtpToUnixS = 2208988800LL;  // 1900 to 1970.
+constexpr char kPoolSuffix[] = "pool.ntp.org";
+
+uint64_t ReadU64(const uint8_t *p) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i) {
+    value = value << 8 | p[i];
+  }
+  return value;
+}
+
+void WriteU64(uint8_t *p, uint64_t value) {
+  for (int i = 7; i >= 0; --i) {
+    p[i] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+// NTP timestamp (seconds since 1900 . 32 bit fraction) to usec since Epoch.
+int64_t NtpToEpochMicros(uint64_t timestamp) {
+  uint64_t seconds = timestamp >> 32;
+  // From 2036 the seconds wrap into era 1, times before 1968 never come up.
+  if (seconds < 0x80000000ULL) {
+    seconds += 1ULL << 32;
+  }
+  const uint64_t fraction_us = ((timestamp & 0xffffffffULL) * 1000000ULL) >> 32;
+  return (static_cast<int64_t>(seconds) - kNtpToUnixS) * 1000000LL +
+         static_cast<int64_t>(fraction_us);
+}
+
+bool IsPoolName(const char *name, size_t length) {
+  const size_t suffix_length = sizeof(kPoolSuffix) - 1;
+  return length >= suffix_length && !isdigit(static_cast<uint8_t>(name[0])) &&
+         strncmp(name + length - suffix_length, kPoolSuffix, suffix_length) ==
+             0;
+}
+
+int64_t Abs(int64_t value) { return value < 0 ? -value : value; }
+
+}  // namespace
+
+void SntpClient::Begin(const char *servers) {
+  Stop();
+  num_servers_ = 0;
+  const char *name = servers ? servers : "";
+  while (*name) {
+    while (*name == ',' || *name == ' ') {
+      name++;
+    }
+    size_t length = 0;
+    while (name[length] && name[length] != ',' && name[length] != ' ') {
+      length++;
+    }
+    if (length > 0 && IsPoolName(name, length)) {
+      for (char n = '0'; n <= '3' && num_servers_ < kMaxServers; ++n) {
+        char numbered[kMaxNameLength + 1];
+        snprintf(numbered, sizeof(numbered), "%c.%.*s", n,
+                 static_cast<int>(length), name);
+        AddServer(numbered, strlen(numbered));
+      }
+    } else if (length > 0) {
+      AddServer(name, length);
+    }
+    name += length;
+  }
+  hal::UdpOpen();
+}
+
+void SntpClient::AddServer(const char *name, size_t length) {
+  if (num_servers_ == kMaxServers || length > kMaxNameLength) {
+    return;
+  }
+  Server &server = servers_[num_servers_++];
+  server = Server();
+  memcpy(server.name, name, length);
+  server.name[length] = '\0';
+}
+
+void SntpClient::Stop() {
+  hal::UdpClose();
+  round_running_ = false;
+  for (size_t i = 0; i < num_servers_; ++i) {
+    servers_[i].cookie = 0;
+  }
+}
+
+size_t SntpClient::StartRound() {
+  has_result_ = false;
+  if (!hal::UdpOpen()) {
+    return 0;
+  }
+  round_++;
+  size_t sent = 0;
+  for (size_t i = 0; i < num_servers_; ++i) {
+    Server &server = servers_[i];
+    server.cookie = 0;
+    server.answered = false;
+    if (server.denied) {
+      continue;
+    }
+    uint8_t packet[kPacketBytes] = {};
+    packet[0] = 0 << 6 | 4 << 3 | 3;  // No leap warning, version 4, client.
+    server.sent_rtc_us = hal::RtcMicros();
+    // Not our time, the server just echoes it back. Unique per request so a
+    // late answer to an earlier one does not count.
+    const uint64_t cookie = static_cast<uint64_t>(server.sent_rtc_us) << 16 ^
+                            static_cast<uint64_t>(round_) << 4 ^ i ^ 1;
+    WriteU64(packet + 40, cookie);
+    if (hal::UdpSendTo(server.name, kNtpPort, packet, sizeof(packet))) {
+      server.cookie = cookie;
+      sent++;
+    }
+  }
+  round_running_ = sent > 0;
+  round_start_rtc_us_ = hal::RtcMicros();
+  return sent;
+}
+
+bool SntpClient::Poll() {
+  if (!round_running_) {
+    return true;
+  }
+  uint8_t packet[kPacketBytes + 20];  // Room for a key id, which is ignored.
+  int size;
+  while ((size = hal::UdpReceive(packet, sizeof(packet))) > 0) {
+    Receive(packet, size, hal::RtcMicros());
+  }
+  const int64_t now_rtc_us = hal::RtcMicros();
+  bool waiting = false;
+  for (size_t i = 0; i < num_servers_; ++i) {
+    waiting |= servers_[i].cookie != 0;
+  }
+  if (waiting && now_rtc_us - round_start_rtc_us_ < kRoundTimeoutMs * 1000) {
+    return false;
+  }
+  FinishRound(now_rtc_us);
+  return true;
+}
+
+void SntpClient::Receive(const uint8_t *packet, size_t size, int64_t rtc_us) {
+  if (size < kPacketBytes) {
+    return;
+  }
+  const uint64_t origin = ReadU64(packet + 24);
+  Server *server = nullptr;
+  for (size_t i = 0; i < num_servers_; ++i) {
+    if (servers_[i].cookie != 0 && servers_[i].cookie == origin) {
+      server = &servers_[i];
+    }
+  }
+  if (!server) {
+    return;  // Late, duplicate or not for us.
+  }
+  server->cookie = 0;
+  server->answered = true;
+
+  const int leap = packet[0] >> 6;
+  const int version = packet[0] >> 3 & 7;
+  const int mode = packet[0] & 7;
+  const int stratum = packet[1];
+  if (stratum == 0) {
+    // Kiss-o'-death, the code is in the reference id.
+    if (!memcmp(packet + 12, "DENY", 4) || !memcmp(packet + 12, "RSTR", 4)) {
+      server->denied = true;
+    }
+    return;
+  }
+  const uint64_t received = ReadU64(packet + 32);
+  const uint64_t transmitted = ReadU64(packet + 40);
+  if (mode != 4 || version < 3 || version > 4 || leap == 3 || stratum > 15 ||
+      received == 0 || transmitted == 0) {
+    return;  // Not a server, or one that is not synchronized itself.
+  }
+
+  const int64_t t1 = server->sent_rtc_us;
+  const int64_t t2 = NtpToEpochMicros(received);
+  const int64_t t3 = NtpToEpochMicros(transmitted);
+  const int64_t t4 = rtc_us;
+  Sample &sample = server->samples[server->next_sample];
+  server->next_sample = (server->next_sample + 1) % kFilterSize;
+  if (server->num_samples < kFilterSize) {
+    server->num_samples++;
+  }
+  sample.offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+  // Can come out a hair negative with the RTC drifting over the round trip.
+  const int64_t delay_us = (t4 - t1) - (t3 - t2);
+  sample.delay_us = delay_us > 0 ? delay_us : 0;
+  sample.rtc_us = t4;
+}
+
+const SntpClient::Sample *SntpClient::Best(const Server &server,
+                                           int64_t now_rtc_us) const {
+  const Sample *best = nullptr;
+  int64_t best_distance = 0;
+  for (size_t i = 0; i < server.num_samples; ++i) {
+    const Sample &sample = server.samples[i];
+    const int64_t distance =
+        sample.delay_us + (now_rtc_us - sample.rtc_us) * kAgePpm / 1000000;
+    // Ties go to the newer one.
+    if (!best || distance < best_distance ||
+        (distance == best_distance && sample.rtc_us > best->rtc_us)) {
+      best = &sample;
+      best_distance = distance;
+    }
+  }
+  return best;
+}
+
+void SntpClient::FinishRound(int64_t now_rtc_us) {
+  round_running_ = false;
+  answers_ = 0;
+  falsetickers_ = 0;
+
+  const Sample *candidates[kMaxServers];
+  size_t num_candidates = 0;
+  for (size_t i = 0; i < num_servers_; ++i) {
+    servers_[i].cookie = 0;
+    const Sample *best = Best(servers_[i], now_rtc_us);
+    if (servers_[i].answered && best) {
+      answers_++;
+      candidates[num_candidates++] = best;
+    }
+  }
+
+  // Correctness intervals, a truechimer's overlaps with a majority's.
+  const Sample *chosen = nullptr;
+  for (size_t i = 0; i < num_candidates; ++i) {
+    const Sample &a = *candidates[i];
+    const int64_t a_margin = a.delay_us / 2 + kMaxErrorUs;
+    size_t overlaps = 0;
+    for (size_t j = 0; j < num_candidates; ++j) {
+      const Sample &b = *candidates[j];
+      const int64_t b_margin = b.delay_us / 2 + kMaxErrorUs;
+      overlaps += Abs(a.offset_us - b.offset_us) <= a_margin + b_margin;
+    }
+    if (overlaps * 2 <= num_candidates) {
+      falsetickers_++;
+    } else if (!chosen || a.delay_us < chosen->delay_us) {
+      chosen = &a;
+    }
+  }
+
+  // A sample is only handed out once, and never one older than the last.
+  if (chosen && chosen->rtc_us > result_rtc_us_) {
+    has_result_ = true;
+    result_ntp_us_ = chosen->rtc_us + chosen->offset_us;
+    result_rtc_us_ = chosen->rtc_us;
+    result_delay_us_ = chosen->delay_us;
+  }
+}
+
+bool SntpClient::Result(int64_t &ntp_us, int64_t &rtc_us) const {
+  ntp_us = result_ntp_us_;
+  rtc_us = result_rtc_us_;
+  return has_result_;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+// SNTP client over hal::Udp*, asking several servers at once and never
+// waiting on the network.
+//
+// A round sends one request to every server and collects the answers for up
+// to kRoundTimeoutMs. Each answer gives the offset of the server's clock from
+// the RTC and the round trip delay, from the four timestamps (RTC when sent,
+// server received, server sent, RTC when read back):
+//
+//   offset = ((t2 - t1) + (t3 - t4)) / 2, delay = (t4 - t1) - (t3 - t2)
+//
+// Network queueing only ever adds delay, and an uneven split of the delay is
+// what puts an error on the offset, so each server keeps its last kFilterSize
+// samples and trusts the one with the least delay (older ones count as a bit
+// slower, kAgePpm, so a stale sample does not win forever). Servers whose
+// offset +- delay / 2 does not overlap with that of a majority of the servers
+// answering are left out as falsetickers, and of the rest the sample with the
+// least delay is the round's result, if it is newer than the last result.
+
+#include <cstddef>
+#include <cstdint>
+
+class SntpClient {
+ public:
+  static constexpr size_t kMaxServers = 4;
+  static constexpr size_t kFilterSize = 8;
+  static constexpr int64_t kRoundTimeoutMs = 1000;
+
+  // servers is a comma separated list of host names, copied. A pool name like
+  // "pool.ntp.org" or "de.pool.ntp.org" stands for its numbered subdomains 0.
+  // to 3., which are different servers.
+  void Begin(const char *servers);
+  void Stop();
+
+  // Sends the requests of a new round, returns how many went out. Servers
+  // whose name is still being resolved are skipped, try again a bit later if
+  // none went out.
+  size_t StartRound();
+  // Reads answers. True once the round is over: all servers answered, or
+  // kRoundTimeoutMs passed since StartRound().
+  bool Poll();
+  bool RoundRunning() const { return round_running_; }
+
+  // The round's result, once Poll() returned true: the server time and the
+  // RTC time it goes with, both usec. False if nothing new came out of it.
+  bool Result(int64_t &ntp_us, int64_t &rtc_us) const;
+  // Of the last round.
+  size_t Answers() const { return answers_; }
+  size_t Falsetickers() const { return falsetickers_; }
+  int64_t ResultDelayUs() const { return result_delay_us_; }
+  size_t NumServers() const { return num_servers_; }
+  const char *ServerName(size_t i) const { return servers_[i].name; }
+
+ private:
+  static constexpr size_t kMaxNameLength = 63;
+  // Dispersion added per second of age when picking the best sample, the
+  // frequency tolerance NTP assumes for a clock.
+  static constexpr int64_t kAgePpm = 15;
+  // Slack on each side of offset +- delay / 2 before two servers disagree.
+  static constexpr int64_t kMaxErrorUs = 25000;
+
+  struct Sample {
+    int64_t offset_us;  // Server time - RTC time.
+    int64_t delay_us;
+    int64_t rtc_us;  // When it came in.
+  };
+
+  struct Server {
+    char name[kMaxNameLength + 1];
+    // Transmit timestamp of the request out, 0 if none. Only an answer that
+    // echoes it is taken.
+    uint64_t cookie;
+    int64_t sent_rtc_us;
+    bool answered;  // This round.
+    bool denied;    // Kiss-o'-death DENY or RSTR, not asked again.
+    Sample samples[kFilterSize];
+    size_t num_samples;
+    size_t next_sample;
+  };
+
+  void AddServer(const char *name, size_t length);
+  void Receive(const uint8_t *packet, size_t size, int64_t rtc_us);
+  // The server's sample with the least delay, counting age. Null if none.
+  const Sample *Best(const Server &server, int64_t now_rtc_us) const;
+  void FinishRound(int64_t now_rtc_us);
+
+  Server servers_[kMaxServers];
+  size_t num_servers_ = 0;
+  bool round_running_ = false;
+  int64_t round_start_rtc_us_ = 0;
+  uint32_t round_ = 0;
+
+  bool has_result_ = false;
+  int64_t result_ntp_us_ = 0;
+  int64_t result_rtc_us_ = 0;
+  int64_t result_delay_us_ = 0;
+  size_t answers_ = 0;
+  size_t falsetickers_ = 0;
+};
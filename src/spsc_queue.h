@@ -0,0 +1,50 @@
+#pragma once
+
+// Lock-free queue for exactly one producer and one consumer, e.g. one task on
+// each core. Neither side ever blocks, Push() fails if the queue is full.
+
+#include <atomic>
+#include <cstddef>
+
+template <typename T, size_t N>
+class SpscQueue {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+ public:
+  // Producer only.
+  bool Push(const T &value) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    items_[head & (N - 1)] = value;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. The oldest item without taking it, nullptr if empty.
+  const T *Front() const {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &items_[tail & (N - 1)];
+  }
+
+  // Consumer only.
+  bool Pop(T &value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = items_[tail & (N - 1)];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  T items_[N];
+  // Free running counters, only ever written by one side each.
+  std::atomic<size_t> head_{0};  // Producer.
+  std::atomic<size_t> tail_{0};  // Consumer.
+};
@@ -0,0 +1,94 @@
+#include "string_arena.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Default block size when strings are interned without a Reserve().
+constexpr size_t kMinBlockBytes = 128;
+constexpr size_t kMinIndexSlots = 16;
+
+// FNV-1a, cheap and good enough for a few dozen short strings.
+uint32_t Hash(const char *str, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    hash = (hash ^ static_cast<uint8_t>(str[i])) * 16777619u;
+  }
+  return hash;
+}
+
+}  // namespace
+
+void StringArena::Reserve(size_t bytes, size_t count) {
+  // Index at most half full, so probe runs stay short.
+  GrowIndex(2 * (count_ + count));
+  if (bytes == 0) {
+    return;
+  }
+  if (!blocks_.empty()) {
+    const Block &last = blocks_.back();
+    if (last.size - last.used >= bytes) {
+      return;
+    }
+  }
+  blocks_.push_back({std::unique_ptr<char[]>(new char[bytes]), bytes, 0});
+}
+
+const char *StringArena::Intern(const char *str) {
+  return Intern(str, strlen(str));
+}
+
+const char *StringArena::Intern(const char *str, size_t length) {
+  GrowIndex(2 * (count_ + 1));
+  const uint32_t hash = Hash(str, length);
+  const size_t mask = index_.size() - 1;
+  size_t i = hash & mask;
+  for (; index_[i].str; i = (i + 1) & mask) {
+    if (index_[i].hash == hash && strncmp(index_[i].str, str, length) == 0 &&
+        index_[i].str[length] == '\0') {
+      return index_[i].str;
+    }
+  }
+  char *copy = Allocate(length + 1);
+  memcpy(copy, str, length);
+  copy[length] = '\0';
+  index_[i] = {copy, hash};
+  count_++;
+  bytes_ += length + 1;
+  return copy;
+}
+
+char *StringArena::Allocate(size_t bytes) {
+  if (blocks_.empty() || blocks_.back().size - blocks_.back().used < bytes) {
+    const size_t size = std::max(bytes, kMinBlockBytes);
+    blocks_.push_back({std::unique_ptr<char[]>(new char[size]), size, 0});
+  }
+  Block &block = blocks_.back();
+  char *result = block.data.get() + block.used;
+  block.used += bytes;
+  return result;
+}
+
+void StringArena::GrowIndex(size_t min_slots) {
+  if (index_.size() >= min_slots) {
+    return;
+  }
+  size_t slots = std::max(index_.size(), kMinIndexSlots);
+  while (slots < min_slots) {
+    slots *= 2;
+  }
+  std::vector<Slot> old(slots, Slot{nullptr, 0});
+  old.swap(index_);
+  const size_t mask = slots - 1;
+  for (const Slot &slot : old) {
+    if (!slot.str) {
+      continue;
+    }
+    size_t i = slot.hash & mask;
+    while (index_[i].str) {
+      i = (i + 1) & mask;
+    }
+    index_[i] = slot;
+  }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Interns NUL terminated strings: equal strings share one copy, and a returned
+// pointer stays valid for the lifetime of the arena.
+//
+// Strings are bump allocated into blocks that never move, a full block is
+// left as is and a new one started, so nothing ever has to be re-pointed.
+// Duplicates are found through an open addressing hash index of the strings,
+// which is the only thing that grows (and rehashes) in place.
+class StringArena {
+ public:
+  StringArena() = default;
+  StringArena(const StringArena &) = delete;
+  StringArena &operator=(const StringArena &) = delete;
+
+  // Makes room for count more strings of bytes in total (NULs included), so
+  // a caller that knows what it will intern gets a single exactly sized block.
+  void Reserve(size_t bytes, size_t count);
+
+  // Pointer to the interned copy of str (or its first length chars).
+  const char *Intern(const char *str);
+  const char *Intern(const char *str, size_t length);
+
+  // Number of distinct strings and the bytes they use, NULs included.
+  size_t Count() const { return count_; }
+  size_t Bytes() const { return bytes_; }
+
+ private:
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+    size_t used;
+  };
+  struct Slot {
+    const char *str;  // nullptr if the slot is free.
+    uint32_t hash;
+  };
+
+  // Where a string of length + 1 bytes goes, starting a block if needed.
+  char *Allocate(size_t bytes);
+  void GrowIndex(size_t min_slots);
+
+  std::vector<Block> blocks_;
+  std::vector<Slot> index_;  // Size is 0 or a power of two.
+  size_t count_ = 0;
+  size_t bytes_ = 0;
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+// Run time and start lateness of a scheduler task, recorded on every run.
+//
+// Run times come from the CPU cycle counter and go into a histogram of
+// kRunBuckets buckets, each 4x wider than the one before (<16 us, <64 us, ...,
+// <64 ms, the rest), lateness is ms past the deadline when the task started.
+// Recording is a few adds, and nothing at all while no task runs. Plain data,
+// so a snapshot can go through a Seqlock.
+//
+// Build with -DTASK_METRICS=0 to leave the recording out of the scheduler.
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#ifndef TASK_METRICS
+#define TASK_METRICS 1
+#endif
+
+struct TaskMetrics {
+  static constexpr size_t kRunBuckets = 8;
+
+  uint32_t runs;
+  uint32_t run_buckets[kRunBuckets];
+  uint32_t run_us_max;
+  uint64_t run_us_total;
+  uint32_t late_ms_max;
+  uint64_t late_ms_total;
+  uint64_t late_ms_squares;  // For the jitter.
+  // Runs that were later than the scheduler's max backlog, so the task's
+  // deadlines were moved up and some runs are lost.
+  uint32_t backlog_clamps;
+
+  // Upper end of bucket, the last one has none.
+  static constexpr uint32_t BucketLimitUs(size_t bucket) {
+    return 16u << (2 * bucket);
+  }
+
+  void Record(uint32_t run_us, int64_t late_ms, bool clamped) {
+    size_t bucket = 0;
+    while (bucket < kRunBuckets - 1 && run_us >= BucketLimitUs(bucket)) {
+      bucket++;
+    }
+    // Deadlines are only ever missed, a task never starts early.
+    const uint32_t late = late_ms > 0 ? static_cast<uint32_t>(late_ms) : 0;
+    runs++;
+    run_buckets[bucket]++;
+    run_us_max = run_us > run_us_max ? run_us : run_us_max;
+    run_us_total += run_us;
+    late_ms_max = late > late_ms_max ? late : late_ms_max;
+    late_ms_total += late;
+    late_ms_squares += static_cast<uint64_t>(late) * late;
+    backlog_clamps += clamped;
+  }
+
+  uint32_t RunUsMean() const { return runs ? run_us_total / runs : 0; }
+  double LateMsMean() const {
+    return runs ? static_cast<double>(late_ms_total) / runs : 0;
+  }
+  // Standard deviation of the lateness.
+  double JitterMs() const {
+    if (!runs) {
+      return 0;
+    }
+    const double mean = LateMsMean();
+    const double variance =
+        static_cast<double>(late_ms_squares) / runs - mean * mean;
+    return variance > 0 ? std::sqrt(variance) : 0;
+  }
+};
@@ -0,0 +1,98 @@
+// Host tests of parsing the config and its binary snapshot, pio test -e
+// native.
+
+#include <unity.h>
+
+#include <cstdlib>
+#include <memory>
+
+#include "config.h"
+#include "hal.h"
+#include "hal_sim.h"
+
+namespace {
+
+// Every string field set, each to its own value.
+constexpr char kComplete[] =
+    R"({"wifi":{"ssid":"gh","password":"wifi-pw","ip":"192.168.1.20"},)"
+    R"("ntp":{"server":"pool.ntp.org"},)"
+    R"("mqtt":{"broker":"10.0.0.2","port":1884,"user":"mqtt-user",)"
+    R"("password":"mqtt-pw","deviceId":"gh1","topic":"greenhouse/1",)"
+    R"("encoding":"msgpack","publishWindowSec":30,"rawSamples":true},)"
+    R"("api":{"token":"t0ken"},)"
+    R"("pumpSchedule":{"utcOffset":0,"pump":[)"
+    R"({"start":{"hour":6,"minute":0,"second":0},)"
+    R"("end":{"hour":6,"minute":5,"second":30},"days":[1,3,5]}]}})";
+
+void WriteConfig(const char *json, size_t size) {
+  hal::File file = hal::File::Open("/config.json", "w");
+  file.Write(json, size);
+  file.Close();
+}
+
+void AssertComplete(const Config &config) {
+  TEST_ASSERT_EQUAL_STRING("gh", config.wifi.ssid);
+  TEST_ASSERT_EQUAL_STRING("wifi-pw", config.wifi.password);
+  TEST_ASSERT_EQUAL(20, config.wifi.ip[3]);
+  TEST_ASSERT_EQUAL_STRING("pool.ntp.org", config.ntp.server);
+  TEST_ASSERT_EQUAL_STRING("10.0.0.2", config.mqtt.broker);
+  TEST_ASSERT_EQUAL(1884, config.mqtt.port);
+  TEST_ASSERT_EQUAL_STRING("mqtt-user", config.mqtt.user);
+  TEST_ASSERT_EQUAL_STRING("mqtt-pw", config.mqtt.password);
+  TEST_ASSERT_EQUAL_STRING("gh1", config.mqtt.device_id);
+  TEST_ASSERT_EQUAL_STRING("greenhouse/1", config.mqtt.topic);
+  TEST_ASSERT_TRUE(config.mqtt.encoding == Config::MqttEncoding::kMsgPack);
+  TEST_ASSERT_EQUAL(30, config.mqtt.publish_window_s);
+  TEST_ASSERT_TRUE(config.mqtt.raw_samples);
+  TEST_ASSERT_EQUAL_STRING("t0ken", config.api.token);
+  // Monday, Wednesday and Friday.
+  TEST_ASSERT_EQUAL(6, config.schedule.SwitchCount());
+}
+
+}  // namespace
+
+void setUp() {
+  hal::FsRemove("/config.json");
+  hal::FsRemove("/config.bin");
+}
+void tearDown() {}
+
+void test_complete_config_keeps_every_string() {
+  WriteConfig(kComplete, sizeof(kComplete) - 1);
+  std::unique_ptr<Config> config = Config::CreateFromJsonFile("/config.json");
+  TEST_ASSERT_NOT_NULL(config.get());
+  AssertComplete(*config);
+}
+
+// The second load comes from the snapshot the first one wrote.
+void test_snapshot_keeps_every_field() {
+  WriteConfig(kComplete, sizeof(kComplete) - 1);
+  std::unique_ptr<Config> parsed = Config::Load("/config.json", "/config.bin");
+  TEST_ASSERT_NOT_NULL(parsed.get());
+  hal::File snapshot = hal::File::Open("/config.bin", "r");
+  TEST_ASSERT_TRUE(static_cast<bool>(snapshot));
+  snapshot.Close();
+
+  std::unique_ptr<Config> loaded = Config::Load("/config.json", "/config.bin");
+  TEST_ASSERT_NOT_NULL(loaded.get());
+  AssertComplete(*loaded);
+  const Config::Changes changes = Config::Diff(*parsed, *loaded);
+  TEST_ASSERT_FALSE(changes.wifi || changes.ntp || changes.mqtt_connection ||
+                    changes.mqtt_publish || changes.schedule || changes.api);
+}
+
+int main(int argc, char **argv) {
+  static char fs_root[] = "/tmp/test_config_XXXXXX";
+  if (!mkdtemp(fs_root)) {
+    return 1;
+  }
+  hal::sim::Options options;
+  options.fs_root = fs_root;
+  options.quiet = true;
+  hal::sim::Init(options);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_complete_config_keeps_every_string);
+  RUN_TEST(test_snapshot_keeps_every_field);
+  return UNITY_END();
+}
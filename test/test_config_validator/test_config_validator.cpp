@@ -0,0 +1,123 @@
+// Host tests of the streaming config validator, pio test -e native.
+
+#include <unity.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "config_validator.h"
+
+namespace {
+
+const std::string kValid =
+    R"({"wifi":{"ssid":"gh","password":"pw","ip":"192.168.1.20"},)"
+    R"("ntp":{"server":"pool.ntp.org"},"api":{"token":"t0ken"},)"
+    R"("mqtt":{"broker":"10.0.0.2","port":1883,"deviceId":"gh1",)"
+    R"("topic":"greenhouse/1","encoding":"msgpack","publishWindowSec":60,)"
+    R"("rawSamples":false},)"
+    R"("pumpSchedule":{"utcOffset":-3,"pump":[)"
+    R"({"start":{"hour":6,"minute":0,"second":0},)"
+    R"("end":{"hour":6,"minute":5,"second":30},"days":[1,3,5]}]}})";
+
+// kValid with the first from replaced by to.
+std::string With(const char *from, const char *to) {
+  std::string json = kValid;
+  const size_t at = json.find(from);
+  TEST_ASSERT_TRUE(at != std::string::npos);
+  return json.replace(at, strlen(from), to);
+}
+
+// Feeds json in chunks of chunk bytes, true if it validates.
+bool Validate(const std::string &json, size_t chunk, ConfigValidator &v) {
+  for (size_t i = 0; i < json.size(); i += chunk) {
+    if (!v.Feed(json.data() + i, std::min(chunk, json.size() - i))) {
+      return false;
+    }
+  }
+  return v.Finish();
+}
+
+void AssertErrorHas(const ConfigValidator &v, const char *what) {
+  TEST_ASSERT_TRUE_MESSAGE(strstr(v.Error(), what) != nullptr, v.Error());
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+void test_valid_config() {
+  ConfigValidator v;
+  TEST_ASSERT_TRUE(Validate(kValid, kValid.size(), v));
+  TEST_ASSERT_EQUAL_STRING("", v.Error());
+}
+
+void test_bad_type() {
+  ConfigValidator v;
+  TEST_ASSERT_FALSE(Validate(With("1883", "\"1883\""), kValid.size(), v));
+  AssertErrorHas(v, "bad value for \"port\"");
+
+  ConfigValidator v2;
+  TEST_ASSERT_FALSE(Validate(With("false", "0"), kValid.size(), v2));
+  AssertErrorHas(v2, "bad value for \"rawSamples\"");
+
+  ConfigValidator v3;
+  TEST_ASSERT_FALSE(Validate(With("\"t0ken\"", "42"), kValid.size(), v3));
+  AssertErrorHas(v3, "bad value for \"token\"");
+}
+
+void test_bad_encoding() {
+  ConfigValidator v;
+  TEST_ASSERT_FALSE(Validate(With("msgpack", "xml"), kValid.size(), v));
+  AssertErrorHas(v, "bad value for \"encoding\"");
+}
+
+// Every cut short upload fails, at the latest in Finish().
+void test_truncated_upload() {
+  for (size_t size = 0; size < kValid.size(); ++size) {
+    ConfigValidator v;
+    TEST_ASSERT_FALSE(Validate(kValid.substr(0, size), 64, v));
+  }
+  ConfigValidator v;
+  TEST_ASSERT_FALSE(Validate(kValid.substr(0, kValid.size() - 3), 64, v));
+  AssertErrorHas(v, "document ends early");
+}
+
+// A chunk boundary anywhere, inside keys, strings, numbers and literals,
+// changes nothing.
+void test_values_split_across_chunks() {
+  for (size_t split = 1; split < kValid.size(); ++split) {
+    ConfigValidator v;
+    TEST_ASSERT_TRUE(v.Feed(kValid.data(), split));
+    TEST_ASSERT_TRUE(v.Feed(kValid.data() + split, kValid.size() - split));
+    TEST_ASSERT_TRUE_MESSAGE(v.Finish(), v.Error());
+  }
+  ConfigValidator v;
+  TEST_ASSERT_TRUE(Validate(kValid, 1, v));
+}
+
+// A bad value is caught however it is split.
+void test_bad_value_split_across_chunks() {
+  const std::string json = With("1883", "70000");
+  const size_t port = json.find("70000");
+  for (size_t split = port; split <= port + 5; ++split) {
+    ConfigValidator v;
+    const bool first = v.Feed(json.data(), split);
+    const bool second =
+        first && v.Feed(json.data() + split, json.size() - split);
+    TEST_ASSERT_FALSE(second);
+    AssertErrorHas(v, "bad value for \"port\"");
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_valid_config);
+  RUN_TEST(test_bad_type);
+  RUN_TEST(test_bad_encoding);
+  RUN_TEST(test_truncated_upload);
+  RUN_TEST(test_values_split_across_chunks);
+  RUN_TEST(test_bad_value_split_across_chunks);
+  return UNITY_END();
+}
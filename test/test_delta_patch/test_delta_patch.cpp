@@ -0,0 +1,237 @@
+// Host tests of applying firmware patches, pio test -e native: a round trip
+// through make_delta.py (needs python3) and the ways a patch is refused.
+
+#include <unity.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "hal.h"
+#include "hal_sim.h"
+#include "ota_update.h"
+#include "sha256.h"
+
+namespace {
+
+using Bytes = std::vector<uint8_t>;
+
+std::string fs_root;
+std::string old_path;  // The "running" image.
+Bytes old_image;
+
+// The repository, from where this file is, for make_delta.py.
+std::string RepoDir() {
+  const std::string file = __FILE__;
+  const size_t at = file.rfind("test/test_delta_patch/");
+  return at == std::string::npos || at == 0 ? "." : file.substr(0, at - 1);
+}
+
+Bytes ReadFile(const std::string &path) {
+  Bytes data;
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    return data;
+  }
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data.insert(data.end(), buffer, buffer + n);
+  }
+  fclose(f);
+  return data;
+}
+
+void WriteFile(const std::string &path, const Bytes &data) {
+  FILE *f = fopen(path.c_str(), "wb");
+  TEST_ASSERT_NOT_NULL(f);
+  fwrite(data.data(), 1, data.size(), f);
+  fclose(f);
+}
+
+// Something like code: repeats with small differences.
+Bytes MakeImage(size_t size, uint32_t seed) {
+  Bytes image(size);
+  for (size_t i = 0; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    image[i] = i % 64 < 48 ? static_cast<uint8_t>(i / 64 + i % 7)
+                           : static_cast<uint8_t>(seed >> 16);
+  }
+  return image;
+}
+
+void PutU32(Bytes &out, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    out.push_back(value >> (8 * i));
+  }
+}
+
+void PutSha(Bytes &out, const Bytes &data) {
+  Sha256 sha;
+  sha.Update(data.data(), data.size());
+  uint8_t digest[Sha256::kDigestBytes];
+  sha.Final(digest);
+  out.insert(out.end(), digest, digest + sizeof(digest));
+}
+
+// A patch by hand: header for base and image, then the operations as LZSS
+// literals only.
+Bytes HandMadePatch(const Bytes &base, const Bytes &image,
+                    const Bytes &operations) {
+  Bytes patch = {'G', 'H', 'D', '1'};
+  PutU32(patch, base.size());
+  PutSha(patch, base);
+  PutU32(patch, image.size());
+  PutSha(patch, image);
+  uint32_t bits = 0;
+  int count = 0;
+  for (uint8_t byte : operations) {
+    bits = bits << 9 | 1 << 8 | byte;
+    count += 9;
+    while (count >= 8) {
+      count -= 8;
+      patch.push_back(bits >> count);
+    }
+  }
+  if (count > 0) {
+    patch.push_back(bits << (8 - count));
+  }
+  return patch;
+}
+
+// Feeds patch in pieces of piece bytes.
+DeltaPatch::Status Apply(DeltaPatch &patch, const Bytes &data, size_t piece) {
+  patch.Begin();
+  DeltaPatch::Status status = patch.status();
+  for (size_t i = 0; i < data.size(); i += piece) {
+    status = patch.Write(data.data() + i, std::min(piece, data.size() - i));
+  }
+  return status;
+}
+
+void AssertFails(const Bytes &data, const char *error) {
+  DeltaPatch patch;
+  TEST_ASSERT_EQUAL(static_cast<int>(DeltaPatch::Status::kFailed),
+                    static_cast<int>(Apply(patch, data, 100)));
+  TEST_ASSERT_EQUAL_STRING(error, patch.Error());
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+void test_make_delta_round_trip() {
+  // The old image with a block inserted, one dropped and bytes changed.
+  Bytes new_image(old_image.begin(), old_image.begin() + 5000);
+  const Bytes inserted = MakeImage(700, 7);
+  new_image.insert(new_image.end(), inserted.begin(), inserted.end());
+  new_image.insert(new_image.end(), old_image.begin() + 6000, old_image.end());
+  for (size_t i = 9000; i < new_image.size(); i += 256) {
+    new_image[i] += 4;  // A moved address.
+  }
+  const std::string new_path = fs_root + "/new.bin";
+  const std::string patch_path = fs_root + "/update.ghd";
+  WriteFile(new_path, new_image);
+  const std::string command = "python3 " + RepoDir() + "/make_delta.py " +
+                              old_path + " " + new_path + " " + patch_path +
+                              " > /dev/null";
+  TEST_ASSERT_EQUAL_INT_MESSAGE(0, system(command.c_str()), command.c_str());
+  const Bytes data = ReadFile(patch_path);
+  TEST_ASSERT_GREATER_THAN(DeltaPatch::kHeaderBytes, data.size());
+  TEST_ASSERT_TRUE(data.size() < new_image.size() / 4);
+
+  for (size_t piece : {data.size(), size_t{1}, size_t{13}, size_t{4096}}) {
+    DeltaPatch patch;
+    TEST_ASSERT_EQUAL(static_cast<int>(DeltaPatch::Status::kDone),
+                      static_cast<int>(Apply(patch, data, piece)));
+    const Bytes written = ReadFile(fs_root + ".ota");
+    TEST_ASSERT_EQUAL(new_image.size(), written.size());
+    TEST_ASSERT_EQUAL_MEMORY(new_image.data(), written.data(),
+                             new_image.size());
+  }
+
+  // The header's SHA-256 of the new image no longer matches.
+  Bytes bad_sha = data;
+  bad_sha[DeltaPatch::kHeaderBytes - 1] ^= 1;
+  AssertFails(bad_sha, "new image does not match its SHA-256");
+}
+
+void test_corrupt_patch() {
+  const Bytes image = {1, 2, 3};
+  AssertFails(HandMadePatch(old_image, image, {'X'}), "corrupt patch");
+
+  // A back reference before the start of the output.
+  Bytes patch = HandMadePatch(old_image, image, {});
+  patch.push_back(0x7f);
+  patch.push_back(0xff);
+  patch.push_back(0xff);
+  AssertFails(patch, "corrupt patch");
+
+  Bytes not_patch = HandMadePatch(old_image, image, {'E'});
+  not_patch[0] = 'X';
+  AssertFails(not_patch, "not a patch");
+}
+
+void test_wrong_base_image() {
+  Bytes other = old_image;
+  other[100] ^= 0xff;
+  AssertFails(HandMadePatch(other, {1, 2, 3}, {'E'}),
+              "patch is for another image");
+
+  Bytes larger = old_image;
+  larger.push_back(0);
+  AssertFails(HandMadePatch(larger, {1, 2, 3}, {'E'}),
+              "patch is for a larger image");
+}
+
+void test_oversized_write() {
+  const Bytes image = {1, 2, 3, 4};
+  // Inserts 5 bytes into a 4 byte image.
+  AssertFails(HandMadePatch(old_image, image,
+                            {'I', 5, 0, 0, 0, 1, 2, 3, 4, 5, 'E'}),
+              "patch writes past the new image");
+  // Copies 8 bytes of the old image into it.
+  AssertFails(HandMadePatch(old_image, image,
+                            {'C', 0, 0, 0, 0, 8, 0, 0, 0, 'E'}),
+              "patch writes past the new image");
+  // Reads past the end of the old image.
+  Bytes read_past = {'C'};
+  PutU32(read_past, old_image.size() - 2);
+  PutU32(read_past, 4);
+  read_past.push_back('E');
+  AssertFails(HandMadePatch(old_image, image, read_past),
+              "patch reads past the old image");
+  // Ends short of the new image.
+  AssertFails(HandMadePatch(old_image, image, {'I', 2, 0, 0, 0, 1, 2, 'E'}),
+              "patch ends before the new image does");
+}
+
+int main(int argc, char **argv) {
+  char dir[] = "/tmp/test_delta_patch_XXXXXX";
+  if (!mkdtemp(dir)) {
+    return 1;
+  }
+  fs_root = dir;
+  old_path = fs_root + "/old.bin";
+  old_image = MakeImage(20000, 1);
+  FILE *f = fopen(old_path.c_str(), "wb");
+  fwrite(old_image.data(), 1, old_image.size(), f);
+  fclose(f);
+
+  hal::sim::Options options;
+  options.fs_root = fs_root.c_str();
+  options.running_image = old_path.c_str();
+  options.quiet = true;
+  hal::sim::Init(options);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_make_delta_round_trip);
+  RUN_TEST(test_corrupt_patch);
+  RUN_TEST(test_wrong_base_image);
+  RUN_TEST(test_oversized_write);
+  return UNITY_END();
+}
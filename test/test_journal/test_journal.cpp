@@ -0,0 +1,138 @@
+// Host tests of the store-and-forward journal, pio test -e native: a torn
+// record at the end of the newer segment is cut off and appending goes on
+// there, the older segment is not evicted for it.
+
+#include <unity.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "hal.h"
+#include "hal_sim.h"
+#include "journal.h"
+
+namespace {
+
+constexpr char kPathA[] = "/journal_a";
+constexpr char kPathB[] = "/journal_b";
+// Room for 4 records of kRecordBytes.
+constexpr size_t kRecordBytes = 20;
+constexpr size_t kSegmentBytes = 8 + 4 * (4 + kRecordBytes + 4);
+
+std::unique_ptr<Journal> journal;
+
+void Append(uint8_t value) {
+  uint8_t data[kRecordBytes];
+  for (uint8_t &byte : data) {
+    byte = value;
+  }
+  TEST_ASSERT_TRUE(journal->BeginAppend(sizeof(data)));
+  TEST_ASSERT_EQUAL(sizeof(data), journal->Write(data, sizeof(data)));
+  TEST_ASSERT_TRUE(journal->EndAppend());
+}
+
+// Half a record at the end of path, as a reset while writing leaves it.
+void Tear(const char *path) {
+  hal::File file = hal::File::Open(path, "a");
+  const uint8_t torn[] = {0x47, 0x52, kRecordBytes, 0, 1, 2, 3};
+  file.Write(torn, sizeof(torn));
+  file.Close();
+}
+
+uint8_t replayed[16];
+size_t replayed_count = 0;
+
+size_t TakeFirstByte(const uint8_t *data, size_t size) {
+  replayed[replayed_count++] = data[0];
+  return size;
+}
+
+// The first byte of every pending record, oldest first.
+std::string Replay() {
+  std::string values;
+  size_t length;
+  while (journal->Front(length)) {
+    replayed_count = 0;
+    TEST_ASSERT_TRUE(journal->CopyFront(TakeFirstByte));
+    values += static_cast<char>('0' + replayed[0]);
+    journal->PopFront();
+  }
+  return values;
+}
+
+// Like a reboot: a new journal that scans the segments again.
+void Reopen() {
+  journal.reset(new Journal(kPathA, kPathB, kSegmentBytes));
+}
+
+}  // namespace
+
+void setUp() {
+  hal::FsRemove(kPathA);
+  hal::FsRemove(kPathB);
+  Reopen();
+}
+void tearDown() {}
+
+// Segment A full with 1-4, B holds 5 and then a torn record.
+void test_torn_tail_found_at_boot() {
+  for (uint8_t i = 1; i <= 5; ++i) {
+    Append(i);
+  }
+  Tear(kPathB);
+  Reopen();
+  TEST_ASSERT_EQUAL(5, journal->Pending());
+
+  Append(6);
+  Append(7);
+  TEST_ASSERT_EQUAL(0, journal->Evicted());
+  TEST_ASSERT_EQUAL(7, journal->Pending());
+  Reopen();
+  TEST_ASSERT_EQUAL(7, journal->Pending());
+  TEST_ASSERT_EQUAL_STRING("1234567", Replay().c_str());
+}
+
+// An append that did not finish leaves its part behind.
+void test_torn_tail_of_failed_append() {
+  for (uint8_t i = 1; i <= 5; ++i) {
+    Append(i);
+  }
+  const uint8_t part[4] = {9, 9, 9, 9};
+  TEST_ASSERT_TRUE(journal->BeginAppend(kRecordBytes));
+  journal->Write(part, sizeof(part));
+  TEST_ASSERT_FALSE(journal->EndAppend());
+
+  Append(6);
+  TEST_ASSERT_EQUAL(0, journal->Evicted());
+  Reopen();
+  TEST_ASSERT_EQUAL(6, journal->Pending());
+  TEST_ASSERT_EQUAL_STRING("123456", Replay().c_str());
+}
+
+// Only a full newer segment still rotates and evicts the oldest records.
+void test_full_journal_evicts_oldest() {
+  for (uint8_t i = 1; i <= 9; ++i) {
+    Append(i);
+  }
+  TEST_ASSERT_EQUAL(4, journal->Evicted());
+  TEST_ASSERT_EQUAL_STRING("56789", Replay().c_str());
+}
+
+int main(int argc, char **argv) {
+  static char fs_root[] = "/tmp/test_journal_XXXXXX";
+  if (!mkdtemp(fs_root)) {
+    return 1;
+  }
+  hal::sim::Options options;
+  options.fs_root = fs_root;
+  options.quiet = true;
+  hal::sim::Init(options);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_torn_tail_found_at_boot);
+  RUN_TEST(test_torn_tail_of_failed_append);
+  RUN_TEST(test_full_journal_evicts_oldest);
+  return UNITY_END();
+}
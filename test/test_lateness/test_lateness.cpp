@@ -0,0 +1,115 @@
+// Host test of the tickless idle, pio test -e native: runs the firmware's
+// setup() and loop() in the simulation and checks how late each task
+// started after its deadline, light sleep wake-up time included.
+
+#include <unity.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "hal.h"
+#include "hal_sim.h"
+
+void setup();
+void loop();
+size_t LoopTaskLateness(const char *names[], int64_t max_lateness_ms[]);
+
+namespace {
+
+constexpr char kConfig[] =
+    R"({"wifi":{"ssid":"gh","password":"pw"},"ntp":{"server":"pool.ntp.org"},)"
+    R"("mqtt":{"broker":"10.0.0.2","port":1883,"deviceId":"gh1",)"
+    R"("topic":"greenhouse/1"},"pumpSchedule":{"utcOffset":3,"pump":[)"
+    R"({"start":{"hour":0,"minute":10,"second":0},)"
+    R"("end":{"hour":0,"minute":12,"second":30}},)"
+    R"({"start":{"hour":1,"minute":0,"second":15},)"
+    R"("end":{"hour":1,"minute":1,"second":0}}]}})";
+
+constexpr int64_t kRunUs = 3 * 3600e6;
+constexpr int kLightSleepWakeUs = 3000;
+// The tasks that switch the pump and read the pressure, only late by the
+// wake-up from light sleep and a task ahead of them.
+constexpr const char *kTightTasks[] = {"watchdog", "pump", "pressure",
+                                       "timekeeper"};
+constexpr int64_t kTightLatenessMs = 5;
+// Any task, a low priority one can wait behind the budgets of the others.
+constexpr int64_t kMaxLatenessMs = 100;
+
+const char *names[32];
+int64_t max_lateness_ms[32];
+size_t num_tasks = 0;
+bool restarted = false;
+
+bool IsTight(const char *name) {
+  for (const char *tight : kTightTasks) {
+    if (!strcmp(name, tight)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+void test_ran_without_restart() { TEST_ASSERT_FALSE(restarted); }
+
+void test_tight_tasks_start_within_wake_up_time() {
+  size_t checked = 0;
+  for (size_t i = 0; i < num_tasks; ++i) {
+    if (IsTight(names[i])) {
+      TEST_ASSERT_LESS_OR_EQUAL_INT64(kTightLatenessMs, max_lateness_ms[i]);
+      ++checked;
+    }
+  }
+  TEST_ASSERT_EQUAL(sizeof(kTightTasks) / sizeof(kTightTasks[0]), checked);
+}
+
+void test_all_tasks_start_within_bound() {
+  TEST_ASSERT_GREATER_THAN(0, num_tasks);
+  for (size_t i = 0; i < num_tasks; ++i) {
+    TEST_ASSERT_LESS_OR_EQUAL_INT64(kMaxLatenessMs, max_lateness_ms[i]);
+  }
+}
+
+void test_idle_slept_most_of_the_time() {
+  const hal::sim::Counters &counters = hal::sim::GetCounters();
+  TEST_ASSERT_GREATER_THAN(0, counters.idle_sleeps);
+  TEST_ASSERT_GREATER_THAN(hal::sim::NowMicros() * 9 / 10, counters.slept_us);
+}
+
+int main(int argc, char **argv) {
+  // A fresh file system, so no NVS or journal of an earlier run.
+  static char fs_root[] = "/tmp/test_lateness_XXXXXX";
+  if (!mkdtemp(fs_root)) {
+    return 1;
+  }
+  hal::sim::Options options;
+  options.fs_root = fs_root;
+  options.light_sleep_wake_us = kLightSleepWakeUs;
+  options.quiet = true;
+  hal::sim::Init(options);
+  hal::File file = hal::File::Open("/config.json", "w");
+  file.Write(kConfig, sizeof(kConfig) - 1);
+  file.Close();
+  hal::sim::SetAdcSource([](int pin, int64_t t_us) { return 1800; });
+
+  try {
+    setup();
+    while (hal::sim::NowMicros() < kRunUs) {
+      loop();
+    }
+  } catch (const hal::sim::RestartRequested &) {
+    restarted = true;
+  }
+  num_tasks = LoopTaskLateness(names, max_lateness_ms);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_ran_without_restart);
+  RUN_TEST(test_tight_tasks_start_within_wake_up_time);
+  RUN_TEST(test_all_tasks_start_within_bound);
+  RUN_TEST(test_idle_slept_most_of_the_time);
+  return UNITY_END();
+}
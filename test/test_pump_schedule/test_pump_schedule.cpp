@@ -0,0 +1,182 @@
+// Host tests of the weekly pump schedule, pio test -e native.
+
+#include <unity.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "config.h"
+#include "hal.h"
+#include "hal_sim.h"
+#include "logger.h"
+#include "pump_schedule.h"
+
+namespace {
+
+constexpr int32_t kMinuteMs = 60 * 1000;
+constexpr int32_t kHourMs = PumpSchedule::kHourMs;
+constexpr int32_t kDayMs = PumpSchedule::kDayMs;
+constexpr int32_t kWeekMs = PumpSchedule::kWeekMs;
+
+PumpSchedule schedule;
+
+int schedule_full_logs = 0;
+
+void CountScheduleFull(int level, LogModule module, const char *text) {
+  if (strstr(text, "Pump schedule full")) {
+    ++schedule_full_logs;
+  }
+}
+
+}  // namespace
+
+void setUp() { schedule = PumpSchedule(); }
+void tearDown() {}
+
+// Saturday 23:00 for two hours runs on into Sunday 01:00.
+void test_run_wraps_from_saturday_into_sunday() {
+  TEST_ASSERT_TRUE(schedule.Add(kWeekMs - kHourMs, 2 * kHourMs));
+  schedule.Finish();
+  TEST_ASSERT_TRUE(schedule.OnAtWeekStart());
+  TEST_ASSERT_EQUAL(2, schedule.SwitchCount());
+
+  const PumpSchedule::State sunday = schedule.At(30 * kMinuteMs);
+  TEST_ASSERT_TRUE(sunday.on);
+  TEST_ASSERT_EQUAL(30 * kMinuteMs, sunday.ms_to_next);
+
+  const PumpSchedule::State saturday = schedule.At(kWeekMs - kMinuteMs);
+  TEST_ASSERT_TRUE(saturday.on);
+  // Off at Sunday 01:00, across the end of the week.
+  TEST_ASSERT_EQUAL(kHourMs + kMinuteMs, saturday.ms_to_next);
+  TEST_ASSERT_EQUAL(59 * kMinuteMs,
+                    schedule.MsSinceSwitch(kWeekMs - kMinuteMs));
+
+  const PumpSchedule::State off = schedule.At(kDayMs);
+  TEST_ASSERT_FALSE(off.on);
+  TEST_ASSERT_EQUAL(kWeekMs - kHourMs - kDayMs, off.ms_to_next);
+}
+
+// Monday 23:50 for 20 minutes, across midnight into Tuesday.
+void test_run_across_midnight() {
+  const int32_t tuesday = 2 * kDayMs;
+  TEST_ASSERT_TRUE(schedule.Add(tuesday - 10 * kMinuteMs, 20 * kMinuteMs));
+  schedule.Finish();
+  TEST_ASSERT_FALSE(schedule.OnAtWeekStart());
+  TEST_ASSERT_TRUE(schedule.At(tuesday - 1).on);
+  TEST_ASSERT_TRUE(schedule.At(tuesday).on);
+  TEST_ASSERT_EQUAL(10 * kMinuteMs, schedule.At(tuesday).ms_to_next);
+  TEST_ASSERT_FALSE(schedule.At(tuesday + 10 * kMinuteMs).on);
+  TEST_ASSERT_FALSE(schedule.At(tuesday - 10 * kMinuteMs - 1).on);
+  // The next switch is the same run a week later.
+  TEST_ASSERT_EQUAL(kWeekMs - 20 * kMinuteMs,
+                    schedule.At(tuesday + 10 * kMinuteMs).ms_to_next);
+}
+
+// Overlapping and touching runs merge into one.
+void test_overlapping_runs_merge() {
+  TEST_ASSERT_TRUE(schedule.Add(kHourMs, kHourMs));
+  TEST_ASSERT_TRUE(schedule.Add(90 * kMinuteMs, kHourMs));
+  TEST_ASSERT_TRUE(schedule.Add(150 * kMinuteMs, 30 * kMinuteMs));
+  TEST_ASSERT_TRUE(schedule.Add(70 * kMinuteMs, 10 * kMinuteMs));
+  schedule.Finish();
+  TEST_ASSERT_EQUAL(2, schedule.SwitchCount());
+  TEST_ASSERT_EQUAL(kHourMs, schedule.Switch(0));
+  TEST_ASSERT_EQUAL(3 * kHourMs, schedule.Switch(1));
+  TEST_ASSERT_TRUE(schedule.At(150 * kMinuteMs).on);
+  TEST_ASSERT_EQUAL(2 * kHourMs, schedule.MsSinceSwitch(3 * kHourMs - 1) + 1);
+}
+
+// Room for kMaxSwitches / 2 separate runs, then Add() fails, but a run that
+// only widens an existing one still fits.
+void test_full_schedule() {
+  constexpr int32_t kSecondMs = 1000;
+  const int max_runs = PumpSchedule::kMaxSwitches / 2;
+  for (int i = 0; i < max_runs; ++i) {
+    TEST_ASSERT_TRUE(schedule.Add(i * 10 * kSecondMs, kSecondMs));
+  }
+  TEST_ASSERT_FALSE(schedule.Add(max_runs * 10 * kSecondMs, kSecondMs));
+  TEST_ASSERT_TRUE(schedule.Add(kSecondMs, kSecondMs));
+  schedule.Finish();
+  TEST_ASSERT_TRUE(schedule.OnAtWeekStart());
+  TEST_ASSERT_EQUAL(2 * max_runs - 1, schedule.SwitchCount());
+  TEST_ASSERT_FALSE(schedule.At(max_runs * 10 * kSecondMs).on);
+}
+
+// Restore() takes back what a finished schedule gives out, and nothing
+// that is not ascending within the week.
+void test_restore() {
+  TEST_ASSERT_TRUE(schedule.Add(0, kHourMs));
+  TEST_ASSERT_TRUE(schedule.Add(kDayMs, kHourMs));
+  schedule.Finish();
+  PumpSchedule restored;
+  TEST_ASSERT_TRUE(restored.Restore(
+      schedule.OnAtWeekStart(),
+      {schedule.Switches(), schedule.Switches() + schedule.SwitchCount()}));
+  TEST_ASSERT_TRUE(restored.OnAtWeekStart());
+  TEST_ASSERT_EQUAL(3, restored.SwitchCount());
+  TEST_ASSERT_TRUE(restored.At(kDayMs + kMinuteMs).on);
+  TEST_ASSERT_EQUAL(kHourMs - kMinuteMs,
+                    restored.At(kDayMs + kMinuteMs).ms_to_next);
+
+  TEST_ASSERT_FALSE(restored.Restore(false, {kDayMs, kHourMs}));
+  TEST_ASSERT_EQUAL(0, restored.SwitchCount());
+  TEST_ASSERT_FALSE(restored.Restore(false, {kHourMs, kWeekMs}));
+  TEST_ASSERT_FALSE(restored.At(kHourMs).on);
+}
+
+// A config with many intervals keeps every run, without a warning.
+void test_config_with_long_schedule() {
+  std::string json = R"({"pumpSchedule":{"utcOffset":0,"pump":[)";
+  const int intervals = 80;  // Each on all 7 days, 560 runs.
+  for (int i = 0; i < intervals; ++i) {
+    char interval[128];
+    snprintf(interval, sizeof(interval),
+             R"(%s{"start":{"hour":%d,"minute":%d},)"
+             R"("end":{"hour":%d,"minute":%d}})",
+             i ? "," : "", i / 6, i % 6 * 10, i / 6, i % 6 * 10 + 5);
+    json += interval;
+  }
+  json += "]}}";
+  hal::File file = hal::File::Open("/config.json", "w");
+  file.Write(json.data(), json.size());
+  file.Close();
+
+  schedule_full_logs = 0;
+  std::unique_ptr<Config> config = Config::CreateFromJsonFile("/config.json");
+  while (logger.Drain(16, CountScheduleFull)) {
+  }
+  TEST_ASSERT_NOT_NULL(config.get());
+  TEST_ASSERT_EQUAL(0, schedule_full_logs);
+  // Less the one at Sunday 00:00, it starts the week on.
+  TEST_ASSERT_EQUAL(2 * 7 * intervals - 1, config->schedule.SwitchCount());
+  // The first and the last interval are there on every day.
+  for (int day = 0; day < 7; ++day) {
+    TEST_ASSERT_TRUE(config->schedule.At(day * kDayMs + kMinuteMs).on);
+    TEST_ASSERT_TRUE(
+        config->schedule.At(day * kDayMs + 13 * kHourMs + 12 * kMinuteMs).on);
+  }
+}
+
+int main(int argc, char **argv) {
+  static char fs_root[] = "/tmp/test_pump_schedule_XXXXXX";
+  if (!mkdtemp(fs_root)) {
+    return 1;
+  }
+  hal::sim::Options options;
+  options.fs_root = fs_root;
+  options.quiet = true;
+  hal::sim::Init(options);
+  logger.StartDeferred();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_run_wraps_from_saturday_into_sunday);
+  RUN_TEST(test_run_across_midnight);
+  RUN_TEST(test_overlapping_runs_merge);
+  RUN_TEST(test_full_schedule);
+  RUN_TEST(test_restore);
+  RUN_TEST(test_config_with_long_schedule);
+  return UNITY_END();
+}
@@ -0,0 +1,94 @@
+// Host tests of the deadline ordered scheduler, pio test -e native.
+
+#include <unity.h>
+
+#include "scheduler.h"
+
+namespace {
+
+struct FakeContext {
+  int64_t now_ms = 0;
+  // Start times of the last run of each task, -1 before the first.
+  int64_t slow_started_ms = -1;
+  int64_t urgent_started_ms = -1;
+  int slow_runs = 0;
+};
+
+enum { kUrgentTask, kSlowTask, kNumTasks };
+
+constexpr TaskDescriptor kTasks[] = {
+    {"urgent", 0, 1},
+    {"slow", 1, 50},
+};
+
+}  // namespace
+
+template <>
+struct TaskBody<FakeContext, kUrgentTask> {
+  static int64_t Run(FakeContext &c) {
+    c.urgent_started_ms = c.now_ms;
+    return 110;
+  }
+};
+
+template <>
+struct TaskBody<FakeContext, kSlowTask> {
+  static int64_t Run(FakeContext &c) {
+    c.slow_started_ms = c.now_ms;
+    // Takes its whole budget, except on the first run at 0.
+    if (c.slow_runs++ > 0) {
+      c.now_ms += kTasks[kSlowTask].budget_ms;
+    }
+    return 100;
+  }
+};
+
+void setUp() {}
+void tearDown() {}
+
+// Runs the scheduler like loop() does: dispatch, then sleep until the next
+// deadline if it is in the future.
+void RunUntil(Scheduler<FakeContext, kNumTasks> &scheduler, FakeContext &c,
+              int64_t end_ms) {
+  while (c.now_ms < end_ms) {
+    const int64_t next_ms =
+        scheduler.Dispatch(c, [&c] { return c.now_ms; });
+    if (next_ms > c.now_ms) {
+      c.now_ms = next_ms;
+    }
+  }
+}
+
+// The slow task is due at 100 and would run until 150, past the urgent
+// task's deadline at 110, so it has to wait for the urgent one.
+void test_deferred_task_waits_for_the_urgent_one() {
+  Scheduler<FakeContext, kNumTasks> scheduler(kTasks, 100);
+  FakeContext c;
+  RunUntil(scheduler, c, 110);
+  TEST_ASSERT_EQUAL_INT64(110, c.now_ms);
+  TEST_ASSERT_EQUAL_INT64(0, c.slow_started_ms);  // Not run at 100.
+
+  scheduler.Dispatch(c, [&c] { return c.now_ms; });
+  TEST_ASSERT_EQUAL_INT64(110, c.urgent_started_ms);
+  TEST_ASSERT_EQUAL_INT64(110, c.slow_started_ms);
+  TEST_ASSERT_EQUAL_INT64(0, scheduler.MaxLatenessMs(kUrgentTask));
+}
+
+// Held back, the next deadline is the urgent task's, not the slow task's
+// own one that already passed.
+void test_next_deadline_of_deferred_task_is_the_urgent_one() {
+  Scheduler<FakeContext, kNumTasks> scheduler(kTasks, 100);
+  FakeContext c;
+  scheduler.Dispatch(c, [&c] { return c.now_ms; });
+  c.now_ms = 100;
+  const int64_t next_ms = scheduler.Dispatch(c, [&c] { return c.now_ms; });
+  TEST_ASSERT_EQUAL_INT64(110, next_ms);
+  TEST_ASSERT_EQUAL_INT64(110, scheduler.NextDeadlineMs());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_deferred_task_waits_for_the_urgent_one);
+  RUN_TEST(test_next_deadline_of_deferred_task_is_the_urgent_one);
+  return UNITY_END();
+}
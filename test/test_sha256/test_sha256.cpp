@@ -0,0 +1,95 @@
+// Host tests of the SHA-256 the firmware updates are checked with, against
+// the NIST example vectors. pio test -e native.
+
+#include <unity.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "sha256.h"
+
+namespace {
+
+std::string Hex(const uint8_t (&digest)[Sha256::kDigestBytes]) {
+  std::string hex;
+  for (uint8_t byte : digest) {
+    char two[3];
+    snprintf(two, sizeof(two), "%02x", byte);
+    hex += two;
+  }
+  return hex;
+}
+
+std::string Digest(const char *text) {
+  Sha256 sha;
+  sha.Update(text, strlen(text));
+  uint8_t digest[Sha256::kDigestBytes];
+  sha.Final(digest);
+  return Hex(digest);
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+void test_empty() {
+  TEST_ASSERT_EQUAL_STRING(
+      "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+      Digest("").c_str());
+}
+
+void test_abc() {
+  TEST_ASSERT_EQUAL_STRING(
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+      Digest("abc").c_str());
+}
+
+// 448 bits, so the length no longer fits the first block.
+void test_two_blocks() {
+  TEST_ASSERT_EQUAL_STRING(
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+      Digest("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq")
+          .c_str());
+}
+
+// A million 'a's, fed in pieces that do not line up with the blocks.
+void test_million_a() {
+  char piece[997];
+  memset(piece, 'a', sizeof(piece));
+  Sha256 sha;
+  size_t left = 1000000;
+  for (size_t n = 1; left > 0; n = (n * 7 + 61) % sizeof(piece) + 1) {
+    const size_t size = std::min(n, left);
+    sha.Update(piece, size);
+    left -= size;
+  }
+  uint8_t digest[Sha256::kDigestBytes];
+  sha.Final(digest);
+  TEST_ASSERT_EQUAL_STRING(
+      "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+      Hex(digest).c_str());
+}
+
+void test_reset_starts_over() {
+  Sha256 sha;
+  sha.Update("something else", 14);
+  uint8_t digest[Sha256::kDigestBytes];
+  sha.Final(digest);
+  sha.Reset();
+  sha.Update("abc", 3);
+  sha.Final(digest);
+  TEST_ASSERT_EQUAL_STRING(Digest("abc").c_str(), Hex(digest).c_str());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty);
+  RUN_TEST(test_abc);
+  RUN_TEST(test_two_blocks);
+  RUN_TEST(test_million_a);
+  RUN_TEST(test_reset_starts_over);
+  return UNITY_END();
+}